@@ -277,8 +277,7 @@ std::fill_n(std::ostream_iterator<char>(std::cout), i, ' ') \
 // Texture
 /*****************************************************************************/
 
-#define STB_IMAGE_IMPLEMENTATION
-#include "stb_image.h"
+#include "../third_party/stb_image.h"
 
 // Read https://learnopengl.com/Getting-started/Textures for more details
 // on textures.
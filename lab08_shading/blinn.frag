@@ -1,30 +1,223 @@
 // https://www.opengl.org/sdk/docs/tutorials/ClockworkCoders/lighting.php
+//
+// Per-pixel lighting of the fixed-function light and material state. The
+// features are switched on by defines put in front of the source by
+// ShaderPermutations, so that each object gets the cheapest variant:
+//
+//   NUM_LIGHTS n        lights 0 to n - 1 are evaluated, 0 draws unlit
+//   DIRECTIONAL_LIGHTS  all lights are directional
+//   TEXTURED            modulate by myTexture
+//   NORMAL_MAP          perturb the normal by normalMap
+//   FOG_LINEAR, FOG_EXP or FOG_EXP2
+//                       fog with the glFog() parameters
+//   SHADOW_CASCADES     light shadowLight is shadowed by the cascaded maps
+//                       of ShadowMaps
+//   SHADOW_CUBE         light shadowLight is shadowed by the distance cube
+//                       map of ShadowMaps
+//   SH_AMBIENT          the ambient light comes from the environment of
+//                       EnvironmentLight instead of the lights and the
+//                       light model
+//
+// Spot lights are evaluated as point lights.
+
+#ifndef NUM_LIGHTS
+#define NUM_LIGHTS 1
+#endif
 
 varying vec3 N;
 varying vec3 v;
+#ifdef TEXTURED
 uniform sampler2D myTexture;
+#endif
+#ifdef NORMAL_MAP
+uniform sampler2D normalMap;
+#endif
+#if NUM_LIGHTS > 0
+// 1 for enabled lights, 0 for disabled ones among them
+uniform float lightEnabled[NUM_LIGHTS];
+#endif
+#if defined(SHADOW_CASCADES) || defined(SHADOW_CUBE)
+#define SHADOWED
+uniform int shadowLight;
+#endif
+#ifdef SHADOW_CASCADES
+uniform sampler2DShadow shadowAtlas;
+// Eye space to the texture coordinates and depth of each cascade
+uniform mat4 shadowMatrix[4];
+// Eye depth at which each cascade ends
+uniform float shadowEnds[4];
+// Distance the position is moved along the normal in each cascade
+uniform float shadowNormalOffsets[4];
+uniform int shadowCascades;
+// Size of a texel of the atlas
+uniform float shadowTexel;
+#endif
+#ifdef SH_AMBIENT
+// Irradiance divided by pi as in ShIrradiance, times the intensity
+uniform vec3 shCoefficients[9];
+// Normals are looked up in world space.
+uniform mat3 shEyeToWorld;
+#endif
+#ifdef SHADOW_CUBE
+// Distance to the nearest caster divided by shadowRange
+uniform samplerCube shadowCube;
+uniform mat4 shadowEyeToWorld;
+uniform vec3 shadowLightPosition;
+uniform float shadowRange;
+uniform float shadowBias;
+// Size of a texel of a face at distance 1
+uniform float shadowTexel;
+#endif
 
-void main (void)
+#ifdef NORMAL_MAP
+// Builds the tangent frame from screen-space derivatives, so that meshes need
+// no tangents. http://www.thetenthplanet.de/archives/1180
+vec3 perturbNormal(vec3 n, vec3 p, vec2 uv)
+{
+   vec3 dp1 = dFdx(p);
+   vec3 dp2 = dFdy(p);
+   vec2 duv1 = dFdx(uv);
+   vec2 duv2 = dFdy(uv);
+   vec3 dp2perp = cross(dp2, n);
+   vec3 dp1perp = cross(n, dp1);
+   vec3 t = dp2perp * duv1.x + dp1perp * duv2.x;
+   vec3 b = dp2perp * duv1.y + dp1perp * duv2.y;
+   float scale = inversesqrt(max(max(dot(t, t), dot(b, b)), 1e-20));
+   vec3 m = texture2D(normalMap, uv).xyz * 2.0 - 1.0;
+   return normalize(mat3(t * scale, b * scale, n) * m);
+}
+#endif
+
+#ifdef SHADOW_CASCADES
+// 1 where lit, 0 in shadow
+float shadowFactor(vec3 n)
+{
+   float depth = -v.z;
+   int cascade = 0;
+   for(int i = 0; i < 4; ++i)
+   {
+      if(i < shadowCascades && depth > shadowEnds[i]) cascade = i + 1;
+   }
+   if(cascade >= shadowCascades) return 1.0;
+   vec3 p = (shadowMatrix[cascade] *
+      vec4(v + n * shadowNormalOffsets[cascade], 1.0)).xyz;
+   // Each lookup blends four comparisons, together covering 3 x 3 texels.
+   float lit = shadow2D(shadowAtlas, p + vec3(-0.5, -0.5, 0.0) * shadowTexel).r;
+   lit += shadow2D(shadowAtlas, p + vec3(0.5, -0.5, 0.0) * shadowTexel).r;
+   lit += shadow2D(shadowAtlas, p + vec3(-0.5, 0.5, 0.0) * shadowTexel).r;
+   lit += shadow2D(shadowAtlas, p + vec3(0.5, 0.5, 0.0) * shadowTexel).r;
+   return lit * 0.25;
+}
+#endif
+
+#ifdef SHADOW_CUBE
+float shadowFactor(vec3 n)
 {
-   // gl_FragColor *= texture2D(myTexture2, vec2(gl_TexCoord[0]));
-   // N = vec3(texture2D(myTexture, vec2(gl_TexCoord[0])));
+   vec3 d = (shadowEyeToWorld * vec4(v, 1.0)).xyz - shadowLightPosition;
+   float dist = length(d);
+   if(dist >= shadowRange) return 1.0;
+   // Moved out along the normal by 1.5 texels at this distance
+   d += (shadowEyeToWorld * vec4(n, 0.0)).xyz * (1.5 * shadowTexel * dist);
+   dist = length(d);
+   return dist - shadowBias <= textureCube(shadowCube, d).r * shadowRange ?
+      1.0 : 0.0;
+}
+#endif
 
+#ifdef SH_AMBIENT
+vec3 shAmbient(vec3 eye_normal)
+{
+   vec3 n = shEyeToWorld * eye_normal;
+   return shCoefficients[0] +
+      shCoefficients[1] * n.y +
+      shCoefficients[2] * n.z +
+      shCoefficients[3] * n.x +
+      shCoefficients[4] * (n.x * n.y) +
+      shCoefficients[5] * (n.y * n.z) +
+      shCoefficients[6] * (3.0 * n.z * n.z - 1.0) +
+      shCoefficients[7] * (n.x * n.z) +
+      shCoefficients[8] * (n.x * n.x - n.y * n.y);
+}
+#endif
 
-   vec3 L = normalize(gl_LightSource[0].position.xyz - v);
+void main (void)
+{
+#if NUM_LIGHTS == 0
+   vec4 color = gl_Color;
+#else
+   vec3 n = normalize(N);
+#ifdef NORMAL_MAP
+   n = perturbNormal(n, v, gl_TexCoord[1].st);
+#endif
    vec3 E = normalize(-v); // we are in Eye Coordinates, so EyePos is (0,0,0)
-   vec3 R = normalize(-reflect(L,N));
 
-   //calculate Ambient Term:
-   vec4 Iamb = gl_FrontLightProduct[0].ambient;
+#ifdef SH_AMBIENT
+   vec4 color = gl_FrontMaterial.emission +
+      gl_FrontMaterial.ambient * vec4(max(shAmbient(n), 0.0), 1.0);
+#else
+   vec4 color = gl_FrontLightModelProduct.sceneColor;
+#endif
+#ifdef SHADOWED
+   float shadow = shadowFactor(n);
+#endif
+   for(int i = 0; i < NUM_LIGHTS; ++i)
+   {
+#ifdef DIRECTIONAL_LIGHTS
+      vec3 L = normalize(gl_LightSource[i].position.xyz);
+      float attenuation = lightEnabled[i];
+#else
+      vec4 p = gl_LightSource[i].position;
+      vec3 d = p.xyz - v * p.w;
+      float dist = length(d);
+      vec3 L = d / dist;
+      float attenuation = lightEnabled[i];
+      if(p.w != 0.0)
+      {
+         attenuation /= gl_LightSource[i].constantAttenuation +
+            gl_LightSource[i].linearAttenuation * dist +
+            gl_LightSource[i].quadraticAttenuation * dist * dist;
+      }
+#endif
+      // Blinn-Phong, as the fixed-function pipeline
+      vec3 H = normalize(L + E);
+      float diffuse = max(dot(n, L), 0.0);
+      float specular = diffuse > 0.0 ?
+         pow(max(dot(n, H), 0.0), gl_FrontMaterial.shininess) : 0.0;
+#ifdef SHADOWED
+      // The ambient part of the light is not shadowed.
+      if(i == shadowLight)
+      {
+         diffuse *= shadow;
+         specular *= shadow;
+      }
+#endif
+#ifdef SH_AMBIENT
+      color += attenuation * (gl_FrontLightProduct[i].diffuse * diffuse +
+         gl_FrontLightProduct[i].specular * specular);
+#else
+      color += attenuation * (gl_FrontLightProduct[i].ambient +
+         gl_FrontLightProduct[i].diffuse * diffuse +
+         gl_FrontLightProduct[i].specular * specular);
+#endif
+   }
+   color = clamp(color, 0.0, 1.0);
+   color.a = gl_FrontMaterial.diffuse.a;
+#endif
+
+#ifdef TEXTURED
+   color *= texture2D(myTexture, gl_TexCoord[0].st);
+#endif
 
-   //calculate Diffuse Term:
-   vec4 Idiff = gl_FrontLightProduct[0].diffuse * max(dot(N,L), 0.0);
-   Idiff = clamp(Idiff, 0.0, 1.0);
+#if defined(FOG_LINEAR)
+   float fog = (gl_Fog.end - gl_FogFragCoord) * gl_Fog.scale;
+#elif defined(FOG_EXP)
+   float fog = exp(-gl_Fog.density * gl_FogFragCoord);
+#elif defined(FOG_EXP2)
+   float fog = exp(-pow(gl_Fog.density * gl_FogFragCoord, 2.0));
+#endif
+#if defined(FOG_LINEAR) || defined(FOG_EXP) || defined(FOG_EXP2)
+   color.rgb = mix(gl_Fog.color.rgb, color.rgb, clamp(fog, 0.0, 1.0));
+#endif
 
-   // calculate Specular Term:
-   vec4 Ispec = gl_FrontLightProduct[0].specular
-                * pow(max(dot(R,E),0.0),0.3*gl_FrontMaterial.shininess);
-   Ispec = clamp(Ispec, 0.0, 1.0);
-   // write Total Color:
-   gl_FragColor = gl_FrontLightModelProduct.sceneColor + Iamb + Idiff + Ispec;
+   gl_FragColor = color;
 }
@@ -1,4 +1,9 @@
 // https://www.opengl.org/sdk/docs/tutorials/ClockworkCoders/lighting.php
+// Specialised by the same defines as blinn.frag.
+
+#ifndef NUM_LIGHTS
+#define NUM_LIGHTS 1
+#endif
 
 varying vec3 N;
 varying vec3 v;
@@ -8,5 +13,18 @@ void main(void)
    v = vec3(gl_ModelViewMatrix * gl_Vertex);
    N = normalize(gl_NormalMatrix * gl_Normal);
    gl_Position = gl_ModelViewProjectionMatrix * gl_Vertex;
-   gl_TexCoord[0] = gl_MultiTexCoord0;
+#ifdef TEXTURED
+   // Objects on an atlas page remap their coordinates with the texture matrix.
+   gl_TexCoord[0] = gl_TextureMatrix[0] * gl_MultiTexCoord0;
+#endif
+#ifdef NORMAL_MAP
+   gl_TexCoord[1] = gl_MultiTexCoord0;
+#endif
+#if NUM_LIGHTS == 0
+   gl_FrontColor = gl_Color;
+#endif
+#if defined(FOG_LINEAR) || defined(FOG_EXP) || defined(FOG_EXP2)
+   // Like the fixed-function pipeline, use the eye-space depth.
+   gl_FogFragCoord = abs(v.z);
+#endif
 }
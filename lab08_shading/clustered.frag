@@ -0,0 +1,72 @@
+#version 120
+
+// Per-pixel lighting by the point lights of ClusteredLights. The fragment
+// looks up its cluster in clusterGrid, which gives the offset and number of
+// its entries in lightIndices, and only shades with those lights. Each light
+// is two texels of lightData: the view-space position and radius, then the
+// color. The global ambient and emission of the material are added as usual.
+
+varying vec3 N;
+varying vec3 v;
+
+uniform sampler2D clusterGrid;
+uniform sampler2D lightData;
+uniform sampler2D lightIndices;
+uniform vec2 gridSize;
+uniform vec2 lightDataSize;
+uniform vec2 indexSize;
+uniform vec2 tileCount;
+// Tiles per pixel
+uniform vec2 tileScale;
+uniform vec2 viewportOrigin;
+// slice = log(depth) * sliceParams.x + sliceParams.y
+uniform vec2 sliceParams;
+
+// Element i of a texture filled row by row
+vec4 fetch(sampler2D data, vec2 size, float i)
+{
+   float y = floor(i / size.x);
+   return texture2D(data, (vec2(i - y * size.x, y) + 0.5) / size);
+}
+
+void main (void)
+{
+   vec3 n = normalize(N);
+   vec3 E = normalize(-v);
+
+   vec2 tile = clamp(floor((gl_FragCoord.xy - viewportOrigin) * tileScale),
+      vec2(0.0), tileCount - 1.0);
+   float slice = clamp(floor(log(-v.z) * sliceParams.x + sliceParams.y),
+      0.0, gridSize.y - 1.0);
+   vec2 cluster = texture2D(clusterGrid,
+      (vec2(tile.y * tileCount.x + tile.x, slice) + 0.5) / gridSize).xy;
+
+   vec3 diffuse = vec3(0.0);
+   vec3 specular = vec3(0.0);
+   int count = int(cluster.y);
+   for(int i = 0; i < count; ++i)
+   {
+      float index = fetch(lightIndices, indexSize, cluster.x + float(i)).r;
+      vec4 light = fetch(lightData, lightDataSize, index * 2.0);
+      vec3 color = fetch(lightData, lightDataSize, index * 2.0 + 1.0).rgb;
+      vec3 d = light.xyz - v;
+      float dist = length(d);
+      vec3 L = d / dist;
+      // Inverse square falloff, windowed to reach zero at the radius
+      float window = clamp(1.0 - pow(dist / light.w, 4.0), 0.0, 1.0);
+      float attenuation = window * window / (dist * dist + 1.0);
+      float nl = max(dot(n, L), 0.0);
+      vec3 H = normalize(L + E);
+      float spec = nl > 0.0 ?
+         pow(max(dot(n, H), 0.0), gl_FrontMaterial.shininess) : 0.0;
+      diffuse += color * (nl * attenuation);
+      specular += color * (spec * attenuation);
+   }
+
+   vec4 result = gl_FrontLightModelProduct.sceneColor;
+   result.rgb += gl_FrontMaterial.diffuse.rgb * diffuse +
+      gl_FrontMaterial.specular.rgb * specular;
+   result = clamp(result, 0.0, 1.0);
+   result.a = gl_FrontMaterial.diffuse.a;
+   gl_FragColor = result;
+}
@@ -0,0 +1,77 @@
+// Lighting pass of DeferredRenderer: adds one light to every pixel covered
+// by its volume, with the lighting model of blinn.frag, reading the surface
+// from the G-buffer (see gbuffer.frag). The eye-space position is rebuilt
+// from the depth buffer.
+//
+// With COMPOSITE defined, copies the accumulated light and the depth to the
+// framebuffer instead.
+
+uniform sampler2D accumBuffer;
+uniform sampler2D albedoBuffer;
+uniform sampler2D specularBuffer;
+uniform sampler2D normalBuffer;
+uniform sampler2D depthBuffer;
+uniform vec2 bufferSize;
+uniform mat4 inverseProjection;
+
+// Eye space, w = 0 for directional lights
+uniform vec4 lightPosition;
+uniform vec3 lightDiffuse;
+uniform vec3 lightSpecular;
+// Constant, linear and quadratic, if lightRadius is 0
+uniform vec3 lightAttenuation;
+// Otherwise, inverse square falloff reaching zero at lightRadius, as in
+// clustered.frag
+uniform float lightRadius;
+
+void main (void)
+{
+   vec2 uv = gl_FragCoord.xy / bufferSize;
+   float depth = texture2D(depthBuffer, uv).r;
+
+#ifdef COMPOSITE
+   gl_FragColor = clamp(texture2D(accumBuffer, uv), 0.0, 1.0);
+   gl_FragDepth = depth;
+#else
+   vec4 normal = texture2D(normalBuffer, uv);
+   if(normal.w == 0.0) discard;
+
+   vec4 p = inverseProjection * vec4(vec3(uv, depth) * 2.0 - 1.0, 1.0);
+   vec3 v = p.xyz / p.w;
+   vec3 n = normalize(normal.xyz);
+   vec3 E = normalize(-v);
+
+   vec3 L;
+   float attenuation = 1.0;
+   if(lightPosition.w == 0.0)
+   {
+      L = normalize(lightPosition.xyz);
+   }
+   else
+   {
+      vec3 d = lightPosition.xyz - v;
+      float dist = length(d);
+      L = d / dist;
+      if(lightRadius > 0.0)
+      {
+         if(dist > lightRadius) discard;
+         float window = clamp(1.0 - pow(dist / lightRadius, 4.0), 0.0, 1.0);
+         attenuation = window * window / (dist * dist + 1.0);
+      }
+      else
+      {
+         attenuation = 1.0 / (lightAttenuation.x +
+            lightAttenuation.y * dist + lightAttenuation.z * dist * dist);
+      }
+   }
+
+   vec3 albedo = texture2D(albedoBuffer, uv).rgb;
+   vec4 specular = texture2D(specularBuffer, uv);
+   vec3 H = normalize(L + E);
+   float nl = max(dot(n, L), 0.0);
+   float spec = nl > 0.0 ?
+      pow(max(dot(n, H), 0.0), specular.a * 128.0) : 0.0;
+   gl_FragColor = vec4(attenuation * (albedo * lightDiffuse * nl +
+      specular.rgb * lightSpecular * spec), 0.0);
+#endif
+}
@@ -0,0 +1,7 @@
+// Light volumes and full-screen quads of DeferredRenderer, which read the
+// G-buffer at gl_FragCoord and need no varyings.
+
+void main(void)
+{
+   gl_Position = ftransform();
+}
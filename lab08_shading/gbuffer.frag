@@ -0,0 +1,73 @@
+// Geometry pass of DeferredRenderer. Takes the defines of blinn.frag, of
+// which NUM_LIGHTS, TEXTURED and NORMAL_MAP matter, and writes
+//
+//   0: emission and ambient light, or the color of unlit geometry
+//   1: diffuse albedo
+//   2: specular color, shininess / 128
+//   3: eye-space normal, 0 for unlit geometry
+//
+// The ambient terms of the lights are not attenuated.
+
+#ifndef NUM_LIGHTS
+#define NUM_LIGHTS 1
+#endif
+
+varying vec3 N;
+varying vec3 v;
+#ifdef TEXTURED
+uniform sampler2D myTexture;
+#endif
+#ifdef NORMAL_MAP
+uniform sampler2D normalMap;
+#endif
+#if NUM_LIGHTS > 0
+uniform float lightEnabled[NUM_LIGHTS];
+#endif
+
+#ifdef NORMAL_MAP
+// As in blinn.frag
+vec3 perturbNormal(vec3 n, vec3 p, vec2 uv)
+{
+   vec3 dp1 = dFdx(p);
+   vec3 dp2 = dFdy(p);
+   vec2 duv1 = dFdx(uv);
+   vec2 duv2 = dFdy(uv);
+   vec3 dp2perp = cross(dp2, n);
+   vec3 dp1perp = cross(n, dp1);
+   vec3 t = dp2perp * duv1.x + dp1perp * duv2.x;
+   vec3 b = dp2perp * duv1.y + dp1perp * duv2.y;
+   float scale = inversesqrt(max(max(dot(t, t), dot(b, b)), 1e-20));
+   vec3 m = texture2D(normalMap, uv).xyz * 2.0 - 1.0;
+   return normalize(mat3(t * scale, b * scale, n) * m);
+}
+#endif
+
+void main (void)
+{
+   vec4 texel = vec4(1.0);
+#ifdef TEXTURED
+   texel = texture2D(myTexture, gl_TexCoord[0].st);
+#endif
+
+#if NUM_LIGHTS == 0
+   gl_FragData[0] = gl_Color * texel;
+   gl_FragData[1] = vec4(0.0);
+   gl_FragData[2] = vec4(0.0);
+   gl_FragData[3] = vec4(0.0);
+#else
+   vec3 n = normalize(N);
+#ifdef NORMAL_MAP
+   n = perturbNormal(n, v, gl_TexCoord[1].st);
+#endif
+   vec4 ambient = gl_FrontLightModelProduct.sceneColor;
+   for(int i = 0; i < NUM_LIGHTS; ++i)
+      ambient += lightEnabled[i] * gl_FrontLightProduct[i].ambient;
+
+   gl_FragData[0] = vec4(clamp(ambient.rgb, 0.0, 1.0) * texel.rgb,
+      gl_FrontMaterial.diffuse.a * texel.a);
+   gl_FragData[1] = vec4(gl_FrontMaterial.diffuse.rgb * texel.rgb, 1.0);
+   gl_FragData[2] = vec4(gl_FrontMaterial.specular.rgb * texel.rgb,
+      gl_FrontMaterial.shininess / 128.0);
+   gl_FragData[3] = vec4(n, 1.0);
+#endif
+}
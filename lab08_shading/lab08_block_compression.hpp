@@ -0,0 +1,780 @@
+#pragma once
+
+// Block compression of RGBA images into the BCn formats understood by GPUs.
+// Independent of OpenGL so that it can be used by the tools and run on worker
+// threads.
+
+#include <cstdint>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <string>
+#include <vector>
+
+#include "lab08_image.hpp"
+
+/*****************************************************************************/
+// Block Formats
+/*****************************************************************************/
+
+enum class BlockFormat
+{
+    // RGB at 4 bits per texel, opaque
+    BC1,
+    // BC1 color plus interpolated alpha at 8 bits per texel
+    BC3,
+    // RGBA at 8 bits per texel with much finer endpoints and weights. Only
+    // mode 6, a single subset with 16 weights, is encoded.
+    BC7,
+};
+
+inline std::size_t blockBytes(BlockFormat format)
+{
+    return format == BlockFormat::BC1 ? 8 : 16;
+}
+
+inline const char * blockFormatName(BlockFormat format)
+{
+    switch(format)
+    {
+        case BlockFormat::BC1: return "BC1";
+        case BlockFormat::BC3: return "BC3";
+        case BlockFormat::BC7: return "BC7";
+        default: return "?";
+    }
+}
+
+/**
+ * \brief An image stored as 4x4 blocks, row by row. Sizes which are not a
+ * multiple of 4 are padded by repeating the edge texels.
+ */
+struct CompressedImage
+{
+    BlockFormat format = BlockFormat::BC1;
+    int width = 0;
+    int height = 0;
+    std::vector<std::uint8_t> blocks;
+
+    int blocksX() const { return (width + 3) / 4; }
+    int blocksY() const { return (height + 3) / 4; }
+    std::size_t bytes() const { return blocks.size(); }
+    // Bytes of one row of blocks, which covers 4 rows of texels.
+    std::size_t blockRowBytes() const { return blocksX() * blockBytes(format); }
+};
+
+// Whether any texel is not fully opaque.
+inline bool hasTranslucency(const std::uint8_t *rgba, int width, int height)
+{
+    const auto count = std::size_t(width) * height;
+    for(std::size_t i = 0; i < count; ++i)
+        if(rgba[i * 4 + 3] != 255) return true;
+    return false;
+}
+
+/*****************************************************************************/
+// BC1
+/*****************************************************************************/
+
+inline std::uint16_t packRgb565(const float c[3])
+{
+    auto q = [](float v, int max) {
+        return static_cast<int>(std::min(std::max(v, 0.f), 255.f) * max / 255
+            + 0.5f);
+    };
+    return static_cast<std::uint16_t>(
+        q(c[0], 31) << 11 | q(c[1], 63) << 5 | q(c[2], 31));
+}
+
+inline void unpackRgb565(std::uint16_t c, int out[3])
+{
+    const int r = c >> 11 & 31, g = c >> 5 & 63, b = c & 31;
+    out[0] = r << 3 | r >> 2;
+    out[1] = g << 2 | g >> 4;
+    out[2] = b << 3 | b >> 2;
+}
+
+// The four colors of a BC1 block in four-color mode.
+inline void bc1Palette(std::uint16_t c0, std::uint16_t c1, int palette[4][3])
+{
+    unpackRgb565(c0, palette[0]);
+    unpackRgb565(c1, palette[1]);
+    for(int i = 0; i < 3; ++i)
+    {
+        palette[2][i] = (2 * palette[0][i] + palette[1][i]) / 3;
+        palette[3][i] = (palette[0][i] + 2 * palette[1][i]) / 3;
+    }
+}
+
+inline int rgbSquaredDistance(const std::uint8_t *texel, const int color[3])
+{
+    int d = 0;
+    for(int i = 0; i < 3; ++i)
+    {
+        const auto e = texel[i] - color[i];
+        d += e * e;
+    }
+    return d;
+}
+
+// Pick the nearest palette entry for every texel, returning the total error.
+inline int bc1Indices(const std::uint8_t block[64], std::uint16_t c0,
+    std::uint16_t c1, std::uint32_t &indices)
+{
+    int palette[4][3];
+    bc1Palette(c0, c1, palette);
+    int error = 0;
+    indices = 0;
+    for(int t = 0; t < 16; ++t)
+    {
+        int best = 0, best_d = rgbSquaredDistance(block + t * 4, palette[0]);
+        for(int i = 1; i < 4; ++i)
+        {
+            const auto d = rgbSquaredDistance(block + t * 4, palette[i]);
+            if(d < best_d)
+            {
+                best = i;
+                best_d = d;
+            }
+        }
+        indices |= std::uint32_t(best) << (t * 2);
+        error += best_d;
+    }
+    return error;
+}
+
+/**
+ * \brief The direction of largest variance of n points of dimension D,
+ * found by power iteration on their covariance matrix. Returns false if the
+ * points coincide.
+ */
+template <int D>
+bool principalAxis(const float (*points)[D], int n, float mean[D],
+    float axis[D])
+{
+    for(int i = 0; i < D; ++i)
+    {
+        mean[i] = 0;
+        for(int p = 0; p < n; ++p) mean[i] += points[p][i];
+        mean[i] /= n;
+    }
+    float cov[D][D] = { };
+    for(int p = 0; p < n; ++p)
+    {
+        for(int i = 0; i < D; ++i)
+            for(int j = 0; j < D; ++j)
+                cov[i][j] += (points[p][i] - mean[i]) * (points[p][j] - mean[j]);
+    }
+    // Start from the diagonal of the bounding box for fast convergence.
+    float trace = 0;
+    for(int i = 0; i < D; ++i)
+    {
+        axis[i] = 1;
+        trace += cov[i][i];
+    }
+    if(trace < 1e-3f) return false;
+    for(int iter = 0; iter < 8; ++iter)
+    {
+        float next[D] = { };
+        float length = 0;
+        for(int i = 0; i < D; ++i)
+        {
+            for(int j = 0; j < D; ++j) next[i] += cov[i][j] * axis[j];
+            length += next[i] * next[i];
+        }
+        if(length < 1e-12f) return false;
+        length = 1 / std::sqrt(length);
+        for(int i = 0; i < D; ++i) axis[i] = next[i] * length;
+    }
+    return true;
+}
+
+// Endpoints at the extremes of the projections onto the principal axis.
+template <int D>
+void fitBlockEndpoints(const float (*points)[D], int n, float e0[D], float e1[D])
+{
+    float mean[D], axis[D];
+    if(!principalAxis<D>(points, n, mean, axis))
+    {
+        for(int i = 0; i < D; ++i) e0[i] = e1[i] = mean[i];
+        return;
+    }
+    float lo = 0, hi = 0;
+    for(int p = 0; p < n; ++p)
+    {
+        float t = 0;
+        for(int i = 0; i < D; ++i) t += (points[p][i] - mean[i]) * axis[i];
+        lo = std::min(lo, t);
+        hi = std::max(hi, t);
+    }
+    for(int i = 0; i < D; ++i)
+    {
+        e0[i] = std::min(std::max(mean[i] + axis[i] * hi, 0.f), 255.f);
+        e1[i] = std::min(std::max(mean[i] + axis[i] * lo, 0.f), 255.f);
+    }
+}
+
+/**
+ * \brief Refit the endpoints by least squares to the texels given the
+ * weights of their current indices. Returns false if the system is singular.
+ */
+inline bool refineBc1Endpoints(const std::uint8_t block[64],
+    std::uint32_t indices, float e0[3], float e1[3])
+{
+    static const float kWeights[4] = { 1.f, 0.f, 2 / 3.f, 1 / 3.f };
+    float aa = 0, bb = 0, ab = 0;
+    float ax[3] = { }, bx[3] = { };
+    for(int t = 0; t < 16; ++t)
+    {
+        const auto a = kWeights[indices >> (t * 2) & 3];
+        const auto b = 1 - a;
+        aa += a * a;
+        bb += b * b;
+        ab += a * b;
+        for(int i = 0; i < 3; ++i)
+        {
+            ax[i] += a * block[t * 4 + i];
+            bx[i] += b * block[t * 4 + i];
+        }
+    }
+    const auto det = aa * bb - ab * ab;
+    if(std::abs(det) < 1e-6f) return false;
+    for(int i = 0; i < 3; ++i)
+    {
+        e0[i] = (ax[i] * bb - bx[i] * ab) / det;
+        e1[i] = (bx[i] * aa - ax[i] * ab) / det;
+    }
+    return true;
+}
+
+/**
+ * \brief Encode the RGB of 4x4 RGBA texels into an 8-byte BC1 block, always
+ * in four-color mode. Endpoints are fit along the principal axis of the
+ * colors and then refined by least squares.
+ */
+inline void encodeBc1Block(const std::uint8_t block[64], std::uint8_t out[8])
+{
+    float points[16][3];
+    for(int t = 0; t < 16; ++t)
+        for(int i = 0; i < 3; ++i) points[t][i] = block[t * 4 + i];
+
+    float e0[3], e1[3];
+    fitBlockEndpoints<3>(points, 16, e0, e1);
+    auto c0 = packRgb565(e0), c1 = packRgb565(e1);
+    std::uint32_t indices;
+    auto error = bc1Indices(block, c0, c1, indices);
+
+    for(int iter = 0; iter < 2 && error > 0 && c0 != c1; ++iter)
+    {
+        if(!refineBc1Endpoints(block, indices, e0, e1)) break;
+        const auto r0 = packRgb565(e0), r1 = packRgb565(e1);
+        std::uint32_t r_indices;
+        const auto r_error = bc1Indices(block, r0, r1, r_indices);
+        if(r_error >= error) break;
+        c0 = r0;
+        c1 = r1;
+        indices = r_indices;
+        error = r_error;
+    }
+
+    // Four-color mode requires c0 > c1. Swapping the endpoints exchanges
+    // indices 0 with 1 and 2 with 3.
+    if(c0 < c1)
+    {
+        std::swap(c0, c1);
+        indices ^= 0x55555555;
+    }
+    else if(c0 == c1)
+    {
+        indices = 0;
+    }
+    out[0] = c0 & 0xff;
+    out[1] = c0 >> 8;
+    out[2] = c1 & 0xff;
+    out[3] = c1 >> 8;
+    for(int i = 0; i < 4; ++i) out[4 + i] = indices >> (i * 8) & 0xff;
+}
+
+/**
+ * \brief Decode a BC1 block to 4x4 RGBA texels. Blocks with c0 <= c1 use
+ * three colors and transparent black unless four_color is set, as for the
+ * color part of BC3.
+ */
+inline void decodeBc1Block(const std::uint8_t in[8], std::uint8_t block[64],
+    bool four_color = false)
+{
+    const std::uint16_t c0 = in[0] | in[1] << 8;
+    const std::uint16_t c1 = in[2] | in[3] << 8;
+    int palette[4][3];
+    bc1Palette(c0, c1, palette);
+    const auto three_color = !four_color && c0 <= c1;
+    if(three_color)
+    {
+        for(int i = 0; i < 3; ++i)
+        {
+            palette[2][i] = (palette[0][i] + palette[1][i]) / 2;
+            palette[3][i] = 0;
+        }
+    }
+    const std::uint32_t indices =
+        in[4] | in[5] << 8 | in[6] << 16 | std::uint32_t(in[7]) << 24;
+    for(int t = 0; t < 16; ++t)
+    {
+        const auto index = indices >> (t * 2) & 3;
+        for(int i = 0; i < 3; ++i)
+            block[t * 4 + i] = static_cast<std::uint8_t>(palette[index][i]);
+        block[t * 4 + 3] = three_color && index == 3 ? 0 : 255;
+    }
+}
+
+/*****************************************************************************/
+// BC3
+/*****************************************************************************/
+
+/**
+ * \brief Encode the alpha of 4x4 RGBA texels into an 8-byte BC4 block with
+ * eight interpolated values between the extremes.
+ */
+inline void encodeBc3AlphaBlock(const std::uint8_t block[64],
+    std::uint8_t out[8])
+{
+    int a0 = 0, a1 = 255;
+    for(int t = 0; t < 16; ++t)
+    {
+        a0 = std::max<int>(a0, block[t * 4 + 3]);
+        a1 = std::min<int>(a1, block[t * 4 + 3]);
+    }
+    out[0] = static_cast<std::uint8_t>(a0);
+    out[1] = static_cast<std::uint8_t>(a1);
+    std::uint64_t indices = 0;
+    if(a0 > a1)
+    {
+        int palette[8] = { a0, a1 };
+        for(int i = 1; i < 7; ++i)
+            palette[i + 1] = ((7 - i) * a0 + i * a1) / 7;
+        for(int t = 0; t < 16; ++t)
+        {
+            int best = 0, best_d = 256;
+            for(int i = 0; i < 8; ++i)
+            {
+                const auto d = std::abs(block[t * 4 + 3] - palette[i]);
+                if(d < best_d)
+                {
+                    best = i;
+                    best_d = d;
+                }
+            }
+            indices |= std::uint64_t(best) << (t * 3);
+        }
+    }
+    for(int i = 0; i < 6; ++i) out[2 + i] = indices >> (i * 8) & 0xff;
+}
+
+inline void decodeBc3AlphaBlock(const std::uint8_t in[8],
+    std::uint8_t block[64])
+{
+    const int a0 = in[0], a1 = in[1];
+    int palette[8] = { a0, a1 };
+    if(a0 > a1)
+    {
+        for(int i = 1; i < 7; ++i)
+            palette[i + 1] = ((7 - i) * a0 + i * a1) / 7;
+    }
+    else
+    {
+        for(int i = 1; i < 5; ++i)
+            palette[i + 1] = ((5 - i) * a0 + i * a1) / 5;
+        palette[6] = 0;
+        palette[7] = 255;
+    }
+    std::uint64_t indices = 0;
+    for(int i = 0; i < 6; ++i) indices |= std::uint64_t(in[2 + i]) << (i * 8);
+    for(int t = 0; t < 16; ++t)
+        block[t * 4 + 3] = static_cast<std::uint8_t>(
+            palette[indices >> (t * 3) & 7]);
+}
+
+inline void encodeBc3Block(const std::uint8_t block[64], std::uint8_t out[16])
+{
+    encodeBc3AlphaBlock(block, out);
+    encodeBc1Block(block, out + 8);
+}
+
+inline void decodeBc3Block(const std::uint8_t in[16], std::uint8_t block[64])
+{
+    decodeBc1Block(in + 8, block, true);
+    decodeBc3AlphaBlock(in, block);
+}
+
+/*****************************************************************************/
+// BC7
+/*****************************************************************************/
+
+constexpr int kBc7Weights4[16] = {
+    0, 4, 9, 13, 17, 21, 26, 30, 34, 38, 43, 47, 51, 55, 60, 64
+};
+
+inline int bc7Interpolate(int e0, int e1, int weight)
+{
+    return ((64 - weight) * e0 + weight * e1 + 32) >> 6;
+}
+
+// Quantize a channel to 7 bits given the shared p-bit.
+inline int bc7Quantize(float v, int p_bit)
+{
+    const auto q = static_cast<int>((v - p_bit) / 2 + 0.5f);
+    return std::min(std::max(q, 0), 127);
+}
+
+/**
+ * \brief Pick the weight for every texel by projecting it onto the line
+ * between the endpoints, which are given as full 8-bit values. Returns the
+ * total error of the interpolated colors.
+ */
+inline int bc7Indices(const std::uint8_t block[64], const int e0[4],
+    const int e1[4], int indices[16])
+{
+    int d[4], length2 = 0;
+    for(int i = 0; i < 4; ++i)
+    {
+        d[i] = e1[i] - e0[i];
+        length2 += d[i] * d[i];
+    }
+    int error = 0;
+    for(int t = 0; t < 16; ++t)
+    {
+        int index = 0;
+        if(length2 > 0)
+        {
+            int dot = 0;
+            for(int i = 0; i < 4; ++i) dot += (block[t * 4 + i] - e0[i]) * d[i];
+            // Position along the line in 64ths, rounded to the nearest weight
+            const auto w = std::min(std::max(dot * 64.f / length2, 0.f), 64.f);
+            while(index < 15 &&
+                w > (kBc7Weights4[index] + kBc7Weights4[index + 1]) * 0.5f)
+                ++index;
+        }
+        indices[t] = index;
+        for(int i = 0; i < 4; ++i)
+        {
+            const auto e = block[t * 4 + i] -
+                bc7Interpolate(e0[i], e1[i], kBc7Weights4[index]);
+            error += e * e;
+        }
+    }
+    return error;
+}
+
+// Writes a 128-bit block from least to most significant bit.
+struct BlockBitWriter
+{
+    std::uint8_t *out;
+    int position = 0;
+
+    void write(std::uint32_t value, int bits)
+    {
+        for(int i = 0; i < bits; ++i, ++position)
+        {
+            if(value >> i & 1) out[position / 8] |= 1 << (position % 8);
+        }
+    }
+};
+
+struct BlockBitReader
+{
+    const std::uint8_t *in;
+    int position = 0;
+
+    std::uint32_t read(int bits)
+    {
+        std::uint32_t value = 0;
+        for(int i = 0; i < bits; ++i, ++position)
+            value |= std::uint32_t(in[position / 8] >> (position % 8) & 1) << i;
+        return value;
+    }
+};
+
+/**
+ * \brief Encode 4x4 RGBA texels into a 16-byte BC7 block using mode 6:
+ * RGBA endpoints of 7 bits plus a p-bit each and 4-bit indices. Endpoints
+ * are fit along the principal axis in RGBA and all four p-bit combinations
+ * are tried.
+ */
+inline void encodeBc7Block(const std::uint8_t block[64], std::uint8_t out[16])
+{
+    float points[16][4];
+    for(int t = 0; t < 16; ++t)
+        for(int i = 0; i < 4; ++i) points[t][i] = block[t * 4 + i];
+    float f0[4], f1[4];
+    fitBlockEndpoints<4>(points, 16, f0, f1);
+
+    int best_error = INT32_MAX;
+    int best_q0[4], best_q1[4], best_p[2] = { }, best_indices[16];
+    for(int p = 0; p < 4; ++p)
+    {
+        const int p0 = p & 1, p1 = p >> 1;
+        int q0[4], q1[4], e0[4], e1[4];
+        for(int i = 0; i < 4; ++i)
+        {
+            q0[i] = bc7Quantize(f0[i], p0);
+            q1[i] = bc7Quantize(f1[i], p1);
+            e0[i] = q0[i] << 1 | p0;
+            e1[i] = q1[i] << 1 | p1;
+        }
+        int indices[16];
+        const auto error = bc7Indices(block, e0, e1, indices);
+        if(error < best_error)
+        {
+            best_error = error;
+            std::copy(q0, q0 + 4, best_q0);
+            std::copy(q1, q1 + 4, best_q1);
+            best_p[0] = p0;
+            best_p[1] = p1;
+            std::copy(indices, indices + 16, best_indices);
+        }
+    }
+
+    // The most significant index bit of the first texel is implied to be
+    // zero. Swap the endpoints if it is not.
+    if(best_indices[0] & 8)
+    {
+        std::swap(best_q0, best_q1);
+        std::swap(best_p[0], best_p[1]);
+        for(auto &&i : best_indices) i = 15 - i;
+    }
+
+    std::memset(out, 0, 16);
+    BlockBitWriter writer { out };
+    writer.write(1 << 6, 7);
+    for(int i = 0; i < 4; ++i)
+    {
+        writer.write(best_q0[i], 7);
+        writer.write(best_q1[i], 7);
+    }
+    writer.write(best_p[0], 1);
+    writer.write(best_p[1], 1);
+    writer.write(best_indices[0], 3);
+    for(int t = 1; t < 16; ++t) writer.write(best_indices[t], 4);
+}
+
+/**
+ * \brief Decode a BC7 block written by encodeBc7Block(). Blocks in other
+ * modes decode to transparent black.
+ */
+inline void decodeBc7Block(const std::uint8_t in[16], std::uint8_t block[64])
+{
+    if((in[0] & 0x7f) != 0x40)
+    {
+        std::memset(block, 0, 64);
+        return;
+    }
+    BlockBitReader reader { in };
+    reader.read(7);
+    int e0[4], e1[4];
+    for(int i = 0; i < 4; ++i)
+    {
+        e0[i] = reader.read(7) << 1;
+        e1[i] = reader.read(7) << 1;
+    }
+    const auto p0 = reader.read(1), p1 = reader.read(1);
+    for(int i = 0; i < 4; ++i)
+    {
+        e0[i] |= p0;
+        e1[i] |= p1;
+    }
+    for(int t = 0; t < 16; ++t)
+    {
+        const auto w = kBc7Weights4[reader.read(t == 0 ? 3 : 4)];
+        for(int i = 0; i < 4; ++i)
+            block[t * 4 + i] = static_cast<std::uint8_t>(
+                bc7Interpolate(e0[i], e1[i], w));
+    }
+}
+
+/*****************************************************************************/
+// Images
+/*****************************************************************************/
+
+/**
+ * \brief Compress an RGBA image. Rows of blocks are encoded in parallel.
+ */
+inline CompressedImage compressImage(const std::uint8_t *rgba, int width,
+    int height, BlockFormat format, ThreadPool &pool = workerPool())
+{
+    CompressedImage out;
+    out.format = format;
+    out.width = width;
+    out.height = height;
+    out.blocks.resize(out.blockRowBytes() * out.blocksY());
+
+    const auto block_bytes = blockBytes(format);
+    const auto blocks_x = out.blocksX();
+    pool.parallelFor(out.blocksY(), std::max(1, 256 / blocks_x),
+        [&](std::size_t begin, std::size_t end) {
+            std::uint8_t block[64];
+            for(auto by = static_cast<int>(begin); by < static_cast<int>(end); ++by)
+            {
+                for(int bx = 0; bx < blocks_x; ++bx)
+                {
+                    // Gather the texels, repeating the edges of the image.
+                    for(int y = 0; y < 4; ++y)
+                    {
+                        const auto sy = std::min(by * 4 + y, height - 1);
+                        for(int x = 0; x < 4; ++x)
+                        {
+                            const auto sx = std::min(bx * 4 + x, width - 1);
+                            std::memcpy(block + (y * 4 + x) * 4,
+                                rgba + (std::size_t(sy) * width + sx) * 4, 4);
+                        }
+                    }
+                    auto *dst = out.blocks.data() +
+                        (std::size_t(by) * blocks_x + bx) * block_bytes;
+                    switch(format)
+                    {
+                        case BlockFormat::BC1: encodeBc1Block(block, dst); break;
+                        case BlockFormat::BC3: encodeBc3Block(block, dst); break;
+                        case BlockFormat::BC7: encodeBc7Block(block, dst); break;
+                    }
+                }
+            }
+        });
+    return out;
+}
+
+/**
+ * \brief Decompress an image, e.g. to check the encoder without a GPU.
+ */
+inline Image decompressImage(const CompressedImage &image)
+{
+    Image out(image.width, image.height);
+    const auto block_bytes = blockBytes(image.format);
+    std::uint8_t block[64];
+    for(int by = 0; by < image.blocksY(); ++by)
+    {
+        for(int bx = 0; bx < image.blocksX(); ++bx)
+        {
+            const auto *src = image.blocks.data() +
+                (std::size_t(by) * image.blocksX() + bx) * block_bytes;
+            switch(image.format)
+            {
+                case BlockFormat::BC1: decodeBc1Block(src, block); break;
+                case BlockFormat::BC3: decodeBc3Block(src, block); break;
+                case BlockFormat::BC7: decodeBc7Block(src, block); break;
+            }
+            for(int y = 0; y < 4 && by * 4 + y < image.height; ++y)
+            {
+                for(int x = 0; x < 4 && bx * 4 + x < image.width; ++x)
+                {
+                    std::memcpy(out.pixels.data() +
+                        (std::size_t(by * 4 + y) * image.width + bx * 4 + x) * 4,
+                        block + (y * 4 + x) * 4, 4);
+                }
+            }
+        }
+    }
+    return out;
+}
+
+/*****************************************************************************/
+// Disk Cache
+/*****************************************************************************/
+
+/*
+ * Compressed mip chains are cached next to their source images. The source
+ * is identified by the hash of its file content, so the cache is rebuilt
+ * when the image is edited.
+ *
+ * File layout, little endian:
+ *     char[4]  "LBCC"
+ *     u32      version
+ *     u64      source hash
+ *     u32      block format
+ *     u32      mip filter
+ *     u32      level count
+ *     per level: u32 width, u32 height, u32 byte count, blocks
+ */
+
+constexpr std::uint32_t kCompressedCacheVersion = 1;
+
+/**
+ * \brief Read a cached mip chain. Returns false if the file is missing,
+ * damaged or was built from a different source or with another mip filter.
+ */
+inline bool readCompressedMipChain(const std::string &path,
+    std::uint64_t source_hash, MipFilter mip_filter,
+    std::vector<CompressedImage> &levels)
+{
+    std::ifstream file(path, std::ios::binary);
+    if(!file) return false;
+
+    auto read = [&](auto &value) {
+        return static_cast<bool>(
+            file.read(reinterpret_cast<char *>(&value), sizeof(value)));
+    };
+    char magic[4];
+    std::uint32_t version, format, filter, count;
+    std::uint64_t hash;
+    if(!file.read(magic, 4) || std::memcmp(magic, "LBCC", 4) != 0) return false;
+    if(!read(version) || version != kCompressedCacheVersion) return false;
+    if(!read(hash) || hash != source_hash) return false;
+    if(!read(format) || format > static_cast<std::uint32_t>(BlockFormat::BC7))
+        return false;
+    if(!read(filter) || filter != static_cast<std::uint32_t>(mip_filter))
+        return false;
+    if(!read(count) || count == 0 || count > 32) return false;
+
+    levels.resize(count);
+    for(auto &&level : levels)
+    {
+        std::uint32_t width, height, size;
+        if(!read(width) || !read(height) || !read(size)) return false;
+        level.format = static_cast<BlockFormat>(format);
+        level.width = static_cast<int>(width);
+        level.height = static_cast<int>(height);
+        if(size != level.blockRowBytes() * level.blocksY()) return false;
+        level.blocks.resize(size);
+        if(!file.read(reinterpret_cast<char *>(level.blocks.data()), size))
+            return false;
+    }
+    return true;
+}
+
+/**
+ * \brief Write a mip chain through a temporary file, so that concurrent
+ * readers never see a partial cache.
+ */
+inline bool writeCompressedMipChain(const std::string &path,
+    std::uint64_t source_hash, MipFilter mip_filter,
+    const std::vector<CompressedImage> &levels)
+{
+    if(levels.empty()) return false;
+    const auto temp_path = path + ".tmp" +
+        std::to_string(std::hash<std::thread::id>()(std::this_thread::get_id()));
+    {
+        std::ofstream file(temp_path, std::ios::binary);
+        if(!file) return false;
+
+        auto write = [&](auto value) {
+            file.write(reinterpret_cast<const char *>(&value), sizeof(value));
+        };
+        file.write("LBCC", 4);
+        write(kCompressedCacheVersion);
+        write(source_hash);
+        write(static_cast<std::uint32_t>(levels.front().format));
+        write(static_cast<std::uint32_t>(mip_filter));
+        write(static_cast<std::uint32_t>(levels.size()));
+        for(auto &&level : levels)
+        {
+            write(static_cast<std::uint32_t>(level.width));
+            write(static_cast<std::uint32_t>(level.height));
+            write(static_cast<std::uint32_t>(level.blocks.size()));
+            file.write(reinterpret_cast<const char *>(level.blocks.data()),
+                level.blocks.size());
+        }
+        if(!file) return false;
+    }
+    std::error_code ec;
+    std::filesystem::rename(temp_path, path, ec);
+    if(!ec) return true;
+    std::filesystem::remove(temp_path, ec);
+    return false;
+}
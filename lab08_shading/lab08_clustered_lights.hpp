@@ -0,0 +1,454 @@
+#pragma once
+
+// Included by lab08_framework.hpp after lab08_shader.hpp.
+
+#include <chrono>
+#include <cmath>
+#include <cstdint>
+#include <vector>
+
+#include "lab08_thread_pool.hpp"
+
+/*****************************************************************************/
+// ClusteredLights
+/*****************************************************************************/
+
+/**
+ * \brief Point lights beyond the eight of the fixed-function pipeline.
+ *
+ * Every frame the view frustum is cut into kTilesX * kTilesY tiles on screen
+ * and kSlices depth slices of exponentially growing thickness, and each
+ * light is assigned to the clusters its sphere of influence touches. The
+ * shader (clustered.frag) finds the cluster of a fragment and only loops
+ * over the lights listed for it. The lights, the lists and the grid are
+ * handed to the shader as float textures, which GLSL 1.20 can read.
+ *
+ * The attributes of the lights are kept in one array each so that the
+ * per-light loops vectorise, and the binning of the slices is spread over
+ * the worker pool.
+ */
+class ClusteredLights
+{
+public:
+    static constexpr int kTilesX = 16;
+    static constexpr int kTilesY = 9;
+    static constexpr int kSlices = 24;
+    static constexpr int kClusters = kTilesX * kTilesY * kSlices;
+    // Width of the light and index textures. A power of two, so that the
+    // shader can split an index into a row and column exactly.
+    static constexpr int kDataWidth = 1024;
+    // Texture units of the grid, lights and indices, after those of
+    // myTexture and normalMap
+    static constexpr int kGridUnit = 2;
+    static constexpr int kLightUnit = 3;
+    static constexpr int kIndexUnit = 4;
+
+private:
+    // World-space lights
+    std::vector<float> mX, mY, mZ, mRadius;
+    std::vector<float> mRed, mGreen, mBlue;
+    // View-space positions of the last update
+    std::vector<float> mViewX, mViewY, mViewZ;
+
+    // Clusters overlapped by the bounding box of a light, none if x0 > x1
+    struct ClusterRange
+    {
+        std::int16_t x0 = 1, x1 = 0, y0 = 0, y1 = 0, z0 = 0, z1 = 0;
+    };
+    std::vector<ClusterRange> mRanges;
+    // Lights of each cluster, at (z * kTilesY + y) * kTilesX + x
+    std::vector<std::vector<std::uint32_t>> mClusterLights =
+        std::vector<std::vector<std::uint32_t>>(kClusters);
+
+    // Projection of the last update
+    float mScaleX = 1, mScaleY = 1;
+    float mNear = 0.5f, mFar = 100;
+    // slice = log(depth) * mSliceScale + mSliceBias
+    float mSliceScale = 1, mSliceBias = 0;
+    float mSliceDepth[kSlices + 1] { };
+    GLint mViewport[4] { 0, 0, 1, 1 };
+
+    // Texels staged for upload
+    std::vector<float> mGridTexels;
+    std::vector<float> mLightTexels;
+    std::vector<float> mIndexTexels;
+    GLuint mGridTexture = 0;
+    GLuint mLightTexture = 0;
+    GLuint mIndexTexture = 0;
+    int mLightRows = 0;
+    int mIndexRows = 0;
+
+    // Statistics of the last update
+    std::size_t mVisible = 0;
+    std::size_t mIndexCount = 0;
+    std::size_t mMaxPerCluster = 0;
+    double mAssignMs = 0;
+
+    int sliceOf(float depth) const
+    {
+        const auto s = static_cast<int>(
+            std::floor(std::log(depth) * mSliceScale + mSliceBias));
+        return std::clamp(s, 0, kSlices - 1);
+    }
+
+    static int tileOf(float ndc, int tiles)
+    {
+        const auto t = static_cast<int>(std::floor((ndc * 0.5f + 0.5f) * tiles));
+        return std::clamp(t, 0, tiles - 1);
+    }
+
+    // Bounds of x / depth over x in [lo, hi] and depth in [near, far]
+    static float minRatio(float lo, float near, float far)
+    {
+        return lo >= 0 ? lo / far : lo / near;
+    }
+    static float maxRatio(float hi, float near, float far)
+    {
+        return hi >= 0 ? hi / near : hi / far;
+    }
+
+    void transformLights(const glm::mat4 &view, std::size_t begin,
+        std::size_t end)
+    {
+        const auto m00 = view[0][0], m10 = view[1][0], m20 = view[2][0],
+            m30 = view[3][0];
+        const auto m01 = view[0][1], m11 = view[1][1], m21 = view[2][1],
+            m31 = view[3][1];
+        const auto m02 = view[0][2], m12 = view[1][2], m22 = view[2][2],
+            m32 = view[3][2];
+        const auto *x = mX.data(), *y = mY.data(), *z = mZ.data();
+        auto *vx = mViewX.data(), *vy = mViewY.data(), *vz = mViewZ.data();
+        // No branches, so that the compiler vectorises the loop.
+        for(auto i = begin; i < end; ++i)
+        {
+            vx[i] = m00 * x[i] + m10 * y[i] + m20 * z[i] + m30;
+            vy[i] = m01 * x[i] + m11 * y[i] + m21 * z[i] + m31;
+            vz[i] = m02 * x[i] + m12 * y[i] + m22 * z[i] + m32;
+        }
+    }
+
+    void computeRanges(std::size_t begin, std::size_t end)
+    {
+        for(auto i = begin; i < end; ++i)
+        {
+            ClusterRange range;
+            const auto depth = -mViewZ[i];
+            const auto r = mRadius[i];
+            const auto near = std::max(depth - r, mNear);
+            const auto far = std::min(depth + r, mFar);
+            if(near < far)
+            {
+                // NDC bounds of the bounding box of the sphere
+                const auto x0 = mScaleX * minRatio(mViewX[i] - r, near, far);
+                const auto x1 = mScaleX * maxRatio(mViewX[i] + r, near, far);
+                const auto y0 = mScaleY * minRatio(mViewY[i] - r, near, far);
+                const auto y1 = mScaleY * maxRatio(mViewY[i] + r, near, far);
+                if(x1 >= -1 && x0 <= 1 && y1 >= -1 && y0 <= 1)
+                {
+                    range.x0 = static_cast<std::int16_t>(tileOf(x0, kTilesX));
+                    range.x1 = static_cast<std::int16_t>(tileOf(x1, kTilesX));
+                    range.y0 = static_cast<std::int16_t>(tileOf(y0, kTilesY));
+                    range.y1 = static_cast<std::int16_t>(tileOf(y1, kTilesY));
+                    range.z0 = static_cast<std::int16_t>(sliceOf(near));
+                    range.z1 = static_cast<std::int16_t>(sliceOf(far));
+                }
+            }
+            mRanges[i] = range;
+        }
+    }
+
+    /**
+     * \brief List the lights of the clusters of one slice. The box range of
+     * a light is refined by testing the sphere against each cluster.
+     */
+    void binSlice(int z)
+    {
+        const auto near = mSliceDepth[z], far = mSliceDepth[z + 1];
+        for(int c = 0; c < kTilesX * kTilesY; ++c)
+            mClusterLights[z * kTilesX * kTilesY + c].clear();
+
+        for(std::size_t i = 0; i < mRanges.size(); ++i)
+        {
+            const auto &range = mRanges[i];
+            if(range.x0 > range.x1 || z < range.z0 || z > range.z1) continue;
+            const auto depth = -mViewZ[i];
+            const auto r2 = mRadius[i] * mRadius[i];
+            const auto dz = depth < near ? near - depth :
+                depth > far ? depth - far : 0.f;
+            for(int y = range.y0; y <= range.y1; ++y)
+            {
+                // View-space extent of the tile row over the slice
+                const auto b0 = -1 + 2.f * y / kTilesY;
+                const auto b1 = -1 + 2.f * (y + 1) / kTilesY;
+                const auto y0 = std::min(b0 * near, b0 * far) / mScaleY;
+                const auto y1 = std::max(b1 * near, b1 * far) / mScaleY;
+                const auto dy = mViewY[i] < y0 ? y0 - mViewY[i] :
+                    mViewY[i] > y1 ? mViewY[i] - y1 : 0.f;
+                for(int x = range.x0; x <= range.x1; ++x)
+                {
+                    const auto a0 = -1 + 2.f * x / kTilesX;
+                    const auto a1 = -1 + 2.f * (x + 1) / kTilesX;
+                    const auto x0 = std::min(a0 * near, a0 * far) / mScaleX;
+                    const auto x1 = std::max(a1 * near, a1 * far) / mScaleX;
+                    const auto dx = mViewX[i] < x0 ? x0 - mViewX[i] :
+                        mViewX[i] > x1 ? mViewX[i] - x1 : 0.f;
+                    if(dx * dx + dy * dy + dz * dz > r2) continue;
+                    mClusterLights[(z * kTilesY + y) * kTilesX + x].push_back(
+                        static_cast<std::uint32_t>(i));
+                }
+            }
+        }
+    }
+
+    /**
+     * \brief Upload texels as rows of kDataWidth, growing the texture when
+     * needed. Pads texels to whole rows.
+     */
+    static void uploadRows(GLuint &texture, int &rows_allocated,
+        GLint internal_format, GLenum format, int channels,
+        std::vector<float> &texels)
+    {
+        const auto row = static_cast<std::size_t>(kDataWidth) * channels;
+        const auto rows = std::max<std::size_t>(1,
+            (texels.size() + row - 1) / row);
+        texels.resize(rows * row);
+        if(!texture) glGenTextures(1, &texture);
+        glBindTexture(GL_TEXTURE_2D, texture);
+        if(static_cast<int>(rows) > rows_allocated)
+        {
+            // Grow geometrically to avoid reallocating while lights are added.
+            rows_allocated = std::max(static_cast<int>(rows),
+                rows_allocated * 2);
+            glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+            glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+            glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+            glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+            glTexImage2D(GL_TEXTURE_2D, 0, internal_format, kDataWidth,
+                rows_allocated, 0, format, GL_FLOAT, nullptr);
+        }
+        glTexSubImage2D(GL_TEXTURE_2D, 0, 0, 0, kDataWidth,
+            static_cast<GLsizei>(rows), format, GL_FLOAT, texels.data());
+    }
+
+public:
+    ClusteredLights() = default;
+    ClusteredLights(const ClusteredLights &) = delete;
+    ClusteredLights & operator=(const ClusteredLights &) = delete;
+
+    ~ClusteredLights()
+    {
+        const GLuint textures[] = { mGridTexture, mLightTexture, mIndexTexture };
+        if(mGridTexture) glDeleteTextures(3, textures);
+    }
+
+    /**
+     * \brief Whether the context has the float textures the shader reads
+     * the clusters from. Without them the forward path lights the scene as
+     * if clustering were off. The first call must be made on the render
+     * thread.
+     */
+    static bool supported()
+    {
+        static const bool supported = [] {
+            // Core since OpenGL 3.0. Older contexts leave the version at 0.
+            GLint major = 0;
+            glGetIntegerv(GL_MAJOR_VERSION, &major);
+            return major >= 3 || (hasGLExtension("GL_ARB_texture_float") &&
+                hasGLExtension("GL_ARB_texture_rg"));
+        }();
+        return supported;
+    }
+
+    std::size_t size() const { return mX.size(); }
+
+    void clear()
+    {
+        for(auto *v : { &mX, &mY, &mZ, &mRadius, &mRed, &mGreen, &mBlue })
+            v->clear();
+    }
+
+    /**
+     * \brief Add a point light reaching radius. The color is not clamped,
+     * so that it also gives the intensity.
+     */
+    std::size_t add(const glm::vec3 &position, float radius,
+        const glm::vec3 &color)
+    {
+        mX.push_back(position.x);
+        mY.push_back(position.y);
+        mZ.push_back(position.z);
+        mRadius.push_back(radius);
+        mRed.push_back(color.x);
+        mGreen.push_back(color.y);
+        mBlue.push_back(color.z);
+        return mX.size() - 1;
+    }
+
+    glm::vec3 position(std::size_t i) const { return { mX[i], mY[i], mZ[i] }; }
+    void setPosition(std::size_t i, const glm::vec3 &p)
+    {
+        mX[i] = p.x;
+        mY[i] = p.y;
+        mZ[i] = p.z;
+    }
+    glm::vec3 color(std::size_t i) const
+    {
+        return { mRed[i], mGreen[i], mBlue[i] };
+    }
+    float radius(std::size_t i) const { return mRadius[i]; }
+    void setRadius(std::size_t i, float radius) { mRadius[i] = radius; }
+
+    /**
+     * \brief Assign the lights to the clusters of the current view. Reads
+     * the modelview (which must hold the camera transformation only),
+     * projection and viewport from OpenGL, and stages the textures.
+     */
+    void update()
+    {
+        const auto start = std::chrono::steady_clock::now();
+
+        glm::mat4 view, projection;
+        glGetFloatv(GL_MODELVIEW_MATRIX, glm::value_ptr(view));
+        glGetFloatv(GL_PROJECTION_MATRIX, glm::value_ptr(projection));
+        glGetIntegerv(GL_VIEWPORT, mViewport);
+        // Recover the frustum from a gluPerspective() matrix.
+        mScaleX = projection[0][0];
+        mScaleY = projection[1][1];
+        mNear = projection[3][2] / (projection[2][2] - 1);
+        mFar = projection[3][2] / (projection[2][2] + 1);
+        mSliceScale = kSlices / std::log(mFar / mNear);
+        mSliceBias = -std::log(mNear) * mSliceScale;
+        for(int z = 0; z <= kSlices; ++z)
+            mSliceDepth[z] = mNear * std::pow(mFar / mNear, 1.f * z / kSlices);
+
+        const auto count = size();
+        mViewX.resize(count);
+        mViewY.resize(count);
+        mViewZ.resize(count);
+        mRanges.resize(count);
+        auto &&pool = workerPool();
+        pool.parallelFor(count, 1024, [&](std::size_t begin, std::size_t end) {
+            transformLights(view, begin, end);
+            computeRanges(begin, end);
+        });
+        pool.parallelFor(kSlices, 1, [&](std::size_t begin, std::size_t end) {
+            for(auto z = begin; z < end; ++z) binSlice(static_cast<int>(z));
+        });
+
+        // Flatten the lists. The grid holds the offset and count of each.
+        mGridTexels.resize(kClusters * 2);
+        mIndexTexels.clear();
+        mMaxPerCluster = 0;
+        for(int c = 0; c < kClusters; ++c)
+        {
+            auto &&lights = mClusterLights[c];
+            mGridTexels[c * 2] = static_cast<float>(mIndexTexels.size());
+            mGridTexels[c * 2 + 1] = static_cast<float>(lights.size());
+            mIndexTexels.insert(mIndexTexels.end(), lights.begin(),
+                lights.end());
+            mMaxPerCluster = std::max(mMaxPerCluster, lights.size());
+        }
+        mIndexCount = mIndexTexels.size();
+
+        mVisible = 0;
+        mLightTexels.resize(count * 8);
+        for(std::size_t i = 0; i < count; ++i)
+        {
+            auto *texel = &mLightTexels[i * 8];
+            texel[0] = mViewX[i];
+            texel[1] = mViewY[i];
+            texel[2] = mViewZ[i];
+            texel[3] = mRadius[i];
+            texel[4] = mRed[i];
+            texel[5] = mGreen[i];
+            texel[6] = mBlue[i];
+            texel[7] = 0;
+            if(mRanges[i].x0 <= mRanges[i].x1) ++mVisible;
+        }
+
+        const std::chrono::duration<double, std::milli> ms =
+            std::chrono::steady_clock::now() - start;
+        mAssignMs = ms.count();
+    }
+
+    /**
+     * \brief Upload the staged textures and set the uniforms of a shader
+     * built from clustered.frag. The textures stay bound to their units.
+     */
+    void apply(const Shader &shader)
+    {
+        glActiveTexture(GL_TEXTURE0 + kGridUnit);
+        if(!mGridTexture)
+        {
+            glGenTextures(1, &mGridTexture);
+            glBindTexture(GL_TEXTURE_2D, mGridTexture);
+            glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+            glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+            glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+            glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+            glTexImage2D(GL_TEXTURE_2D, 0, GL_RG32F, kTilesX * kTilesY,
+                kSlices, 0, GL_RG, GL_FLOAT, nullptr);
+        }
+        glBindTexture(GL_TEXTURE_2D, mGridTexture);
+        glTexSubImage2D(GL_TEXTURE_2D, 0, 0, 0, kTilesX * kTilesY, kSlices,
+            GL_RG, GL_FLOAT, mGridTexels.data());
+        glActiveTexture(GL_TEXTURE0 + kLightUnit);
+        uploadRows(mLightTexture, mLightRows, GL_RGBA32F, GL_RGBA, 4,
+            mLightTexels);
+        glActiveTexture(GL_TEXTURE0 + kIndexUnit);
+        uploadRows(mIndexTexture, mIndexRows, GL_R32F, GL_RED, 1,
+            mIndexTexels);
+        glActiveTexture(GL_TEXTURE0);
+
+        glUseProgram(shader.programId());
+        glUniform1i(shader.uniform("clusterGrid"), kGridUnit);
+        glUniform1i(shader.uniform("lightData"), kLightUnit);
+        glUniform1i(shader.uniform("lightIndices"), kIndexUnit);
+        glUniform2f(shader.uniform("tileCount"), kTilesX, kTilesY);
+        glUniform2f(shader.uniform("tileScale"),
+            1.f * kTilesX / mViewport[2], 1.f * kTilesY / mViewport[3]);
+        glUniform2f(shader.uniform("viewportOrigin"),
+            static_cast<float>(mViewport[0]), static_cast<float>(mViewport[1]));
+        glUniform2f(shader.uniform("sliceParams"), mSliceScale, mSliceBias);
+        glUniform2f(shader.uniform("gridSize"), kTilesX * kTilesY, kSlices);
+        glUniform2f(shader.uniform("lightDataSize"), kDataWidth,
+            static_cast<float>(mLightRows));
+        glUniform2f(shader.uniform("indexSize"), kDataWidth,
+            static_cast<float>(mIndexRows));
+        glUseProgram(0);
+    }
+
+    /**
+     * \brief Draw each light as a point of its color.
+     */
+    void drawMarkers() const
+    {
+        glPushAttrib(GL_ENABLE_BIT | GL_POINT_BIT | GL_CURRENT_BIT);
+        glDisable(GL_LIGHTING);
+        glDisable(GL_TEXTURE_2D);
+        glPointSize(3);
+        glBegin(GL_POINTS);
+        for(std::size_t i = 0; i < size(); ++i)
+        {
+            const auto peak = std::max({ mRed[i], mGreen[i], mBlue[i], 1e-6f });
+            glColor3f(mRed[i] / peak, mGreen[i] / peak, mBlue[i] / peak);
+            glVertex3f(mX[i], mY[i], mZ[i]);
+        }
+        glEnd();
+        glPopAttrib();
+    }
+
+    void emitControlWidgets()
+    {
+        if(!supported())
+        {
+            ImGui::TextWrapped("Forward shading needs OpenGL 3.0 or "
+                "GL_ARB_texture_float and GL_ARB_texture_rg");
+        }
+        ImGui::Text("%zu lights, %zu in view", size(), mVisible);
+        ImGui::Text("%dx%dx%d clusters, %zu light indices, at most %zu",
+            kTilesX, kTilesY, kSlices, mIndexCount, mMaxPerCluster);
+        ImGui::Text("Assignment: %.2f ms on %zu threads", mAssignMs,
+            workerPool().size() + 1);
+    }
+};
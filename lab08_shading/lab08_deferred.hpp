@@ -0,0 +1,402 @@
+#pragma once
+
+// Included by lab08_framework.hpp after Material and gShaderOverride.
+
+#include <algorithm>
+#include <cmath>
+
+/*****************************************************************************/
+// DeferredRenderer
+/*****************************************************************************/
+
+/**
+ * \brief Renders the scene in two passes, so that the cost of a light does
+ * not depend on the overdraw or on the number of other lights.
+ *
+ * The geometry pass draws every object with a variant of gbuffer.frag,
+ * which stores the surface of each pixel: normal, diffuse albedo, specular
+ * color and shininess, and the ambient and emitted light. The lighting pass
+ * then adds each light to the pixels it can reach with deferred.frag: a
+ * full-screen quad for directional and unattenuated lights, and a sphere
+ * around lights with a limited range. Last, the accumulated light and the
+ * depth are copied to the framebuffer.
+ *
+ * Fog is not applied on this path.
+ */
+class DeferredRenderer
+{
+    enum Buffer { ACCUM, ALBEDO, SPECULAR, NORMAL, BUFFER_COUNT };
+
+    // Attenuation below this is treated as no light.
+    static constexpr float kCutoff = 1 / 256.f;
+    // A sphere of kVolumeSlices x kVolumeStacks facets lies inside the unit
+    // sphere; scaling it by this makes it enclose the sphere.
+    static constexpr int kVolumeSlices = 12;
+    static constexpr int kVolumeStacks = 8;
+    static constexpr float kVolumeScale = 1.1f;
+
+    int mWidth = 0;
+    int mHeight = 0;
+    GLuint mTextures[BUFFER_COUNT] { };
+    GLuint mDepthTexture = 0;
+    // All buffers, for the geometry pass
+    GLuint mGeometryFramebuffer = 0;
+    // Only the accumulated light, for the lighting pass
+    GLuint mLightFramebuffer = 0;
+    // Bound when the geometry pass began, and drawn to by composite()
+    GLint mOutputFramebuffer = 0;
+    GLuint mVolumeList = 0;
+
+    ShaderPermutations mGeometry { "blinn.vert", "gbuffer.frag" };
+    ShaderHandle mLighting;
+    ShaderHandle mComposite;
+    // Not retried every frame if they fail to build
+    bool mShadersLoaded = false;
+    glm::mat4 mProjection { 1 };
+
+    // Statistics of the last frame
+    int mFullScreenLights = 0;
+    int mVolumeLights = 0;
+
+    void release()
+    {
+        if(mGeometryFramebuffer)
+        {
+            glDeleteFramebuffers(1, &mGeometryFramebuffer);
+            glDeleteFramebuffers(1, &mLightFramebuffer);
+            glDeleteTextures(BUFFER_COUNT, mTextures);
+            glDeleteTextures(1, &mDepthTexture);
+        }
+        mGeometryFramebuffer = mLightFramebuffer = mDepthTexture = 0;
+        std::fill(mTextures, mTextures + BUFFER_COUNT, 0);
+    }
+
+    static GLuint createBuffer(GLint internal_format, GLenum format,
+        GLenum type, int width, int height)
+    {
+        GLuint texture;
+        glGenTextures(1, &texture);
+        glBindTexture(GL_TEXTURE_2D, texture);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+        glTexImage2D(GL_TEXTURE_2D, 0, internal_format, width, height, 0,
+            format, type, nullptr);
+        return texture;
+    }
+
+    void allocate(int width, int height)
+    {
+        release();
+        mWidth = width;
+        mHeight = height;
+        // Light is accumulated in floating point and clamped when composited.
+        mTextures[ACCUM] = createBuffer(GL_RGBA16F, GL_RGBA, GL_FLOAT,
+            width, height);
+        mTextures[ALBEDO] = createBuffer(GL_RGBA8, GL_RGBA, GL_UNSIGNED_BYTE,
+            width, height);
+        mTextures[SPECULAR] = createBuffer(GL_RGBA8, GL_RGBA,
+            GL_UNSIGNED_BYTE, width, height);
+        mTextures[NORMAL] = createBuffer(GL_RGBA16F, GL_RGBA, GL_FLOAT,
+            width, height);
+        mDepthTexture = createBuffer(GL_DEPTH_COMPONENT24,
+            GL_DEPTH_COMPONENT, GL_UNSIGNED_INT, width, height);
+        glBindTexture(GL_TEXTURE_2D, 0);
+        gTextureBinder.invalidate();
+
+        glGenFramebuffers(1, &mGeometryFramebuffer);
+        glBindFramebuffer(GL_FRAMEBUFFER, mGeometryFramebuffer);
+        for(int i = 0; i < BUFFER_COUNT; ++i)
+            glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0 + i,
+                GL_TEXTURE_2D, mTextures[i], 0);
+        glFramebufferTexture2D(GL_FRAMEBUFFER, GL_DEPTH_ATTACHMENT,
+            GL_TEXTURE_2D, mDepthTexture, 0);
+        if(glCheckFramebufferStatus(GL_FRAMEBUFFER) != GL_FRAMEBUFFER_COMPLETE)
+            std::cerr << "G-buffer is incomplete" << std::endl;
+
+        // The depth is read by the lighting pass, so it cannot be attached.
+        glGenFramebuffers(1, &mLightFramebuffer);
+        glBindFramebuffer(GL_FRAMEBUFFER, mLightFramebuffer);
+        glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0,
+            GL_TEXTURE_2D, mTextures[ACCUM], 0);
+    }
+
+    void bindBuffers(const Shader &shader) const
+    {
+        static const char *names[BUFFER_COUNT] = {
+            "accumBuffer", "albedoBuffer", "specularBuffer", "normalBuffer"
+        };
+        for(int i = 0; i < BUFFER_COUNT; ++i)
+        {
+            glActiveTexture(GL_TEXTURE1 + i);
+            glBindTexture(GL_TEXTURE_2D, mTextures[i]);
+            glUniform1i(shader.uniform(names[i]), 1 + i);
+        }
+        glActiveTexture(GL_TEXTURE1 + BUFFER_COUNT);
+        glBindTexture(GL_TEXTURE_2D, mDepthTexture);
+        glUniform1i(shader.uniform("depthBuffer"), 1 + BUFFER_COUNT);
+        glActiveTexture(GL_TEXTURE0);
+        glUniform2f(shader.uniform("bufferSize"), static_cast<float>(mWidth),
+            static_cast<float>(mHeight));
+        glUniformMatrix4fv(shader.uniform("inverseProjection"), 1, GL_FALSE,
+            glm::value_ptr(glm::inverse(mProjection)));
+    }
+
+    // Covers the viewport, with the matrices reset and no face culling.
+    static void drawFullScreenQuad()
+    {
+        glPushAttrib(GL_ENABLE_BIT);
+        glDisable(GL_CULL_FACE);
+        glMatrixMode(GL_PROJECTION);
+        glPushMatrix();
+        glLoadIdentity();
+        glMatrixMode(GL_MODELVIEW);
+        glPushMatrix();
+        glLoadIdentity();
+        glBegin(GL_QUADS);
+            glVertex2f(-1, -1);
+            glVertex2f(1, -1);
+            glVertex2f(1, 1);
+            glVertex2f(-1, 1);
+        glEnd();
+        glPopMatrix();
+        glMatrixMode(GL_PROJECTION);
+        glPopMatrix();
+        glMatrixMode(GL_MODELVIEW);
+        glPopAttrib();
+    }
+
+    void drawVolume(const glm::vec3 &center, float radius)
+    {
+        if(!mVolumeList)
+        {
+            mVolumeList = glGenLists(1);
+            auto *quadric = gluNewQuadric();
+            glNewList(mVolumeList, GL_COMPILE);
+            gluSphere(quadric, 1, kVolumeSlices, kVolumeStacks);
+            glEndList();
+            gluDeleteQuadric(quadric);
+        }
+        glPushMatrix();
+        glTranslatef(center.x, center.y, center.z);
+        const auto scale = radius * kVolumeScale;
+        glScalef(scale, scale, scale);
+        glCallList(mVolumeList);
+        glPopMatrix();
+    }
+
+    // Additive, without depth, drawing the back faces of volumes so that
+    // they still cover the pixels when the camera is inside.
+    void beginLighting(const Shader &shader)
+    {
+        glBindFramebuffer(GL_FRAMEBUFFER, mLightFramebuffer);
+        glPushAttrib(GL_ENABLE_BIT | GL_COLOR_BUFFER_BIT |
+            GL_DEPTH_BUFFER_BIT | GL_POLYGON_BIT | GL_TEXTURE_BIT);
+        glDisable(GL_DEPTH_TEST);
+        glDepthMask(GL_FALSE);
+        glDisable(GL_LIGHTING);
+        glDisable(GL_TEXTURE_2D);
+        glEnable(GL_BLEND);
+        glBlendFunc(GL_ONE, GL_ONE);
+        glEnable(GL_CULL_FACE);
+        glCullFace(GL_FRONT);
+        glUseProgram(shader.programId());
+        bindBuffers(shader);
+    }
+
+    void endLighting()
+    {
+        glUseProgram(0);
+        glPopAttrib();
+        glBindFramebuffer(GL_FRAMEBUFFER, mOutputFramebuffer);
+    }
+
+public:
+    DeferredRenderer() = default;
+    DeferredRenderer(const DeferredRenderer &) = delete;
+    DeferredRenderer & operator=(const DeferredRenderer &) = delete;
+
+    ~DeferredRenderer()
+    {
+        release();
+        if(mVolumeList) glDeleteLists(mVolumeList, 1);
+    }
+
+    /**
+     * \brief Whether the context can render to the floating point G-buffer,
+     * which the deferred path needs. The first call must be made on the
+     * render thread.
+     */
+    static bool supported()
+    {
+        static const bool supported = [] {
+            // Core since OpenGL 3.0. Older contexts leave the version at 0.
+            GLint major = 0;
+            glGetIntegerv(GL_MAJOR_VERSION, &major);
+            return major >= 3 ||
+                (hasGLExtension("GL_ARB_framebuffer_object") &&
+                hasGLExtension("GL_ARB_texture_float") &&
+                hasGLExtension("GL_ARB_draw_buffers"));
+        }();
+        return supported;
+    }
+
+    /**
+     * \brief Bind the G-buffer, sized like the viewport, and make the scene
+     * draw into it. The projection and viewport must be set up.
+     */
+    void beginGeometry()
+    {
+        if(!mShadersLoaded)
+        {
+            mShadersLoaded = true;
+            mLighting = gShaderCache.load("deferred.vert", "deferred.frag");
+            mComposite = gShaderCache.load("deferred.vert", "deferred.frag",
+                "#define COMPOSITE\n", "composite");
+        }
+        glGetIntegerv(GL_FRAMEBUFFER_BINDING, &mOutputFramebuffer);
+        GLint viewport[4];
+        glGetIntegerv(GL_VIEWPORT, viewport);
+        if(viewport[2] != mWidth || viewport[3] != mHeight)
+            allocate(viewport[2], viewport[3]);
+        glGetFloatv(GL_PROJECTION_MATRIX, glm::value_ptr(mProjection));
+        mFullScreenLights = mVolumeLights = 0;
+
+        glBindFramebuffer(GL_FRAMEBUFFER, mGeometryFramebuffer);
+        static const GLenum buffers[BUFFER_COUNT] = {
+            GL_COLOR_ATTACHMENT0, GL_COLOR_ATTACHMENT1,
+            GL_COLOR_ATTACHMENT2, GL_COLOR_ATTACHMENT3
+        };
+        glDrawBuffers(BUFFER_COUNT, buffers);
+        glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
+        glPushAttrib(GL_ENABLE_BIT);
+        glDisable(GL_FOG);
+        gShaderOverride = &mGeometry;
+    }
+
+    void endGeometry()
+    {
+        gShaderOverride = nullptr;
+        glPopAttrib();
+        glBindFramebuffer(GL_FRAMEBUFFER, mOutputFramebuffer);
+    }
+
+    /**
+     * \brief Add the enabled fixed-function lights, whose positions were set
+     * during the geometry pass. Spot lights are treated as point lights.
+     */
+    void drawFixedFunctionLights()
+    {
+        if(!mLighting || !glIsEnabled(GL_LIGHTING)) return;
+        std::vector<int> lights;
+        for(int i = 0; i < 8; ++i)
+            if(glIsEnabled(GL_LIGHT0 + i)) lights.push_back(i);
+        if(lights.empty()) return;
+
+        beginLighting(*mLighting);
+        glUniform1f(mLighting->uniform("lightRadius"), 0);
+        for(auto i : lights)
+        {
+            glm::vec4 position, diffuse, specular;
+            glm::vec3 attenuation;
+            glGetLightfv(GL_LIGHT0 + i, GL_POSITION, &position.x);
+            glGetLightfv(GL_LIGHT0 + i, GL_DIFFUSE, &diffuse.x);
+            glGetLightfv(GL_LIGHT0 + i, GL_SPECULAR, &specular.x);
+            glGetLightfv(GL_LIGHT0 + i, GL_CONSTANT_ATTENUATION,
+                &attenuation.x);
+            glGetLightfv(GL_LIGHT0 + i, GL_LINEAR_ATTENUATION, &attenuation.y);
+            glGetLightfv(GL_LIGHT0 + i, GL_QUADRATIC_ATTENUATION,
+                &attenuation.z);
+            glUniform4fv(mLighting->uniform("lightPosition"), 1, &position.x);
+            glUniform3fv(mLighting->uniform("lightDiffuse"), 1, &diffuse.x);
+            glUniform3fv(mLighting->uniform("lightSpecular"), 1, &specular.x);
+            glUniform3fv(mLighting->uniform("lightAttenuation"), 1,
+                &attenuation.x);
+
+            // Distance at which the attenuation drops below kCutoff
+            auto range = -1.f;
+            if(position.w != 0 && (attenuation.y > 0 || attenuation.z > 0))
+            {
+                const auto c = attenuation.x - 1 / kCutoff;
+                range = attenuation.z > 0 ?
+                    (-attenuation.y + std::sqrt(attenuation.y * attenuation.y -
+                        4 * attenuation.z * c)) / (2 * attenuation.z) :
+                    -c / attenuation.y;
+            }
+            if(range > 0)
+            {
+                // The position is already in eye space.
+                glPushMatrix();
+                glLoadIdentity();
+                drawVolume(glm::vec3(position), range);
+                glPopMatrix();
+                ++mVolumeLights;
+            }
+            else
+            {
+                drawFullScreenQuad();
+                ++mFullScreenLights;
+            }
+        }
+        endLighting();
+    }
+
+    /**
+     * \brief Add point lights with a limited range, each drawn as a sphere.
+     * The modelview must hold the camera transformation.
+     */
+    void drawPointLights(const ClusteredLights &lights)
+    {
+        if(!mLighting || lights.size() == 0) return;
+        glm::mat4 view;
+        glGetFloatv(GL_MODELVIEW_MATRIX, glm::value_ptr(view));
+
+        beginLighting(*mLighting);
+        const auto position = mLighting->uniform("lightPosition");
+        const auto diffuse = mLighting->uniform("lightDiffuse");
+        const auto specular = mLighting->uniform("lightSpecular");
+        const auto radius = mLighting->uniform("lightRadius");
+        for(std::size_t i = 0; i < lights.size(); ++i)
+        {
+            const auto center = lights.position(i);
+            const auto color = lights.color(i);
+            const auto eye = view * glm::vec4(center, 1);
+            glUniform4fv(position, 1, &eye.x);
+            glUniform3fv(diffuse, 1, &color.x);
+            glUniform3fv(specular, 1, &color.x);
+            glUniform1f(radius, lights.radius(i));
+            drawVolume(center, lights.radius(i));
+        }
+        mVolumeLights += static_cast<int>(lights.size());
+        endLighting();
+    }
+
+    /**
+     * \brief Copy the lit image and the depth to the framebuffer, so that
+     * forward rendering can continue on top.
+     */
+    void composite()
+    {
+        if(!mComposite) return;
+        glPushAttrib(GL_ENABLE_BIT | GL_DEPTH_BUFFER_BIT);
+        glDisable(GL_LIGHTING);
+        glDisable(GL_TEXTURE_2D);
+        glEnable(GL_DEPTH_TEST);
+        glDepthFunc(GL_ALWAYS);
+        glDepthMask(GL_TRUE);
+        glUseProgram(mComposite->programId());
+        bindBuffers(*mComposite);
+        drawFullScreenQuad();
+        glUseProgram(0);
+        glPopAttrib();
+    }
+
+    void emitControlWidgets()
+    {
+        ImGui::Text("G-buffer %dx%d, %zu geometry variants", mWidth, mHeight,
+            mGeometry.size());
+        ImGui::Text("Lights: %d full screen, %d volumes", mFullScreenLights,
+            mVolumeLights);
+    }
+};
@@ -0,0 +1,176 @@
+#pragma once
+
+// Included by lab08_framework.hpp after lab08_shader_permutations.hpp.
+
+#include <chrono>
+#include <future>
+#include <map>
+#include <string>
+#include <utility>
+
+#include "lab08_spherical_harmonics.hpp"
+
+/*****************************************************************************/
+// EnvironmentLight
+/*****************************************************************************/
+
+/**
+ * \brief Ambient light from an equirectangular image, LDR or HDR, given to
+ * the uber shader as the nine coefficients of ShIrradiance. The image is
+ * decoded and projected on the worker pool when loaded, and the result is
+ * kept by path, so that switching back to an image is free. The shader
+ * evaluates the coefficients for the normal of each pixel instead of the
+ * constant ambient of the lights and the light model.
+ */
+class EnvironmentLight
+{
+    struct Projection
+    {
+        ShIrradiance irradiance;
+        int width = 0;
+        int height = 0;
+        double milliseconds = 0;
+    };
+
+    std::map<std::string, Projection> mCache;
+    std::future<Projection> mLoading;
+    std::string mLoadingPath;
+    // Asked for while another load was running, loaded after it
+    std::string mQueuedPath;
+    // The path of the projection in use, empty if none
+    std::string mPath;
+    float mIntensity = 1;
+    glm::mat3 mEyeToWorld { 1 };
+
+    static Projection project(const std::string &path)
+    {
+        Projection projection;
+        int num_channels;
+        // 8-bit images are taken as they are, like the colors of the lights
+        // and materials, rather than decoded from sRGB.
+        const auto hdr = stbi_is_hdr(path.c_str()) != 0;
+        void *texels = hdr ?
+            static_cast<void *>(stbi_loadf(path.c_str(), &projection.width,
+                &projection.height, &num_channels, 4)) :
+            static_cast<void *>(stbi_load(path.c_str(), &projection.width,
+                &projection.height, &num_channels, 4));
+        if(!texels)
+        {
+            std::cerr << "Failed to load " << path << ": "
+                << stbi_failure_reason() << std::endl;
+            return { };
+        }
+        LinearImage image(projection.width, projection.height);
+        for(std::size_t i = 0; i < image.texels.size(); ++i)
+        {
+            image.texels[i] = hdr ? static_cast<const float *>(texels)[i] :
+                static_cast<const stbi_uc *>(texels)[i] * (1 / 255.f);
+        }
+        stbi_image_free(texels);
+        const auto start = std::chrono::steady_clock::now();
+        projection.irradiance = projectIrradiance(image);
+        const std::chrono::duration<double, std::milli> ms =
+            std::chrono::steady_clock::now() - start;
+        projection.milliseconds = ms.count();
+        return projection;
+    }
+
+public:
+    /**
+     * \brief Use the image at the path, once projected in the background
+     * unless it has been before. One image is projected at a time; a load
+     * still running finishes and is cached on its own, and the last image
+     * asked for meanwhile is loaded by update() after it.
+     */
+    void load(const std::string &path)
+    {
+        // Also for a cached image, so that the running load does not
+        // replace it when it finishes.
+        mQueuedPath = mLoading.valid() && path != mLoadingPath ?
+            path : std::string();
+        if(mCache.count(path))
+        {
+            mPath = path;
+            return;
+        }
+        if(mLoading.valid()) return;
+        mLoadingPath = path;
+        mLoading = workerPool().submit([path]() { return project(path); });
+    }
+
+    // Take the result of a finished load and start the queued one.
+    void update()
+    {
+        if(!mLoading.valid() || mLoading.wait_for(std::chrono::seconds(0)) !=
+            std::future_status::ready)
+            return;
+        auto projection = mLoading.get();
+        if(projection.width != 0)
+        {
+            mCache[mLoadingPath] = projection;
+            if(mQueuedPath.empty()) mPath = mLoadingPath;
+        }
+        if(!mQueuedPath.empty()) load(std::exchange(mQueuedPath, { }));
+    }
+
+    bool ready() const { return !mPath.empty(); }
+    bool loading() const { return mLoading.valid(); }
+
+    // The inverse of the view matrix, to look up normals in world space
+    void setEyeToWorld(const glm::mat4 &eye_to_world)
+    {
+        mEyeToWorld = glm::mat3(eye_to_world);
+    }
+
+    void apply(const Shader &shader) const
+    {
+        auto irradiance = mCache.at(mPath).irradiance;
+        for(auto &&rgb : irradiance.coefficients)
+        {
+            for(auto &&c : rgb) c *= mIntensity;
+        }
+        glUniform3fv(shader.uniform("shCoefficients"), 9,
+            &irradiance.coefficients[0][0]);
+        glUniformMatrix3fv(shader.uniform("shEyeToWorld"), 1, GL_FALSE,
+            glm::value_ptr(mEyeToWorld));
+    }
+
+    void emitControlWidgets()
+    {
+        ImGui::SliderFloat("Intensity", &mIntensity, 0, 4);
+        if(loading())
+            ImGui::Text("Projecting %s", mLoadingPath.c_str());
+        if(!ready())
+        {
+            ImGui::TextUnformatted("No environment image");
+            return;
+        }
+        if(ImGui::BeginCombo("Image", mPath.c_str()))
+        {
+            for(auto &&entry : mCache)
+            {
+                if(ImGui::Selectable(entry.first.c_str(),
+                    entry.first == mPath))
+                    mPath = entry.first;
+            }
+            ImGui::EndCombo();
+        }
+        auto &&projection = mCache.at(mPath);
+        ImGui::Text("%dx%d, projected in %.1f ms on %zu threads",
+            projection.width, projection.height, projection.milliseconds,
+            workerPool().size());
+        // The ambient light straight up and down
+        const float up[3] = { 0, 1, 0 }, down[3] = { 0, -1, 0 };
+        float rgb_up[3], rgb_down[3];
+        projection.irradiance.evaluate(up, rgb_up);
+        projection.irradiance.evaluate(down, rgb_down);
+        ImGui::ColorEdit3("Up", rgb_up, ImGuiColorEditFlags_NoInputs |
+            ImGuiColorEditFlags_HDR);
+        ImGui::SameLine();
+        ImGui::ColorEdit3("Down", rgb_down, ImGuiColorEditFlags_NoInputs |
+            ImGuiColorEditFlags_HDR);
+    }
+};
+
+// When set, the variants of permutations get their ambient light from it.
+inline EnvironmentLight *gEnvironmentLight = nullptr;
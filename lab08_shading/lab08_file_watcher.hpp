@@ -0,0 +1,205 @@
+#pragma once
+
+// Independent of OpenGL.
+
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <filesystem>
+#include <functional>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
+
+#ifdef __linux__
+#   include <poll.h>
+#   include <sys/eventfd.h>
+#   include <sys/inotify.h>
+#   include <unistd.h>
+#endif
+
+/*****************************************************************************/
+// FileWatcher
+/*****************************************************************************/
+
+/**
+ * \brief Reports changes of a set of files on a thread of its own. Uses
+ * inotify on Linux and compares modification times elsewhere.
+ *
+ * The directories of the files are watched rather than the files, because
+ * editors often save by writing a new file and renaming it over the old one.
+ * Bursts of events for a file are coalesced, and the callback is called
+ * once the file has been quiet for kSettleTime.
+ */
+class FileWatcher
+{
+public:
+    using Callback = std::function<void(const std::string &path)>;
+
+private:
+    static constexpr auto kSettleTime = std::chrono::milliseconds(50);
+#ifndef __linux__
+    static constexpr auto kPollInterval = std::chrono::milliseconds(250);
+#endif
+
+    Callback mCallback;
+    std::thread mThread;
+    std::mutex mMutex;
+    // Canonical paths of the watched files
+    std::unordered_set<std::string> mFiles;
+
+#ifdef __linux__
+    int mInotify = -1;
+    // Wakes the thread up to stop it
+    int mWake = -1;
+    // Watched directories by watch descriptor
+    std::unordered_map<int, std::string> mDirectories;
+#else
+    bool mStopping = false;
+    std::condition_variable mCondition;
+    std::unordered_map<std::string, std::filesystem::file_time_type> mTimes;
+#endif
+
+    static std::string canonical(const std::string &path)
+    {
+        std::error_code ec;
+        const auto p = std::filesystem::weakly_canonical(path, ec);
+        return ec ? path : p.string();
+    }
+
+#ifdef __linux__
+    void threadMain()
+    {
+        std::unordered_set<std::string> pending;
+        alignas(inotify_event) char buffer[4096];
+        while(true)
+        {
+            pollfd fds[2] = { { mInotify, POLLIN, 0 }, { mWake, POLLIN, 0 } };
+            const auto timeout = pending.empty() ? -1 :
+                static_cast<int>(kSettleTime.count());
+            const auto ready = ::poll(fds, 2, timeout);
+            if(fds[1].revents) return;
+
+            if(ready == 0)
+            {
+                // Quiet for long enough
+                for(auto &&path : pending) mCallback(path);
+                pending.clear();
+                continue;
+            }
+            if(ready < 0 || !(fds[0].revents & POLLIN)) continue;
+
+            const auto length = ::read(mInotify, buffer, sizeof(buffer));
+            std::lock_guard<std::mutex> lock(mMutex);
+            for(ssize_t i = 0; i < length; )
+            {
+                const auto *event = reinterpret_cast<const inotify_event *>(
+                    buffer + i);
+                i += sizeof(inotify_event) + event->len;
+                auto dir = mDirectories.find(event->wd);
+                if(event->len == 0 || dir == mDirectories.end()) continue;
+                auto path = (std::filesystem::path(dir->second) /
+                    event->name).string();
+                if(mFiles.count(path)) pending.insert(std::move(path));
+            }
+        }
+    }
+#else
+    void threadMain()
+    {
+        std::unique_lock<std::mutex> lock(mMutex);
+        while(!mCondition.wait_for(lock, kPollInterval,
+            [this]() { return mStopping; }))
+        {
+            std::vector<std::string> changed;
+            for(auto &&file : mFiles)
+            {
+                std::error_code ec;
+                const auto time = std::filesystem::last_write_time(file, ec);
+                if(ec) continue;
+                auto &&known = mTimes[file];
+                if(known != time)
+                {
+                    known = time;
+                    changed.push_back(file);
+                }
+            }
+            if(changed.empty()) continue;
+            lock.unlock();
+            // Let the writer finish.
+            std::this_thread::sleep_for(kSettleTime);
+            for(auto &&path : changed) mCallback(path);
+            lock.lock();
+        }
+    }
+#endif
+
+public:
+    /**
+     * \brief The callback is called on the watcher thread with the
+     * canonical path of a changed file.
+     */
+    explicit FileWatcher(Callback callback)
+        : mCallback(std::move(callback))
+    {
+    }
+
+    FileWatcher(const FileWatcher &) = delete;
+    FileWatcher & operator=(const FileWatcher &) = delete;
+
+    ~FileWatcher()
+    {
+        if(mThread.joinable())
+        {
+#ifdef __linux__
+            const std::uint64_t one = 1;
+            [[maybe_unused]] auto written = ::write(mWake, &one, sizeof(one));
+#else
+            {
+                std::lock_guard<std::mutex> lock(mMutex);
+                mStopping = true;
+            }
+            mCondition.notify_all();
+#endif
+            mThread.join();
+        }
+#ifdef __linux__
+        if(mInotify >= 0) ::close(mInotify);
+        if(mWake >= 0) ::close(mWake);
+#endif
+    }
+
+    /**
+     * \brief Start watching a file. The thread is started by the first
+     * call. Returns false if the file cannot be watched.
+     */
+    bool watch(const std::string &path)
+    {
+        const auto file = canonical(path);
+        std::lock_guard<std::mutex> lock(mMutex);
+        if(mFiles.count(file)) return true;
+#ifdef __linux__
+        if(mInotify < 0)
+        {
+            mInotify = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+            mWake = eventfd(0, EFD_CLOEXEC);
+            if(mInotify < 0 || mWake < 0) return false;
+        }
+        const auto dir = std::filesystem::path(file).parent_path().string();
+        const auto wd = inotify_add_watch(mInotify, dir.c_str(),
+            IN_CLOSE_WRITE | IN_MOVED_TO);
+        if(wd < 0) return false;
+        mDirectories[wd] = dir;
+#else
+        std::error_code ec;
+        mTimes[file] = std::filesystem::last_write_time(file, ec);
+        if(ec) return false;
+#endif
+        mFiles.insert(file);
+        if(!mThread.joinable()) mThread = std::thread([this]() { threadMain(); });
+        return true;
+    }
+};
@@ -0,0 +1,506 @@
+#pragma once
+
+// Included by lab08_framework.hpp after lab08_environment.hpp.
+
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include "lab08_thread_pool.hpp"
+
+/*****************************************************************************/
+// FrameCapture
+/*****************************************************************************/
+
+enum class CaptureFormat
+{
+    // One binary PPM per frame
+    PPM,
+    // One file of RGBA per frame, bottom row first as OpenGL reads it
+    RGBA,
+    // A single stream of I420 frames, e.g. for ffmpeg -f rawvideo
+    YUV,
+};
+
+inline const char * captureFormatName(CaptureFormat format)
+{
+    switch(format)
+    {
+        case CaptureFormat::PPM: return "PPM";
+        case CaptureFormat::RGBA: return "Raw RGBA";
+        case CaptureFormat::YUV: return "Raw YUV (I420)";
+        default: return "?";
+    }
+}
+
+/**
+ * \brief Whether fences can tell when a readback is done, which capturing
+ * needs. The first call must be made on the render thread.
+ */
+inline bool syncObjectsSupported()
+{
+    static const bool supported = [] {
+        // Core since OpenGL 3.2. Older contexts leave the version at 0.
+        GLint major = 0, minor = 0;
+        glGetIntegerv(GL_MAJOR_VERSION, &major);
+        glGetIntegerv(GL_MINOR_VERSION, &minor);
+        return major * 10 + minor >= 32 || hasGLExtension("GL_ARB_sync");
+    }();
+    return supported;
+}
+
+/**
+ * \brief Records the frames drawn into the framebuffer without stalling the
+ * render thread on them. Each frame is read into the next of a ring of pixel
+ * buffer objects and only mapped a few frames later, once its fence shows
+ * the copy is done. The pixels then go to the worker pool to be encoded and
+ * written, in the order of the frames.
+ *
+ * Memory is bounded by a fixed number of frames in flight. When encoding
+ * falls behind, capture() waits for a frame to be written rather than
+ * dropping one; such stalls are counted so that they show.
+ */
+class FrameCapture
+{
+    // A frame between the readback and its file
+    struct Frame
+    {
+        std::uint64_t index = 0;
+        std::vector<std::uint8_t> rgba;
+        std::vector<std::uint8_t> encoded;
+    };
+
+    struct Readback
+    {
+        GLuint buffer = 0;
+        GLsync fence = nullptr;
+        std::uint64_t index = 0;
+    };
+
+    // Shared with the encoders
+    struct Output
+    {
+        std::mutex mutex;
+        std::condition_variable frameFreed;
+        std::vector<std::unique_ptr<Frame>> free;
+        // Encoded frames waiting for those before them
+        std::map<std::uint64_t, std::unique_ptr<Frame>> encoded;
+        std::uint64_t nextToWrite = 0;
+        // Frames out of the free list
+        std::size_t inFlight = 0;
+        std::FILE *stream = nullptr;
+        // An encoder is writing frames out
+        bool writing = false;
+        std::uint64_t written = 0;
+        std::uint64_t failed = 0;
+    };
+
+    std::vector<Readback> mRing;
+    // The oldest readback not mapped yet, and how many are pending
+    std::size_t mTail = 0;
+    std::size_t mPending = 0;
+    std::shared_ptr<Output> mOutput = std::make_shared<Output>();
+
+    bool mRecording = false;
+    CaptureFormat mFormat = CaptureFormat::PPM;
+    std::string mPrefix = "capture_";
+    // Capture the UI drawn over the scene too
+    bool mIncludeUi = false;
+    int mRingSize = 3;
+    int mMaxFramesInFlight = 8;
+    int mWidth = 0;
+    int mHeight = 0;
+    std::uint64_t mCaptured = 0;
+    std::uint64_t mStalls = 0;
+    double mStallMs = 0;
+    // Readbacks mapped before their fence, because the ring was full
+    std::uint64_t mEarlyMaps = 0;
+
+    std::size_t frameBytes() const
+    {
+        return std::size_t(4) * mWidth * mHeight;
+    }
+
+    // BT.601 limited range, for even sizes; an odd last row or column is
+    // left out.
+    static void encodeI420(const Frame &frame, int width, int height,
+        std::vector<std::uint8_t> &yuv)
+    {
+        const auto w = width & ~1, h = height & ~1;
+        yuv.resize(std::size_t(w) * h * 3 / 2);
+        auto *y_plane = yuv.data();
+        auto *u_plane = y_plane + std::size_t(w) * h;
+        auto *v_plane = u_plane + std::size_t(w / 2) * (h / 2);
+        for(int y = 0; y < h; ++y)
+        {
+            // From the top row down
+            const auto *row = frame.rgba.data() +
+                std::size_t(height - 1 - y) * width * 4;
+            for(int x = 0; x < w; ++x)
+            {
+                const int r = row[x * 4], g = row[x * 4 + 1],
+                    b = row[x * 4 + 2];
+                y_plane[std::size_t(y) * w + x] = static_cast<std::uint8_t>(
+                    16 + ((66 * r + 129 * g + 25 * b + 128) >> 8));
+            }
+            if(y & 1) continue;
+            const auto *next = row - std::size_t(width) * 4;
+            for(int x = 0; x < w; x += 2)
+            {
+                int r = 0, g = 0, b = 0;
+                for(auto *p : { row + x * 4, row + x * 4 + 4, next + x * 4,
+                    next + x * 4 + 4 })
+                {
+                    r += p[0];
+                    g += p[1];
+                    b += p[2];
+                }
+                r = (r + 2) / 4;
+                g = (g + 2) / 4;
+                b = (b + 2) / 4;
+                const auto i = std::size_t(y / 2) * (w / 2) + x / 2;
+                u_plane[i] = static_cast<std::uint8_t>(
+                    128 + ((-38 * r - 74 * g + 112 * b + 128) >> 8));
+                v_plane[i] = static_cast<std::uint8_t>(
+                    128 + ((112 * r - 94 * g - 18 * b + 128) >> 8));
+            }
+        }
+    }
+
+    static void encodePpm(const Frame &frame, int width, int height,
+        std::vector<std::uint8_t> &ppm)
+    {
+        char header[32];
+        const auto header_size = std::snprintf(header, sizeof(header),
+            "P6\n%d %d\n255\n", width, height);
+        ppm.assign(header, header + header_size);
+        ppm.reserve(ppm.size() + std::size_t(3) * width * height);
+        for(int y = height - 1; y >= 0; --y)
+        {
+            const auto *row = frame.rgba.data() + std::size_t(y) * width * 4;
+            for(int x = 0; x < width; ++x)
+                ppm.insert(ppm.end(), row + x * 4, row + x * 4 + 3);
+        }
+    }
+
+    static bool writeFrame(Output &output, const Frame &frame,
+        CaptureFormat format, const std::string &prefix, std::string &path)
+    {
+        const auto &bytes = format == CaptureFormat::RGBA ?
+            frame.rgba : frame.encoded;
+        if(format == CaptureFormat::YUV)
+        {
+            path = prefix + ".yuv";
+            return output.stream && std::fwrite(bytes.data(), 1,
+                bytes.size(), output.stream) == bytes.size();
+        }
+        char number[16];
+        std::snprintf(number, sizeof(number), "%05llu",
+            static_cast<unsigned long long>(frame.index));
+        path = prefix + number +
+            (format == CaptureFormat::PPM ? ".ppm" : ".rgba");
+        auto *file = std::fopen(path.c_str(), "wb");
+        auto ok = file && std::fwrite(bytes.data(), 1, bytes.size(),
+            file) == bytes.size();
+        if(file) ok = std::fclose(file) == 0 && ok;
+        return ok;
+    }
+
+    // Write out the frames that are next in order, unless another encoder
+    // already does. The files are written with the lock released, which
+    // holds only to take the frames and to return them to the free list.
+    static void writeReady(Output &output, CaptureFormat format,
+        const std::string &prefix, std::unique_lock<std::mutex> &lock)
+    {
+        if(output.writing) return;
+        output.writing = true;
+        std::vector<std::unique_ptr<Frame>> ready;
+        for(;;)
+        {
+            auto it = output.encoded.begin();
+            while(it != output.encoded.end() &&
+                it->first == output.nextToWrite)
+            {
+                ready.push_back(std::move(it->second));
+                it = output.encoded.erase(it);
+                ++output.nextToWrite;
+            }
+            if(ready.empty()) break;
+
+            lock.unlock();
+            std::uint64_t written = 0;
+            std::string failed_path;
+            for(const auto &frame : ready)
+            {
+                std::string path;
+                if(writeFrame(output, *frame, format, prefix, path))
+                    ++written;
+                else if(failed_path.empty()) failed_path = path;
+            }
+            lock.lock();
+
+            const auto failed = ready.size() - written;
+            // Only the first failure, rather than one per frame
+            if(failed > 0 && output.failed == 0)
+                std::cerr << "Cannot write " << failed_path << std::endl;
+            output.written += written;
+            output.failed += failed;
+            output.inFlight -= ready.size();
+            for(auto &frame : ready) output.free.push_back(std::move(frame));
+            ready.clear();
+            output.frameFreed.notify_all();
+        }
+        output.writing = false;
+    }
+
+    // Copy a finished readback out of its buffer and hand it to an encoder.
+    void retire(Readback &readback)
+    {
+        std::unique_ptr<Frame> frame;
+        {
+            std::unique_lock<std::mutex> lock(mOutput->mutex);
+            if(mOutput->free.empty())
+            {
+                ++mStalls;
+                const auto start = std::chrono::steady_clock::now();
+                mOutput->frameFreed.wait(lock, [this]() {
+                    return !mOutput->free.empty();
+                });
+                const std::chrono::duration<double, std::milli> ms =
+                    std::chrono::steady_clock::now() - start;
+                mStallMs += ms.count();
+            }
+            frame = std::move(mOutput->free.back());
+            mOutput->free.pop_back();
+            ++mOutput->inFlight;
+        }
+
+        if(glClientWaitSync(readback.fence, 0, 0) == GL_TIMEOUT_EXPIRED)
+        {
+            ++mEarlyMaps;
+            glClientWaitSync(readback.fence, GL_SYNC_FLUSH_COMMANDS_BIT,
+                GL_TIMEOUT_IGNORED);
+        }
+        glDeleteSync(readback.fence);
+        readback.fence = nullptr;
+        frame->index = readback.index;
+        frame->rgba.resize(frameBytes());
+        glBindBuffer(GL_PIXEL_PACK_BUFFER, readback.buffer);
+        if(const auto *pixels = glMapBuffer(GL_PIXEL_PACK_BUFFER,
+            GL_READ_ONLY))
+        {
+            std::memcpy(frame->rgba.data(), pixels, frame->rgba.size());
+            glUnmapBuffer(GL_PIXEL_PACK_BUFFER);
+        }
+        glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+
+        workerPool().submit([output = mOutput, frame = frame.release(),
+            format = mFormat, prefix = mPrefix, width = mWidth,
+            height = mHeight]() {
+            ProfileScope scope("Encode Frame");
+            std::unique_ptr<Frame> owned(frame);
+            if(format == CaptureFormat::PPM)
+                encodePpm(*owned, width, height, owned->encoded);
+            else if(format == CaptureFormat::YUV)
+                encodeI420(*owned, width, height, owned->encoded);
+            std::unique_lock<std::mutex> lock(output->mutex);
+            const auto index = owned->index;
+            output->encoded[index] = std::move(owned);
+            writeReady(*output, format, prefix, lock);
+        });
+    }
+
+    void retireTail()
+    {
+        retire(mRing[mTail]);
+        mTail = (mTail + 1) % mRing.size();
+        --mPending;
+    }
+
+public:
+    FrameCapture() = default;
+    FrameCapture(const FrameCapture &) = delete;
+    FrameCapture & operator=(const FrameCapture &) = delete;
+
+    ~FrameCapture()
+    {
+        stop();
+        for(auto &&readback : mRing) glDeleteBuffers(1, &readback.buffer);
+    }
+
+    void setFormat(CaptureFormat format) { mFormat = format; }
+    // Frames are written to <prefix>00000.ppm and so on, or <prefix>.yuv
+    void setPrefix(std::string prefix) { mPrefix = std::move(prefix); }
+    void setIncludeUi(bool include_ui) { mIncludeUi = include_ui; }
+    bool includesUi() const { return mIncludeUi; }
+    bool recording() const { return mRecording; }
+
+    /**
+     * \brief Start recording frames of the given size. The size of the
+     * framebuffer must not change until stop(). Fails without sync objects.
+     */
+    bool start(int width, int height)
+    {
+        stop();
+        if(!syncObjectsSupported())
+        {
+            std::cerr << "Capturing frames needs OpenGL 3.2 or GL_ARB_sync"
+                << std::endl;
+            return false;
+        }
+        mWidth = width;
+        mHeight = height;
+        if(mRing.size() != static_cast<std::size_t>(mRingSize))
+        {
+            for(auto &&readback : mRing) glDeleteBuffers(1, &readback.buffer);
+            mRing.assign(mRingSize, Readback());
+        }
+        for(auto &&readback : mRing)
+        {
+            if(!readback.buffer) glGenBuffers(1, &readback.buffer);
+            glBindBuffer(GL_PIXEL_PACK_BUFFER, readback.buffer);
+            glBufferData(GL_PIXEL_PACK_BUFFER,
+                static_cast<GLsizeiptr>(frameBytes()), nullptr,
+                GL_STREAM_READ);
+        }
+        glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+        mTail = mPending = 0;
+
+        // A new Output, so that encoders of a stopped recording never see
+        // this one.
+        mOutput = std::make_shared<Output>();
+        for(int i = 0; i < mMaxFramesInFlight; ++i)
+            mOutput->free.push_back(std::make_unique<Frame>());
+        if(mFormat == CaptureFormat::YUV)
+        {
+            const auto path = mPrefix + ".yuv";
+            mOutput->stream = std::fopen(path.c_str(), "wb");
+            if(!mOutput->stream)
+            {
+                std::cerr << "Cannot write " << path << std::endl;
+                return false;
+            }
+        }
+        mCaptured = mStalls = mEarlyMaps = 0;
+        mStallMs = 0;
+        mRecording = true;
+        return true;
+    }
+
+    /**
+     * \brief Read the frame in the framebuffer bound for reading, and pass
+     * on those read earlier whose copy has finished. Call after drawing the
+     * frame and before swapping buffers.
+     */
+    void capture()
+    {
+        if(!mRecording) return;
+        ProfileScope scope("Capture");
+        // Every buffer of the ring holds a frame still being copied.
+        if(mPending == mRing.size()) retireTail();
+
+        auto &&readback = mRing[(mTail + mPending) % mRing.size()];
+        readback.index = mCaptured++;
+        glPixelStorei(GL_PACK_ALIGNMENT, 1);
+        glBindBuffer(GL_PIXEL_PACK_BUFFER, readback.buffer);
+        glReadPixels(0, 0, mWidth, mHeight, GL_RGBA, GL_UNSIGNED_BYTE,
+            nullptr);
+        glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+        readback.fence = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+        ++mPending;
+
+        // The older ones that are done, but not the one just read
+        while(mPending > 1 &&
+            glClientWaitSync(mRing[mTail].fence, 0, 0) != GL_TIMEOUT_EXPIRED)
+            retireTail();
+    }
+
+    // Retire the pending frames and wait until all are written.
+    void stop()
+    {
+        if(!mRecording) return;
+        while(mPending > 0) retireTail();
+        std::unique_lock<std::mutex> lock(mOutput->mutex);
+        mOutput->frameFreed.wait(lock, [this]() {
+            return mOutput->inFlight == 0;
+        });
+        if(mOutput->stream)
+        {
+            std::fclose(mOutput->stream);
+            mOutput->stream = nullptr;
+        }
+        mRecording = false;
+    }
+
+    std::uint64_t captured() const { return mCaptured; }
+    std::uint64_t written() const
+    {
+        std::lock_guard<std::mutex> lock(mOutput->mutex);
+        return mOutput->written;
+    }
+    std::uint64_t stalls() const { return mStalls; }
+
+    void emitControlWidgets(int width, int height)
+    {
+        if(!syncObjectsSupported())
+        {
+            ImGui::TextUnformatted("Needs OpenGL 3.2 or GL_ARB_sync");
+            return;
+        }
+        if(!mRecording)
+        {
+            if(ImGui::BeginCombo("Format", captureFormatName(mFormat)))
+            {
+                for(auto format : { CaptureFormat::PPM, CaptureFormat::RGBA,
+                    CaptureFormat::YUV })
+                {
+                    if(ImGui::Selectable(captureFormatName(format),
+                        format == mFormat))
+                        mFormat = format;
+                }
+                ImGui::EndCombo();
+            }
+            char prefix[256];
+            std::snprintf(prefix, sizeof(prefix), "%s", mPrefix.c_str());
+            if(ImGui::InputText("Prefix", prefix, sizeof(prefix)))
+                mPrefix = prefix;
+            ImGui::Checkbox("Include UI", &mIncludeUi);
+            ImGui::SliderInt("Readback Ring", &mRingSize, 1, 8);
+            ImGui::SliderInt("Frames in Flight", &mMaxFramesInFlight, 1, 64);
+            if(ImGui::Button("Record")) start(width, height);
+        }
+        else if(ImGui::Button("Stop")) stop();
+
+        std::uint64_t written, failed;
+        {
+            std::lock_guard<std::mutex> lock(mOutput->mutex);
+            written = mOutput->written;
+            failed = mOutput->failed;
+        }
+        ImGui::Text("%llu captured, %llu written, %llu failed",
+            static_cast<unsigned long long>(mCaptured),
+            static_cast<unsigned long long>(written),
+            static_cast<unsigned long long>(failed));
+        ImGui::Text("%llu stalls for %.1f ms, %llu mapped early, "
+            "%.1f MB in flight at most",
+            static_cast<unsigned long long>(mStalls), mStallMs,
+            static_cast<unsigned long long>(mEarlyMaps),
+            mMaxFramesInFlight * 2.0 * width * height * 4 / (1 << 20));
+        if(mRecording && mFormat == CaptureFormat::YUV)
+        {
+            ImGui::TextWrapped("ffmpeg -f rawvideo -pix_fmt yuv420p "
+                "-s %dx%d -r 60 -i %s.yuv", mWidth & ~1, mHeight & ~1,
+                mPrefix.c_str());
+        }
+    }
+};
+
+// Frames of the window, or of --headless, are captured after being drawn.
+inline FrameCapture gFrameCapture;
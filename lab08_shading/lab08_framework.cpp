@@ -0,0 +1,286 @@
+// The parts of the framework that are the same for every build of the lab:
+// window creation and the main loop, or with --headless the offscreen
+// rendering of a number of frames. The lab provides the scene through the
+// functions declared at the end of lab08_framework.hpp.
+
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+
+#include "lab08_framework.hpp"
+
+#ifdef LAB_HEADLESS_EGL
+#   include "lab08_headless.hpp"
+#endif
+
+// Update and draw the scene and the UI. Without a window, as when running
+// headless, there is no input and update() is not called.
+void renderFrame(GLFWwindow *window, float dt, bool draw_ui)
+{
+    {
+        ProfileScope scope("Loading");
+        gUploadBudget.beginFrame();
+        gTextureUploader.pump();
+        gTextureStreamer.update();
+        gShaderCache.update();
+        gTextureBinder.beginFrame();
+        gMaterials.beginFrame();
+    }
+
+    ImGui_ImplOpenGL2_NewFrame();
+    if(window)
+    {
+        ImGui_ImplGlfw_NewFrame();
+    }
+    else
+    {
+        auto &&io = ImGui::GetIO();
+        io.DisplaySize = ImVec2(static_cast<float>(gFramebufferWidth),
+            static_cast<float>(gFramebufferHeight));
+        io.DeltaTime = dt;
+    }
+    ImGui::NewFrame();
+
+    if(window)
+    {
+        ProfileScope scope("Update");
+        update(window, dt);
+    }
+    {
+        ProfileScope scope("Render");
+        GpuProfileScope gpu_scope("Render");
+        // Set up the camera and draw our scene
+        render(dt);
+    }
+    if(!gFrameCapture.includesUi()) gFrameCapture.capture();
+    gProfiler.emitOverlay();
+
+    // Rendering
+    {
+        ProfileScope scope("ImGui::Render");
+        ImGui::Render();
+    }
+    if(draw_ui)
+    {
+        ProfileScope scope("Draw UI");
+        GpuProfileScope gpu_scope("Draw UI");
+        glViewport(0, 0, gFramebufferWidth, gFramebufferHeight);
+        ImGui_ImplOpenGL2_RenderDrawData(ImGui::GetDrawData());
+    }
+    if(gFrameCapture.includesUi()) gFrameCapture.capture();
+}
+
+void mainLoop(GLFWwindow *window)
+{
+    auto time = glfwGetTime();
+
+    // Loop until the user closes the window
+    while(!glfwWindowShouldClose(window))
+    {
+        const auto new_time = glfwGetTime();
+        // Elapsed time since last frame, in seconds.
+        const auto dt = static_cast<float>(new_time - time);
+        time = new_time;
+
+        gProfiler.beginFrame();
+        renderFrame(window, dt, true);
+
+        // Swap front and back buffers
+        {
+            ProfileScope scope("Swap Buffers");
+            glfwSwapBuffers(window);
+        }
+        // Poll for and process events, this will call into the callbacks
+        // we set before when related events occur.
+        glfwPollEvents();
+        gProfiler.endFrame();
+    }
+}
+
+/*****************************************************************************/
+// Headless Mode
+/*****************************************************************************/
+
+struct HeadlessOptions
+{
+    int frames = 60;
+    // Each frame is written by gFrameCapture to <prefix>00000.ppm and so
+    // on, if set
+    const char *writePrefix = nullptr;
+    CaptureFormat format = CaptureFormat::PPM;
+    bool ui = false;
+    // The frames are profiled and exported as a Chrome trace, if set
+    const char *tracePath = nullptr;
+};
+
+/**
+ * \brief Render a fixed number of frames offscreen, 1/60 s apart whatever
+ * time they take so that the images do not depend on the machine, then
+ * report the frame time. The first frame, which also loads and compiles
+ * what the scene needs, is reported on its own.
+ */
+int headlessMain([[maybe_unused]] const HeadlessOptions &options)
+{
+#ifdef LAB_HEADLESS_EGL
+    HeadlessContext context;
+    if(!context.create(gFramebufferWidth, gFramebufferHeight)) return 1;
+    std::cout << "Headless on " << glGetString(GL_RENDERER) << ", "
+        << glGetString(GL_VERSION) << std::endl;
+
+    IMGUI_CHECKVERSION();
+    ImGui::CreateContext();
+    // The layout of the windows is the default one, and stays saved as is.
+    ImGui::GetIO().IniFilename = nullptr;
+    ImGui_ImplOpenGL2_Init();
+    initScene();
+
+    if(options.writePrefix)
+    {
+        gFrameCapture.setFormat(options.format);
+        gFrameCapture.setPrefix(options.writePrefix);
+        gFrameCapture.setIncludeUi(options.ui);
+        if(!gFrameCapture.start(gFramebufferWidth, gFramebufferHeight))
+            return 1;
+    }
+    if(options.tracePath)
+    {
+        gProfiler.setEnabled(true);
+        gProfiler.setTraceFrames(options.frames);
+    }
+    double first_ms = 0, rest_ms = 0;
+    for(int frame = 0; frame < options.frames; ++frame)
+    {
+        const auto start = std::chrono::steady_clock::now();
+        gProfiler.beginFrame();
+        renderFrame(nullptr, 1 / 60.f, options.ui);
+        {
+            ProfileScope scope("Finish");
+            glFinish();
+        }
+        gProfiler.endFrame();
+        const std::chrono::duration<double, std::milli> ms =
+            std::chrono::steady_clock::now() - start;
+        (frame == 0 ? first_ms : rest_ms) += ms.count();
+    }
+    gFrameCapture.stop();
+    if(options.tracePath) gProfiler.exportTrace(options.tracePath);
+    std::printf("%d frames of %dx%d: first %.1f ms", options.frames,
+        gFramebufferWidth, gFramebufferHeight, first_ms);
+    if(options.frames > 1)
+    {
+        const auto frame_ms = rest_ms / (options.frames - 1);
+        std::printf(", then %.2f ms per frame (%.1f fps)", frame_ms,
+            1000 / frame_ms);
+    }
+    std::printf("\n");
+    if(options.writePrefix)
+    {
+        std::printf("%llu frames written, %llu stalls on encoding\n",
+            static_cast<unsigned long long>(gFrameCapture.written()),
+            static_cast<unsigned long long>(gFrameCapture.stalls()));
+    }
+
+    ImGui_ImplOpenGL2_Shutdown();
+    ImGui::DestroyContext();
+    return gFrameCapture.written() == gFrameCapture.captured() ? 0 : 1;
+#else
+    std::cerr << "Built without EGL, headless mode is not available"
+        << std::endl;
+    return 1;
+#endif
+}
+
+int main(int argc, char **argv)
+{
+    gProfiler.nameThread("Render");
+    auto headless = false;
+    HeadlessOptions options;
+    for(int i = 1; i < argc; ++i)
+    {
+        if(std::strcmp(argv[i], "--headless") == 0)
+            headless = true;
+        else if(std::strcmp(argv[i], "--size") == 0 && i + 2 < argc)
+        {
+            gFramebufferWidth = std::atoi(argv[++i]);
+            gFramebufferHeight = std::atoi(argv[++i]);
+        }
+        else if(std::strcmp(argv[i], "--frames") == 0 && i + 1 < argc)
+            options.frames = std::atoi(argv[++i]);
+        else if(std::strcmp(argv[i], "--write") == 0 && i + 1 < argc)
+            options.writePrefix = argv[++i];
+        else if(std::strcmp(argv[i], "--raw") == 0)
+            options.format = CaptureFormat::RGBA;
+        else if(std::strcmp(argv[i], "--yuv") == 0)
+            options.format = CaptureFormat::YUV;
+        else if(std::strcmp(argv[i], "--ui") == 0)
+            options.ui = true;
+        else if(std::strcmp(argv[i], "--trace") == 0 && i + 1 < argc)
+            options.tracePath = argv[++i];
+        else
+        {
+            std::cerr << "Usage: " << argv[0] << " [--headless] "
+                "[--size <width> <height>] [--frames <count>] "
+                "[--write <prefix>] [--raw | --yuv] [--ui] "
+                "[--trace <trace.json>]" << std::endl;
+            return 1;
+        }
+    }
+    if(gFramebufferWidth <= 0 || gFramebufferHeight <= 0 ||
+        options.frames <= 0)
+    {
+        std::cerr << "Invalid size or frame count" << std::endl;
+        return 1;
+    }
+    if(headless) return headlessMain(options);
+
+    GLFWwindow *window = nullptr;
+
+    // Initialize the library
+    if(!glfwInit())
+        return -1;
+
+    glfwWindowHint(GLFW_SAMPLES, 4);
+
+    // Create a windowed mode window and its OpenGL context
+    window = glfwCreateWindow(
+        gFramebufferWidth, gFramebufferHeight, gWindowTitle,
+        nullptr, nullptr);
+    // If you cannot create the window, update your graphics driver first!
+    if(!window)
+    {
+        glfwTerminate();
+        return -1;
+    }
+    // Get the correct size of the framebuffer.
+    glfwGetFramebufferSize(window, &gFramebufferWidth, &gFramebufferHeight);
+
+    glfwMakeContextCurrent(window);
+#ifdef _WIN32
+    glewInit();
+#endif
+
+    IMGUI_CHECKVERSION();
+    ImGui::CreateContext();
+    ImGui_ImplGlfw_InitForOpenGL(window, false);
+    ImGui_ImplOpenGL2_Init();
+
+    installCallbacks(window);
+
+    // Make the window's context current
+    glfwMakeContextCurrent(window);
+    // Enable vertical sync
+    glfwSwapInterval(1);
+
+    initScene();
+    mainLoop(window);
+    // Write out what is still being recorded.
+    gFrameCapture.stop();
+
+    ImGui_ImplOpenGL2_Shutdown();
+    ImGui_ImplGlfw_Shutdown();
+    ImGui::DestroyContext();
+
+    glfwTerminate();
+    return 0;
+}
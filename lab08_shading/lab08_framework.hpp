@@ -1,11 +1,10 @@
-#pragma once
-
-// #include <gl/glew.h>
+﻿#pragma once
 
 // Linking with OpenGL libraries in Windows
 #ifdef _WIN32
 #   pragma comment(lib, "OpenGL32.lib")
 #   pragma comment(lib, "GLU32.lib")
+#   pragma comment(lib, "glew32.lib")
 #   define WIN32_LEAN_AND_MEAN
 #   include <Windows.h>
 // These macros defined by Windows can cause troubles, so get rid of them.
@@ -13,6 +12,9 @@
 #   undef far
 #   undef max
 #   undef min
+// Windows only exports OpenGL 1.1 functions. GLEW loads the newer ones such
+// as buffer objects. It must be included before gl.h.
+#   include <GL/glew.h>
 #   include <GL/gl.h>
 #   include <GL/glu.h>
 #   define GLFW_EXPOSE_NATIVE_WIN32
@@ -25,10 +27,22 @@
 #   include <OpenGL/glu.h>
 #endif
 
+// Other platforms declare the newer OpenGL functions in glext.h.
+#if !defined(_WIN32) && !defined(__APPLE__)
+#   define GL_GLEXT_PROTOTYPES
+#   include <GL/gl.h>
+#   include <GL/glu.h>
+#endif
+
+#include <algorithm>
+#include <array>
+#include <cstring>
+#include <functional>
 #include <vector>
 #include <iostream>
 #include <iterator>
 #include <memory>
+#include <optional>
 #include <fstream>
 #include <sstream>
 
@@ -41,19 +55,70 @@
 // Convers glm vector to string
 #include <glm/gtx/string_cast.hpp>
 
-// ImGUI
-#include "imgui-1.73/imgui.cpp"
-#include "imgui-1.73/imgui_widgets.cpp"
-#include "imgui-1.73/imgui_draw.cpp"
-#include "imgui-1.73/imgui_impl_opengl2.cpp"
-#include "imgui-1.73/imgui_impl_glfw.cpp"
+// ImGUI, compiled once into the cglabs_imgui library
+#include "../third_party/imgui-1.73/imgui.h"
+#include "../third_party/imgui-1.73/imgui_impl_opengl2.h"
+#include "../third_party/imgui-1.73/imgui_impl_glfw.h"
 
 /*****************************************************************************/
 // Texture
 /*****************************************************************************/
 
-#define STB_IMAGE_IMPLEMENTATION
-#include "stb_image.h"
+#include "../third_party/stb_image.h"
+
+#include "lab08_image.hpp"
+
+#ifndef GL_TEXTURE_MAX_ANISOTROPY_EXT
+#   define GL_TEXTURE_MAX_ANISOTROPY_EXT 0x84FE
+#   define GL_MAX_TEXTURE_MAX_ANISOTROPY_EXT 0x84FF
+#endif
+
+/**
+ * \brief Whether the current OpenGL context advertises an extension.
+ */
+inline bool hasGLExtension(const char *name)
+{
+    const auto *extensions =
+        reinterpret_cast<const char *>(glGetString(GL_EXTENSIONS));
+    if(!extensions) return false;
+    const auto length = std::strlen(name);
+    for(auto *p = std::strstr(extensions, name); p;
+        p = std::strstr(p + length, name))
+    {
+        // Make sure that a whole name matched, not a prefix of another.
+        if((p == extensions || p[-1] == ' ') &&
+            (p[length] == ' ' || p[length] == '\0'))
+            return true;
+    }
+    return false;
+}
+
+enum class TextureFiltering
+{
+    NEAREST,
+    BILINEAR,
+    TRILINEAR,
+    ANISOTROPIC,
+};
+
+inline const char * textureFilteringName(TextureFiltering filtering)
+{
+    switch(filtering)
+    {
+        case TextureFiltering::NEAREST: return "Nearest";
+        case TextureFiltering::BILINEAR: return "Bilinear";
+        case TextureFiltering::TRILINEAR: return "Trilinear";
+        case TextureFiltering::ANISOTROPIC: return "Anisotropic";
+        default: return "?";
+    }
+}
+
+// Applied to textures when they are loaded
+inline TextureFiltering gTextureFiltering = TextureFiltering::TRILINEAR;
+// Used to build the mip chains of textures when they are loaded
+inline MipFilter gMipFilter = MipFilter::BOX;
+
+struct TextureData;
 
 // Read https://learnopengl.com/Getting-started/Textures for more details
 // on textures.
@@ -61,6 +126,33 @@ class Texture
 {
     GLuint mTextureId = 0;
     bool mLoaded = false;
+    int mWidth = 0;
+    int mHeight = 0;
+    int mLevels = 1;
+    // Video memory of all levels
+    std::size_t mBytes = 0;
+    TextureFiltering mFiltering = gTextureFiltering;
+
+    // Set while an asynchronous load is in flight. Results of older loads
+    // are recognized by their serial and dropped.
+    bool mPending = false;
+    std::uint32_t mLoadSerial = 0;
+    std::string mError;
+    // Expires with the texture so that late decode results are discarded.
+    std::shared_ptr<char> mAlive = std::make_shared<char>();
+    // Another texture with identical content to use instead of this one.
+    std::shared_ptr<Texture> mAlias;
+
+    // Managed by TextureStreamer: only the levels from mBaseLevel down are
+    // in video memory. mWantedSize is the largest size in pixels the
+    // texture was drawn at in the current frame.
+    bool mStreamed = false;
+    int mBaseLevel = 0;
+    float mWantedSize = 0;
+
+    friend class TextureUploader;
+    friend class TextureCache;
+    friend class TextureStreamer;
 
     void create()
     {
@@ -73,7 +165,63 @@ class Texture
         glBindTexture(GL_TEXTURE_2D, 0);
     }
 
+    // Upload every level at once. Defined after TextureData.
+    void upload(const TextureData &data);
+
+    // Declare how many mip levels are uploaded and apply the filtering
+    // accordingly.
+    void setLevels(int levels)
+    {
+        mLevels = levels;
+        glBindTexture(GL_TEXTURE_2D, mTextureId);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAX_LEVEL, levels - 1);
+        glBindTexture(GL_TEXTURE_2D, 0);
+        setFiltering(mFiltering);
+    }
+
+    void fail(std::string error)
+    {
+        mError = std::move(error);
+        mPending = false;
+        mLoaded = false;
+    }
+
+    /**
+     * \brief A grey checkerboard bound in place of textures which are still
+     * loading or failed to load.
+     */
+    static GLuint fallbackTextureId()
+    {
+        static GLuint id = 0;
+        if(id == 0)
+        {
+            unsigned char pixels[8 * 8 * 4];
+            for(int y = 0; y < 8; ++y)
+            {
+                for(int x = 0; x < 8; ++x)
+                {
+                    const unsigned char c = (x / 4 + y / 4) % 2 ? 160 : 96;
+                    auto *p = &pixels[(y * 8 + x) * 4];
+                    p[0] = p[1] = p[2] = c;
+                    p[3] = 255;
+                }
+            }
+            glGenTextures(1, &id);
+            glBindTexture(GL_TEXTURE_2D, id);
+            glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+            glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+            glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA, 8, 8, 0, GL_RGBA,
+                GL_UNSIGNED_BYTE, pixels);
+            glBindTexture(GL_TEXTURE_2D, 0);
+        }
+        return id;
+    }
+
 public:
+    Texture() = default;
+    Texture(const Texture &) = delete;
+    Texture & operator=(const Texture &) = delete;
+
     ~Texture()
     {
         if(mTextureId)
@@ -83,150 +231,517 @@ public:
         }
     }
 
-    void loadFromFile(const char *path)
+    /**
+     * \brief Decode and upload an image file on the calling thread, or
+     * upload a texture container (.cgtex) straight from its mapping. Returns
+     * false and leaves the texture unchanged if the file cannot be decoded.
+     * Defined after TextureData, like the other loading functions.
+     */
+    bool loadFromFile(const char *path);
+
+    /**
+     * \brief Decode an image file held in memory, such as one read by
+     * TextureCache. Returns false if stb_image cannot decode it. Given the
+     * path of the file, compressed mip chains are cached next to it.
+     */
+    bool loadFromMemory(const void *file_data, std::size_t size,
+        const std::string &source_path = { });
+
+    /**
+     * \brief Allocate a transparent black texture without mip levels, to be
+     * filled in with updateRegion().
+     */
+    void allocate(int width, int height)
     {
         if(mTextureId == 0) create();
-        int width, height, num_channels;
-        auto data = stbi_load(path, &width, &height, &num_channels, 4);
+        const std::vector<std::uint8_t> clear(std::size_t(4) * width * height);
         glBindTexture(GL_TEXTURE_2D, mTextureId);
-        glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA, width, height, 0, GL_RGBA, GL_UNSIGNED_BYTE, data);
+        glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA, width, height, 0, GL_RGBA,
+            GL_UNSIGNED_BYTE, clear.data());
         glBindTexture(GL_TEXTURE_2D, 0);
-        stbi_image_free(data);
+        mWidth = width;
+        mHeight = height;
+        mBytes = clear.size();
+        setLevels(1);
         mLoaded = true;
+        mPending = false;
+        mError.clear();
+    }
+
+    // Overwrite a rectangle of the base level with tightly packed RGBA.
+    void updateRegion(int x, int y, int width, int height,
+        const std::uint8_t *rgba)
+    {
+        glBindTexture(GL_TEXTURE_2D, mTextureId);
+        glTexSubImage2D(GL_TEXTURE_2D, 0, x, y, width, height, GL_RGBA,
+            GL_UNSIGNED_BYTE, rgba);
+        glBindTexture(GL_TEXTURE_2D, 0);
+    }
+
+    /**
+     * \brief Select how the texture is sampled. Modes other than NEAREST
+     * only differ once mip levels are uploaded; ANISOTROPIC falls back to
+     * TRILINEAR without GL_EXT_texture_filter_anisotropic.
+     */
+    void setFiltering(TextureFiltering filtering)
+    {
+        mFiltering = filtering;
+        if(mTextureId == 0) return;
+
+        const auto mipmapped = mLevels > 1;
+        GLint min_filter = GL_NEAREST, mag_filter = GL_LINEAR;
+        switch(filtering)
+        {
+            case TextureFiltering::NEAREST:
+                min_filter = mipmapped ? GL_NEAREST_MIPMAP_NEAREST : GL_NEAREST;
+                mag_filter = GL_NEAREST;
+                break;
+            case TextureFiltering::BILINEAR:
+                min_filter = mipmapped ? GL_LINEAR_MIPMAP_NEAREST : GL_LINEAR;
+                break;
+            case TextureFiltering::TRILINEAR:
+            case TextureFiltering::ANISOTROPIC:
+                min_filter = mipmapped ? GL_LINEAR_MIPMAP_LINEAR : GL_LINEAR;
+                break;
+        }
+        glBindTexture(GL_TEXTURE_2D, mTextureId);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, min_filter);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, mag_filter);
+        if(maxAnisotropy() > 1)
+        {
+            glTexParameterf(GL_TEXTURE_2D, GL_TEXTURE_MAX_ANISOTROPY_EXT,
+                filtering == TextureFiltering::ANISOTROPIC ?
+                maxAnisotropy() : 1.f);
+        }
+        glBindTexture(GL_TEXTURE_2D, 0);
+    }
+
+    TextureFiltering filtering() const { return mFiltering; }
+
+    // The highest anisotropy supported, 1 without the extension.
+    static float maxAnisotropy()
+    {
+        static const float max_anisotropy = []() {
+            GLfloat value = 1;
+            if(hasGLExtension("GL_EXT_texture_filter_anisotropic"))
+                glGetFloatv(GL_MAX_TEXTURE_MAX_ANISOTROPY_EXT, &value);
+            return value;
+        }();
+        return max_anisotropy;
     }
 
-    GLuint textureId() const { return mTextureId; }
-    bool loaded() const { return mLoaded; }
+    /**
+     * \brief Decode the image on the worker pool and upload it on the render
+     * thread via gTextureUploader. The fallback texture is bound until
+     * then. Defined after TextureUploader.
+     */
+    void loadFromFileAsync(const char *path);
+
+    // The id to bind. This is the fallback texture while loading or after
+    // a failed load.
+    GLuint textureId() const
+    {
+        if(mAlias) return mAlias->textureId();
+        if(mLoaded) return mTextureId;
+        if(mPending || !mError.empty()) return fallbackTextureId();
+        return mTextureId;
+    }
+    bool loaded() const { return mAlias ? mAlias->loaded() : mLoaded; }
+    bool pending() const { return mPending; }
+    bool failed() const { return !mError.empty(); }
+    const std::string & error() const { return mError; }
+    int width() const { return mAlias ? mAlias->width() : mWidth; }
+    int height() const { return mAlias ? mAlias->height() : mHeight; }
+    int levels() const { return mAlias ? mAlias->levels() : mLevels; }
+    bool streamed() const { return mStreamed; }
+    // The finest level in video memory, above 0 only for streamed textures
+    int residentLevel() const { return mBaseLevel; }
+    // Report that a streamed texture is drawn across this many pixels.
+    void requestSize(float pixels)
+    {
+        mWantedSize = std::max(mWantedSize, pixels);
+    }
+    // Video memory used by the texture
+    std::size_t bytes() const { return mAlias ? 0 : mBytes; }
 };
 
-/*****************************************************************************/
-// Shader
-/*****************************************************************************/
-/*
-std::string readFileToString(const char *path)
+// Shared ownership of textures handed out by TextureCache
+using TextureHandle = std::shared_ptr<Texture>;
+
+#include "lab08_profiler.hpp"
+#include "lab08_texture_upload.hpp"
+#include "lab08_texture_cache.hpp"
+#include "lab08_texture_atlas.hpp"
+
+/**
+ * \brief Skips binding the texture which is already bound while drawing the
+ * scene, so that objects sharing a texture, e.g. an atlas page, are drawn
+ * without switching textures. Other code binding textures behind its back
+ * must call invalidate().
+ */
+class TextureBinder
 {
-    std::string code;
-    std::ifstream input(path, std::ios::in);
-    if(input.is_open())
+    // No texture has this id, so the first bind always goes through.
+    static constexpr GLuint kUnknown = ~GLuint(0);
+
+    GLuint mBound = kUnknown;
+    std::uint64_t mBinds = 0;
+    std::uint64_t mSkipped = 0;
+    std::uint64_t mLastBinds = 0;
+    std::uint64_t mLastSkipped = 0;
+
+public:
+    void beginFrame()
     {
-        std::stringstream buf;
-        buf << input.rdbuf();
-        code = buf.str();
-        input.close();
+        mLastBinds = mBinds;
+        mLastSkipped = mSkipped;
+        mBinds = mSkipped = 0;
+        invalidate();
     }
-    else
+
+    void invalidate() { mBound = kUnknown; }
+
+    void bind(GLuint texture_id)
     {
-        throw std::runtime_error { "Could not open file." };
+        if(texture_id == mBound)
+        {
+            ++mSkipped;
+            return;
+        }
+        glBindTexture(GL_TEXTURE_2D, texture_id);
+        mBound = texture_id;
+        ++mBinds;
     }
-    return code;
-}
 
-class Shader
+    // Counts of the last complete frame
+    std::uint64_t binds() const { return mLastBinds; }
+    std::uint64_t skipped() const { return mLastSkipped; }
+};
+
+inline TextureBinder gTextureBinder;
+
+/*****************************************************************************/
+// Shader
+/*****************************************************************************/
+
+#include "lab08_software_rasterizer.hpp"
+#include "lab08_shader.hpp"
+#include "lab08_shader_permutations.hpp"
+#include "lab08_clustered_lights.hpp"
+#include "lab08_environment.hpp"
+#include "lab08_frame_capture.hpp"
+
+/*****************************************************************************/
+// Material
+/*****************************************************************************/
+
+struct Material
 {
-    GLuint mProgram = 0;
+    // These are default values as said in
+    // https://www.khronos.org/registry/OpenGL-Refpages/gl2.1/xhtml/glMaterial.xml
+
+    glm::vec4 ambient { 0.2f, 0.2f, 0.2f, 1.0f };
+    glm::vec4 diffuse { 0.8f, 0.8f, 0.8f, 1.0f };
+    glm::vec4 specular { 0, 0, 0, 1 };
+    glm::vec4 emission { 0, 0, 0, 1 };
+    float shininess = 0;
+    // Tangent-space normals, only used by shaders with the NORMAL_MAP feature
+    TextureHandle normalMap;
+
+    bool operator==(const Material &other) const
+    {
+        return ambient == other.ambient && diffuse == other.diffuse &&
+            specular == other.specular && emission == other.emission &&
+            shininess == other.shininess && normalMap == other.normalMap;
+    }
 
-    void deleteProgram()
+    // Returns whether a value changed.
+    bool emitControlWidgets()
     {
-        if(mProgram)
+        auto changed = ImGui::SliderFloat4("Ambient", &ambient.x, 0, 1);
+        changed |= ImGui::SliderFloat4("Diffuse", &diffuse.x, 0, 1);
+        changed |= ImGui::SliderFloat4("Specular", &specular.x, 0, 1);
+        changed |= ImGui::SliderFloat4("Emission", &emission.x, 0, 1);
+        changed |= ImGui::SliderFloat("Shininess", &shininess, 0, 128);
+        if(normalMap)
         {
-            glDeleteProgram(mProgram);
-            mProgram = 0;
+            ImGui::Text("Normal map %dx%d", normalMap->width(),
+                normalMap->height());
+            ImGui::SameLine();
+            if(ImGui::SmallButton("Remove"))
+            {
+                normalMap.reset();
+                changed = true;
+            }
         }
+        return changed;
+    }
+
+    void apply() const
+    {
+        glMaterialfv(GL_FRONT, GL_AMBIENT, &ambient.x);
+        glMaterialfv(GL_FRONT, GL_DIFFUSE, &diffuse.x);
+        glMaterialfv(GL_FRONT, GL_SPECULAR, &specular.x);
+        glMaterialfv(GL_FRONT, GL_EMISSION, &emission.x);
+        glMaterialfv(GL_FRONT, GL_SHININESS, &shininess);
+    }
+
+    SoftwareMaterial toSoftware() const
+    {
+        SoftwareMaterial m;
+        std::copy_n(&ambient.x, 4, m.ambient);
+        std::copy_n(&diffuse.x, 4, m.diffuse);
+        std::copy_n(&specular.x, 4, m.specular);
+        std::copy_n(&emission.x, 4, m.emission);
+        m.shininess = shininess;
+        return m;
+    }
+};
+
+using MaterialId = std::uint32_t;
+// Registered first, with the defaults of OpenGL, and used by every object
+// which is not given another one
+constexpr MaterialId kDefaultMaterial = 0;
+
+/**
+ * \brief Owns the materials of the scene under ids which never change, so
+ * that objects refer to a material by id and draws can be sorted by it.
+ * Adding a material equal to a registered one returns the existing id.
+ * Entries are edited in place with update(), which every object using the
+ * id follows.
+ *
+ * Like TextureBinder, apply() skips the glMaterial() calls when the material
+ * is already in effect. Code changing the material state behind its back
+ * must call invalidate().
+ */
+class MaterialRegistry
+{
+    static constexpr MaterialId kUnknown = ~MaterialId(0);
+
+    std::vector<Material> mMaterials;
+    std::vector<std::string> mNames;
+    MaterialId mApplied = kUnknown;
+    // Selected in the editor
+    MaterialId mSelected = kDefaultMaterial;
+    std::uint64_t mApplies = 0;
+    std::uint64_t mSkipped = 0;
+    std::uint64_t mLastApplies = 0;
+    std::uint64_t mLastSkipped = 0;
+
+    MaterialId append(const Material &material, std::string name)
+    {
+        const auto id = static_cast<MaterialId>(mMaterials.size());
+        if(name.empty()) name = "Material " + std::to_string(id);
+        mMaterials.push_back(material);
+        mNames.push_back(std::move(name));
+        return id;
     }
 
 public:
-    void load(const char *vertex_file_path, const char *fragment_file_path)
+    MaterialRegistry()
     {
-        deleteProgram();
+        append(Material(), "Default");
+    }
 
-        // Original Source Code: http://www.opengl-tutorial.org/beginners-tutorials/tutorial-2-the-first-triangle/
+    // Returns the id of an equal material if there is one.
+    MaterialId add(const Material &material, std::string name = { })
+    {
+        const auto found = std::find(mMaterials.begin(), mMaterials.end(),
+            material);
+        if(found != mMaterials.end())
+            return static_cast<MaterialId>(found - mMaterials.begin());
+        return append(material, std::move(name));
+    }
 
-        // Create the shaders
-        GLuint vertex_shader_id = glCreateShader(GL_VERTEX_SHADER);
-        GLuint fragment_shader_id = glCreateShader(GL_FRAGMENT_SHADER);
+    const Material & operator[](MaterialId id) const
+    {
+        return mMaterials[id];
+    }
 
-        // Read the Vertex Shader code from the file
-        const auto vertex_shader_code = readFileToString(vertex_file_path);
+    void update(MaterialId id, const Material &material)
+    {
+        mMaterials[id] = material;
+        if(id == mApplied) invalidate();
+    }
 
-        // Read the Fragment Shader code from the file
-        const auto fragment_shader_code = readFileToString(fragment_file_path);
+    std::size_t size() const { return mMaterials.size(); }
 
-        GLint Result = GL_FALSE;
-        int InfoLogLength;
+    void beginFrame()
+    {
+        mLastApplies = mApplies;
+        mLastSkipped = mSkipped;
+        mApplies = mSkipped = 0;
+        invalidate();
+    }
 
-        // Compile Vertex Shader
-        printf("Compiling shader : %s\n", vertex_file_path);
-        char const *vertex_source_pointer = vertex_shader_code.c_str();
-        glShaderSource(vertex_shader_id, 1, &vertex_source_pointer, NULL);
-        glCompileShader(vertex_shader_id);
+    void invalidate() { mApplied = kUnknown; }
 
-        // Check Vertex Shader
-        glGetShaderiv(vertex_shader_id, GL_COMPILE_STATUS, &Result);
-        glGetShaderiv(vertex_shader_id, GL_INFO_LOG_LENGTH, &InfoLogLength);
-        if(InfoLogLength > 0)
+    void apply(MaterialId id)
+    {
+        if(id == mApplied)
         {
-            std::vector<char> VertexShaderErrorMessage(InfoLogLength + 1);
-            glGetShaderInfoLog(vertex_shader_id, InfoLogLength, NULL,
-                &VertexShaderErrorMessage[0]);
-            printf("%s\n", &VertexShaderErrorMessage[0]);
+            ++mSkipped;
+            return;
         }
+        mMaterials[id].apply();
+        mApplied = id;
+        ++mApplies;
+    }
 
-        // Compile Fragment Shader
-        printf("Compiling shader : %s\n", fragment_file_path);
-        char const *FragmentSourcePointer = fragment_shader_code.c_str();
-        glShaderSource(fragment_shader_id, 1, &FragmentSourcePointer, NULL);
-        glCompileShader(fragment_shader_id);
+    // Counts of the last complete frame
+    std::uint64_t applies() const { return mLastApplies; }
+    std::uint64_t skipped() const { return mLastSkipped; }
 
-        // Check Fragment Shader
-        glGetShaderiv(fragment_shader_id, GL_COMPILE_STATUS, &Result);
-        glGetShaderiv(fragment_shader_id, GL_INFO_LOG_LENGTH, &InfoLogLength);
-        if(InfoLogLength > 0)
+    // Returns whether another material was picked.
+    bool emitSelector(const char *label, MaterialId &id) const
+    {
+        auto changed = false;
+        if(ImGui::BeginCombo(label, mNames[id].c_str()))
         {
-            std::vector<char> FragmentShaderErrorMessage(InfoLogLength + 1);
-            glGetShaderInfoLog(fragment_shader_id, InfoLogLength, NULL,
-                &FragmentShaderErrorMessage[0]);
-            printf("%s\n", &FragmentShaderErrorMessage[0]);
+            for(MaterialId i = 0; i < mMaterials.size(); ++i)
+            {
+                ImGui::PushID(static_cast<int>(i));
+                if(ImGui::Selectable(mNames[i].c_str(), i == id))
+                {
+                    changed = i != id;
+                    id = i;
+                }
+                ImGui::PopID();
+            }
+            ImGui::EndCombo();
         }
+        return changed;
+    }
 
-        // Link the program
-        printf("Linking program\n");
-        GLuint ProgramID = glCreateProgram();
-        glAttachShader(ProgramID, vertex_shader_id);
-        glAttachShader(ProgramID, fragment_shader_id);
-        glLinkProgram(ProgramID);
-
-        // Check the program
-        glGetProgramiv(ProgramID, GL_LINK_STATUS, &Result);
-        glGetProgramiv(ProgramID, GL_INFO_LOG_LENGTH, &InfoLogLength);
-        if(InfoLogLength > 0)
-        {
-            std::vector<char> ProgramErrorMessage(InfoLogLength + 1);
-            glGetProgramInfoLog(ProgramID, InfoLogLength, NULL,
-                &ProgramErrorMessage[0]);
-            printf("%s\n", &ProgramErrorMessage[0]);
-        }
+    // Pick an entry and edit it in place, or start a new one from it.
+    void emitControlWidgets()
+    {
+        emitSelector("Material", mSelected);
+        ImGui::SameLine();
+        if(ImGui::SmallButton("Copy"))
+            mSelected = append(mMaterials[mSelected], { });
+        auto material = mMaterials[mSelected];
+        if(material.emitControlWidgets()) update(mSelected, material);
+        ImGui::Text("%zu materials, applied %llu, skipped %llu per frame",
+            mMaterials.size(), static_cast<unsigned long long>(applies()),
+            static_cast<unsigned long long>(skipped()));
+    }
+};
 
-        glDetachShader(ProgramID, vertex_shader_id);
-        glDetachShader(ProgramID, fragment_shader_id);
+inline MaterialRegistry gMaterials;
 
-        glDeleteShader(vertex_shader_id);
-        glDeleteShader(fragment_shader_id);
+// When set, every object is drawn with a variant of this instead of its own
+// shader, e.g. to fill the G-buffer of the deferred renderer.
+inline ShaderPermutations *gShaderOverride = nullptr;
 
-        mProgram = ProgramID;
+// When set, the variants of permutations also receive the shadows of one
+// light. Defined in lab08_shadows.hpp after Object, whose hierarchy the
+// maps are drawn from.
+class ShadowMaps;
+inline ShadowMaps *gShadowMaps = nullptr;
+// Set the shadow feature of the key if the shadowed light is among its lights.
+inline void addShadowFeatures(ShaderKey &key);
+// Bind the maps and set the uniforms of a variant with a shadow feature.
+inline void applyShadowMaps(const Shader &shader);
+
+/*****************************************************************************/
+// GpuTimer
+/*****************************************************************************/
+
+/**
+ * \brief Measures the GPU time of a part of the frame with timer queries.
+ * The result of a frame is read one frame later so that the CPU never waits
+ * for it. Without timer queries nothing is measured.
+ */
+class GpuTimer
+{
+    GLuint mQueries[2] { };
+    bool mPending[2] { };
+    int mCurrent = 0;
+    double mLastMs = 0;
+
+public:
+    GpuTimer() = default;
+    GpuTimer(const GpuTimer &) = delete;
+    GpuTimer & operator=(const GpuTimer &) = delete;
+
+    ~GpuTimer()
+    {
+        if(mQueries[0]) glDeleteQueries(2, mQueries);
+    }
+
+    // Whether the context has timer queries. The first call must be made on
+    // the render thread.
+    static bool supported()
+    {
+        static const bool supported = [] {
+            // Core since OpenGL 3.3. Older contexts leave the version at 0.
+            GLint major = 0, minor = 0;
+            glGetIntegerv(GL_MAJOR_VERSION, &major);
+            glGetIntegerv(GL_MINOR_VERSION, &minor);
+            return major * 10 + minor >= 33 ||
+                hasGLExtension("GL_ARB_timer_query");
+        }();
+        return supported;
+    }
+
+    void begin()
+    {
+        if(!supported()) return;
+        if(!mQueries[0]) glGenQueries(2, mQueries);
+        glBeginQuery(GL_TIME_ELAPSED, mQueries[mCurrent]);
     }
 
-    ~Shader()
+    void end()
     {
-        deleteProgram();
+        if(!supported()) return;
+        glEndQuery(GL_TIME_ELAPSED);
+        mPending[mCurrent] = true;
+        mCurrent ^= 1;
+        // The query of the previous frame
+        if(!mPending[mCurrent]) return;
+        GLint available = 0;
+        glGetQueryObjectiv(mQueries[mCurrent], GL_QUERY_RESULT_AVAILABLE,
+            &available);
+        if(!available) return;
+        GLuint64 ns = 0;
+        glGetQueryObjectui64v(mQueries[mCurrent], GL_QUERY_RESULT, &ns);
+        mLastMs = ns * 1e-6;
+        mPending[mCurrent] = false;
     }
 
-    GLuint programId() const { return mProgram; }
+    double milliseconds() const { return mLastMs; }
 };
-*/
+
+#include "lab08_deferred.hpp"
+
 /*****************************************************************************/
 // Object
 /*****************************************************************************/
 
+/**
+ * \brief Diameter in pixels of a sphere around the origin of the current
+ * modelview matrix as projected with the current projection matrix and
+ * viewport. Returns 0 if the center is behind the camera.
+ */
+inline float projectedDiameter(float radius)
+{
+    GLfloat modelview[16], projection[16];
+    GLint viewport[4];
+    glGetFloatv(GL_MODELVIEW_MATRIX, modelview);
+    glGetFloatv(GL_PROJECTION_MATRIX, projection);
+    glGetIntegerv(GL_VIEWPORT, viewport);
+
+    const auto mv = glm::make_mat4(modelview);
+    const auto p = glm::make_mat4(projection);
+    const auto center = p * mv * glm::vec4(0, 0, 0, 1);
+    if(center.w <= 0) return 0;
+    // Largest scaling applied to the object
+    const auto scale = std::max({ glm::length(glm::vec3(mv[0])),
+        glm::length(glm::vec3(mv[1])), glm::length(glm::vec3(mv[2])) });
+    return radius * scale * p[1][1] * viewport[3] / center.w;
+}
+
 /**
  * \brief Base class of all objects that can modify the OpenGL states and
  * issueing drawing commands, including renderable objects, camera, or joints.
@@ -263,7 +778,21 @@ protected:
     std::vector<std::unique_ptr<Object>> mChildObjects;
 
     Texture *mTexture = nullptr;
-    // Shader *mShader = nullptr;
+    // Keeps a texture from TextureCache alive while this object uses it.
+    TextureHandle mTextureHandle;
+    // A part of an atlas page used instead of mTexture
+    AtlasRegionHandle mAtlasRegion;
+    // Drawn with the fixed-function pipeline if neither is set
+    ShaderHandle mShader;
+    // The variant matching the material and scene state is used.
+    ShaderPermutations *mPermutations = nullptr;
+    // Applied before draw()
+    MaterialId mMaterial = kDefaultMaterial;
+    // Drawn into the shadow maps of ShadowMaps
+    bool mCastsShadows = false;
+    // The texture as read by a SoftwareRenderer, which cannot sample the
+    // textures of OpenGL
+    std::shared_ptr<const Image> mTextureImage;
 
 public:
     // A class intended for inheriting must have a virtual destructor to
@@ -272,8 +801,44 @@ public:
 
     // Below are setters & getters for member variables.
 
-    void setTexture(Texture *texture) { mTexture = texture; }
-    // void setShader(Shader *shader) { mShader = shader; }
+    void setTexture(Texture *texture)
+    {
+        mTextureHandle.reset();
+        mAtlasRegion.reset();
+        mTexture = texture;
+    }
+    void setTexture(TextureHandle texture)
+    {
+        mTextureHandle = std::move(texture);
+        mAtlasRegion.reset();
+        mTexture = mTextureHandle.get();
+    }
+    // Texture coordinates of the object are remapped to the region.
+    void setTexture(AtlasRegionHandle region)
+    {
+        mTextureHandle.reset();
+        mTexture = nullptr;
+        mAtlasRegion = std::move(region);
+    }
+    void setShader(ShaderHandle shader)
+    {
+        mPermutations = nullptr;
+        mShader = std::move(shader);
+    }
+    void setShader(ShaderPermutations *permutations)
+    {
+        mShader.reset();
+        mPermutations = permutations;
+    }
+    const ShaderHandle & shader() const { return mShader; }
+    void setMaterial(MaterialId material) { mMaterial = material; }
+    MaterialId material() const { return mMaterial; }
+    void setCastsShadows(bool casts) { mCastsShadows = casts; }
+    void setTextureImage(std::shared_ptr<const Image> image)
+    {
+        mTextureImage = std::move(image);
+    }
+    bool castsShadows() const { return mCastsShadows; }
 
     // Returns a reference to the variable storing translation.
     // You can directly modify the value via the reference.
@@ -355,37 +920,39 @@ public:
         if(mParent) mParent->applyWorldToLocalMatrix();
     }
 
-    auto localToWorldMatrix() const
+    /**
+     * \brief The transformation applied by applyLocalToParentMatrix() as a
+     * matrix. Override both together.
+     */
+    virtual glm::mat4 localToParentMatrix() const
     {
-        auto s = glm::scale(glm::mat4(1), mScaling);
         // glm::rotate uses radians but glRotate uses degrees...!!! wth
-        auto rx = glm::rotate(s,
-            glm::radians(mOrientation.x), glm::vec3(1, 0, 0));
-        auto ry = glm::rotate(rx,
-            glm::radians(mOrientation.y), glm::vec3(0, 1, 0));
-        auto rz = glm::rotate(ry,
-            glm::radians(mOrientation.z), glm::vec3(0, 0, 1));
-        auto t = glm::translate(rz, mPosition);
-
-        // t * rz * ry * rx * s;
-
-        return t;
+        auto m = glm::translate(glm::mat4(1), mPosition);
+        m = glm::rotate(m, glm::radians(mOrientation.z), glm::vec3(0, 0, 1));
+        m = glm::rotate(m, glm::radians(mOrientation.y), glm::vec3(0, 1, 0));
+        m = glm::rotate(m, glm::radians(mOrientation.x), glm::vec3(1, 0, 0));
+        return glm::scale(m, mScaling);
     }
 
-    auto worldToLocalMatrix() const
+    glm::mat4 localToWorldMatrix() const
     {
-        auto t = glm::translate(glm::mat4(1), -mPosition);
-        auto rz = glm::rotate(t,
-            glm::radians(-mOrientation.z), glm::vec3(0, 0, 1));
-        auto ry = glm::rotate(rz,
-            glm::radians(-mOrientation.y), glm::vec3(0, 1, 0));
-        auto rx = glm::rotate(ry,
-            glm::radians(-mOrientation.x), glm::vec3(1, 0, 0));
-        auto s = glm::scale(rx, 1.f / mScaling);
+        if(mParent)
+            return mParent->localToWorldMatrix() * localToParentMatrix();
+        return localToParentMatrix();
+    }
 
-        // s * rx * ry * rz * t;
+    glm::mat4 worldToLocalMatrix() const
+    {
+        return glm::inverse(localToWorldMatrix());
+    }
 
-        return s;
+    /**
+     * \brief Radius of a sphere around the local origin enclosing what
+     * draw() draws, used to estimate how large the object appears.
+     */
+    virtual float boundingRadius() const
+    {
+        return 1;
     }
 
     virtual void emitControlWidgets()
@@ -393,6 +960,7 @@ public:
         ImGui::DragFloat3("Position", &mPosition.x, 0.01f);
         ImGui::DragFloat3("Scaling", &mScaling.x, 0.01f);
         ImGui::DragFloat3("Orientation", &mOrientation.x, 0.01f);
+        gMaterials.emitSelector("Material", mMaterial);
     }
 
     void renderControlWidgetHierarchy()
@@ -412,6 +980,105 @@ public:
         }
     }
 
+    /**
+     * \brief Bind the texture of the object, or none, before draw(). Atlas
+     * regions are selected with the texture matrix. Streamed textures are
+     * told how large the object appears.
+     */
+    void beginTexturing() const
+    {
+        if(mAtlasRegion)
+        {
+            gTextureBinder.bind(mAtlasRegion->page->textureId());
+            const auto size = mAtlasRegion->uvMax - mAtlasRegion->uvMin;
+            glMatrixMode(GL_TEXTURE);
+            glPushMatrix();
+            glTranslatef(mAtlasRegion->uvMin.x, mAtlasRegion->uvMin.y, 0);
+            glScalef(size.x, size.y, 1);
+            glMatrixMode(GL_MODELVIEW);
+        }
+        else
+        {
+            if(mTexture && mTexture->streamed())
+                mTexture->requestSize(projectedDiameter(boundingRadius()));
+            gTextureBinder.bind(mTexture ? mTexture->textureId() : 0);
+        }
+    }
+
+    void endTexturing() const
+    {
+        if(mAtlasRegion)
+        {
+            glMatrixMode(GL_TEXTURE);
+            glPopMatrix();
+            glMatrixMode(GL_MODELVIEW);
+        }
+    }
+
+    /**
+     * \brief Apply the material and bind the shader of the object before
+     * draw(). With permutations, or gShaderOverride, the variant is chosen
+     * from the lights, fog and texturing in effect, the maps of the material,
+     * and the shadows and environment set for the pass. The state is read
+     * from OpenGL unless the pass read it already and passes it in. Returns
+     * the program bound, or nullptr for the fixed-function pipeline.
+     */
+    const Shader * beginShading(const SceneShading *scene = nullptr) const
+    {
+        gMaterials.apply(mMaterial);
+        auto &&material = gMaterials[mMaterial];
+        auto *permutations = gShaderOverride ? gShaderOverride : mPermutations;
+        if(!mShader && !permutations) return nullptr;
+
+        const auto shading = scene ? *scene : currentSceneShading();
+        auto key = shading.key;
+        key.set(ShaderFeature::TEXTURE, (mTexture || mAtlasRegion) &&
+            shading.texturing);
+        key.set(ShaderFeature::NORMAL_MAP, material.normalMap != nullptr);
+        // The G-buffer and single shaders are not built to receive shadows
+        // or the environment.
+        if(gShadowMaps && !gShaderOverride && mPermutations)
+            addShadowFeatures(key);
+        if(gEnvironmentLight && gEnvironmentLight->ready() &&
+            !gShaderOverride && mPermutations && key.lights > 0)
+            key.set(ShaderFeature::SH_AMBIENT);
+        auto &&shader = permutations ? permutations->acquire(key) : mShader;
+        if(!shader) return nullptr;
+
+        glUseProgram(shader->programId());
+        glUniform1i(shader->uniform("myTexture"), 0);
+        glUniform1i(shader->uniform("normalMap"), 1);
+        // A shader without permutations is built for at least one light.
+        glUniform1fv(shader->uniform("lightEnabled"),
+            std::max(key.lights, 1), shading.lightEnabled);
+        if(key.has(ShaderFeature::NORMAL_MAP))
+        {
+            glActiveTexture(GL_TEXTURE1);
+            glBindTexture(GL_TEXTURE_2D, material.normalMap->textureId());
+            glActiveTexture(GL_TEXTURE0);
+        }
+        if(key.has(ShaderFeature::SHADOW_CASCADES) ||
+            key.has(ShaderFeature::SHADOW_CUBE))
+            applyShadowMaps(*shader);
+        if(key.has(ShaderFeature::SH_AMBIENT))
+            gEnvironmentLight->apply(*shader);
+        return shader.get();
+    }
+
+    void endShading(const Shader *shader) const
+    {
+        if(shader)
+        {
+            glUseProgram(0);
+            if(gMaterials[mMaterial].normalMap)
+            {
+                glActiveTexture(GL_TEXTURE1);
+                glBindTexture(GL_TEXTURE_2D, 0);
+                glActiveTexture(GL_TEXTURE0);
+            }
+        }
+    }
+
     /**
      * \brief Issue drawing commands like glBegin() & glEnd().
      * \param dt The elapsed time since last frame. Useful for animations.
@@ -420,6 +1087,32 @@ public:
     {
     }
 
+    /**
+     * \brief Issue the drawing commands of draw() to a renderer working
+     * without OpenGL. The modelview, material and texture are already set.
+     */
+    virtual void rasterize(SoftwareRenderer &)
+    {
+    }
+
+    /**
+     * \brief The counterpart of drawHierarchyTransformed() for a
+     * SoftwareRenderer, which has no matrix stack.
+     */
+    void rasterizeHierarchy(SoftwareRenderer &renderer,
+        const glm::mat4 &parent_modelview)
+    {
+        const auto modelview = parent_modelview * localToParentMatrix();
+        renderer.setModelView(value_ptr(modelview));
+        renderer.setMaterial(gMaterials[mMaterial].toSoftware());
+        renderer.setTexture(mTextureImage.get());
+        rasterize(renderer);
+        for(auto &&c : mChildObjects)
+        {
+            c->rasterizeHierarchy(renderer, modelview);
+        }
+    }
+
     void drawHierarchyTransformed(float dt)
     {
         // Save the current matrix
@@ -427,8 +1120,8 @@ public:
         // Apply cube local-to-parent transformation, might be overridden in
         // derived classes.
         applyLocalToParentMatrix();
-        // Call the draw() function of the derived class.
-        draw(dt);
+        // Children are not drawn with the shader or material of the parent.
+        drawInPlace(dt);
         for(auto &&c : mChildObjects)
         {
             c->drawHierarchyTransformed(dt);
@@ -449,16 +1142,34 @@ public:
         // Apply cube local-to-parent transformation, might be overridden in
         // derived classes.
         applyLocalToParentMatrix();
-        // if(mShader) glUseProgram(mShader->programId());
-        if(mTexture) glBindTexture(GL_TEXTURE_2D, mTexture->textureId());
-        // Call the draw() function of the derived class.
-        draw(dt);
-        if(mTexture) glBindTexture(GL_TEXTURE_2D, 0);
-        // if(mShader) glUseProgram(0);
+        drawInPlace(dt);
         // Restore to last saved matrix
         glPopMatrix();
     }
 
+    /**
+     * \brief Draw this object with its material, shader and texture at the
+     * current modelview matrix, and the state of the pass if it is known.
+     */
+    void drawInPlace(float dt, const SceneShading *scene = nullptr)
+    {
+        auto shader = beginShading(scene);
+        beginTexturing();
+        // Call the draw() function of the derived class.
+        draw(dt);
+        endTexturing();
+        endShading(shader);
+    }
+
+    /**
+     * \brief Whether draw() sets state which other objects are drawn with,
+     * like the position of a light. DrawQueue keeps these in front.
+     */
+    virtual bool affectsOtherDraws() const
+    {
+        return false;
+    }
+
     /**
      * \brief Optional methods for updating your object with time.
      * \param dt The elapsed time since last frame. Useful for animations.
@@ -467,6 +1178,33 @@ public:
     {
     }
 
+    /**
+     * \brief Append this object and its descendants with their modelview
+     * matrices.
+     */
+    void collectHierarchy(std::vector<std::pair<Object *, glm::mat4>> &objects,
+        const glm::mat4 &parent_modelview)
+    {
+        const auto modelview = parent_modelview * localToParentMatrix();
+        objects.emplace_back(this, modelview);
+        for(auto &&c : mChildObjects)
+        {
+            c->collectHierarchy(objects, modelview);
+        }
+    }
+
+    /**
+     * \brief Append this object and its descendants which cast shadows.
+     */
+    void collectShadowCasters(std::vector<Object *> &casters)
+    {
+        if(mCastsShadows) casters.push_back(this);
+        for(auto &&c : mChildObjects)
+        {
+            c->collectShadowCasters(casters);
+        }
+    }
+
     /**
      * \brief Add a child object to this object.
      * \tparam T The type of the child.
@@ -523,6 +1261,191 @@ std::fill_n(std::ostream_iterator<char>(std::cout), i, ' ') \
     }
 };
 
+/*****************************************************************************/
+// DrawQueue
+/*****************************************************************************/
+
+/**
+ * \brief How far an enabled light reaches, in eye space, so that objects
+ * out of its reach are drawn with the light disabled.
+ */
+struct LightInfluence
+{
+    // 0 for GL_LIGHT0
+    int index = 0;
+    glm::vec3 position { 0 };
+    // Infinite for directional lights
+    float radius = INFINITY;
+    // The largest component of the diffuse color
+    float intensity = 1;
+    // Constant, linear and quadratic, as given to glLight()
+    glm::vec3 attenuation { 1, 0, 0 };
+
+    // What is left of the intensity at the distance
+    float contribution(float distance) const
+    {
+        if(radius == INFINITY) return intensity;
+        return intensity / (attenuation.x + attenuation.y * distance +
+            attenuation.z * distance * distance);
+    }
+};
+
+/**
+ * \brief The distance at which the attenuated intensity falls below the
+ * cutoff, or infinity if it never does.
+ */
+inline float attenuationRadius(float intensity, const glm::vec3 &attenuation,
+    float cutoff = 1 / 256.f)
+{
+    // Solve c + l d + q d^2 = intensity / cutoff for d.
+    const auto c = attenuation.x - intensity / cutoff;
+    const auto l = attenuation.y;
+    const auto q = attenuation.z;
+    if(c >= 0) return 0;
+    if(q > 0) return (-l + std::sqrt(l * l - 4 * q * c)) / (2 * q);
+    if(l > 0) return -c / l;
+    return INFINITY;
+}
+
+/**
+ * \brief Draws a hierarchy sorted by material, so that MaterialRegistry
+ * switches the material once per material in use instead of once per
+ * object. Objects whose draw() affects the others, e.g. lights, come first
+ * in the order of the hierarchy; the rest keep that order among those
+ * sharing a material.
+ *
+ * Given the influences of the enabled lights, each object is drawn with
+ * only those whose radius reaches its bounding sphere, the strongest first
+ * up to a limit per object. Lights without an influence are left alone.
+ */
+class DrawQueue
+{
+    std::vector<std::pair<Object *, glm::mat4>> mObjects;
+    const std::vector<LightInfluence> *mLights = nullptr;
+    int mMaxLightsPerObject = kMaxShaderLights;
+    // Of the last draw
+    std::size_t mObjectsLit = 0;
+    std::size_t mLightsAssigned = 0;
+
+    // The lights reaching the sphere around center, as a bit per light
+    std::uint32_t assignLights(const glm::vec3 &center, float radius) const
+    {
+        std::array<std::pair<float, int>, kMaxShaderLights> reaching;
+        std::size_t count = 0;
+        for(auto &&light : *mLights)
+        {
+            if(count == reaching.size()) break;
+            const auto distance = std::max(0.f,
+                glm::length(light.position - center) - radius);
+            if(distance > light.radius) continue;
+            reaching[count++] = { light.contribution(distance), light.index };
+        }
+        // Only the strongest ones are assigned.
+        const auto assigned = std::min(count,
+            static_cast<std::size_t>(std::max(mMaxLightsPerObject, 0)));
+        std::partial_sort(reaching.begin(), reaching.begin() + assigned,
+            reaching.begin() + count, std::greater<>());
+        std::uint32_t mask = 0;
+        for(std::size_t i = 0; i < assigned; ++i)
+            mask |= 1u << reaching[i].second;
+        return mask;
+    }
+
+    static void switchLights(std::uint32_t from, std::uint32_t to)
+    {
+        for(int i = 0; i < kMaxShaderLights; ++i)
+        {
+            const auto bit = 1u << i;
+            if((from & bit) == (to & bit)) continue;
+            if(to & bit) glEnable(GL_LIGHT0 + i);
+            else glDisable(GL_LIGHT0 + i);
+        }
+    }
+
+public:
+    /**
+     * \brief Assign the lights per object from now on, or enable them all
+     * for every object with nullptr. The influences must outlive the draws.
+     */
+    void setLights(const std::vector<LightInfluence> *lights,
+        int max_per_object)
+    {
+        mLights = lights;
+        mMaxLightsPerObject = max_per_object;
+    }
+
+    // Draw the hierarchy below root with the given view matrix.
+    void draw(Object &root, const glm::mat4 &view, float dt)
+    {
+        ProfileScope scope("Draw Queue");
+        {
+            ProfileScope sort_scope("Collect and Sort");
+            mObjects.clear();
+            root.collectHierarchy(mObjects, view);
+            std::stable_sort(mObjects.begin(), mObjects.end(),
+                [](const auto &a, const auto &b) {
+                const auto a_first = a.first->affectsOtherDraws();
+                const auto b_first = b.first->affectsOtherDraws();
+                if(a_first != b_first) return a_first;
+                return !a_first && a.first->material() < b.first->material();
+            });
+        }
+
+        // The influences are of enabled lights.
+        std::uint32_t all_lights = 0;
+        if(mLights)
+        {
+            for(auto &&light : *mLights) all_lights |= 1u << light.index;
+        }
+        auto enabled = all_lights;
+        mObjectsLit = mLightsAssigned = 0;
+        // Read once the objects setting state, like lights, are drawn.
+        std::optional<SceneShading> scene;
+        glPushMatrix();
+        for(auto &&[object, modelview] : mObjects)
+        {
+            if(!scene && !object->affectsOtherDraws())
+                scene = currentSceneShading();
+            auto shading = scene;
+            if(mLights && !object->affectsOtherDraws())
+            {
+                // The view is rigid, so the scale is that of the object.
+                const auto scale = std::max({ glm::length(
+                    glm::vec3(modelview[0])), glm::length(
+                    glm::vec3(modelview[1])), glm::length(
+                    glm::vec3(modelview[2])) });
+                const auto lights = assignLights(glm::vec3(modelview[3]),
+                    object->boundingRadius() * scale);
+                switchLights(enabled, lights);
+                enabled = lights;
+                // Lights without an influence stay as they are.
+                shading = scene->withLights(lights | ~all_lights);
+                ++mObjectsLit;
+                for(auto bits = lights; bits; bits &= bits - 1)
+                    ++mLightsAssigned;
+            }
+            // Per object, named by its class
+            ProfileScope object_scope(gProfiler.enabled() ?
+                className(typeid(*object)) : nullptr);
+            glLoadMatrixf(value_ptr(modelview));
+            object->drawInPlace(dt, shading ? &*shading : nullptr);
+        }
+        glPopMatrix();
+        switchLights(enabled, all_lights);
+    }
+
+    std::size_t size() const { return mObjects.size(); }
+    // Lights per object on average in the last draw
+    float lightsPerObject() const
+    {
+        return mObjectsLit ? float(mLightsAssigned) / mObjectsLit : 0;
+    }
+};
+
+inline DrawQueue gDrawQueue;
+
+#include "lab08_shadows.hpp"
+
 /*****************************************************************************/
 // Camera
 /*****************************************************************************/
@@ -679,6 +1602,17 @@ public:
             glVertex3f(0, 0, 1);
         glEnd();
     }
+
+    void rasterize(SoftwareRenderer &renderer) override
+    {
+        for(int axis = 0; axis < 3; ++axis)
+        {
+            SoftwareVertex v[2] = { };
+            v[1].position[axis] = 1;
+            renderer.setColor(axis == 0, axis == 1, axis == 2);
+            renderer.drawLines(v, 2);
+        }
+    }
 };
 
 
@@ -710,6 +1644,11 @@ public:
     void setStep(float step) { mStep = step; }
     void setHeight(float height) { mHeight = height; }
 
+    float boundingRadius() const override
+    {
+        return std::sqrt(2 * mSize * mSize + mHeight * mHeight);
+    }
+
     void draw(float dt) override
     {
         glBegin(GL_LINES);
@@ -728,6 +1667,20 @@ public:
             }
         glEnd();
     }
+
+    void rasterize(SoftwareRenderer &renderer) override
+    {
+        std::vector<SoftwareVertex> v;
+        for(float i = -mSize; i <= mSize; i += mStep)
+        {
+            v.push_back({ { -mSize, mHeight, i }, { 0, 1, 0 }, { 0, 0 } });
+            v.push_back({ { mSize, mHeight, i }, { 0, 1, 0 }, { 0, 0 } });
+            v.push_back({ { i, mHeight, -mSize }, { 0, 1, 0 }, { 0, 0 } });
+            v.push_back({ { i, mHeight, mSize }, { 0, 1, 0 }, { 0, 0 } });
+        }
+        renderer.setColor(0.75f, 0.75f, 0.75f);
+        renderer.drawLines(v.data(), v.size());
+    }
 };
 
 /*****************************************************************************/
@@ -764,6 +1717,11 @@ public:
     void setHalfSize(float half_size) { mHalfSize = half_size; }
     void setAlpha(int alpha) { mAlpha = alpha; }
 
+    float boundingRadius() const override
+    {
+        return mHalfSize * 1.7320508f;
+    }
+
     void draw(float dt) override
     {
         const glm::vec3 v[] = {
@@ -799,6 +1757,39 @@ public:
             QUAD_INDICES(v, 4, 0, 2, 6);
         glEnd();
     }
+
+    // Unlike draw(), the faces get normals so that they can be lit.
+    void rasterize(SoftwareRenderer &renderer) override
+    {
+        const auto h = mHalfSize;
+        const float v[][3] = {
+            { h, h, h }, { h, h, -h }, { h, -h, h }, { h, -h, -h },
+            { -h, h, h }, { -h, h, -h }, { -h, -h, h }, { -h, -h, -h },
+        };
+        auto quad = [&](int a, int b, int c, int d, float nx, float ny,
+            float nz, int red, int green, int blue) {
+            const int corners[] = { a, b, c, d };
+            const float uv[][2] = { { 0, 0 }, { 1, 0 }, { 1, 1 }, { 0, 1 } };
+            SoftwareVertex q[4];
+            for(int i = 0; i < 4; ++i)
+            {
+                q[i] = { { v[corners[i]][0], v[corners[i]][1],
+                    v[corners[i]][2] }, { nx, ny, nz },
+                    { uv[i][0], uv[i][1] } };
+            }
+            const SoftwareVertex triangles[] = {
+                q[0], q[1], q[2], q[0], q[2], q[3] };
+            renderer.setColor(red / 255.f, green / 255.f, blue / 255.f,
+                mAlpha / 255.f);
+            renderer.drawTriangles(triangles, 6);
+        };
+        quad(1, 0, 4, 5, 0, 1, 0, 169, 102, 194);
+        quad(2, 3, 7, 6, 0, -1, 0, 164, 33, 14);
+        quad(5, 4, 6, 7, -1, 0, 0, 228, 69, 147);
+        quad(0, 1, 3, 2, 1, 0, 0, 136, 157, 210);
+        quad(1, 5, 7, 3, 0, 0, -1, 138, 250, 122);
+        quad(4, 0, 2, 6, 0, 0, 1, 1, 37, 146);
+    }
 };
 
 /*****************************************************************************/
@@ -824,11 +1815,25 @@ public:
         gluDeleteQuadric(mQuadric);
     }
 
+    float boundingRadius() const override { return mRadius; }
+
     void draw(float dt) override
     {
         gluSphere(mQuadric, mRadius, 64, 64);
     }
 
+    void rasterize(SoftwareRenderer &renderer) override
+    {
+        // Shared by all spheres and scaled to the radius
+        static std::vector<SoftwareVertex> vertices;
+        static std::vector<std::uint32_t> indices;
+        if(vertices.empty()) buildSoftwareSphere(1, 64, 64, vertices, indices);
+        renderer.setModelView(value_ptr(glm::scale(
+            glm::make_mat4(renderer.modelView()), glm::vec3(mRadius))));
+        renderer.drawIndexed(vertices.data(), vertices.size(),
+            indices.data(), indices.size());
+    }
+
     void emitControlWidgets() override
     {
         Object::emitControlWidgets();
@@ -837,94 +1842,51 @@ public:
     }
 };
 
-void installCallbacks(GLFWwindow *window);
-void initScene();
-void render(float dt);
-void update(GLFWwindow *window, float dt);
-void mainLoop(GLFWwindow *window);
-
-extern int gFramebufferWidth;
-extern int gFramebufferHeight;
-extern const char *gWindowTitle;
-
-void mainLoop(GLFWwindow *window)
-{
-    auto time = glfwGetTime();
-
-    // Loop until the user closes the window
-    while(!glfwWindowShouldClose(window))
-    {
-        const auto new_time = glfwGetTime();
-        // Elapsed time since last frame, in seconds.
-        const auto dt = static_cast<float>(new_time - time);
-        time = new_time;
-
-        ImGui_ImplOpenGL2_NewFrame();
-        ImGui_ImplGlfw_NewFrame();
-        ImGui::NewFrame();
-
-        update(window, dt);
-        // Set up the camera and draw our scene
-        render(dt);
-
-        // Rendering
-        ImGui::Render();
-        glViewport(0, 0, gFramebufferWidth, gFramebufferHeight);
-        ImGui_ImplOpenGL2_RenderDrawData(ImGui::GetDrawData());
-
-        // Swap front and back buffers
-        glfwSwapBuffers(window);
-        // Poll for and process events, this will call into the callbacks
-        // we set before when related events occur.
-        glfwPollEvents();
-    }
-}
+/*****************************************************************************/
+// UploadBudget
+/*****************************************************************************/
 
-int main(void)
+/**
+ * \brief Limits how many bytes are copied to the GPU per frame by objects
+ * which stream their data in, so that large uploads are spread over several
+ * frames instead of stalling one.
+ */
+class UploadBudget
 {
-    GLFWwindow *window = nullptr;
+    std::size_t mBytesPerFrame = 16 << 20;
+    std::size_t mBytesLeft = mBytesPerFrame;
 
-    // Initialize the library
-    if(!glfwInit())
-        return -1;
+public:
+    void setBytesPerFrame(std::size_t bytes) { mBytesPerFrame = bytes; }
+    std::size_t bytesPerFrame() const { return mBytesPerFrame; }
 
-    glfwWindowHint(GLFW_SAMPLES, 4);
+    void beginFrame() { mBytesLeft = mBytesPerFrame; }
 
-    // Create a windowed mode window and its OpenGL context
-    window = glfwCreateWindow(
-        gFramebufferWidth, gFramebufferHeight, gWindowTitle,
-        nullptr, nullptr);
-    // If you cannot create the window, update your graphics driver first!
-    if(!window)
+    // Returns how many of the wanted bytes may be uploaded now.
+    std::size_t acquire(std::size_t wanted)
     {
-        glfwTerminate();
-        return -1;
+        const auto granted = std::min(wanted, mBytesLeft);
+        mBytesLeft -= granted;
+        return granted;
     }
-    // Get the correct size of the framebuffer.
-    glfwGetFramebufferSize(window, &gFramebufferWidth, &gFramebufferHeight);
-
-    glfwMakeContextCurrent(window);
-    // glewInit();
+};
 
-    IMGUI_CHECKVERSION();
-    ImGui::CreateContext();
-    ImGui_ImplGlfw_InitForOpenGL(window, false);
-    ImGui_ImplOpenGL2_Init();
+inline UploadBudget gUploadBudget;
 
-    installCallbacks(window);
+#include "lab08_texture_streaming.hpp"
 
-    // Make the window's context current
-    glfwMakeContextCurrent(window);
-    // Enable vertical sync
-    glfwSwapInterval(1);
+/*****************************************************************************/
+// Mesh
+/*****************************************************************************/
 
-    initScene();
-    mainLoop(window);
+#include "lab08_mesh.hpp"
 
-    ImGui_ImplOpenGL2_Shutdown();
-    ImGui_ImplGlfw_Shutdown();
-    ImGui::DestroyContext();
+void installCallbacks(GLFWwindow *window);
+void initScene();
+void render(float dt);
+void update(GLFWwindow *window, float dt);
+void mainLoop(GLFWwindow *window);
 
-    glfwTerminate();
-    return 0;
-}
+extern int gFramebufferWidth;
+extern int gFramebufferHeight;
+extern const char *gWindowTitle;
@@ -0,0 +1,126 @@
+#pragma once
+
+// Rendering without a window or a display, e.g. with Mesa's llvmpipe in a
+// container. Included by lab08_framework.cpp when CMake finds EGL and
+// defines LAB_HEADLESS_EGL.
+
+#include <EGL/egl.h>
+#include <EGL/eglext.h>
+
+/*****************************************************************************/
+// HeadlessContext
+/*****************************************************************************/
+
+/**
+ * \brief An OpenGL context on a surfaceless EGL display, made current with
+ * a framebuffer object of the given size bound in place of the window.
+ * Passes that bind framebuffers of their own restore the binding they
+ * found, so they draw into it like into a window, and FrameCapture reads
+ * it back.
+ */
+class HeadlessContext
+{
+    EGLDisplay mDisplay = EGL_NO_DISPLAY;
+    EGLContext mContext = EGL_NO_CONTEXT;
+    GLuint mFramebuffer = 0;
+    GLuint mRenderbuffers[2] { };
+
+    static EGLDisplay openDisplay()
+    {
+        // Mesa renders without any window system on this platform.
+        auto get_platform_display = reinterpret_cast<
+            PFNEGLGETPLATFORMDISPLAYEXTPROC>(
+            eglGetProcAddress("eglGetPlatformDisplayEXT"));
+        if(get_platform_display)
+        {
+            auto display = get_platform_display(
+                EGL_PLATFORM_SURFACELESS_MESA, EGL_DEFAULT_DISPLAY, nullptr);
+            if(display != EGL_NO_DISPLAY) return display;
+        }
+        return eglGetDisplay(EGL_DEFAULT_DISPLAY);
+    }
+
+public:
+    HeadlessContext() = default;
+    HeadlessContext(const HeadlessContext &) = delete;
+    HeadlessContext & operator=(const HeadlessContext &) = delete;
+
+    ~HeadlessContext()
+    {
+        if(mContext != EGL_NO_CONTEXT)
+        {
+            glDeleteFramebuffers(1, &mFramebuffer);
+            glDeleteRenderbuffers(2, mRenderbuffers);
+            eglMakeCurrent(mDisplay, EGL_NO_SURFACE, EGL_NO_SURFACE,
+                EGL_NO_CONTEXT);
+            eglDestroyContext(mDisplay, mContext);
+        }
+        if(mDisplay != EGL_NO_DISPLAY) eglTerminate(mDisplay);
+    }
+
+    // Create the context and framebuffer, or tell why not on std::cerr.
+    bool create(int width, int height)
+    {
+        mDisplay = openDisplay();
+        EGLint major, minor;
+        if(mDisplay == EGL_NO_DISPLAY ||
+            !eglInitialize(mDisplay, &major, &minor))
+        {
+            std::cerr << "Cannot initialize an EGL display" << std::endl;
+            return false;
+        }
+        if(!eglBindAPI(EGL_OPENGL_API))
+        {
+            std::cerr << "EGL does not support desktop OpenGL" << std::endl;
+            return false;
+        }
+        // Surfaceless displays only have configs for pbuffers, instead of
+        // the default of windows.
+        const EGLint config_attributes[] = {
+            EGL_SURFACE_TYPE, EGL_PBUFFER_BIT,
+            EGL_RENDERABLE_TYPE, EGL_OPENGL_BIT,
+            EGL_NONE
+        };
+        EGLConfig config;
+        EGLint num_configs = 0;
+        if(!eglChooseConfig(mDisplay, config_attributes, &config, 1,
+            &num_configs) || num_configs == 0)
+        {
+            std::cerr << "No EGL config renders desktop OpenGL" << std::endl;
+            return false;
+        }
+        // The default compatibility profile, for the fixed-function pipeline
+        mContext = eglCreateContext(mDisplay, config, EGL_NO_CONTEXT,
+            nullptr);
+        if(mContext == EGL_NO_CONTEXT || !eglMakeCurrent(mDisplay,
+            EGL_NO_SURFACE, EGL_NO_SURFACE, mContext))
+        {
+            std::cerr << "Cannot make a surfaceless OpenGL context current, "
+                "error 0x" << std::hex << eglGetError() << std::dec
+                << std::endl;
+            return false;
+        }
+
+        glGenRenderbuffers(2, mRenderbuffers);
+        glBindRenderbuffer(GL_RENDERBUFFER, mRenderbuffers[0]);
+        glRenderbufferStorage(GL_RENDERBUFFER, GL_RGBA8, width, height);
+        glBindRenderbuffer(GL_RENDERBUFFER, mRenderbuffers[1]);
+        glRenderbufferStorage(GL_RENDERBUFFER, GL_DEPTH24_STENCIL8, width,
+            height);
+        glBindRenderbuffer(GL_RENDERBUFFER, 0);
+        glGenFramebuffers(1, &mFramebuffer);
+        glBindFramebuffer(GL_FRAMEBUFFER, mFramebuffer);
+        glFramebufferRenderbuffer(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0,
+            GL_RENDERBUFFER, mRenderbuffers[0]);
+        glFramebufferRenderbuffer(GL_FRAMEBUFFER, GL_DEPTH_STENCIL_ATTACHMENT,
+            GL_RENDERBUFFER, mRenderbuffers[1]);
+        if(glCheckFramebufferStatus(GL_FRAMEBUFFER) !=
+            GL_FRAMEBUFFER_COMPLETE)
+        {
+            std::cerr << "Incomplete offscreen framebuffer" << std::endl;
+            return false;
+        }
+        glViewport(0, 0, width, height);
+        return true;
+    }
+};
@@ -0,0 +1,419 @@
+#pragma once
+
+// CPU-side image processing. Independent of OpenGL so that it can be used by
+// the tools and run on worker threads.
+
+#include <cmath>
+#include <cstdint>
+#include <vector>
+
+#include "lab08_thread_pool.hpp"
+
+#if defined(__SSE2__) || defined(_M_X64) || \
+    (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#   include <emmintrin.h>
+#   define LAB_IMAGE_SSE2 1
+#endif
+
+/*****************************************************************************/
+// Image
+/*****************************************************************************/
+
+/**
+ * \brief An 8-bit RGBA image with sRGB encoded color and linear alpha.
+ */
+struct Image
+{
+    int width = 0;
+    int height = 0;
+    std::vector<std::uint8_t> pixels;
+
+    Image() = default;
+    Image(int w, int h)
+        : width(w), height(h), pixels(std::size_t(4) * w * h)
+    {
+    }
+
+    std::size_t bytes() const { return pixels.size(); }
+};
+
+/**
+ * \brief An RGBA image in linear floating point, the working format of the
+ * filters.
+ */
+struct LinearImage
+{
+    int width = 0;
+    int height = 0;
+    std::vector<float> texels;
+
+    LinearImage() = default;
+    LinearImage(int w, int h)
+        : width(w), height(h), texels(std::size_t(4) * w * h)
+    {
+    }
+
+    float * row(int y) { return texels.data() + std::size_t(4) * width * y; }
+    const float * row(int y) const
+    {
+        return texels.data() + std::size_t(4) * width * y;
+    }
+};
+
+// Number of levels of a full mip chain, including the base level.
+inline int mipLevelCount(int width, int height)
+{
+    int levels = 1;
+    while(width > 1 || height > 1)
+    {
+        width = std::max(1, width / 2);
+        height = std::max(1, height / 2);
+        ++levels;
+    }
+    return levels;
+}
+
+/*****************************************************************************/
+// Texel arithmetic
+/*****************************************************************************/
+
+// One RGBA texel, kept in an SSE register where available.
+#ifdef LAB_IMAGE_SSE2
+struct Texel4
+{
+    __m128 v;
+};
+
+inline Texel4 zeroTexel() { return { _mm_setzero_ps() }; }
+inline Texel4 loadTexel(const float *p) { return { _mm_loadu_ps(p) }; }
+inline void storeTexel(float *p, Texel4 t) { _mm_storeu_ps(p, t.v); }
+inline Texel4 operator+(Texel4 a, Texel4 b) { return { _mm_add_ps(a.v, b.v) }; }
+inline Texel4 operator*(Texel4 a, float s)
+{
+    return { _mm_mul_ps(a.v, _mm_set1_ps(s)) };
+}
+#else
+struct Texel4
+{
+    float v[4];
+};
+
+inline Texel4 zeroTexel() { return { 0, 0, 0, 0 }; }
+inline Texel4 loadTexel(const float *p) { return { p[0], p[1], p[2], p[3] }; }
+inline void storeTexel(float *p, Texel4 t)
+{
+    for(int i = 0; i < 4; ++i) p[i] = t.v[i];
+}
+inline Texel4 operator+(Texel4 a, Texel4 b)
+{
+    for(int i = 0; i < 4; ++i) a.v[i] += b.v[i];
+    return a;
+}
+inline Texel4 operator*(Texel4 a, float s)
+{
+    for(int i = 0; i < 4; ++i) a.v[i] *= s;
+    return a;
+}
+#endif
+
+/*****************************************************************************/
+// sRGB conversion
+/*****************************************************************************/
+
+/**
+ * \brief Lookup tables between 8-bit sRGB and linear intensity. Encoding
+ * goes through a table finely spaced enough to round to the nearest sRGB
+ * value everywhere except in the darkest few steps.
+ */
+struct SrgbTables
+{
+    static constexpr int kEncodeSize = 1 << 14;
+
+    float decode[256];
+    std::uint8_t encode[kEncodeSize];
+
+    SrgbTables()
+    {
+        for(int i = 0; i < 256; ++i)
+        {
+            const auto c = i / 255.f;
+            decode[i] = c <= 0.04045f ?
+                c / 12.92f : std::pow((c + 0.055f) / 1.055f, 2.4f);
+        }
+        for(int i = 0; i < kEncodeSize; ++i)
+        {
+            const auto l = static_cast<float>(i) / (kEncodeSize - 1);
+            const auto c = l <= 0.0031308f ?
+                l * 12.92f : 1.055f * std::pow(l, 1 / 2.4f) - 0.055f;
+            encode[i] = static_cast<std::uint8_t>(c * 255 + 0.5f);
+        }
+    }
+};
+
+inline const SrgbTables & srgbTables()
+{
+    static const SrgbTables tables;
+    return tables;
+}
+
+// Grain of the row loops, in texels
+constexpr std::size_t kImageRowGrainTexels = 16 << 10;
+
+inline std::size_t imageRowGrain(int width)
+{
+    return std::max<std::size_t>(1, kImageRowGrainTexels / width);
+}
+
+inline LinearImage decodeSrgb(const std::uint8_t *rgba, int width,
+    int height, ThreadPool &pool)
+{
+    LinearImage out(width, height);
+    const auto &tables = srgbTables();
+    pool.parallelFor(height, imageRowGrain(width),
+        [&](std::size_t begin, std::size_t end) {
+            const auto count = std::size_t(4) * width * (end - begin);
+            const auto *src = rgba + std::size_t(4) * width * begin;
+            auto *dst = out.row(static_cast<int>(begin));
+            for(std::size_t i = 0; i < count; i += 4)
+            {
+                dst[i + 0] = tables.decode[src[i + 0]];
+                dst[i + 1] = tables.decode[src[i + 1]];
+                dst[i + 2] = tables.decode[src[i + 2]];
+                dst[i + 3] = src[i + 3] / 255.f;
+            }
+        });
+    return out;
+}
+
+inline Image encodeSrgb(const LinearImage &image, ThreadPool &pool)
+{
+    Image out(image.width, image.height);
+    const auto &tables = srgbTables();
+    pool.parallelFor(image.height, imageRowGrain(image.width),
+        [&](std::size_t begin, std::size_t end) {
+            const auto count = std::size_t(4) * image.width * (end - begin);
+            const auto *src = image.row(static_cast<int>(begin));
+            auto *dst = out.pixels.data() +
+                std::size_t(4) * image.width * begin;
+#ifdef LAB_IMAGE_SSE2
+            const auto zero = _mm_setzero_ps();
+            const auto one = _mm_set1_ps(1.f);
+            const auto color_scale = _mm_set1_ps(SrgbTables::kEncodeSize - 1.f);
+            const auto alpha_scale = _mm_set1_ps(255.f);
+            alignas(16) std::int32_t color[4], alpha[4];
+            for(std::size_t i = 0; i < count; i += 4)
+            {
+                // Filters with negative lobes overshoot, so clamp first.
+                const auto t = _mm_min_ps(_mm_max_ps(
+                    _mm_loadu_ps(src + i), zero), one);
+                _mm_store_si128(reinterpret_cast<__m128i *>(color),
+                    _mm_cvtps_epi32(_mm_mul_ps(t, color_scale)));
+                _mm_store_si128(reinterpret_cast<__m128i *>(alpha),
+                    _mm_cvtps_epi32(_mm_mul_ps(t, alpha_scale)));
+                dst[i + 0] = tables.encode[color[0]];
+                dst[i + 1] = tables.encode[color[1]];
+                dst[i + 2] = tables.encode[color[2]];
+                dst[i + 3] = static_cast<std::uint8_t>(alpha[3]);
+            }
+#else
+            for(std::size_t i = 0; i < count; i += 4)
+            {
+                for(int c = 0; c < 4; ++c)
+                {
+                    const auto t = std::min(std::max(src[i + c], 0.f), 1.f);
+                    dst[i + c] = c < 3 ?
+                        tables.encode[static_cast<int>(
+                            t * (SrgbTables::kEncodeSize - 1) + 0.5f)] :
+                        static_cast<std::uint8_t>(t * 255 + 0.5f);
+                }
+            }
+#endif
+        });
+    return out;
+}
+
+/*****************************************************************************/
+// Downsampling
+/*****************************************************************************/
+
+enum class MipFilter
+{
+    // Average of 2x2 texels. Fast, slightly blurry.
+    BOX,
+    // Kaiser-windowed sinc over 6x6 texels. Sharper, costs about 3x more.
+    KAISER,
+};
+
+inline const char * mipFilterName(MipFilter filter)
+{
+    switch(filter)
+    {
+        case MipFilter::BOX: return "Box";
+        case MipFilter::KAISER: return "Kaiser";
+        default: return "?";
+    }
+}
+
+/**
+ * \brief Halve the image in both dimensions by averaging 2x2 blocks. Odd
+ * sizes round down like OpenGL does.
+ */
+inline LinearImage downsampleBox(const LinearImage &src, ThreadPool &pool)
+{
+    LinearImage dst(std::max(1, src.width / 2), std::max(1, src.height / 2));
+    pool.parallelFor(dst.height, imageRowGrain(dst.width),
+        [&](std::size_t begin, std::size_t end) {
+            for(auto y = static_cast<int>(begin); y < static_cast<int>(end); ++y)
+            {
+                const auto *row0 = src.row(std::min(2 * y, src.height - 1));
+                const auto *row1 = src.row(std::min(2 * y + 1, src.height - 1));
+                auto *out = dst.row(y);
+                for(int x = 0; x < dst.width; ++x)
+                {
+                    const auto x0 = std::size_t(4) * std::min(2 * x, src.width - 1);
+                    const auto x1 = std::size_t(4) * std::min(2 * x + 1, src.width - 1);
+                    const auto sum =
+                        loadTexel(row0 + x0) + loadTexel(row0 + x1) +
+                        loadTexel(row1 + x0) + loadTexel(row1 + x1);
+                    storeTexel(out + std::size_t(4) * x, sum * 0.25f);
+                }
+            }
+        });
+    return dst;
+}
+
+/**
+ * \brief Weights of the Kaiser filter for a 2:1 reduction. Tap i samples the
+ * source texel at offset i - 2.5 from the center of the destination texel.
+ */
+struct KaiserWeights
+{
+    static constexpr int kTaps = 6;
+    float w[kTaps];
+
+    KaiserWeights()
+    {
+        const double alpha = 4;
+        // Half width of the window in destination texels
+        const double radius = 1.5;
+        const double pi = 3.14159265358979323846;
+        // Zeroth order modified Bessel function of the first kind
+        auto bessel_i0 = [](double x) {
+            double sum = 1, term = 1;
+            for(int k = 1; k < 32; ++k)
+            {
+                term *= (x / (2 * k)) * (x / (2 * k));
+                sum += term;
+            }
+            return sum;
+        };
+        double total = 0;
+        double weights[kTaps];
+        for(int i = 0; i < kTaps; ++i)
+        {
+            // Offset in destination texels
+            const double x = (i - 2.5) / 2;
+            const double sinc = std::sin(pi * x) / (pi * x);
+            const double r = x / radius;
+            const double window = bessel_i0(alpha * std::sqrt(1 - r * r)) /
+                bessel_i0(alpha);
+            weights[i] = sinc * window;
+            total += weights[i];
+        }
+        for(int i = 0; i < kTaps; ++i)
+            w[i] = static_cast<float>(weights[i] / total);
+    }
+};
+
+inline const KaiserWeights & kaiserWeights()
+{
+    static const KaiserWeights weights;
+    return weights;
+}
+
+/**
+ * \brief Halve the image with a separable Kaiser-windowed sinc filter,
+ * clamping at the edges. A dimension of 1 is passed through.
+ */
+inline LinearImage downsampleKaiser(const LinearImage &src, ThreadPool &pool)
+{
+    const auto &k = kaiserWeights();
+    constexpr int taps = KaiserWeights::kTaps;
+
+    // Horizontal pass
+    LinearImage tmp(std::max(1, src.width / 2), src.height);
+    pool.parallelFor(tmp.height, imageRowGrain(tmp.width),
+        [&](std::size_t begin, std::size_t end) {
+            for(auto y = static_cast<int>(begin); y < static_cast<int>(end); ++y)
+            {
+                const auto *in = src.row(y);
+                auto *out = tmp.row(y);
+                if(src.width == 1)
+                {
+                    storeTexel(out, loadTexel(in));
+                    continue;
+                }
+                for(int x = 0; x < tmp.width; ++x)
+                {
+                    auto sum = zeroTexel();
+                    for(int i = 0; i < taps; ++i)
+                    {
+                        const auto sx = std::min(std::max(2 * x - 2 + i, 0),
+                            src.width - 1);
+                        sum = sum + loadTexel(in + std::size_t(4) * sx) * k.w[i];
+                    }
+                    storeTexel(out + std::size_t(4) * x, sum);
+                }
+            }
+        });
+
+    // Vertical pass, combining whole rows
+    LinearImage dst(tmp.width, std::max(1, src.height / 2));
+    pool.parallelFor(dst.height, imageRowGrain(dst.width),
+        [&](std::size_t begin, std::size_t end) {
+            for(auto y = static_cast<int>(begin); y < static_cast<int>(end); ++y)
+            {
+                auto *out = dst.row(y);
+                if(tmp.height == 1)
+                {
+                    std::copy(tmp.row(0), tmp.row(0) + 4 * tmp.width, out);
+                    continue;
+                }
+                const float *rows[taps];
+                for(int i = 0; i < taps; ++i)
+                    rows[i] = tmp.row(std::min(std::max(2 * y - 2 + i, 0),
+                        tmp.height - 1));
+                for(int x = 0; x < dst.width; ++x)
+                {
+                    const auto o = std::size_t(4) * x;
+                    auto sum = loadTexel(rows[0] + o) * k.w[0];
+                    for(int i = 1; i < taps; ++i)
+                        sum = sum + loadTexel(rows[i] + o) * k.w[i];
+                    storeTexel(out + o, sum);
+                }
+            }
+        });
+    return dst;
+}
+
+/**
+ * \brief Build the mip levels below an sRGB RGBA image, from half its size
+ * down to 1x1. Filtering happens in linear space so that the levels keep
+ * the brightness of the base image. Each level is derived from the previous
+ * one at full float precision, with its rows filtered in parallel.
+ */
+inline std::vector<Image> buildMipLevels(const std::uint8_t *rgba,
+    int width, int height, MipFilter filter = MipFilter::BOX,
+    ThreadPool &pool = workerPool())
+{
+    std::vector<Image> levels;
+    levels.reserve(mipLevelCount(width, height) - 1);
+    auto current = decodeSrgb(rgba, width, height, pool);
+    while(current.width > 1 || current.height > 1)
+    {
+        current = filter == MipFilter::KAISER ?
+            downsampleKaiser(current, pool) : downsampleBox(current, pool);
+        levels.push_back(encodeSrgb(current, pool));
+    }
+    return levels;
+}
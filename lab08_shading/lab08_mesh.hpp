@@ -0,0 +1,1417 @@
+#pragma once
+
+// Included by lab08_framework.hpp after the definition of Object.
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <limits>
+#include <string>
+#include <type_traits>
+#include <unordered_map>
+
+#include "../third_party/tiny_obj_loader.h"
+
+#include "lab08_thread_pool.hpp"
+
+/*****************************************************************************/
+// MeshData
+/*****************************************************************************/
+
+struct MeshVertex
+{
+    glm::vec3 position;
+    glm::vec3 normal;
+    glm::vec2 texcoord;
+};
+
+/**
+ * \brief A small group of triangles which is culled as a whole. The bounding
+ * sphere is used for frustum culling and the normal cone for back-face
+ * culling. See "Optimizing the Graphics Pipeline with Compute" (Wihlidal,
+ * GDC 2016) for the idea.
+ */
+struct MeshCluster
+{
+    glm::vec3 center { 0, 0, 0 };
+    float radius = 0;
+    // All triangle normals lie within acos(sqrt(1 - cutoff^2)) of the axis.
+    // A cutoff of 1 disables back-face culling of the cluster.
+    glm::vec3 coneAxis { 0, 0, 1 };
+    float coneCutoff = 1;
+    // The triangles of the cluster are stored contiguously in the index
+    // buffer of the mesh.
+    std::uint32_t indexOffset = 0;
+    std::uint32_t triangleCount = 0;
+};
+
+enum class VertexQuantization
+{
+    NONE,
+    // 16-bit positions, half-float texcoords and octahedral normals with
+    // 8 or 16 bits per component.
+    OCT8,
+    OCT16,
+};
+
+/**
+ * \brief How far the quantized attributes are off from the original ones.
+ */
+struct QuantizationError
+{
+    // In the units of the mesh
+    float maxPosition = 0;
+    float rmsPosition = 0;
+    // In degrees
+    float maxNormal = 0;
+    float meanNormal = 0;
+    float maxTexcoord = 0;
+};
+
+/**
+ * \brief Compact storage of the vertices of a mesh, one array per attribute.
+ * A position is reconstructed as offset + q * scale. The scale is the same
+ * along all axes so that the dequantization can be folded into the model
+ * matrix without distorting the normals.
+ */
+struct QuantizedVertices
+{
+    VertexQuantization format = VertexQuantization::NONE;
+    glm::vec3 offset { 0, 0, 0 };
+    float scale = 1;
+    // 3 per vertex
+    std::vector<std::int16_t> positions;
+    // 2 per vertex, only the one matching the format is used
+    std::vector<std::int8_t> normals8;
+    std::vector<std::int16_t> normals16;
+    // 2 half floats per vertex
+    std::vector<std::uint16_t> texcoords;
+    QuantizationError error;
+
+    std::size_t size() const { return positions.size() / 3; }
+    std::size_t bytes() const
+    {
+        return positions.size() * 2 + normals8.size() +
+            normals16.size() * 2 + texcoords.size() * 2;
+    }
+};
+
+/**
+ * \brief CPU-side geometry of a triangle mesh. Indices are sorted so that
+ * every cluster references a contiguous range of them. After quantization
+ * the vertices live in quantized instead.
+ */
+struct MeshData
+{
+    std::vector<MeshVertex> vertices;
+    QuantizedVertices quantized;
+    std::vector<std::uint32_t> indices;
+    std::vector<MeshCluster> clusters;
+    glm::vec3 boundsMin { 0, 0, 0 };
+    glm::vec3 boundsMax { 0, 0, 0 };
+    // Diffuse map of the first material which has one. Meshes are drawn
+    // with a single texture.
+    std::string diffuseTexture;
+
+    bool isQuantized() const
+    {
+        return quantized.format != VertexQuantization::NONE;
+    }
+    std::size_t vertexCount() const
+    {
+        return isQuantized() ? quantized.size() : vertices.size();
+    }
+    std::size_t triangleCount() const { return indices.size() / 3; }
+};
+
+// The upper end of the 64-128 triangles range keeps the per-cluster
+// overhead of culling small while clusters still fit in a few cache lines.
+constexpr std::uint32_t kMaxClusterTriangles = 124;
+
+// Spreads the lower 10 bits of v so there are two zero bits between each.
+inline std::uint32_t expandBits10(std::uint32_t v)
+{
+    v &= 0x3ff;
+    v = (v | (v << 16)) & 0x030000ff;
+    v = (v | (v << 8)) & 0x0300f00f;
+    v = (v | (v << 4)) & 0x030c30c3;
+    v = (v | (v << 2)) & 0x09249249;
+    return v;
+}
+
+/**
+ * \brief Partition the triangles of the mesh into clusters of at most
+ * kMaxClusterTriangles triangles and compute their bounds.
+ *
+ * Triangles are first bucketed by the dominant axis of their normal, which
+ * keeps the normal cones of a cluster below ~55 degrees, then sorted along a
+ * Morton curve through their centroids so that a cluster covers a compact
+ * region of the surface.
+ */
+inline void buildMeshClusters(MeshData &mesh)
+{
+    const auto num_triangles = mesh.triangleCount();
+    mesh.clusters.clear();
+    if(num_triangles == 0) return;
+
+    auto &&v = mesh.vertices;
+    auto &&idx = mesh.indices;
+
+    mesh.boundsMin = mesh.boundsMax = v[idx[0]].position;
+    for(auto &&i : idx)
+    {
+        mesh.boundsMin = min(mesh.boundsMin, v[i].position);
+        mesh.boundsMax = max(mesh.boundsMax, v[i].position);
+    }
+    const auto extent = max(mesh.boundsMax - mesh.boundsMin, glm::vec3(1e-6f));
+
+    std::vector<std::pair<std::uint64_t, std::uint32_t>> keys(num_triangles);
+    workerPool().parallelFor(num_triangles, 4096,
+        [&](std::size_t begin, std::size_t end) {
+        for(auto t = begin; t < end; ++t)
+        {
+            const auto &a = v[idx[t * 3 + 0]].position;
+            const auto &b = v[idx[t * 3 + 1]].position;
+            const auto &c = v[idx[t * 3 + 2]].position;
+            const auto n = cross(b - a, c - a);
+            const auto an = abs(n);
+            int axis = an.x > an.y ? (an.x > an.z ? 0 : 2) : (an.y > an.z ? 1 : 2);
+            const std::uint64_t bucket = axis * 2 + (n[axis] < 0 ? 1 : 0);
+
+            const auto p = ((a + b + c) / 3.f - mesh.boundsMin) / extent * 1023.f;
+            const auto morton =
+                expandBits10(static_cast<std::uint32_t>(p.x)) << 2 |
+                expandBits10(static_cast<std::uint32_t>(p.y)) << 1 |
+                expandBits10(static_cast<std::uint32_t>(p.z));
+            keys[t] = { bucket << 32 | morton, static_cast<std::uint32_t>(t) };
+        }
+    });
+    std::sort(keys.begin(), keys.end());
+
+    // Reorder the index buffer and cut it into clusters. A cluster never
+    // spans two normal buckets.
+    std::vector<std::uint32_t> sorted(idx.size());
+    std::vector<std::pair<std::uint32_t, std::uint32_t>> ranges;
+    for(std::uint32_t t = 0; t < num_triangles; ++t)
+    {
+        const auto src = keys[t].second * 3;
+        sorted[t * 3 + 0] = idx[src + 0];
+        sorted[t * 3 + 1] = idx[src + 1];
+        sorted[t * 3 + 2] = idx[src + 2];
+        const bool new_bucket = t == 0 ||
+            (keys[t].first >> 32) != (keys[t - 1].first >> 32);
+        if(new_bucket || ranges.back().second == kMaxClusterTriangles)
+            ranges.emplace_back(t, 0);
+        ++ranges.back().second;
+    }
+    idx.swap(sorted);
+
+    mesh.clusters.resize(ranges.size());
+    workerPool().parallelFor(ranges.size(), 256,
+        [&](std::size_t begin, std::size_t end) {
+        for(auto c = begin; c < end; ++c)
+        {
+            auto &&cluster = mesh.clusters[c];
+            cluster.indexOffset = ranges[c].first * 3;
+            cluster.triangleCount = ranges[c].second;
+            const auto *tri = &idx[cluster.indexOffset];
+            const auto count = cluster.triangleCount * 3;
+
+            // Bounding sphere around the center of the AABB.
+            auto lo = v[tri[0]].position, hi = lo;
+            for(std::uint32_t i = 1; i < count; ++i)
+            {
+                lo = min(lo, v[tri[i]].position);
+                hi = max(hi, v[tri[i]].position);
+            }
+            cluster.center = (lo + hi) * 0.5f;
+            cluster.radius = 0;
+            for(std::uint32_t i = 0; i < count; ++i)
+            {
+                cluster.radius = std::max(cluster.radius,
+                    distance(cluster.center, v[tri[i]].position));
+            }
+
+            // Normal cone around the average face normal.
+            glm::vec3 axis { 0, 0, 0 };
+            for(std::uint32_t i = 0; i < count; i += 3)
+            {
+                const auto n = cross(
+                    v[tri[i + 1]].position - v[tri[i]].position,
+                    v[tri[i + 2]].position - v[tri[i]].position);
+                const auto len = length(n);
+                if(len > 0) axis += n / len;
+            }
+            const auto axis_len = length(axis);
+            cluster.coneAxis = axis_len > 0 ? axis / axis_len : glm::vec3(0, 0, 1);
+            float min_dot = 1;
+            for(std::uint32_t i = 0; i < count; i += 3)
+            {
+                const auto n = cross(
+                    v[tri[i + 1]].position - v[tri[i]].position,
+                    v[tri[i + 2]].position - v[tri[i]].position);
+                const auto len = length(n);
+                if(len > 0)
+                    min_dot = std::min(min_dot, dot(n / len, cluster.coneAxis));
+            }
+            // Wide cones almost never pass the test, don't bother.
+            cluster.coneCutoff = min_dot <= 0.1f ?
+                1 : std::sqrt(1 - min_dot * min_dot);
+        }
+    });
+}
+
+/*****************************************************************************/
+// Vertex Quantization
+/*****************************************************************************/
+
+inline std::uint16_t floatToHalf(float value)
+{
+    std::uint32_t x;
+    std::memcpy(&x, &value, sizeof(x));
+    const std::uint32_t sign = (x >> 16) & 0x8000;
+    const std::uint32_t bits = (x >> 23) & 0xff;
+    std::uint32_t mantissa = x & 0x7fffff;
+    const int exponent = static_cast<int>(bits) - 127 + 15;
+
+    if(bits == 0xff) // inf or nan
+        return static_cast<std::uint16_t>(sign | 0x7c00 | (mantissa ? 0x200 : 0));
+    if(exponent >= 31) // too large, becomes inf
+        return static_cast<std::uint16_t>(sign | 0x7c00);
+    if(exponent <= 0) // denormal or zero
+    {
+        if(exponent < -10) return static_cast<std::uint16_t>(sign);
+        mantissa |= 0x800000;
+        const auto shift = static_cast<std::uint32_t>(14 - exponent);
+        auto half = mantissa >> shift;
+        if((mantissa >> (shift - 1)) & 1) ++half;
+        return static_cast<std::uint16_t>(sign | half);
+    }
+    // Rounding may carry into the exponent, which is still correct.
+    auto half = sign | static_cast<std::uint32_t>(exponent) << 10 | mantissa >> 13;
+    if(mantissa & 0x1000) ++half;
+    return static_cast<std::uint16_t>(half);
+}
+
+inline float halfToFloat(std::uint16_t half)
+{
+    const std::uint32_t sign = (half & 0x8000u) << 16;
+    std::uint32_t exponent = (half >> 10) & 0x1f;
+    std::uint32_t mantissa = half & 0x3ff;
+    std::uint32_t x;
+    if(exponent == 0x1f)
+    {
+        x = sign | 0x7f800000 | mantissa << 13;
+    }
+    else if(exponent == 0)
+    {
+        if(mantissa == 0)
+        {
+            x = sign;
+        }
+        else
+        {
+            // Normalize the denormal
+            exponent = 127 - 15 + 1;
+            while(!(mantissa & 0x400))
+            {
+                mantissa <<= 1;
+                --exponent;
+            }
+            x = sign | exponent << 23 | (mantissa & 0x3ff) << 13;
+        }
+    }
+    else
+    {
+        x = sign | (exponent + 127 - 15) << 23 | mantissa << 13;
+    }
+    float value;
+    std::memcpy(&value, &x, sizeof(value));
+    return value;
+}
+
+inline float signNotZero(float v) { return v < 0 ? -1.f : 1.f; }
+
+/**
+ * \brief Map a unit vector onto the [-1, 1]^2 square by projecting it on an
+ * octahedron and unfolding the lower half. See "A Survey of Efficient
+ * Representations for Independent Unit Vectors" (Cigolle et al., JCGT 2014).
+ */
+inline glm::vec2 octahedralEncode(glm::vec3 n)
+{
+    n /= std::abs(n.x) + std::abs(n.y) + std::abs(n.z);
+    if(n.z >= 0) return { n.x, n.y };
+    return {
+        (1 - std::abs(n.y)) * signNotZero(n.x),
+        (1 - std::abs(n.x)) * signNotZero(n.y)
+    };
+}
+
+inline glm::vec3 octahedralDecode(glm::vec2 e)
+{
+    glm::vec3 n { e.x, e.y, 1 - std::abs(e.x) - std::abs(e.y) };
+    if(n.z < 0)
+    {
+        n.x = (1 - std::abs(e.y)) * signNotZero(e.x);
+        n.y = (1 - std::abs(e.x)) * signNotZero(e.y);
+    }
+    return normalize(n);
+}
+
+template <typename T>
+T toSnorm(float v)
+{
+    constexpr auto range = static_cast<float>(std::numeric_limits<T>::max());
+    return static_cast<T>(std::round(glm::clamp(v, -1.f, 1.f) * range));
+}
+
+template <typename T>
+float fromSnorm(T v)
+{
+    constexpr auto range = static_cast<float>(std::numeric_limits<T>::max());
+    return std::max(v / range, -1.f);
+}
+
+/**
+ * \brief Vertex layout uploaded for quantized meshes. The fixed-function
+ * pipeline cannot unpack octahedral normals, so they are expanded to signed
+ * normalized XYZ while uploading. T is std::int8_t or std::int16_t.
+ * TexCoord is std::uint16_t for half floats, or float for contexts which
+ * cannot read half float vertices.
+ */
+template <typename T, typename TexCoord = std::uint16_t>
+struct PackedVertex
+{
+    std::int16_t position[4];
+    T normal[4];
+    TexCoord texcoord[2];
+};
+
+/**
+ * \brief Whether vertex arrays can be GL_HALF_FLOAT. The first call must be
+ * made on the render thread.
+ */
+inline bool halfFloatVerticesSupported()
+{
+    static const bool supported = [] {
+        // Core since OpenGL 3.0. Older contexts leave the version at 0.
+        GLint major = 0;
+        glGetIntegerv(GL_MAJOR_VERSION, &major);
+        return major >= 3 || hasGLExtension("GL_ARB_half_float_vertex");
+    }();
+    return supported;
+}
+
+template <typename T, typename TexCoord>
+void unpackQuantizedVertices(const QuantizedVertices &q,
+    std::size_t first, std::size_t count, PackedVertex<T, TexCoord> *out)
+{
+    for(std::size_t i = 0; i < count; ++i)
+    {
+        const auto v = first + i;
+        auto &&o = out[i];
+        o.position[0] = q.positions[v * 3 + 0];
+        o.position[1] = q.positions[v * 3 + 1];
+        o.position[2] = q.positions[v * 3 + 2];
+        o.position[3] = 1;
+        glm::vec2 e;
+        if(q.format == VertexQuantization::OCT8)
+            e = { fromSnorm(q.normals8[v * 2]), fromSnorm(q.normals8[v * 2 + 1]) };
+        else
+            e = { fromSnorm(q.normals16[v * 2]), fromSnorm(q.normals16[v * 2 + 1]) };
+        const auto n = octahedralDecode(e);
+        o.normal[0] = toSnorm<T>(n.x);
+        o.normal[1] = toSnorm<T>(n.y);
+        o.normal[2] = toSnorm<T>(n.z);
+        o.normal[3] = 0;
+        if constexpr(std::is_same_v<TexCoord, float>)
+        {
+            o.texcoord[0] = halfToFloat(q.texcoords[v * 2 + 0]);
+            o.texcoord[1] = halfToFloat(q.texcoords[v * 2 + 1]);
+        }
+        else
+        {
+            o.texcoord[0] = q.texcoords[v * 2 + 0];
+            o.texcoord[1] = q.texcoords[v * 2 + 1];
+        }
+    }
+}
+
+inline std::size_t packedVertexSize(VertexQuantization format,
+    bool half_texcoords = true)
+{
+    switch(format)
+    {
+        case VertexQuantization::OCT8:
+            return half_texcoords ? sizeof(PackedVertex<std::int8_t>) :
+                sizeof(PackedVertex<std::int8_t, float>);
+        case VertexQuantization::OCT16:
+            return half_texcoords ? sizeof(PackedVertex<std::int16_t>) :
+                sizeof(PackedVertex<std::int16_t, float>);
+        default: return sizeof(MeshVertex);
+    }
+}
+
+/**
+ * \brief Quantize the vertices of the mesh in place, replacing the float
+ * vertices, and measure the error against the values the GPU will see.
+ * Clusters must already be built since they keep referring to the original
+ * coordinate system.
+ */
+inline void quantizeMeshData(MeshData &mesh, VertexQuantization format)
+{
+    if(format == VertexQuantization::NONE || mesh.isQuantized()) return;
+
+    auto &&src = mesh.vertices;
+    const auto n = src.size();
+    auto &&q = mesh.quantized;
+    q = QuantizedVertices();
+    q.format = format;
+    q.positions.resize(n * 3);
+    q.texcoords.resize(n * 2);
+    if(format == VertexQuantization::OCT8)
+        q.normals8.resize(n * 2);
+    else
+        q.normals16.resize(n * 2);
+
+    glm::vec3 lo { 0, 0, 0 }, hi { 0, 0, 0 };
+    if(n)
+    {
+        lo = hi = src[0].position;
+        for(auto &&v : src)
+        {
+            lo = min(lo, v.position);
+            hi = max(hi, v.position);
+        }
+    }
+    q.offset = (lo + hi) * 0.5f;
+    const auto half_extent = (hi - lo) * 0.5f;
+    q.scale = std::max(std::max(half_extent.x, half_extent.y),
+        std::max(half_extent.z, 1e-20f)) / 32767;
+
+    // Per-range error sums, reduced after the parallel loop.
+    struct ErrorSums
+    {
+        double position2 = 0, normal = 0;
+        float maxPosition = 0, maxNormal = 0, maxTexcoord = 0;
+    };
+    constexpr std::size_t grain = 16384;
+    std::vector<ErrorSums> sums((n + grain - 1) / grain);
+
+    workerPool().parallelFor(n, grain, [&](std::size_t begin, std::size_t end) {
+        auto &&e = sums[begin / grain];
+        for(auto i = begin; i < end; ++i)
+        {
+            auto &&v = src[i];
+            const auto p = round((v.position - q.offset) / q.scale);
+            for(int c = 0; c < 3; ++c)
+            {
+                q.positions[i * 3 + c] = static_cast<std::int16_t>(
+                    glm::clamp(p[c], -32767.f, 32767.f));
+            }
+            const auto len = length(v.normal);
+            const auto oct = octahedralEncode(
+                len > 0 ? v.normal / len : glm::vec3(0, 0, 1));
+            if(format == VertexQuantization::OCT8)
+            {
+                q.normals8[i * 2 + 0] = toSnorm<std::int8_t>(oct.x);
+                q.normals8[i * 2 + 1] = toSnorm<std::int8_t>(oct.y);
+            }
+            else
+            {
+                q.normals16[i * 2 + 0] = toSnorm<std::int16_t>(oct.x);
+                q.normals16[i * 2 + 1] = toSnorm<std::int16_t>(oct.y);
+            }
+            q.texcoords[i * 2 + 0] = floatToHalf(v.texcoord.x);
+            q.texcoords[i * 2 + 1] = floatToHalf(v.texcoord.y);
+
+            // Compare against what the vertex will look like on the GPU.
+            glm::vec3 position, normal;
+            glm::vec2 texcoord;
+            if(format == VertexQuantization::OCT8)
+            {
+                PackedVertex<std::int8_t> packed;
+                unpackQuantizedVertices(q, i, 1, &packed);
+                position = q.offset + q.scale * glm::vec3(packed.position[0],
+                    packed.position[1], packed.position[2]);
+                normal = normalize(glm::vec3(fromSnorm(packed.normal[0]),
+                    fromSnorm(packed.normal[1]), fromSnorm(packed.normal[2])));
+            }
+            else
+            {
+                PackedVertex<std::int16_t> packed;
+                unpackQuantizedVertices(q, i, 1, &packed);
+                position = q.offset + q.scale * glm::vec3(packed.position[0],
+                    packed.position[1], packed.position[2]);
+                normal = normalize(glm::vec3(fromSnorm(packed.normal[0]),
+                    fromSnorm(packed.normal[1]), fromSnorm(packed.normal[2])));
+            }
+            texcoord = { halfToFloat(q.texcoords[i * 2]),
+                halfToFloat(q.texcoords[i * 2 + 1]) };
+
+            const auto dp = distance(position, v.position);
+            e.position2 += dp * dp;
+            e.maxPosition = std::max(e.maxPosition, dp);
+            if(len > 0)
+            {
+                const auto angle = glm::degrees(std::acos(
+                    glm::clamp(dot(normal, v.normal / len), -1.f, 1.f)));
+                e.normal += angle;
+                e.maxNormal = std::max(e.maxNormal, angle);
+            }
+            const auto dt = abs(texcoord - v.texcoord);
+            e.maxTexcoord = std::max(e.maxTexcoord, std::max(dt.x, dt.y));
+        }
+    });
+
+    ErrorSums total;
+    for(auto &&e : sums)
+    {
+        total.position2 += e.position2;
+        total.normal += e.normal;
+        total.maxPosition = std::max(total.maxPosition, e.maxPosition);
+        total.maxNormal = std::max(total.maxNormal, e.maxNormal);
+        total.maxTexcoord = std::max(total.maxTexcoord, e.maxTexcoord);
+    }
+    q.error.maxPosition = total.maxPosition;
+    q.error.maxNormal = total.maxNormal;
+    q.error.maxTexcoord = total.maxTexcoord;
+    if(n)
+    {
+        q.error.rmsPosition = static_cast<float>(std::sqrt(total.position2 / n));
+        q.error.meanNormal = static_cast<float>(total.normal / n);
+    }
+
+    std::vector<MeshVertex>().swap(src);
+}
+
+/**
+ * \brief Convert parsed OBJ data into an indexed triangle mesh. Vertices are
+ * deduplicated by their position/normal/texcoord index triple. Missing
+ * normals are computed from the faces.
+ */
+inline void buildMeshDataFromObj(const tinyobj::attrib_t &attrib,
+    const std::vector<tinyobj::shape_t> &shapes, MeshData &mesh)
+{
+    struct IndexHash
+    {
+        std::size_t operator()(const tinyobj::index_t &i) const
+        {
+            return (std::size_t(i.vertex_index) * 73856093) ^
+                (std::size_t(i.normal_index) * 19349663) ^
+                (std::size_t(i.texcoord_index) * 83492791);
+        }
+    };
+    struct IndexEqual
+    {
+        bool operator()(const tinyobj::index_t &a, const tinyobj::index_t &b) const
+        {
+            return a.vertex_index == b.vertex_index &&
+                a.normal_index == b.normal_index &&
+                a.texcoord_index == b.texcoord_index;
+        }
+    };
+    std::unordered_map<tinyobj::index_t, std::uint32_t, IndexHash, IndexEqual>
+        unique_vertices;
+
+    mesh = MeshData();
+    bool missing_normals = false;
+    for(auto &&shape : shapes)
+    {
+        for(auto &&index : shape.mesh.indices)
+        {
+            auto iter = unique_vertices.find(index);
+            if(iter == unique_vertices.end())
+            {
+                MeshVertex vertex { };
+                const auto vi = 3 * index.vertex_index;
+                vertex.position = {
+                    attrib.vertices[vi + 0],
+                    attrib.vertices[vi + 1],
+                    attrib.vertices[vi + 2]
+                };
+                if(index.normal_index >= 0)
+                {
+                    const auto ni = 3 * index.normal_index;
+                    vertex.normal = {
+                        attrib.normals[ni + 0],
+                        attrib.normals[ni + 1],
+                        attrib.normals[ni + 2]
+                    };
+                }
+                else
+                {
+                    missing_normals = true;
+                }
+                if(index.texcoord_index >= 0)
+                {
+                    const auto ti = 2 * index.texcoord_index;
+                    vertex.texcoord = {
+                        attrib.texcoords[ti + 0],
+                        attrib.texcoords[ti + 1]
+                    };
+                }
+                iter = unique_vertices.emplace(index,
+                    static_cast<std::uint32_t>(mesh.vertices.size())).first;
+                mesh.vertices.push_back(vertex);
+            }
+            mesh.indices.push_back(iter->second);
+        }
+    }
+
+    if(missing_normals)
+    {
+        for(auto &&vertex : mesh.vertices)
+            vertex.normal = { 0, 0, 0 };
+        for(std::size_t i = 0; i + 2 < mesh.indices.size(); i += 3)
+        {
+            auto &&a = mesh.vertices[mesh.indices[i + 0]];
+            auto &&b = mesh.vertices[mesh.indices[i + 1]];
+            auto &&c = mesh.vertices[mesh.indices[i + 2]];
+            // Area weighted face normal
+            const auto n = cross(
+                b.position - a.position, c.position - a.position);
+            a.normal += n;
+            b.normal += n;
+            c.normal += n;
+        }
+        for(auto &&vertex : mesh.vertices)
+        {
+            const auto len = length(vertex.normal);
+            vertex.normal = len > 0 ? vertex.normal / len : glm::vec3(0, 1, 0);
+        }
+    }
+
+    buildMeshClusters(mesh);
+}
+
+// Directory part of a path including the trailing separator, used to find
+// the .mtl files referenced by an OBJ.
+inline std::string parentDirectory(const std::string &path)
+{
+    const auto slash = path.find_last_of("/\\");
+    return slash == std::string::npos ? "" : path.substr(0, slash + 1);
+}
+
+inline std::string findDiffuseTexture(
+    const std::vector<tinyobj::material_t> &materials,
+    const std::string &base_dir)
+{
+    for(auto &&m : materials)
+    {
+        if(!m.diffuse_texname.empty())
+            return base_dir + m.diffuse_texname;
+    }
+    return { };
+}
+
+/**
+ * \brief Load a triangulated OBJ file. Returns false and fills error on
+ * failure.
+ */
+inline bool loadObjMeshData(const char *path, MeshData &mesh, std::string &error)
+{
+    tinyobj::attrib_t attrib;
+    std::vector<tinyobj::shape_t> shapes;
+    std::vector<tinyobj::material_t> materials;
+    std::string warn;
+
+    if(!tinyobj::LoadObj(&attrib, &shapes, &materials, &warn, &error, path,
+        parentDirectory(path).c_str()))
+        return false;
+
+    buildMeshDataFromObj(attrib, shapes, mesh);
+    mesh.diffuseTexture = findDiffuseTexture(materials, parentDirectory(path));
+    return true;
+}
+
+/*****************************************************************************/
+// MeshImportJob
+/*****************************************************************************/
+
+/**
+ * \brief Progress and result of an OBJ import running on the worker pool.
+ * The render thread polls the stage; data and error may only be touched
+ * once the stage has left READING/PARSING.
+ */
+struct MeshImportJob
+{
+    enum Stage
+    {
+        READING,
+        PARSING,
+        DONE,
+        FAILED,
+    };
+
+    std::string path;
+    std::atomic<int> stage { READING };
+    std::atomic<std::uint64_t> bytesRead { 0 };
+    std::atomic<std::uint64_t> fileSize { 0 };
+    MeshData data;
+    std::string error;
+
+    float readProgress() const
+    {
+        const auto size = fileSize.load();
+        return size ? static_cast<float>(bytesRead.load()) / size : 0.f;
+    }
+};
+
+/**
+ * \brief Read and parse an OBJ file on the worker pool. The file is read in
+ * chunks so the progress can be displayed, then parsed directly from memory.
+ */
+inline std::shared_ptr<MeshImportJob> importObjAsync(std::string path,
+    VertexQuantization quantization = VertexQuantization::NONE)
+{
+    auto job = std::make_shared<MeshImportJob>();
+    job->path = std::move(path);
+
+    workerPool().post([job, quantization]() {
+        auto fail = [&](std::string error) {
+            job->error = std::move(error);
+            job->stage = MeshImportJob::FAILED;
+        };
+
+        std::ifstream file(job->path, std::ios::binary | std::ios::ate);
+        if(!file) return fail("Cannot open file.");
+        const auto size = static_cast<std::uint64_t>(file.tellg());
+        file.seekg(0);
+        job->fileSize = size;
+
+        std::vector<char> buffer(size);
+        constexpr std::uint64_t chunk = 4 << 20;
+        for(std::uint64_t offset = 0; offset < size; offset += chunk)
+        {
+            const auto n = std::min(chunk, size - offset);
+            if(!file.read(buffer.data() + offset, n))
+                return fail("Read error.");
+            job->bytesRead = offset + n;
+        }
+        file.close();
+
+        job->stage = MeshImportJob::PARSING;
+
+        // Lets tinyobj read from the buffer without copying it into a
+        // stringstream first.
+        struct MemoryBuffer : std::streambuf
+        {
+            MemoryBuffer(char *begin, char *end) { setg(begin, begin, end); }
+        } memory(buffer.data(), buffer.data() + buffer.size());
+        std::istream stream(&memory);
+
+        tinyobj::attrib_t attrib;
+        std::vector<tinyobj::shape_t> shapes;
+        std::vector<tinyobj::material_t> materials;
+        std::string warn, error;
+        tinyobj::MaterialFileReader mtl_reader(parentDirectory(job->path));
+        if(!tinyobj::LoadObj(&attrib, &shapes, &materials, &warn, &error,
+            &stream, &mtl_reader))
+            return fail(error);
+        // The text is no longer needed, release it before building the mesh.
+        std::vector<char>().swap(buffer);
+
+        buildMeshDataFromObj(attrib, shapes, job->data);
+        job->data.diffuseTexture =
+            findDiffuseTexture(materials, parentDirectory(job->path));
+        quantizeMeshData(job->data, quantization);
+        job->stage = MeshImportJob::DONE;
+    });
+
+    return job;
+}
+
+/*****************************************************************************/
+// Mesh
+/*****************************************************************************/
+
+/**
+ * \brief A triangle mesh drawn from a vertex buffer. Before each draw the
+ * clusters outside the view frustum or facing away from the camera are
+ * removed and the indices of the remaining ones are compacted into a
+ * per-frame index list.
+ *
+ * The vertex buffer is filled progressively within the per-frame upload
+ * budget, and a mesh can be imported in the background with
+ * loadFromObjAsync(). Until the geometry is ready its bounding box (or a
+ * unit box when the bounds are not known yet) is drawn instead.
+ */
+class Mesh : public Object
+{
+protected:
+    MeshData mData;
+
+    std::shared_ptr<MeshImportJob> mImport;
+    std::string mImportPath;
+    std::string mError;
+
+    GLuint mVertexBuffer = 0;
+    // Bytes of the vertex buffer already filled.
+    std::size_t mUploadedBytes = 0;
+    // Quantized vertices are unpacked here before being uploaded.
+    std::vector<char> mStaging;
+    // Float vertices for SoftwareRenderer, converted on first use
+    std::vector<SoftwareVertex> mRasterVertices;
+
+    // Per-frame culling results. These are kept around to avoid allocating
+    // every frame.
+    std::vector<std::uint8_t> mClusterVisible;
+    std::vector<std::uint32_t> mClusterDest;
+    std::vector<std::uint32_t> mVisibleIndices;
+
+    bool mClusterCulling = true;
+    bool mFrustumCulling = true;
+    bool mBackfaceCulling = true;
+
+    // Triangle counters of the last frame.
+    std::size_t mTrianglesSubmitted = 0;
+    std::size_t mTrianglesFrustumCulled = 0;
+    std::size_t mTrianglesBackfaceCulled = 0;
+
+    enum : std::uint8_t
+    {
+        CLUSTER_VISIBLE = 0,
+        CLUSTER_OUTSIDE_FRUSTUM,
+        CLUSTER_BACK_FACING,
+    };
+
+    /**
+     * \brief Classify every cluster against the frustum planes and the
+     * camera position given in the local coordinate system of the mesh,
+     * then gather the indices of the visible ones. Both passes run on the
+     * worker pool.
+     */
+    void cullClusters(const glm::vec4 (&planes)[6], const glm::vec3 &eye,
+        bool cone_test)
+    {
+        const auto num_clusters = mData.clusters.size();
+        mClusterVisible.resize(num_clusters);
+        mClusterDest.resize(num_clusters);
+
+        workerPool().parallelFor(num_clusters, 256,
+            [&](std::size_t begin, std::size_t end) {
+            for(auto c = begin; c < end; ++c)
+            {
+                auto &&cluster = mData.clusters[c];
+                auto result = CLUSTER_VISIBLE;
+                if(mFrustumCulling)
+                {
+                    for(auto &&p : planes)
+                    {
+                        if(dot(glm::vec3(p), cluster.center) + p.w <
+                            -cluster.radius)
+                        {
+                            result = CLUSTER_OUTSIDE_FRUSTUM;
+                            break;
+                        }
+                    }
+                }
+                if(result == CLUSTER_VISIBLE && cone_test)
+                {
+                    const auto to_center = cluster.center - eye;
+                    if(dot(to_center, cluster.coneAxis) >=
+                        cluster.coneCutoff * length(to_center) + cluster.radius)
+                        result = CLUSTER_BACK_FACING;
+                }
+                mClusterVisible[c] = result;
+            }
+        });
+
+        // Prefix sum giving the output position of each visible cluster.
+        std::uint32_t total = 0;
+        mTrianglesFrustumCulled = mTrianglesBackfaceCulled = 0;
+        for(std::size_t c = 0; c < num_clusters; ++c)
+        {
+            const auto tris = mData.clusters[c].triangleCount;
+            mClusterDest[c] = total;
+            switch(mClusterVisible[c])
+            {
+                case CLUSTER_VISIBLE: total += tris * 3; break;
+                case CLUSTER_OUTSIDE_FRUSTUM: mTrianglesFrustumCulled += tris; break;
+                case CLUSTER_BACK_FACING: mTrianglesBackfaceCulled += tris; break;
+                default: ;
+            }
+        }
+        mTrianglesSubmitted = total / 3;
+
+        mVisibleIndices.resize(total);
+        workerPool().parallelFor(num_clusters, 256,
+            [&](std::size_t begin, std::size_t end) {
+            for(auto c = begin; c < end; ++c)
+            {
+                if(mClusterVisible[c] != CLUSTER_VISIBLE) continue;
+                auto &&cluster = mData.clusters[c];
+                std::copy_n(mData.indices.begin() + cluster.indexOffset,
+                    cluster.triangleCount * 3,
+                    mVisibleIndices.begin() + mClusterDest[c]);
+            }
+        });
+    }
+
+    /**
+     * \brief Extract the frustum planes and the eye position in the local
+     * coordinate system from the current OpenGL matrices and cull.
+     * Returns the index list to draw.
+     */
+    const std::vector<std::uint32_t> & visibleIndices()
+    {
+        if(!mClusterCulling || mData.clusters.empty())
+        {
+            mTrianglesSubmitted = mData.triangleCount();
+            mTrianglesFrustumCulled = mTrianglesBackfaceCulled = 0;
+            return mData.indices;
+        }
+
+        glm::mat4 modelview, projection;
+        glGetFloatv(GL_MODELVIEW_MATRIX, value_ptr(modelview));
+        glGetFloatv(GL_PROJECTION_MATRIX, value_ptr(projection));
+
+        // Gribb & Hartmann: the planes are sums/differences of the rows of
+        // the local-to-clip matrix.
+        const auto m = projection * modelview;
+        glm::vec4 rows[4];
+        for(int i = 0; i < 4; ++i)
+            rows[i] = { m[0][i], m[1][i], m[2][i], m[3][i] };
+        glm::vec4 planes[6] = {
+            rows[3] + rows[0], rows[3] - rows[0],
+            rows[3] + rows[1], rows[3] - rows[1],
+            rows[3] + rows[2], rows[3] - rows[2],
+        };
+        for(auto &&p : planes)
+            p /= length(glm::vec3(p));
+
+        const auto eye = glm::vec3(inverse(modelview) * glm::vec4(0, 0, 0, 1));
+
+        // The normal cones are only preserved by similarity transforms.
+        const auto sx = length(glm::vec3(modelview[0]));
+        const auto sy = length(glm::vec3(modelview[1]));
+        const auto sz = length(glm::vec3(modelview[2]));
+        const bool uniform_scale =
+            std::abs(sx - sy) < 1e-3f * sx && std::abs(sx - sz) < 1e-3f * sx;
+
+        cullClusters(planes, eye, mBackfaceCulling && uniform_scale);
+        return mVisibleIndices;
+    }
+
+    std::size_t vertexSize() const
+    {
+        return mData.isQuantized() ?
+            packedVertexSize(mData.quantized.format,
+            halfFloatVerticesSupported()) : sizeof(MeshVertex);
+    }
+
+    // Into mStaging, with float texcoords if half floats cannot be drawn
+    template <typename T>
+    void unpackForUpload(std::size_t first, std::size_t count)
+    {
+        if(halfFloatVerticesSupported())
+        {
+            unpackQuantizedVertices(mData.quantized, first, count,
+                reinterpret_cast<PackedVertex<T> *>(mStaging.data()));
+        }
+        else
+        {
+            unpackQuantizedVertices(mData.quantized, first, count,
+                reinterpret_cast<PackedVertex<T, float> *>(mStaging.data()));
+        }
+    }
+
+    // Size of the vertex buffer
+    std::size_t vertexBytes() const
+    {
+        return mData.vertexCount() * vertexSize();
+    }
+
+    bool ready() const
+    {
+        return !mImport && mVertexBuffer && mUploadedBytes == vertexBytes();
+    }
+
+    /**
+     * \brief Pick up the result of a finished import.
+     */
+    void pollImport()
+    {
+        if(!mImport) return;
+        switch(mImport->stage.load())
+        {
+            case MeshImportJob::DONE:
+                setData(std::move(mImport->data));
+                mImport.reset();
+                break;
+
+            case MeshImportJob::FAILED:
+                mError = mImport->error;
+                std::cerr << "Failed to load " << mImportPath << ": "
+                    << mError << std::endl;
+                mImport.reset();
+                break;
+
+            default: ;
+        }
+    }
+
+    /**
+     * \brief Copy the next slice of vertices into the vertex buffer, limited
+     * by the upload budget of this frame.
+     */
+    void uploadVertices()
+    {
+        const auto total = vertexBytes();
+        if(total == 0 || mUploadedBytes == total) return;
+
+        if(mVertexBuffer == 0)
+        {
+            glGenBuffers(1, &mVertexBuffer);
+            glBindBuffer(GL_ARRAY_BUFFER, mVertexBuffer);
+            glBufferData(GL_ARRAY_BUFFER, total, nullptr, GL_STATIC_DRAW);
+        }
+        else
+        {
+            glBindBuffer(GL_ARRAY_BUFFER, mVertexBuffer);
+        }
+
+        // Only upload whole vertices.
+        const auto stride = vertexSize();
+        auto bytes = gUploadBudget.acquire(total - mUploadedBytes);
+        bytes -= bytes % stride;
+        if(bytes)
+        {
+            const char *src = nullptr;
+            const auto first = mUploadedBytes / stride;
+            const auto count = bytes / stride;
+            switch(mData.quantized.format)
+            {
+                case VertexQuantization::OCT8:
+                    mStaging.resize(bytes);
+                    unpackForUpload<std::int8_t>(first, count);
+                    src = mStaging.data();
+                    break;
+
+                case VertexQuantization::OCT16:
+                    mStaging.resize(bytes);
+                    unpackForUpload<std::int16_t>(first, count);
+                    src = mStaging.data();
+                    break;
+
+                default:
+                    src = reinterpret_cast<const char *>(
+                        mData.vertices.data() + first);
+            }
+            glBufferSubData(GL_ARRAY_BUFFER, mUploadedBytes, bytes, src);
+            mUploadedBytes += bytes;
+        }
+        if(mUploadedBytes == total) std::vector<char>().swap(mStaging);
+        glBindBuffer(GL_ARRAY_BUFFER, 0);
+    }
+
+    void drawPlaceholder() const
+    {
+        glm::vec3 lo { -0.5f, -0.5f, -0.5f }, hi { 0.5f, 0.5f, 0.5f };
+        if(!mData.indices.empty())
+        {
+            lo = mData.boundsMin;
+            hi = mData.boundsMax;
+        }
+        const glm::vec3 v[] = {
+            { lo.x, lo.y, lo.z }, { hi.x, lo.y, lo.z },
+            { hi.x, hi.y, lo.z }, { lo.x, hi.y, lo.z },
+            { lo.x, lo.y, hi.z }, { hi.x, lo.y, hi.z },
+            { hi.x, hi.y, hi.z }, { lo.x, hi.y, hi.z },
+        };
+        static const int edges[] = {
+            0, 1, 1, 2, 2, 3, 3, 0,
+            4, 5, 5, 6, 6, 7, 7, 4,
+            0, 4, 1, 5, 2, 6, 3, 7,
+        };
+
+        glPushAttrib(GL_ENABLE_BIT | GL_CURRENT_BIT);
+        glDisable(GL_LIGHTING);
+        glDisable(GL_TEXTURE_2D);
+        glBegin(GL_LINES);
+            glColor3f(1, 0.75f, 0);
+            for(auto e : edges)
+                glVertex3fv(value_ptr(v[e]));
+        glEnd();
+        glPopAttrib();
+    }
+
+public:
+    Mesh() = default;
+
+    explicit Mesh(MeshData data)
+    {
+        setData(std::move(data));
+    }
+
+    ~Mesh()
+    {
+        if(mVertexBuffer)
+        {
+            glDeleteBuffers(1, &mVertexBuffer);
+            mVertexBuffer = 0;
+        }
+    }
+
+    /**
+     * \brief Replace the geometry. The vertex buffer is refilled during the
+     * following frames.
+     */
+    void setData(MeshData data)
+    {
+        mData = std::move(data);
+        if(mData.clusters.empty()) buildMeshClusters(mData);
+        // Materials of other meshes often share their images, so they go
+        // through the cache. This runs while drawing, so the image is decoded
+        // on the worker pool; beginTexturing() binds it from the next frame.
+        if(!mTexture && !mData.diffuseTexture.empty())
+            setTexture(gTextureCache.acquireAsync(mData.diffuseTexture));
+        if(mVertexBuffer)
+        {
+            glDeleteBuffers(1, &mVertexBuffer);
+            mVertexBuffer = 0;
+        }
+        mUploadedBytes = 0;
+        mRasterVertices.clear();
+    }
+
+    const MeshData & data() const { return mData; }
+
+    bool loadFromObj(const char *path)
+    {
+        MeshData data;
+        std::string error;
+        if(!loadObjMeshData(path, data, error))
+        {
+            std::cerr << "Failed to load " << path << ": " << error << std::endl;
+            return false;
+        }
+        setData(std::move(data));
+        return true;
+    }
+
+    /**
+     * \brief Start importing an OBJ file on the worker pool. The mesh keeps
+     * drawing a placeholder until the import and the upload are finished.
+     */
+    void loadFromObjAsync(const char *path,
+        VertexQuantization quantization = VertexQuantization::NONE)
+    {
+        mImportPath = path;
+        mError.clear();
+        mImport = importObjAsync(path, quantization);
+    }
+
+    /**
+     * \brief Switch an already loaded mesh to a quantized vertex format.
+     */
+    void quantize(VertexQuantization format)
+    {
+        if(mImport || mData.isQuantized()) return;
+        quantizeMeshData(mData, format);
+        setData(std::move(mData));
+    }
+
+    std::size_t trianglesSubmitted() const { return mTrianglesSubmitted; }
+    std::size_t trianglesCulled() const
+    {
+        return mTrianglesFrustumCulled + mTrianglesBackfaceCulled;
+    }
+
+    // The farthest corner of the bounding box, of the placeholder box while
+    // the bounds are unknown.
+    float boundingRadius() const override
+    {
+        if(mData.indices.empty()) return 0.8660254f;
+        return length(max(abs(mData.boundsMin), abs(mData.boundsMax)));
+    }
+
+    void draw(float dt) override
+    {
+        pollImport();
+        if(!mError.empty()) return;
+        uploadVertices();
+        if(!ready())
+        {
+            drawPlaceholder();
+            return;
+        }
+        if(mData.indices.empty()) return;
+
+        auto &&indices = visibleIndices();
+        if(indices.empty()) return;
+
+        const auto stride = static_cast<GLsizei>(vertexSize());
+        const auto format = mData.quantized.format;
+
+        glPushClientAttrib(GL_CLIENT_VERTEX_ARRAY_BIT);
+        glPushAttrib(GL_ENABLE_BIT);
+        glPushMatrix();
+        glBindBuffer(GL_ARRAY_BUFFER, mVertexBuffer);
+        glEnableClientState(GL_VERTEX_ARRAY);
+        glEnableClientState(GL_NORMAL_ARRAY);
+        glEnableClientState(GL_TEXTURE_COORD_ARRAY);
+        if(format == VertexQuantization::NONE)
+        {
+            glVertexPointer(3, GL_FLOAT, stride,
+                reinterpret_cast<const void *>(offsetof(MeshVertex, position)));
+            glNormalPointer(GL_FLOAT, stride,
+                reinterpret_cast<const void *>(offsetof(MeshVertex, normal)));
+            glTexCoordPointer(2, GL_FLOAT, stride,
+                reinterpret_cast<const void *>(offsetof(MeshVertex, texcoord)));
+        }
+        else
+        {
+            // The offsets are the same for all packed layouts except for
+            // the texcoords, which follow normals of either size.
+            const auto texcoord_offset =
+                format == VertexQuantization::OCT8 ?
+                offsetof(PackedVertex<std::int8_t>, texcoord) :
+                offsetof(PackedVertex<std::int16_t>, texcoord);
+            using FloatTexCoords8 = PackedVertex<std::int8_t, float>;
+            using FloatTexCoords16 = PackedVertex<std::int16_t, float>;
+            static_assert(offsetof(PackedVertex<std::int8_t>, texcoord) ==
+                offsetof(FloatTexCoords8, texcoord) &&
+                offsetof(PackedVertex<std::int16_t>, texcoord) ==
+                offsetof(FloatTexCoords16, texcoord),
+                "Float texcoords are placed like half floats");
+            glVertexPointer(3, GL_SHORT, stride, nullptr);
+            glNormalPointer(
+                format == VertexQuantization::OCT8 ? GL_BYTE : GL_SHORT,
+                stride, reinterpret_cast<const void *>(
+                    offsetof(PackedVertex<std::int8_t>, normal)));
+            glTexCoordPointer(2,
+                halfFloatVerticesSupported() ? GL_HALF_FLOAT : GL_FLOAT,
+                stride, reinterpret_cast<const void *>(texcoord_offset));
+
+            // Dequantization folded into the model matrix. The culling
+            // above has already read the matrix without it. The uniform
+            // scale shrinks the normals, which GL_RESCALE_NORMAL undoes.
+            const auto &q = mData.quantized;
+            glTranslatef(q.offset.x, q.offset.y, q.offset.z);
+            glScalef(q.scale, q.scale, q.scale);
+            glEnable(GL_RESCALE_NORMAL);
+        }
+        glColor3f(1, 1, 1);
+        // The index list changes every frame so it stays in client memory.
+        glDrawElements(GL_TRIANGLES, static_cast<GLsizei>(indices.size()),
+            GL_UNSIGNED_INT, indices.data());
+        glBindBuffer(GL_ARRAY_BUFFER, 0);
+        glPopMatrix();
+        glPopAttrib();
+        glPopClientAttrib();
+    }
+
+    // Nothing is drawn until the import is finished.
+    void rasterize(SoftwareRenderer &renderer) override
+    {
+        pollImport();
+        if(mImport || !mError.empty() || mData.indices.empty()) return;
+        if(mRasterVertices.empty())
+        {
+            const auto &q = mData.quantized;
+            mRasterVertices.resize(mData.vertexCount());
+            for(std::size_t i = 0; i < mRasterVertices.size(); ++i)
+            {
+                auto &&o = mRasterVertices[i];
+                MeshVertex v;
+                if(mData.isQuantized())
+                {
+                    v.position = q.offset + q.scale * glm::vec3(
+                        q.positions[i * 3], q.positions[i * 3 + 1],
+                        q.positions[i * 3 + 2]);
+                    v.normal = octahedralDecode(
+                        q.format == VertexQuantization::OCT8 ?
+                        glm::vec2(fromSnorm(q.normals8[i * 2]),
+                            fromSnorm(q.normals8[i * 2 + 1])) :
+                        glm::vec2(fromSnorm(q.normals16[i * 2]),
+                            fromSnorm(q.normals16[i * 2 + 1])));
+                    v.texcoord = { halfToFloat(q.texcoords[i * 2]),
+                        halfToFloat(q.texcoords[i * 2 + 1]) };
+                }
+                else
+                {
+                    v = mData.vertices[i];
+                }
+                std::copy_n(&v.position.x, 3, o.position);
+                std::copy_n(&v.normal.x, 3, o.normal);
+                std::copy_n(&v.texcoord.x, 2, o.texcoord);
+            }
+        }
+        renderer.setColor(1, 1, 1);
+        renderer.drawIndexed(mRasterVertices.data(),
+            mRasterVertices.size(), mData.indices.data(),
+            mData.indices.size());
+    }
+
+    void emitControlWidgets() override
+    {
+        Object::emitControlWidgets();
+
+        if(!mImportPath.empty())
+            ImGui::TextUnformatted(mImportPath.c_str());
+        if(!mError.empty())
+        {
+            ImGui::TextColored(ImVec4(1, 0.3f, 0.3f, 1), "Error: %s",
+                mError.c_str());
+            return;
+        }
+        if(mImport)
+        {
+            if(mImport->stage == MeshImportJob::READING)
+            {
+                ImGui::ProgressBar(mImport->readProgress(), ImVec2(-1, 0),
+                    "Reading");
+            }
+            else
+            {
+                ImGui::ProgressBar(1, ImVec2(-1, 0), "Parsing");
+            }
+            return;
+        }
+        if(!ready())
+        {
+            const auto total = vertexBytes();
+            ImGui::ProgressBar(total ? 1.f * mUploadedBytes / total : 0.f,
+                ImVec2(-1, 0), "Uploading");
+        }
+
+        ImGui::Checkbox("Cluster Culling", &mClusterCulling);
+        ImGui::SameLine();
+        ImGui::Checkbox("Frustum", &mFrustumCulling);
+        ImGui::SameLine();
+        ImGui::Checkbox("Back-face", &mBackfaceCulling);
+        ImGui::Text("%zu clusters, %zu triangles",
+            mData.clusters.size(), mData.triangleCount());
+        ImGui::Text("Submitted: %zu, culled: %zu (frustum %zu, back-face %zu)",
+            mTrianglesSubmitted, trianglesCulled(),
+            mTrianglesFrustumCulled, mTrianglesBackfaceCulled);
+
+        if(mData.isQuantized())
+        {
+            auto &&q = mData.quantized;
+            ImGui::Text("Vertices: %s, %zu KiB (%zu KiB on GPU)",
+                q.format == VertexQuantization::OCT8 ? "oct8" : "oct16",
+                q.bytes() / 1024, vertexBytes() / 1024);
+            ImGui::Text("Position error: max %g, rms %g",
+                q.error.maxPosition, q.error.rmsPosition);
+            ImGui::Text("Normal error: max %.3f, mean %.3f deg",
+                q.error.maxNormal, q.error.meanNormal);
+            ImGui::Text("Texcoord error: max %g", q.error.maxTexcoord);
+        }
+        else
+        {
+            ImGui::Text("Vertices: float, %zu KiB", vertexBytes() / 1024);
+            if(ready())
+            {
+                if(ImGui::Button("Quantize (oct8)"))
+                    quantize(VertexQuantization::OCT8);
+                ImGui::SameLine();
+                if(ImGui::Button("Quantize (oct16)"))
+                    quantize(VertexQuantization::OCT16);
+            }
+        }
+    }
+};
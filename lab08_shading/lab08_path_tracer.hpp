@@ -0,0 +1,1110 @@
+#pragma once
+
+// A path tracer running on the CPU. Independent of OpenGL and GLM so that it
+// can be used by the tools on machines without a GPU.
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cmath>
+#include <cstdint>
+#include <future>
+#include <limits>
+#include <memory>
+#include <unordered_map>
+#include <vector>
+
+#include "lab08_software_rasterizer.hpp"
+
+/*****************************************************************************/
+// PathTracerScene
+/*****************************************************************************/
+
+struct PathVec3
+{
+    float x = 0, y = 0, z = 0;
+
+    PathVec3() = default;
+    PathVec3(float x, float y, float z) : x(x), y(y), z(z) { }
+    explicit PathVec3(const float *v) : x(v[0]), y(v[1]), z(v[2]) { }
+
+    float operator[](int i) const { return i == 0 ? x : i == 1 ? y : z; }
+};
+
+inline PathVec3 operator+(PathVec3 a, PathVec3 b)
+{
+    return { a.x + b.x, a.y + b.y, a.z + b.z };
+}
+inline PathVec3 operator-(PathVec3 a, PathVec3 b)
+{
+    return { a.x - b.x, a.y - b.y, a.z - b.z };
+}
+inline PathVec3 operator*(PathVec3 a, PathVec3 b)
+{
+    return { a.x * b.x, a.y * b.y, a.z * b.z };
+}
+inline PathVec3 operator*(PathVec3 a, float s)
+{
+    return { a.x * s, a.y * s, a.z * s };
+}
+inline float dot(PathVec3 a, PathVec3 b)
+{
+    return a.x * b.x + a.y * b.y + a.z * b.z;
+}
+inline PathVec3 cross(PathVec3 a, PathVec3 b)
+{
+    return { a.y * b.z - a.z * b.y, a.z * b.x - a.x * b.z,
+        a.x * b.y - a.y * b.x };
+}
+inline PathVec3 normalize(PathVec3 a)
+{
+    const auto length_squared = dot(a, a);
+    return length_squared > 0 ? a * (1 / std::sqrt(length_squared)) : a;
+}
+inline PathVec3 min(PathVec3 a, PathVec3 b)
+{
+    return { std::min(a.x, b.x), std::min(a.y, b.y), std::min(a.z, b.z) };
+}
+inline PathVec3 max(PathVec3 a, PathVec3 b)
+{
+    return { std::max(a.x, b.x), std::max(a.y, b.y), std::max(a.z, b.z) };
+}
+
+/**
+ * \brief The triangles, materials and lights of a scene in world space, as
+ * drawn by Object::rasterizeHierarchy() with the view as modelview, and a
+ * bounding volume hierarchy over them. Lines are ignored. Textures are
+ * copied, so the scene stays valid while the objects change.
+ *
+ * The hierarchy has four children per node, whose boxes a ray is tested
+ * against at once, and stores the triangles of its leaves in blocks of
+ * four, tested at once as well. It is built by splitting with the surface
+ * area heuristic (binned, see "On fast Construction of SAH-based Bounding
+ * Volume Hierarchies", Wald 2007) twice per node.
+ */
+class PathTracerScene : public SoftwareRenderer
+{
+public:
+    struct Material
+    {
+        PathVec3 diffuse;
+        PathVec3 specular;
+        PathVec3 emission;
+        float shininess = 0;
+        // Index into mTextures, or -1
+        int texture = -1;
+    };
+
+    struct Triangle
+    {
+        std::uint32_t vertices[3];
+        std::uint32_t material;
+    };
+
+    struct Light
+    {
+        // Direction towards the light if w is 0
+        float position[4];
+        PathVec3 color;
+        float attenuation[3];
+    };
+
+    static constexpr std::uint32_t kNone = 0xffffffffu;
+
+    // Four children, as boxes in SoA layout
+    struct Node
+    {
+        float minX[4], minY[4], minZ[4];
+        float maxX[4], maxY[4], maxZ[4];
+        // Index of an inner node, or of the first block of a leaf with
+        // kLeafBit set, or 0 for an empty slot
+        std::uint32_t child[4];
+        // Blocks of a leaf, 0 for inner nodes and empty slots
+        std::uint32_t blocks[4];
+    };
+    static constexpr std::uint32_t kLeafBit = 0x80000000u;
+
+    // Four triangles as a vertex and two edges, for Moeller-Trumbore
+    struct Block
+    {
+        float v0[3][4];
+        float e1[3][4];
+        float e2[3][4];
+        // kNone pads the last block of a leaf.
+        std::uint32_t triangle[4];
+    };
+
+    struct Hit
+    {
+        float t;
+        float u, v;
+        std::uint32_t triangle = kNone;
+    };
+
+private:
+    std::vector<SoftwareVertex> mVertices;
+    std::vector<Triangle> mTriangles;
+    std::vector<Material> mMaterials;
+    std::vector<Image> mTextures;
+    std::unordered_map<const Image *, int> mTextureIndices;
+    std::vector<Light> mSceneLights;
+    bool mLightEnabled[kMaxLights] { };
+
+    std::vector<Node> mNodes;
+    std::vector<Block> mBlocks;
+
+    std::uint32_t currentMaterial()
+    {
+        if(mStateChanged || mMaterials.empty())
+        {
+            Material m;
+            m.diffuse = PathVec3(mMaterial.diffuse);
+            m.specular = PathVec3(mMaterial.specular);
+            m.emission = PathVec3(mMaterial.emission);
+            m.shininess = mMaterial.shininess;
+            if(mTexture)
+            {
+                auto inserted = mTextureIndices.emplace(mTexture,
+                    static_cast<int>(mTextures.size()));
+                if(inserted.second) mTextures.push_back(*mTexture);
+                m.texture = inserted.first->second;
+            }
+            mMaterials.push_back(m);
+            mStateChanged = false;
+        }
+        return static_cast<std::uint32_t>(mMaterials.size() - 1);
+    }
+
+    std::uint32_t addVertex(const SoftwareVertex &v)
+    {
+        SoftwareVertex world;
+        transformPosition(v.position, world.position);
+        transformNormal(v.normal, world.normal);
+        std::copy_n(v.texcoord, 2, world.texcoord);
+        mVertices.push_back(world);
+        return static_cast<std::uint32_t>(mVertices.size() - 1);
+    }
+
+    struct Bounds
+    {
+        PathVec3 lo { INFINITY, INFINITY, INFINITY };
+        PathVec3 hi { -INFINITY, -INFINITY, -INFINITY };
+
+        void grow(PathVec3 p)
+        {
+            lo = min(lo, p);
+            hi = max(hi, p);
+        }
+        void grow(const Bounds &b)
+        {
+            lo = min(lo, b.lo);
+            hi = max(hi, b.hi);
+        }
+        float area() const
+        {
+            const auto d = hi - lo;
+            return d.x < 0 ? 0 : 2 * (d.x * d.y + d.y * d.z + d.z * d.x);
+        }
+    };
+
+    // Per triangle, while building
+    std::vector<Bounds> mBuildBounds;
+    std::vector<PathVec3> mCentroids;
+    std::vector<std::uint32_t> mOrder;
+
+    static constexpr int kBins = 12;
+    static constexpr std::uint32_t kLeafSize = 4;
+    static constexpr int kTraversalStack = 256;
+
+    Bounds rangeBounds(std::uint32_t begin, std::uint32_t end) const
+    {
+        Bounds b;
+        for(auto i = begin; i < end; ++i) b.grow(mBuildBounds[mOrder[i]]);
+        return b;
+    }
+
+    /**
+     * \brief Partition the range at the cheapest of the bin boundaries along
+     * the longest axis of the centroids. Returns the first index of the
+     * second part, or begin if the range should stay a leaf.
+     */
+    std::uint32_t split(std::uint32_t begin, std::uint32_t end)
+    {
+        const auto count = end - begin;
+        if(count <= kLeafSize) return begin;
+        Bounds centroids;
+        for(auto i = begin; i < end; ++i) centroids.grow(mCentroids[mOrder[i]]);
+        const auto extent = centroids.hi - centroids.lo;
+        const auto axis = extent.x >= extent.y && extent.x >= extent.z ? 0 :
+            extent.y >= extent.z ? 1 : 2;
+        const auto lo = centroids.lo[axis];
+        const auto size = extent[axis];
+        if(!(size > 0))
+        {
+            // All centroids coincide; split in the middle.
+            return begin + count / 2;
+        }
+
+        auto binOf = [&](std::uint32_t triangle) {
+            const auto b = static_cast<int>(
+                (mCentroids[triangle][axis] - lo) / size * kBins);
+            return std::min(b, kBins - 1);
+        };
+        Bounds bins[kBins];
+        std::uint32_t counts[kBins] { };
+        for(auto i = begin; i < end; ++i)
+        {
+            const auto b = binOf(mOrder[i]);
+            bins[b].grow(mBuildBounds[mOrder[i]]);
+            ++counts[b];
+        }
+        // Cost of splitting after each bin, swept from both sides
+        float right_cost[kBins];
+        Bounds right;
+        std::uint32_t right_count = 0;
+        for(int b = kBins - 1; b > 0; --b)
+        {
+            right.grow(bins[b]);
+            right_count += counts[b];
+            right_cost[b] = right.area() * right_count;
+        }
+        Bounds left;
+        std::uint32_t left_count = 0;
+        auto best_cost = INFINITY;
+        auto best_bin = 0;
+        for(int b = 0; b < kBins - 1; ++b)
+        {
+            left.grow(bins[b]);
+            left_count += counts[b];
+            const auto cost = left.area() * left_count + right_cost[b + 1];
+            if(left_count > 0 && left_count < count && cost < best_cost)
+            {
+                best_cost = cost;
+                best_bin = b;
+            }
+        }
+        if(best_cost == INFINITY) return begin + count / 2;
+        // A leaf is cheaper when intersecting all triangles costs less than
+        // a traversal step and the triangles of both halves.
+        const auto leaf_cost = rangeBounds(begin, end).area() * count;
+        if(count <= 4 * kLeafSize && leaf_cost <= best_cost + 1e-6f)
+            return begin;
+        return static_cast<std::uint32_t>(std::partition(
+            mOrder.begin() + begin, mOrder.begin() + end,
+            [&](std::uint32_t t) { return binOf(t) <= best_bin; }) -
+            mOrder.begin());
+    }
+
+    std::uint32_t addLeaf(std::uint32_t begin, std::uint32_t end)
+    {
+        const auto first = static_cast<std::uint32_t>(mBlocks.size());
+        for(auto i = begin; i < end; i += 4)
+        {
+            Block block;
+            for(std::uint32_t lane = 0; lane < 4; ++lane)
+            {
+                // Padding repeats the last triangle, which cannot be
+                // nearer than itself.
+                const auto t = mOrder[std::min(i + lane, end - 1)];
+                block.triangle[lane] = i + lane < end ? t : kNone;
+                const PathVec3 v0(mVertices[mTriangles[t].vertices[0]].position);
+                const PathVec3 v1(mVertices[mTriangles[t].vertices[1]].position);
+                const PathVec3 v2(mVertices[mTriangles[t].vertices[2]].position);
+                for(int c = 0; c < 3; ++c)
+                {
+                    block.v0[c][lane] = v0[c];
+                    block.e1[c][lane] = v1[c] - v0[c];
+                    block.e2[c][lane] = v2[c] - v0[c];
+                }
+            }
+            mBlocks.push_back(block);
+        }
+        return first;
+    }
+
+    // Build the node over the range and return its index.
+    std::uint32_t buildNode(std::uint32_t begin, std::uint32_t end)
+    {
+        const auto index = static_cast<std::uint32_t>(mNodes.size());
+        mNodes.emplace_back();
+        // Split the range in two, then both halves again.
+        struct Range { std::uint32_t begin, end; bool leaf; };
+        Range ranges[4];
+        int count = 0;
+        const auto middle = split(begin, end);
+        if(middle == begin)
+        {
+            ranges[count++] = { begin, end, true };
+        }
+        else
+        {
+            for(auto half : { Range { begin, middle, false },
+                Range { middle, end, false } })
+            {
+                const auto quarter = split(half.begin, half.end);
+                if(quarter == half.begin)
+                {
+                    ranges[count++] = { half.begin, half.end, true };
+                }
+                else
+                {
+                    ranges[count++] = { half.begin, quarter, false };
+                    ranges[count++] = { quarter, half.end, false };
+                }
+            }
+        }
+
+        Node node;
+        for(int i = 0; i < 4; ++i)
+        {
+            Bounds b;
+            node.child[i] = 0;
+            node.blocks[i] = 0;
+            if(i < count)
+            {
+                auto &&r = ranges[i];
+                b = rangeBounds(r.begin, r.end);
+                if(r.leaf || r.end - r.begin <= kLeafSize)
+                {
+                    node.child[i] = addLeaf(r.begin, r.end) | kLeafBit;
+                    node.blocks[i] = (r.end - r.begin + 3) / 4;
+                }
+                else
+                {
+                    node.child[i] = buildNode(r.begin, r.end);
+                }
+            }
+            node.minX[i] = b.lo.x;
+            node.minY[i] = b.lo.y;
+            node.minZ[i] = b.lo.z;
+            node.maxX[i] = b.hi.x;
+            node.maxY[i] = b.hi.y;
+            node.maxZ[i] = b.hi.z;
+        }
+        mNodes[index] = node;
+        return index;
+    }
+
+public:
+    void enableLight(int index, bool enabled)
+    {
+        mLightEnabled[index] = enabled;
+    }
+
+    void drawTriangles(const SoftwareVertex *vertices,
+        std::size_t count) override
+    {
+        const auto material = currentMaterial();
+        for(std::size_t i = 0; i + 2 < count; i += 3)
+        {
+            Triangle t;
+            for(int k = 0; k < 3; ++k) t.vertices[k] = addVertex(vertices[i + k]);
+            t.material = material;
+            mTriangles.push_back(t);
+        }
+    }
+
+    void drawIndexed(const SoftwareVertex *vertices, std::size_t vertex_count,
+        const std::uint32_t *indices, std::size_t index_count) override
+    {
+        const auto material = currentMaterial();
+        const auto base = static_cast<std::uint32_t>(mVertices.size());
+        for(std::size_t i = 0; i < vertex_count; ++i) addVertex(vertices[i]);
+        for(std::size_t i = 0; i + 2 < index_count; i += 3)
+        {
+            mTriangles.push_back({ { base + indices[i], base + indices[i + 1],
+                base + indices[i + 2] }, material });
+        }
+    }
+
+    // Lines have no area for rays to hit, so the path tracer ignores them.
+    void drawLines(const SoftwareVertex *, std::size_t) override
+    {
+    }
+
+    /**
+     * \brief Take the enabled lights as they are now and build the hierarchy
+     * over everything drawn so far.
+     */
+    void build()
+    {
+        mSceneLights.clear();
+        for(int i = 0; i < kMaxLights; ++i)
+        {
+            if(!mLightEnabled[i]) continue;
+            Light light;
+            std::copy_n(mLights[i].position, 4, light.position);
+            light.color = PathVec3(mLights[i].diffuse);
+            std::copy_n(mLights[i].attenuation, 3, light.attenuation);
+            mSceneLights.push_back(light);
+        }
+
+        const auto count = static_cast<std::uint32_t>(mTriangles.size());
+        mBuildBounds.resize(count);
+        mCentroids.resize(count);
+        mOrder.resize(count);
+        for(std::uint32_t t = 0; t < count; ++t)
+        {
+            Bounds b;
+            for(auto v : mTriangles[t].vertices)
+                b.grow(PathVec3(mVertices[v].position));
+            mBuildBounds[t] = b;
+            mCentroids[t] = (b.lo + b.hi) * 0.5f;
+            mOrder[t] = t;
+        }
+        mNodes.clear();
+        mBlocks.clear();
+        if(count > 0) buildNode(0, count);
+        mBuildBounds = { };
+        mCentroids = { };
+        mOrder = { };
+    }
+
+    std::size_t triangleCount() const { return mTriangles.size(); }
+    std::size_t nodeCount() const { return mNodes.size(); }
+    const std::vector<Light> & lights() const { return mSceneLights; }
+    const Triangle & triangle(std::uint32_t t) const { return mTriangles[t]; }
+    const SoftwareVertex & vertex(std::uint32_t v) const
+    {
+        return mVertices[v];
+    }
+    const Material & material(std::uint32_t m) const { return mMaterials[m]; }
+    const Image & texture(int t) const { return mTextures[t]; }
+
+    /**
+     * \brief Find the nearest triangle along the ray within (t_min, t_max),
+     * or with any_hit the first found. Counts the visited nodes.
+     */
+    Hit intersect(PathVec3 origin, PathVec3 direction, float t_min,
+        float t_max, bool any_hit = false) const
+    {
+        Hit hit;
+        hit.t = t_max;
+        if(mNodes.empty()) return hit;
+        const PathVec3 inverse { 1 / direction.x, 1 / direction.y,
+            1 / direction.z };
+        // Nodes still to visit. A hierarchy degenerated by the splits can
+        // be deeper than the stack holds, so the rest goes to overflow.
+        std::uint32_t stack[kTraversalStack];
+        std::vector<std::uint32_t> overflow;
+        int depth = 0;
+        stack[depth++] = 0;
+        while(depth > 0 || !overflow.empty())
+        {
+            std::uint32_t index;
+            if(!overflow.empty())
+            {
+                index = overflow.back();
+                overflow.pop_back();
+            }
+            else index = stack[--depth];
+            const auto &node = mNodes[index];
+            float entry[4];
+            auto mask = intersectBoxes(node, origin, inverse, t_min, hit.t,
+                entry);
+            // Visit the nearer children first, so push them last.
+            int order[4], n = 0;
+            while(mask)
+            {
+                const auto i = mask & 1 ? 0 : mask & 2 ? 1 : mask & 4 ? 2 : 3;
+                mask &= mask - 1;
+                // Empty slot; the root is never a child.
+                if(node.child[i] == 0) continue;
+                auto k = n++;
+                while(k > 0 && entry[order[k - 1]] < entry[i])
+                {
+                    order[k] = order[k - 1];
+                    --k;
+                }
+                order[k] = i;
+            }
+            for(int k = 0; k < n; ++k)
+            {
+                const auto i = order[k];
+                if(!(node.child[i] & kLeafBit))
+                {
+                    if(depth < kTraversalStack) stack[depth++] = node.child[i];
+                    else overflow.push_back(node.child[i]);
+                    continue;
+                }
+                const auto first = node.child[i] & ~kLeafBit;
+                for(auto b = first; b < first + node.blocks[i]; ++b)
+                {
+                    if(intersectBlock(mBlocks[b], origin, direction, t_min,
+                        hit) && any_hit)
+                        return hit;
+                }
+            }
+        }
+        return hit;
+    }
+
+private:
+    // Returns a bit for each box the ray enters within (t_min, t_max).
+    static int intersectBoxes(const Node &node, PathVec3 origin,
+        PathVec3 inverse, float t_min, float t_max, float *entry)
+    {
+#ifdef LAB_IMAGE_SSE2
+        auto slab = [](const float *lo, const float *hi, float o, float inv,
+            __m128 &near, __m128 &far) {
+            const auto io = _mm_set1_ps(o);
+            const auto ii = _mm_set1_ps(inv);
+            const auto t0 = _mm_mul_ps(_mm_sub_ps(_mm_loadu_ps(lo), io), ii);
+            const auto t1 = _mm_mul_ps(_mm_sub_ps(_mm_loadu_ps(hi), io), ii);
+            near = _mm_max_ps(near, _mm_min_ps(t0, t1));
+            far = _mm_min_ps(far, _mm_max_ps(t0, t1));
+        };
+        auto near = _mm_set1_ps(t_min);
+        auto far = _mm_set1_ps(t_max);
+        slab(node.minX, node.maxX, origin.x, inverse.x, near, far);
+        slab(node.minY, node.maxY, origin.y, inverse.y, near, far);
+        slab(node.minZ, node.maxZ, origin.z, inverse.z, near, far);
+        _mm_storeu_ps(entry, near);
+        return _mm_movemask_ps(_mm_cmple_ps(near, far));
+#else
+        int mask = 0;
+        for(int i = 0; i < 4; ++i)
+        {
+            auto near = t_min, far = t_max;
+            const float lo[3] = { node.minX[i], node.minY[i], node.minZ[i] };
+            const float hi[3] = { node.maxX[i], node.maxY[i], node.maxZ[i] };
+            for(int c = 0; c < 3; ++c)
+            {
+                const auto t0 = (lo[c] - origin[c]) * inverse[c];
+                const auto t1 = (hi[c] - origin[c]) * inverse[c];
+                near = std::max(near, std::min(t0, t1));
+                far = std::min(far, std::max(t0, t1));
+            }
+            entry[i] = near;
+            if(near <= far) mask |= 1 << i;
+        }
+        return mask;
+#endif
+    }
+
+    // Moeller-Trumbore for the four triangles of the block
+    static bool intersectBlock(const Block &block, PathVec3 origin,
+        PathVec3 direction, float t_min, Hit &hit)
+    {
+        float t[4], u[4], v[4];
+        int mask;
+#ifdef LAB_IMAGE_SSE2
+        const __m128 d[3] = { _mm_set1_ps(direction.x),
+            _mm_set1_ps(direction.y), _mm_set1_ps(direction.z) };
+        __m128 e1[3], e2[3], s[3];
+        for(int c = 0; c < 3; ++c)
+        {
+            e1[c] = _mm_loadu_ps(block.e1[c]);
+            e2[c] = _mm_loadu_ps(block.e2[c]);
+            s[c] = _mm_sub_ps(_mm_set1_ps(origin[c]),
+                _mm_loadu_ps(block.v0[c]));
+        }
+        auto cross = [](const __m128 *a, const __m128 *b, __m128 *out) {
+            out[0] = _mm_sub_ps(_mm_mul_ps(a[1], b[2]), _mm_mul_ps(a[2], b[1]));
+            out[1] = _mm_sub_ps(_mm_mul_ps(a[2], b[0]), _mm_mul_ps(a[0], b[2]));
+            out[2] = _mm_sub_ps(_mm_mul_ps(a[0], b[1]), _mm_mul_ps(a[1], b[0]));
+        };
+        auto dot = [](const __m128 *a, const __m128 *b) {
+            return _mm_add_ps(_mm_add_ps(_mm_mul_ps(a[0], b[0]),
+                _mm_mul_ps(a[1], b[1])), _mm_mul_ps(a[2], b[2]));
+        };
+        __m128 p[3], q[3];
+        cross(d, e2, p);
+        cross(s, e1, q);
+        const auto determinant = dot(e1, p);
+        const auto inverse = _mm_div_ps(_mm_set1_ps(1), determinant);
+        const auto lu = _mm_mul_ps(dot(s, p), inverse);
+        const auto lv = _mm_mul_ps(dot(d, q), inverse);
+        const auto lt = _mm_mul_ps(dot(e2, q), inverse);
+        const auto zero = _mm_setzero_ps();
+        auto valid = _mm_and_ps(_mm_cmpge_ps(lu, zero),
+            _mm_cmpge_ps(lv, zero));
+        valid = _mm_and_ps(valid, _mm_cmple_ps(_mm_add_ps(lu, lv),
+            _mm_set1_ps(1)));
+        valid = _mm_and_ps(valid, _mm_cmpgt_ps(lt, _mm_set1_ps(t_min)));
+        valid = _mm_and_ps(valid, _mm_cmplt_ps(lt, _mm_set1_ps(hit.t)));
+        // Rejects the determinant 0 and the infinite values it gives
+        valid = _mm_and_ps(valid, _mm_cmpneq_ps(determinant, zero));
+        mask = _mm_movemask_ps(valid);
+        if(!mask) return false;
+        _mm_storeu_ps(t, lt);
+        _mm_storeu_ps(u, lu);
+        _mm_storeu_ps(v, lv);
+#else
+        mask = 0;
+        for(int i = 0; i < 4; ++i)
+        {
+            const PathVec3 e1 { block.e1[0][i], block.e1[1][i],
+                block.e1[2][i] };
+            const PathVec3 e2 { block.e2[0][i], block.e2[1][i],
+                block.e2[2][i] };
+            const auto s = origin - PathVec3 { block.v0[0][i],
+                block.v0[1][i], block.v0[2][i] };
+            const auto p = ::cross(direction, e2);
+            const auto q = ::cross(s, e1);
+            const auto determinant = ::dot(e1, p);
+            if(determinant == 0) continue;
+            const auto inverse = 1 / determinant;
+            u[i] = ::dot(s, p) * inverse;
+            v[i] = ::dot(direction, q) * inverse;
+            t[i] = ::dot(e2, q) * inverse;
+            if(u[i] >= 0 && v[i] >= 0 && u[i] + v[i] <= 1 && t[i] > t_min &&
+                t[i] < hit.t)
+                mask |= 1 << i;
+        }
+        if(!mask) return false;
+#endif
+        for(int i = 0; i < 4; ++i)
+        {
+            if(!(mask & 1 << i) || !(t[i] < hit.t)) continue;
+            hit.t = t[i];
+            hit.u = u[i];
+            hit.v = v[i];
+            hit.triangle = block.triangle[i];
+        }
+        return hit.triangle != kNone;
+    }
+};
+
+/*****************************************************************************/
+// PathTracer
+/*****************************************************************************/
+
+// Where the primary rays start, from the matrices given to OpenGL
+struct PathCamera
+{
+    // The inverse of the view matrix, column-major
+    float eyeToWorld[16] { 1, 0, 0, 0, 0, 1, 0, 0, 0, 0, 1, 0, 0, 0, 0, 1 };
+    // A perspective projection matrix, column-major
+    float projection[16] { 1, 0, 0, 0, 0, 1, 0, 0, 0, 0, 1, 0, 0, 0, 0, 1 };
+
+    bool operator==(const PathCamera &other) const
+    {
+        return std::equal(eyeToWorld, eyeToWorld + 16, other.eyeToWorld) &&
+            std::equal(projection, projection + 16, other.projection);
+    }
+};
+
+/**
+ * \brief Renders a PathTracerScene progressively, one sample per pixel per
+ * pass, and averages the passes. The screen is split into tiles which the
+ * worker pool takes one at a time, so that threads finishing early pick up
+ * the remaining ones.
+ *
+ * Surfaces reflect with a Lambertian diffuse and a normalized Blinn-Phong
+ * specular lobe. Every bounce samples the lights of the scene with shadow
+ * rays and continues in a direction drawn from one of the lobes; paths are
+ * ended by Russian roulette. Colors are used as they are, as the rest of
+ * the lab does with OpenGL, with the lights scaled by pi so that the direct
+ * light on diffuse surfaces matches the rasterized image. Rays escaping the
+ * scene return the sky color.
+ *
+ * Passes run on the worker pool while the caller polls update(), or are
+ * run on the calling thread with renderPass() when there is no window.
+ */
+class PathTracer
+{
+public:
+    static constexpr int kTileSize = 32;
+
+    struct Settings
+    {
+        int maxBounces = 4;
+        float sky[3] { 0.2f, 0.2f, 0.2f };
+    };
+
+private:
+    // Everything a pass needs, replaced as a whole on restart while the
+    // previous pass may still be running
+    struct Session
+    {
+        std::shared_ptr<const PathTracerScene> scene;
+        PathCamera camera;
+        Settings settings;
+        int width = 0;
+        int height = 0;
+        // Sums of the samples, RGB per pixel
+        std::vector<float> sum;
+        int samples = 0;
+        // The average as RGBA rows from bottom to top
+        std::vector<std::uint8_t> pixels;
+        std::atomic<std::uint64_t> rays { 0 };
+        double seconds = 0;
+    };
+
+    std::shared_ptr<Session> mSession;
+    std::future<void> mPass;
+    // The session of the running pass
+    std::shared_ptr<Session> mPassSession;
+    // Of the last finished pass
+    int mSamples = 0;
+    std::uint64_t mRays = 0;
+    double mRaysPerSecond = 0;
+    double mPassMs = 0;
+    // Copy of the session pixels after the last finished pass, so that they
+    // can be read while the next pass writes the session
+    std::vector<std::uint8_t> mPixels;
+
+    // PCG32, see https://www.pcg-random.org
+    struct Random
+    {
+        std::uint64_t state;
+
+        Random(std::uint64_t seed)
+            : state(seed * 6364136223846793005ull + 1442695040888963407ull)
+        {
+        }
+
+        float next()
+        {
+            const auto old = state;
+            state = old * 6364136223846793005ull + 1442695040888963407ull;
+            const auto shifted = static_cast<std::uint32_t>(
+                ((old >> 18u) ^ old) >> 27u);
+            const auto rotation = static_cast<std::uint32_t>(old >> 59u);
+            const auto bits = (shifted >> rotation) |
+                (shifted << ((32 - rotation) & 31));
+            return (bits >> 8) * (1.f / 16777216);
+        }
+    };
+
+    // An orthonormal basis around n
+    static void basis(PathVec3 n, PathVec3 &t, PathVec3 &b)
+    {
+        const auto sign = std::copysign(1.f, n.z);
+        const auto a = -1 / (sign + n.z);
+        const auto c = n.x * n.y * a;
+        t = { 1 + sign * n.x * n.x * a, sign * c, -sign * n.x };
+        b = { c, sign + n.y * n.y * a, -n.y };
+    }
+
+    static PathVec3 sampleTexture(const Image &image, float s, float t)
+    {
+        auto wrap = [](int i, int n) { i %= n; return i < 0 ? i + n : i; };
+        const auto x = s * image.width - 0.5f;
+        const auto y = t * image.height - 0.5f;
+        const auto fx = std::floor(x);
+        const auto fy = std::floor(y);
+        const auto x0 = wrap(static_cast<int>(fx), image.width);
+        const auto y0 = wrap(static_cast<int>(fy), image.height);
+        const auto x1 = wrap(x0 + 1, image.width);
+        const auto y1 = wrap(y0 + 1, image.height);
+        auto texel = [&](int tx, int ty) {
+            const auto *p = &image.pixels[
+                (std::size_t(ty) * image.width + tx) * 4];
+            return PathVec3(p[0], p[1], p[2]);
+        };
+        const auto wx = x - fx, wy = y - fy;
+        const auto top = texel(x0, y0) * (1 - wx) + texel(x1, y0) * wx;
+        const auto bottom = texel(x0, y1) * (1 - wx) + texel(x1, y1) * wx;
+        return (top * (1 - wy) + bottom * wy) * (1 / 255.f);
+    }
+
+    static float luminance(PathVec3 c)
+    {
+        return 0.2126f * c.x + 0.7152f * c.y + 0.0722f * c.z;
+    }
+
+    // Radiance along the ray, counting the rays traced
+    static PathVec3 trace(const Session &session, PathVec3 origin,
+        PathVec3 direction, Random &random, std::uint64_t &rays)
+    {
+        const auto &scene = *session.scene;
+        const PathVec3 sky(session.settings.sky);
+        const auto pi = 3.14159265f;
+        PathVec3 radiance, throughput { 1, 1, 1 };
+        for(int bounce = 0; ; ++bounce)
+        {
+            ++rays;
+            const auto hit = scene.intersect(origin, direction, 0, INFINITY);
+            if(hit.triangle == PathTracerScene::kNone)
+            {
+                radiance = radiance + throughput * sky;
+                break;
+            }
+
+            const auto &triangle = scene.triangle(hit.triangle);
+            const auto &m = scene.material(triangle.material);
+            const auto &a = scene.vertex(triangle.vertices[0]);
+            const auto &b = scene.vertex(triangle.vertices[1]);
+            const auto &c = scene.vertex(triangle.vertices[2]);
+            const auto w = 1 - hit.u - hit.v;
+            const PathVec3 pa(a.position), pb(b.position), pc(c.position);
+            auto geometric = normalize(cross(pb - pa, pc - pa));
+            auto n = normalize(PathVec3(a.normal) * w +
+                PathVec3(b.normal) * hit.u + PathVec3(c.normal) * hit.v);
+            // Both sides of a triangle are seen.
+            if(dot(geometric, direction) > 0) geometric = geometric * -1;
+            if(dot(n, geometric) < 0) n = n * -1;
+            auto diffuse = m.diffuse;
+            if(m.texture >= 0)
+            {
+                const auto s = a.texcoord[0] * w + b.texcoord[0] * hit.u +
+                    c.texcoord[0] * hit.v;
+                const auto t = a.texcoord[1] * w + b.texcoord[1] * hit.u +
+                    c.texcoord[1] * hit.v;
+                diffuse = diffuse * sampleTexture(scene.texture(m.texture),
+                    s, t);
+            }
+            radiance = radiance + throughput * m.emission;
+            if(bounce >= session.settings.maxBounces) break;
+
+            const auto position = origin + direction * hit.t;
+            // Off the surface, against self-intersection
+            const auto offset = position + geometric *
+                (1e-4f * std::max(1.f, std::abs(hit.t)));
+            const auto view = direction * -1;
+            const auto specular_norm = (m.shininess + 8) / (8 * pi);
+
+            // Light sampling
+            for(auto &&light : scene.lights())
+            {
+                const PathVec3 p(light.position);
+                auto to_light = p - position * light.position[3];
+                const auto distance = light.position[3] != 0 ?
+                    std::sqrt(dot(to_light, to_light)) : INFINITY;
+                to_light = normalize(to_light);
+                const auto cosine = dot(n, to_light);
+                if(cosine <= 0 || dot(geometric, to_light) <= 0) continue;
+                ++rays;
+                if(scene.intersect(offset, to_light, 0, distance, true)
+                    .triangle != PathTracerScene::kNone)
+                    continue;
+                auto attenuation = 1.f;
+                if(light.position[3] != 0)
+                {
+                    attenuation /= light.attenuation[0] +
+                        light.attenuation[1] * distance +
+                        light.attenuation[2] * distance * distance;
+                }
+                const auto h = normalize(to_light + view);
+                const auto brdf = diffuse * (1 / pi) + m.specular *
+                    (specular_norm * std::pow(std::max(dot(n, h), 0.f),
+                    m.shininess));
+                radiance = radiance + throughput * brdf * light.color *
+                    (pi * cosine * attenuation);
+            }
+
+            // Continue along one of the lobes
+            const auto diffuse_weight = luminance(diffuse);
+            const auto specular_weight = luminance(m.specular);
+            if(diffuse_weight + specular_weight <= 0) break;
+            const auto specular_probability = specular_weight /
+                (diffuse_weight + specular_weight);
+            PathVec3 t, bt;
+            basis(n, t, bt);
+            const auto u1 = random.next(), u2 = random.next();
+            const auto phi = 2 * pi * u2;
+            if(random.next() < specular_probability)
+            {
+                // Half vectors distributed as cos^shininess
+                const auto cos_h = std::pow(1 - u1, 1 / (m.shininess + 1));
+                const auto sin_h = std::sqrt(std::max(0.f, 1 - cos_h * cos_h));
+                const auto h = t * (sin_h * std::cos(phi)) +
+                    bt * (sin_h * std::sin(phi)) + n * cos_h;
+                const auto vh = dot(view, h);
+                if(vh <= 0) break;
+                direction = h * (2 * vh) - view;
+                const auto cosine = dot(n, direction);
+                if(cosine <= 0 || dot(geometric, direction) <= 0) break;
+                // f cos / pdf with pdf = (s + 1) / (2 pi) cos_h^s / (4 vh)
+                throughput = throughput * m.specular * ((m.shininess + 8) /
+                    (m.shininess + 1) * cosine * vh / specular_probability);
+            }
+            else
+            {
+                // Cosine-weighted, which cancels with the diffuse BRDF
+                const auto r = std::sqrt(u1);
+                direction = t * (r * std::cos(phi)) + bt * (r * std::sin(phi)) +
+                    n * std::sqrt(std::max(0.f, 1 - u1));
+                if(dot(geometric, direction) <= 0) break;
+                throughput = throughput * diffuse *
+                    (1 / (1 - specular_probability));
+            }
+            origin = offset;
+
+            if(bounce >= 2)
+            {
+                const auto survive = std::min(0.95f, std::max({ throughput.x,
+                    throughput.y, throughput.z }));
+                if(random.next() >= survive) break;
+                throughput = throughput * (1 / survive);
+            }
+        }
+        return radiance;
+    }
+
+    static void renderTile(Session &session, int tile)
+    {
+        const auto tiles_x = (session.width + kTileSize - 1) / kTileSize;
+        const auto x0 = tile % tiles_x * kTileSize;
+        const auto y0 = tile / tiles_x * kTileSize;
+        const auto x1 = std::min(x0 + kTileSize, session.width);
+        const auto y1 = std::min(y0 + kTileSize, session.height);
+        const auto *view = session.camera.eyeToWorld;
+        const auto *p = session.camera.projection;
+        const PathVec3 origin(view + 12);
+        std::uint64_t rays = 0;
+        for(int y = y0; y < y1; ++y)
+        {
+            for(int x = x0; x < x1; ++x)
+            {
+                const auto pixel = std::size_t(y) * session.width + x;
+                Random random(pixel * 9781 + std::uint64_t(session.samples) *
+                    6271 * session.width * session.height + 1);
+                // Jittered within the pixel, which antialiases the edges
+                const auto nx = (x + random.next()) / session.width * 2 - 1;
+                const auto ny = (y + random.next()) / session.height * 2 - 1;
+                const PathVec3 eye { (nx + p[8]) / p[0], (ny + p[9]) / p[5],
+                    -1 };
+                const auto direction = normalize(
+                    PathVec3(view) * eye.x + PathVec3(view + 4) * eye.y +
+                    PathVec3(view + 8) * eye.z);
+                const auto radiance = trace(session, origin, direction,
+                    random, rays);
+                auto *sum = &session.sum[pixel * 3];
+                // Not-a-number from degenerate geometry would spread.
+                if(radiance.x == radiance.x && radiance.y == radiance.y &&
+                    radiance.z == radiance.z)
+                {
+                    sum[0] += radiance.x;
+                    sum[1] += radiance.y;
+                    sum[2] += radiance.z;
+                }
+                const auto scale = 1.f / (session.samples + 1);
+                auto *out = &session.pixels[pixel * 4];
+                for(int c = 0; c < 3; ++c)
+                {
+                    out[c] = static_cast<std::uint8_t>(std::min(
+                        sum[c] * scale, 1.f) * 255 + 0.5f);
+                }
+                out[3] = 255;
+            }
+        }
+        session.rays += rays;
+    }
+
+    static void runPass(Session &session)
+    {
+        const auto start = std::chrono::steady_clock::now();
+        session.rays = 0;
+        const auto tiles = std::size_t(
+            (session.width + kTileSize - 1) / kTileSize) *
+            ((session.height + kTileSize - 1) / kTileSize);
+        workerPool().parallelFor(tiles, 1,
+            [&](std::size_t begin, std::size_t end) {
+            for(auto tile = begin; tile < end; ++tile)
+                renderTile(session, static_cast<int>(tile));
+        });
+        ++session.samples;
+        const std::chrono::duration<double> seconds =
+            std::chrono::steady_clock::now() - start;
+        session.seconds = seconds.count();
+    }
+
+    // Publish the pixels and statistics of the finished pass.
+    void takeResult()
+    {
+        mPixels = mSession->pixels;
+        mSamples = mSession->samples;
+        mRays = mSession->rays;
+        mPassMs = mSession->seconds * 1000;
+        mRaysPerSecond = mSession->seconds > 0 ?
+            mSession->rays / mSession->seconds : 0;
+    }
+
+public:
+    PathTracer() = default;
+
+    ~PathTracer()
+    {
+        if(mPass.valid()) mPass.wait();
+    }
+
+    PathTracer(const PathTracer &) = delete;
+    PathTracer & operator=(const PathTracer &) = delete;
+
+    /**
+     * \brief Start over with a new scene, camera, settings or size. A pass
+     * still running on the previous ones finishes in the background and is
+     * discarded.
+     */
+    void restart(std::shared_ptr<const PathTracerScene> scene,
+        const PathCamera &camera, const Settings &settings, int width,
+        int height)
+    {
+        auto session = std::make_shared<Session>();
+        session->scene = std::move(scene);
+        session->camera = camera;
+        session->settings = settings;
+        session->width = width;
+        session->height = height;
+        session->sum.assign(std::size_t(width) * height * 3, 0.f);
+        session->pixels.assign(std::size_t(width) * height * 4, 0);
+        mSession = std::move(session);
+        mSamples = 0;
+        mPixels.assign(std::size_t(width) * height * 4, 0);
+    }
+
+    bool matches(const std::shared_ptr<const PathTracerScene> &scene,
+        const PathCamera &camera, int width, int height) const
+    {
+        return mSession && mSession->scene == scene &&
+            mSession->camera == camera && mSession->width == width &&
+            mSession->height == height;
+    }
+
+    /**
+     * \brief Start the next pass on the worker pool unless one is running.
+     * Returns true when a pass of the current session has finished since
+     * the last call, so that pixels() has changed.
+     */
+    bool update()
+    {
+        auto finished = false;
+        if(mPass.valid() &&
+            mPass.wait_for(std::chrono::seconds(0)) == std::future_status::ready)
+        {
+            // The session may have been replaced meanwhile.
+            mPass.get();
+            if(mPassSession == mSession)
+            {
+                takeResult();
+                finished = true;
+            }
+            mPassSession.reset();
+        }
+        if(!mPass.valid() && mSession && mSession->scene)
+        {
+            mPassSession = mSession;
+            mPass = workerPool().submit([session = mSession]() {
+                runPass(*session);
+            });
+        }
+        return finished;
+    }
+
+    // Run one pass on the calling thread and the worker pool.
+    void renderPass()
+    {
+        if(mPass.valid())
+        {
+            mPass.get();
+            mPassSession.reset();
+        }
+        if(!mSession || !mSession->scene) return;
+        runPass(*mSession);
+        takeResult();
+    }
+
+    // The average of the finished passes as RGBA rows, bottom to top
+    const std::vector<std::uint8_t> & pixels() const { return mPixels; }
+
+    int width() const { return mSession ? mSession->width : 0; }
+    int height() const { return mSession ? mSession->height : 0; }
+    int samples() const { return mSamples; }
+    std::uint64_t rays() const { return mRays; }
+    double raysPerSecond() const { return mRaysPerSecond; }
+    double passMilliseconds() const { return mPassMs; }
+    bool running() const { return mPass.valid(); }
+};
@@ -0,0 +1,605 @@
+#pragma once
+
+// Included by lab08_framework.hpp before the subsystems that it times.
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <deque>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <string_view>
+#include <typeindex>
+#include <typeinfo>
+#include <unordered_map>
+#include <vector>
+
+#if defined(__GNUG__)
+#   include <cstdlib>
+#   include <cxxabi.h>
+#endif
+
+#include "lab08_thread_pool.hpp"
+
+/*****************************************************************************/
+// Profiler
+/*****************************************************************************/
+
+/**
+ * \brief The name of a class as written in the source, e.g. to name the
+ * scope of an object by its class. GCC and Clang mangle the names of
+ * typeid, so each is demangled once and kept for the rest of the program.
+ */
+inline const char * className(const std::type_info &type)
+{
+    static std::mutex mutex;
+    static std::unordered_map<std::type_index, std::string> names;
+    std::lock_guard<std::mutex> lock(mutex);
+    auto it = names.find(type);
+    if(it != names.end()) return it->second.c_str();
+    std::string name = type.name();
+#if defined(__GNUG__)
+    int status = 0;
+    if(auto *demangled = abi::__cxa_demangle(type.name(), nullptr, nullptr,
+        &status))
+    {
+        if(status == 0) name = demangled;
+        std::free(demangled);
+    }
+#else
+    // MSVC names them "class Cube" and so on.
+    for(const std::string prefix : { "class ", "struct " })
+    {
+        if(name.compare(0, prefix.size(), prefix) == 0)
+            name.erase(0, prefix.size());
+    }
+#endif
+    return names.emplace(type, std::move(name)).first->second.c_str();
+}
+
+/**
+ * \brief A timed scope of some thread, or of the GPU. The name must outlive
+ * the profiler, e.g. a string literal or one of className().
+ */
+struct ProfileEvent
+{
+    const char *name = nullptr;
+    // Nanoseconds since the profiler was created
+    std::uint64_t begin = 0;
+    std::uint64_t end = 0;
+};
+
+/**
+ * \brief Collects the scopes timed by ProfileScope on any thread and by
+ * GpuProfileScope on the render thread, frame by frame.
+ *
+ * Each thread appends its events to a ring of its own that only the render
+ * thread empties, at endFrame(), so timing a scope takes no lock. Events
+ * that do not fit because a thread outpaces the frames are dropped and
+ * counted. GPU scopes are timestamp queries, read a few frames later when
+ * their results are available, and put on the timeline of the CPU.
+ *
+ * The overlay shows the frame times of the last few seconds and the time
+ * per scope. exportTrace() writes the events of the last frames as a Chrome
+ * trace, to be opened in chrome://tracing or Perfetto.
+ */
+class Profiler
+{
+    using Clock = std::chrono::steady_clock;
+
+    // Written by its thread, read by the render thread
+    struct ThreadBuffer
+    {
+        static constexpr std::size_t kCapacity = 1 << 13;
+        ProfileEvent events[kCapacity];
+        std::atomic<std::size_t> head { 0 };
+        std::atomic<std::size_t> tail { 0 };
+        std::atomic<std::uint64_t> dropped { 0 };
+        std::string name;
+    };
+
+    // The timestamp queries of the GPU scopes of a frame
+    struct GpuFrame
+    {
+        std::vector<GLuint> queries;
+        std::vector<const char *> names;
+        std::size_t used = 0;
+        // The CPU time of the GPU timestamp gpuBase
+        std::uint64_t cpuBase = 0;
+        GLint64 gpuBase = 0;
+        bool pending = false;
+    };
+
+    struct Frame
+    {
+        std::uint64_t begin = 0;
+        std::uint64_t end = 0;
+        // Events per thread, with the GPU as the last thread
+        std::vector<std::vector<ProfileEvent>> threads;
+    };
+
+    struct ScopeStats
+    {
+        // Of the last frame, then smoothed over the frames
+        double frameMs = 0;
+        int frameCalls = 0;
+        double averageMs = 0;
+        double averageCalls = 0;
+        double maxMs = 0;
+    };
+
+    static constexpr int kGpuLatency = 4;
+    static constexpr std::size_t kHistory = 240;
+
+    const Clock::time_point mEpoch = Clock::now();
+    std::atomic<bool> mEnabled { false };
+    bool mOverlay = false;
+    bool mGpuSupported = false;
+    bool mGpuChecked = false;
+    // Whether the GPU scopes of this frame are timed
+    bool mGpuActive = false;
+
+    std::mutex mThreadsMutex;
+    std::vector<std::unique_ptr<ThreadBuffer>> mThreads;
+
+    GpuFrame mGpuFrames[kGpuLatency];
+    int mGpuFrame = 0;
+    // GPU events read since the last endFrame()
+    std::vector<ProfileEvent> mGpuEvents;
+
+    std::uint64_t mFrameBegin = 0;
+    std::deque<Frame> mTrace;
+    std::size_t mTraceFrames = 120;
+    std::map<std::string, ScopeStats, std::less<>> mCpuStats;
+    std::map<std::string, ScopeStats, std::less<>> mGpuStats;
+    std::vector<float> mCpuFrameMs;
+    std::vector<float> mGpuFrameMs;
+    std::uint64_t mDropped = 0;
+
+    ThreadBuffer & threadBuffer()
+    {
+        thread_local ThreadBuffer *buffer = nullptr;
+        if(!buffer)
+        {
+            auto owned = std::make_unique<ThreadBuffer>();
+            std::lock_guard<std::mutex> lock(mThreadsMutex);
+            // Threads other than the workers name themselves.
+            const auto worker = ThreadPool::workerIndex();
+            owned->name = worker >= 0 ?
+                "Worker " + std::to_string(worker + 1) :
+                "Thread " + std::to_string(mThreads.size());
+            buffer = owned.get();
+            mThreads.push_back(std::move(owned));
+        }
+        return *buffer;
+    }
+
+    static void accumulate(std::map<std::string, ScopeStats, std::less<>>
+        &stats, const std::vector<ProfileEvent> &events)
+    {
+        for(auto &&event : events)
+        {
+            auto it = stats.find(std::string_view(event.name));
+            if(it == stats.end())
+                it = stats.emplace(event.name, ScopeStats()).first;
+            it->second.frameMs += (event.end - event.begin) * 1e-6;
+            ++it->second.frameCalls;
+        }
+    }
+
+    // Fold the frame into the averages and start the next one.
+    static void smooth(std::map<std::string, ScopeStats, std::less<>> &stats)
+    {
+        for(auto &&[name, scope] : stats)
+        {
+            scope.averageMs += (scope.frameMs - scope.averageMs) * 0.05;
+            scope.averageCalls += (scope.frameCalls - scope.averageCalls) *
+                0.05;
+            scope.maxMs = std::max(scope.maxMs * 0.995, scope.frameMs);
+            scope.frameMs = 0;
+            scope.frameCalls = 0;
+        }
+    }
+
+    static void pushHistory(std::vector<float> &history, float value)
+    {
+        if(history.size() == kHistory) history.erase(history.begin());
+        history.push_back(value);
+    }
+
+    // Read the timestamps of the oldest frame of queries, waiting for them
+    // only if wait is set.
+    void readGpuFrame(GpuFrame &frame, bool wait)
+    {
+        if(!frame.pending) return;
+        if(!wait && frame.used > 0)
+        {
+            GLint available = 0;
+            glGetQueryObjectiv(frame.queries[frame.used - 1],
+                GL_QUERY_RESULT_AVAILABLE, &available);
+            if(!available) return;
+        }
+        std::vector<ProfileEvent> events;
+        for(std::size_t i = 0; i + 1 < frame.used; i += 2)
+        {
+            GLuint64 begin = 0, end = 0;
+            glGetQueryObjectui64v(frame.queries[i], GL_QUERY_RESULT, &begin);
+            glGetQueryObjectui64v(frame.queries[i + 1], GL_QUERY_RESULT, &end);
+            ProfileEvent event;
+            event.name = frame.names[i / 2];
+            event.begin = frame.cpuBase + (static_cast<GLint64>(begin) -
+                frame.gpuBase);
+            event.end = event.begin + (end - begin);
+            events.push_back(event);
+        }
+        frame.pending = false;
+        frame.used = 0;
+        frame.names.clear();
+        accumulate(mGpuStats, events);
+        smooth(mGpuStats);
+        mGpuEvents.insert(mGpuEvents.end(), events.begin(), events.end());
+        if(events.empty()) return;
+        // From the first GPU scope to the end of the last, which may nest
+        auto begin = events.front().begin, end = events.front().end;
+        for(auto &&event : events)
+        {
+            begin = std::min(begin, event.begin);
+            end = std::max(end, event.end);
+        }
+        pushHistory(mGpuFrameMs, static_cast<float>((end - begin) * 1e-6));
+    }
+
+public:
+    Profiler() = default;
+    Profiler(const Profiler &) = delete;
+    Profiler & operator=(const Profiler &) = delete;
+
+    std::uint64_t now() const
+    {
+        return static_cast<std::uint64_t>(
+            std::chrono::duration_cast<std::chrono::nanoseconds>(
+            Clock::now() - mEpoch).count());
+    }
+
+    bool enabled() const { return mEnabled.load(std::memory_order_relaxed); }
+    void setEnabled(bool enabled) { mEnabled = enabled; }
+    bool overlay() const { return mOverlay; }
+    void setOverlay(bool overlay) { mOverlay = overlay; }
+    // Keep the events of this many of the last frames for exportTrace().
+    void setTraceFrames(std::size_t frames) { mTraceFrames = frames; }
+    bool gpuEnabled() const { return enabled() && mGpuActive; }
+
+    // Name the calling thread in the overlay and the trace.
+    void nameThread(const char *name)
+    {
+        auto &&buffer = threadBuffer();
+        std::lock_guard<std::mutex> lock(mThreadsMutex);
+        buffer.name = name;
+    }
+
+    // Called by ProfileScope, on any thread
+    void record(const ProfileEvent &event)
+    {
+        auto &&buffer = threadBuffer();
+        const auto head = buffer.head.load(std::memory_order_relaxed);
+        if(head - buffer.tail.load(std::memory_order_acquire) ==
+            ThreadBuffer::kCapacity)
+        {
+            buffer.dropped.fetch_add(1, std::memory_order_relaxed);
+            return;
+        }
+        buffer.events[head % ThreadBuffer::kCapacity] = event;
+        buffer.head.store(head + 1, std::memory_order_release);
+    }
+
+    // Called by GpuProfileScope on the render thread; returns the query
+    // index to end it with.
+    std::size_t beginGpu(const char *name)
+    {
+        auto &&frame = mGpuFrames[mGpuFrame];
+        if(frame.used + 2 > frame.queries.size())
+        {
+            const auto count = std::max<std::size_t>(16,
+                frame.queries.size());
+            frame.queries.resize(frame.queries.size() + count);
+            glGenQueries(static_cast<GLsizei>(count),
+                frame.queries.data() + frame.queries.size() - count);
+        }
+        frame.names.push_back(name);
+        const auto index = frame.used;
+        frame.used += 2;
+        glQueryCounter(frame.queries[index], GL_TIMESTAMP);
+        return index;
+    }
+
+    void endGpu(std::size_t index)
+    {
+        glQueryCounter(mGpuFrames[mGpuFrame].queries[index + 1],
+            GL_TIMESTAMP);
+    }
+
+    /**
+     * \brief Start a frame on the render thread. GPU scopes are timed from
+     * here on if the context has timer queries.
+     */
+    void beginFrame()
+    {
+        mFrameBegin = now();
+        if(!enabled()) return;
+        if(!mGpuChecked)
+        {
+            // Core since OpenGL 3.3
+            GLint major = 0, minor = 0;
+            glGetIntegerv(GL_MAJOR_VERSION, &major);
+            glGetIntegerv(GL_MINOR_VERSION, &minor);
+            mGpuSupported = major * 10 + minor >= 33 ||
+                hasGLExtension("GL_ARB_timer_query");
+            mGpuChecked = true;
+        }
+        if(!mGpuSupported) return;
+        // The queries of this slot were issued kGpuLatency frames ago.
+        auto &&frame = mGpuFrames[mGpuFrame];
+        readGpuFrame(frame, true);
+        glGetInteger64v(GL_TIMESTAMP, &frame.gpuBase);
+        frame.cpuBase = now();
+        frame.pending = true;
+        mGpuActive = true;
+    }
+
+    // Collect the events of all threads at the end of a frame.
+    void endFrame()
+    {
+        mGpuActive = false;
+        if(!enabled())
+        {
+            mGpuEvents.clear();
+            return;
+        }
+        Frame frame;
+        frame.begin = mFrameBegin;
+        frame.end = now();
+        {
+            std::lock_guard<std::mutex> lock(mThreadsMutex);
+            frame.threads.resize(mThreads.size() + 1);
+            for(std::size_t i = 0; i < mThreads.size(); ++i)
+            {
+                auto &&buffer = *mThreads[i];
+                const auto tail = buffer.tail.load(std::memory_order_relaxed);
+                const auto head = buffer.head.load(std::memory_order_acquire);
+                for(auto j = tail; j != head; ++j)
+                {
+                    frame.threads[i].push_back(
+                        buffer.events[j % ThreadBuffer::kCapacity]);
+                }
+                buffer.tail.store(head, std::memory_order_release);
+                mDropped += buffer.dropped.exchange(0,
+                    std::memory_order_relaxed);
+                accumulate(mCpuStats, frame.threads[i]);
+            }
+        }
+        smooth(mCpuStats);
+        pushHistory(mCpuFrameMs,
+            static_cast<float>((frame.end - frame.begin) * 1e-6));
+
+        if(mGpuSupported)
+        {
+            mGpuFrame = (mGpuFrame + 1) % kGpuLatency;
+            // Older frames whose results came in meanwhile
+            for(int i = 1; i < kGpuLatency; ++i)
+                readGpuFrame(mGpuFrames[(mGpuFrame + i) % kGpuLatency], false);
+        }
+        frame.threads.back() = std::move(mGpuEvents);
+        mGpuEvents.clear();
+
+        mTrace.push_back(std::move(frame));
+        while(mTrace.size() > mTraceFrames) mTrace.pop_front();
+    }
+
+    /**
+     * \brief Write the events of the frames kept, at most the last
+     * mTraceFrames, in the Trace Event Format of Chrome.
+     */
+    bool exportTrace(const char *path)
+    {
+        auto *file = std::fopen(path, "w");
+        if(!file)
+        {
+            std::cerr << "Cannot write " << path << std::endl;
+            return false;
+        }
+        std::vector<std::string> names;
+        {
+            std::lock_guard<std::mutex> lock(mThreadsMutex);
+            for(auto &&buffer : mThreads) names.push_back(buffer->name);
+        }
+        names.push_back("GPU");
+        auto write_string = [file](const char *s) {
+            std::fputc('"', file);
+            for(; *s; ++s)
+            {
+                if(*s == '"' || *s == '\\') std::fputc('\\', file);
+                if(static_cast<unsigned char>(*s) >= 0x20) std::fputc(*s, file);
+            }
+            std::fputc('"', file);
+        };
+
+        std::fprintf(file, "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[\n");
+        auto first = true;
+        for(std::size_t i = 0; i < names.size(); ++i)
+        {
+            std::fprintf(file, "%s{\"ph\":\"M\",\"pid\":1,\"tid\":%zu,"
+                "\"name\":\"thread_name\",\"args\":{\"name\":",
+                first ? "" : ",\n", i);
+            write_string(names[i].c_str());
+            std::fprintf(file, "}}");
+            first = false;
+        }
+        for(auto &&frame : mTrace)
+        {
+            // The frames themselves, on the render thread
+            std::fprintf(file, ",\n{\"ph\":\"X\",\"pid\":1,\"tid\":0,"
+                "\"name\":\"Frame\",\"ts\":%.3f,\"dur\":%.3f}",
+                frame.begin * 1e-3, (frame.end - frame.begin) * 1e-3);
+            for(std::size_t i = 0; i < frame.threads.size(); ++i)
+            {
+                const auto tid = i + 1 == frame.threads.size() ?
+                    names.size() - 1 : i;
+                for(auto &&event : frame.threads[i])
+                {
+                    std::fprintf(file, ",\n{\"ph\":\"X\",\"pid\":1,"
+                        "\"tid\":%zu,\"name\":", tid);
+                    write_string(event.name);
+                    std::fprintf(file, ",\"ts\":%.3f,\"dur\":%.3f}",
+                        event.begin * 1e-3, (event.end - event.begin) * 1e-3);
+                }
+            }
+        }
+        std::fprintf(file, "\n]}\n");
+        return std::fclose(file) == 0;
+    }
+
+    void emitControlWidgets()
+    {
+        auto enabled = this->enabled();
+        if(ImGui::Checkbox("Enable", &enabled)) setEnabled(enabled);
+        ImGui::SameLine();
+        ImGui::Checkbox("Overlay", &mOverlay);
+        auto trace_frames = static_cast<int>(mTraceFrames);
+        if(ImGui::SliderInt("Trace Frames", &trace_frames, 1, 1000))
+            mTraceFrames = static_cast<std::size_t>(trace_frames);
+        if(ImGui::Button("Export Chrome Trace"))
+            exportTrace("profile_trace.json");
+        ImGui::SameLine();
+        ImGui::Text("%zu frames kept", mTrace.size());
+        if(mDropped > 0)
+        {
+            ImGui::Text("%llu events dropped",
+                static_cast<unsigned long long>(mDropped));
+        }
+        if(mGpuChecked && !mGpuSupported)
+            ImGui::TextUnformatted("No timer queries, CPU only");
+    }
+
+    /**
+     * \brief The window of frame time graphs and the time per scope, shown
+     * while enabled with the overlay on.
+     */
+    void emitOverlay()
+    {
+        if(!mOverlay || !enabled()) return;
+        // At the top right, out of the way of the Scene Control window
+        const auto &io = ImGui::GetIO();
+        ImGui::SetNextWindowPos(ImVec2(io.DisplaySize.x - 430, 10),
+            ImGuiCond_FirstUseEver);
+        ImGui::SetNextWindowSize(ImVec2(420, 420), ImGuiCond_FirstUseEver);
+        ImGui::SetNextWindowBgAlpha(0.8f);
+        if(!ImGui::Begin("Profiler", &mOverlay))
+        {
+            ImGui::End();
+            return;
+        }
+        auto plot = [](const char *label, const std::vector<float> &history) {
+            if(history.empty()) return;
+            const auto max_ms = *std::max_element(history.begin(),
+                history.end());
+            char overlay[64];
+            std::snprintf(overlay, sizeof(overlay), "%.2f ms, max %.2f",
+                history.back(), max_ms);
+            ImGui::PlotLines(label, history.data(),
+                static_cast<int>(history.size()), 0, overlay, 0,
+                std::max(max_ms, 1.f), ImVec2(0, 60));
+        };
+        plot("CPU Frame", mCpuFrameMs);
+        plot("GPU Frame", mGpuFrameMs);
+
+        auto table = [](const char *title, const std::map<std::string,
+            ScopeStats, std::less<>> &stats) {
+            if(stats.empty()) return;
+            ImGui::Separator();
+            ImGui::Columns(4, title);
+            ImGui::TextUnformatted(title);
+            ImGui::NextColumn();
+            ImGui::TextUnformatted("ms");
+            ImGui::NextColumn();
+            ImGui::TextUnformatted("max ms");
+            ImGui::NextColumn();
+            ImGui::TextUnformatted("calls");
+            ImGui::NextColumn();
+            ImGui::Separator();
+            for(auto &&[name, scope] : stats)
+            {
+                ImGui::TextUnformatted(name.c_str());
+                ImGui::NextColumn();
+                ImGui::Text("%.3f", scope.averageMs);
+                ImGui::NextColumn();
+                ImGui::Text("%.3f", scope.maxMs);
+                ImGui::NextColumn();
+                ImGui::Text("%.1f", scope.averageCalls);
+                ImGui::NextColumn();
+            }
+            ImGui::Columns(1);
+        };
+        table("CPU Scope", mCpuStats);
+        table("GPU Scope", mGpuStats);
+        ImGui::End();
+    }
+};
+
+inline Profiler gProfiler;
+
+/**
+ * \brief Times the enclosing scope on the calling thread while gProfiler is
+ * enabled.
+ */
+class ProfileScope
+{
+    ProfileEvent mEvent;
+
+public:
+    explicit ProfileScope(const char *name)
+    {
+        if(!gProfiler.enabled()) return;
+        mEvent.name = name;
+        mEvent.begin = gProfiler.now();
+    }
+
+    ProfileScope(const ProfileScope &) = delete;
+    ProfileScope & operator=(const ProfileScope &) = delete;
+
+    ~ProfileScope()
+    {
+        if(!mEvent.name) return;
+        mEvent.end = gProfiler.now();
+        gProfiler.record(mEvent);
+    }
+};
+
+/**
+ * \brief Times the GPU commands issued in the enclosing scope, on the render
+ * thread, while gProfiler is enabled and timer queries are available.
+ */
+class GpuProfileScope
+{
+    std::size_t mIndex = 0;
+    bool mActive = false;
+
+public:
+    explicit GpuProfileScope(const char *name)
+    {
+        if(!gProfiler.gpuEnabled()) return;
+        mIndex = gProfiler.beginGpu(name);
+        mActive = true;
+    }
+
+    GpuProfileScope(const GpuProfileScope &) = delete;
+    GpuProfileScope & operator=(const GpuProfileScope &) = delete;
+
+    ~GpuProfileScope()
+    {
+        if(mActive) gProfiler.endGpu(mIndex);
+    }
+};
@@ -0,0 +1,774 @@
+#pragma once
+
+// Included by lab08_framework.hpp.
+
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <filesystem>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <unordered_map>
+
+#include "lab08_file_watcher.hpp"
+#include "lab08_texture_container.hpp"
+
+#ifndef GL_COMPLETION_STATUS_KHR
+#   define GL_COMPLETION_STATUS_KHR 0x91B1
+#endif
+
+inline bool readFileToString(const std::string &path, std::string &code)
+{
+    std::ifstream input(path, std::ios::in | std::ios::binary);
+    if(!input) return false;
+    std::stringstream buf;
+    buf << input.rdbuf();
+    code = buf.str();
+    return true;
+}
+
+/**
+ * \brief Put preprocessor lines in front of a shader source, after its
+ * #version directive if it has one. A #line directive keeps the line numbers
+ * in compiler messages matching the file.
+ */
+inline std::string injectDefines(const std::string &source,
+    const std::string &defines)
+{
+    if(defines.empty()) return source;
+    if(source.compare(0, 8, "#version") != 0)
+        return defines + "#line 1\n" + source;
+    const auto eol = source.find('\n');
+    if(eol == std::string::npos) return source + "\n" + defines;
+    return source.substr(0, eol + 1) + defines + "#line 2\n" +
+        source.substr(eol + 1);
+}
+
+/**
+ * \brief Whether linked programs can be read back with glGetProgramBinary()
+ * and restored with glProgramBinary(). The first call must be made on the
+ * render thread.
+ */
+inline bool programBinariesSupported()
+{
+#ifdef __APPLE__
+    // Not available in legacy contexts
+    return false;
+#else
+    static const bool supported = []() {
+        GLint formats = 0;
+        glGetIntegerv(GL_NUM_PROGRAM_BINARY_FORMATS, &formats);
+        // Old contexts report an error instead of 0.
+        while(glGetError() != GL_NO_ERROR) { }
+        return formats > 0;
+    }();
+    return supported;
+#endif
+}
+
+/**
+ * \brief Whether the driver compiles and links on its own threads and can
+ * be asked if it is done without waiting. The first call must be made on the
+ * render thread.
+ */
+inline bool parallelShaderCompileSupported()
+{
+    static const bool supported =
+        hasGLExtension("GL_KHR_parallel_shader_compile") ||
+        hasGLExtension("GL_ARB_parallel_shader_compile");
+    return supported;
+}
+
+/**
+ * \brief Identifies the driver, since program binaries are only valid for
+ * the driver that produced them.
+ */
+inline std::uint64_t driverHash()
+{
+    static const std::uint64_t hash = []() {
+        std::uint64_t h = hashBytes("", 0);
+        for(auto name : { GL_VENDOR, GL_RENDERER, GL_VERSION })
+        {
+            const auto *s = reinterpret_cast<const char *>(glGetString(name));
+            if(s) h = hashBytes(s, std::strlen(s) + 1, h);
+        }
+        return h;
+    }();
+    return hash;
+}
+
+/*****************************************************************************/
+// Shader
+/*****************************************************************************/
+
+/**
+ * \brief A linked GLSL program. The locations of its active uniforms and
+ * attributes are queried once after linking, so that looking them up while
+ * drawing does not reach into the driver.
+ */
+class Shader
+{
+    friend class ShaderCache;
+
+    GLuint mProgram = 0;
+    std::string mName;
+    std::uint64_t mHash = 0;
+    bool mFromBinary = false;
+    // Kept to rebuild the program when one of them changes
+    std::string mVertexSource;
+    std::string mFragmentSource;
+    // Put in front of the files by ShaderCache::load()
+    std::string mDefines;
+    // Names not found are remembered as -1 too.
+    mutable std::unordered_map<std::string, GLint> mUniforms;
+    mutable std::unordered_map<std::string, GLint> mAttributes;
+
+    void queryLocations()
+    {
+        mUniforms.clear();
+        mAttributes.clear();
+        GLint count = 0, max_length = 0;
+        glGetProgramiv(mProgram, GL_ACTIVE_UNIFORMS, &count);
+        glGetProgramiv(mProgram, GL_ACTIVE_UNIFORM_MAX_LENGTH, &max_length);
+        std::vector<char> name(std::max(max_length, 1));
+        for(GLint i = 0; i < count; ++i)
+        {
+            GLint size;
+            GLenum type;
+            glGetActiveUniform(mProgram, i, max_length, nullptr, &size, &type,
+                name.data());
+            // Arrays are reported as "name[0]".
+            std::string n = name.data();
+            const auto bracket = n.find('[');
+            if(bracket != std::string::npos) n.erase(bracket);
+            // Built-in gl_ uniforms have no location.
+            const auto location = glGetUniformLocation(mProgram, name.data());
+            if(location >= 0) mUniforms[n] = location;
+        }
+        glGetProgramiv(mProgram, GL_ACTIVE_ATTRIBUTES, &count);
+        glGetProgramiv(mProgram, GL_ACTIVE_ATTRIBUTE_MAX_LENGTH, &max_length);
+        name.resize(std::max(max_length, 1));
+        for(GLint i = 0; i < count; ++i)
+        {
+            GLint size;
+            GLenum type;
+            glGetActiveAttrib(mProgram, i, max_length, nullptr, &size, &type,
+                name.data());
+            const auto location = glGetAttribLocation(mProgram, name.data());
+            if(location >= 0) mAttributes[name.data()] = location;
+        }
+    }
+
+public:
+    Shader() = default;
+    Shader(const Shader &) = delete;
+    Shader & operator=(const Shader &) = delete;
+
+    ~Shader()
+    {
+        if(mProgram) glDeleteProgram(mProgram);
+    }
+
+    /**
+     * \brief The current program. Changes when the shader is reloaded, so
+     * query it when binding rather than keeping it.
+     */
+    GLuint programId() const { return mProgram; }
+    const std::string & name() const { return mName; }
+    // Hash of the sources the program was built from
+    std::uint64_t hash() const { return mHash; }
+    // Restored from a program binary rather than compiled
+    bool fromBinary() const { return mFromBinary; }
+
+    // Returns -1 if the program has no such active uniform.
+    GLint uniform(const std::string &name) const
+    {
+        auto iter = mUniforms.find(name);
+        if(iter != mUniforms.end()) return iter->second;
+        return mUniforms[name] = glGetUniformLocation(mProgram, name.c_str());
+    }
+
+    // Returns -1 if the program has no such active attribute.
+    GLint attribute(const std::string &name) const
+    {
+        auto iter = mAttributes.find(name);
+        if(iter != mAttributes.end()) return iter->second;
+        return mAttributes[name] = glGetAttribLocation(mProgram, name.c_str());
+    }
+};
+
+using ShaderHandle = std::shared_ptr<Shader>;
+
+/*****************************************************************************/
+// ShaderCache
+/*****************************************************************************/
+
+/*
+ * Linked programs are saved in kShaderCacheDirectory, one file per program
+ * named after the hash of its sources and the driver.
+ *
+ * File layout, little endian:
+ *     char[4]  "LPGB"
+ *     u32      version
+ *     u64      source hash
+ *     u64      driver hash
+ *     u32      binary format
+ *     u32      byte count
+ *     binary
+ */
+
+constexpr std::uint32_t kProgramBinaryVersion = 1;
+constexpr const char *kShaderCacheDirectory = "shader_cache";
+
+/**
+ * \brief Deduplicates programs by the hash of their sources, so that objects
+ * sharing a shader share one program no matter which files it came from.
+ * Linked programs are saved as driver binaries and restored on later runs
+ * instead of being compiled again. Compiling from source remains the
+ * fallback whenever binaries are unsupported, missing or rejected, e.g.
+ * after a driver update.
+ *
+ * Shaders loaded from files are reloaded when the files change. A watcher
+ * thread re-reads the sources, and update() starts building the new program
+ * on the render thread without waiting for it. Objects keep drawing with the
+ * old program until the new one has linked; if it fails, the old one stays
+ * and the error is shown by emitErrorWindow().
+ */
+class ShaderCache
+{
+    // A program being compiled and linked, possibly by driver threads
+    struct Build
+    {
+        GLuint program = 0;
+        GLuint vertexShader = 0;
+        GLuint fragmentShader = 0;
+    };
+
+    // A reload of a shader waiting for its new program
+    struct Reload
+    {
+        std::weak_ptr<Shader> shader;
+        Build build;
+        std::uint64_t hash = 0;
+        std::string vertexSource;
+        std::string fragmentSource;
+    };
+
+    struct WatchedFile
+    {
+        std::weak_ptr<Shader> shader;
+        GLenum stage = GL_VERTEX_SHADER;
+    };
+
+    std::unordered_map<std::uint64_t, ShaderHandle> mPrograms;
+    bool mUseBinaries = true;
+    bool mHotReload = true;
+
+    // Shaders to rebuild when a file changes, by canonical path
+    std::unordered_multimap<std::string, WatchedFile> mWatched;
+    std::vector<Reload> mReloads;
+    // The last error of each shader, by name
+    std::unordered_map<std::string, std::string> mErrors;
+
+    std::uint64_t mHits = 0;
+    std::uint64_t mCompiled = 0;
+    std::uint64_t mRestored = 0;
+    std::uint64_t mReloaded = 0;
+    // Time spent creating programs
+    double mBuildMs = 0;
+
+    // Content of changed files, written by the watcher thread
+    std::mutex mChangedMutex;
+    std::unordered_map<std::string, std::string> mChanged;
+    // Last, so that its thread stops before the members it uses go away.
+    FileWatcher mWatcher { [this](const std::string &path) {
+        std::string code;
+        if(!readFileToString(path, code)) return;
+        std::lock_guard<std::mutex> lock(mChangedMutex);
+        mChanged[path] = std::move(code);
+    } };
+
+    static std::uint64_t sourceHash(const std::string &vertex_source,
+        const std::string &fragment_source)
+    {
+        // Hash the lengths too, so that moving code from one stage to the
+        // other changes the hash.
+        const std::uint64_t lengths[2] = {
+            vertex_source.size(), fragment_source.size() };
+        auto hash = hashBytes(lengths, sizeof(lengths));
+        hash = hashBytes(vertex_source.data(), vertex_source.size(), hash);
+        return hashBytes(fragment_source.data(), fragment_source.size(), hash);
+    }
+
+    static std::string binaryPath(std::uint64_t hash)
+    {
+        char name[32];
+        std::snprintf(name, sizeof(name), "%016llx.bin",
+            static_cast<unsigned long long>(hash ^ driverHash()));
+        return (std::filesystem::path(kShaderCacheDirectory) / name).string();
+    }
+
+    /**
+     * \brief Issue the compile and link commands without asking for their
+     * results, which would wait for the compiler.
+     */
+    static Build startBuild(const std::string &vertex_source,
+        const std::string &fragment_source, bool retrievable)
+    {
+        Build build;
+        build.vertexShader = glCreateShader(GL_VERTEX_SHADER);
+        build.fragmentShader = glCreateShader(GL_FRAGMENT_SHADER);
+        const char *code = vertex_source.c_str();
+        glShaderSource(build.vertexShader, 1, &code, nullptr);
+        glCompileShader(build.vertexShader);
+        code = fragment_source.c_str();
+        glShaderSource(build.fragmentShader, 1, &code, nullptr);
+        glCompileShader(build.fragmentShader);
+
+        build.program = glCreateProgram();
+#ifndef __APPLE__
+        if(retrievable)
+        {
+            glProgramParameteri(build.program,
+                GL_PROGRAM_BINARY_RETRIEVABLE_HINT, GL_TRUE);
+        }
+#endif
+        glAttachShader(build.program, build.vertexShader);
+        glAttachShader(build.program, build.fragmentShader);
+        glLinkProgram(build.program);
+        return build;
+    }
+
+    // Whether finishBuild() would not wait for the compiler.
+    static bool buildDone(const Build &build)
+    {
+        GLint done = GL_TRUE;
+        if(parallelShaderCompileSupported())
+            glGetProgramiv(build.program, GL_COMPLETION_STATUS_KHR, &done);
+        return done == GL_TRUE;
+    }
+
+    static std::string shaderLog(GLuint shader)
+    {
+        GLint status = GL_FALSE, length = 0;
+        glGetShaderiv(shader, GL_COMPILE_STATUS, &status);
+        if(status == GL_TRUE) return { };
+        glGetShaderiv(shader, GL_INFO_LOG_LENGTH, &length);
+        std::vector<char> log(std::max(length, 1));
+        glGetShaderInfoLog(shader, length, nullptr, log.data());
+        return log.data();
+    }
+
+    /**
+     * \brief Collect the result of a build. Returns the program, or 0 with
+     * the compiler and linker messages.
+     */
+    static GLuint finishBuild(Build &build, std::string &error)
+    {
+        GLint status = GL_FALSE;
+        glGetProgramiv(build.program, GL_LINK_STATUS, &status);
+        if(status != GL_TRUE)
+        {
+            const auto vertex_log = shaderLog(build.vertexShader);
+            const auto fragment_log = shaderLog(build.fragmentShader);
+            if(!vertex_log.empty()) error += "Vertex shader:\n" + vertex_log;
+            if(!fragment_log.empty())
+                error += "Fragment shader:\n" + fragment_log;
+            if(vertex_log.empty() && fragment_log.empty())
+            {
+                GLint length = 0;
+                glGetProgramiv(build.program, GL_INFO_LOG_LENGTH, &length);
+                std::vector<char> log(std::max(length, 1));
+                glGetProgramInfoLog(build.program, length, nullptr,
+                    log.data());
+                error += "Link:\n" + std::string(log.data());
+            }
+        }
+        glDetachShader(build.program, build.vertexShader);
+        glDetachShader(build.program, build.fragmentShader);
+        glDeleteShader(build.vertexShader);
+        glDeleteShader(build.fragmentShader);
+        if(status == GL_TRUE) return build.program;
+        glDeleteProgram(build.program);
+        return 0;
+    }
+
+    /**
+     * \brief Throw a build away without asking for its result. The driver
+     * deletes the objects once it is done with them.
+     */
+    static void cancelBuild(Build &build)
+    {
+        glDeleteShader(build.vertexShader);
+        glDeleteShader(build.fragmentShader);
+        glDeleteProgram(build.program);
+        build = Build();
+    }
+
+    void reportError(const std::string &name, const std::string &error)
+    {
+        std::cerr << "Cannot build shader " << name << ":\n" << error
+            << std::endl;
+        mErrors[name] = error;
+    }
+
+    /**
+     * \brief Start rebuilding the shaders using changed files. A reload
+     * already in flight for a shader is superseded.
+     */
+    void startReloads()
+    {
+        std::unordered_map<std::string, std::string> changed;
+        {
+            std::lock_guard<std::mutex> lock(mChangedMutex);
+            changed.swap(mChanged);
+        }
+        if(!mHotReload) return;
+
+        for(auto &&file : changed)
+        {
+            const auto range = mWatched.equal_range(file.first);
+            for(auto iter = range.first; iter != range.second; ++iter)
+            {
+                auto shader = iter->second.shader.lock();
+                if(!shader) continue;
+
+                // Start from the sources of a pending reload, so that
+                // changing both files in a row keeps both changes.
+                auto pending = std::find_if(mReloads.begin(), mReloads.end(),
+                    [&](const Reload &r) {
+                        return r.shader.lock() == shader;
+                    });
+                Reload reload;
+                reload.shader = shader;
+                reload.vertexSource = pending != mReloads.end() ?
+                    pending->vertexSource : shader->mVertexSource;
+                reload.fragmentSource = pending != mReloads.end() ?
+                    pending->fragmentSource : shader->mFragmentSource;
+                (iter->second.stage == GL_VERTEX_SHADER ?
+                    reload.vertexSource : reload.fragmentSource) =
+                    injectDefines(file.second, shader->mDefines);
+                reload.hash = sourceHash(reload.vertexSource,
+                    reload.fragmentSource);
+                if(pending != mReloads.end())
+                {
+                    if(pending->hash == reload.hash) continue;
+                    cancelBuild(pending->build);
+                    mReloads.erase(pending);
+                }
+                // Saved without changes, or a broken edit was undone
+                if(reload.hash == shader->mHash)
+                {
+                    mErrors.erase(shader->mName);
+                    continue;
+                }
+
+                reload.build = startBuild(reload.vertexSource,
+                    reload.fragmentSource,
+                    mUseBinaries && programBinariesSupported());
+                mReloads.push_back(std::move(reload));
+            }
+        }
+    }
+
+    /**
+     * \brief Swap in the programs which finished linking. Builds are
+     * started after this in update(), so without
+     * GL_KHR_parallel_shader_compile the result is collected a frame after
+     * the build started, giving drivers that compile on their own threads
+     * the time to finish.
+     */
+    void finishReloads()
+    {
+        for(auto iter = mReloads.begin(); iter != mReloads.end(); )
+        {
+            if(!buildDone(iter->build))
+            {
+                ++iter;
+                continue;
+            }
+            auto shader = iter->shader.lock();
+            std::string error;
+            const auto program = finishBuild(iter->build, error);
+            if(!shader)
+            {
+                if(program) glDeleteProgram(program);
+            }
+            else if(!program)
+            {
+                reportError(shader->mName, error);
+            }
+            else
+            {
+                auto cached = mPrograms.find(shader->mHash);
+                if(cached != mPrograms.end() && cached->second == shader)
+                    mPrograms.erase(cached);
+                glDeleteProgram(shader->mProgram);
+                shader->mProgram = program;
+                shader->mHash = iter->hash;
+                shader->mFromBinary = false;
+                shader->mVertexSource = std::move(iter->vertexSource);
+                shader->mFragmentSource = std::move(iter->fragmentSource);
+                shader->queryLocations();
+                mPrograms[shader->mHash] = shader;
+                if(mUseBinaries && programBinariesSupported())
+                    saveBinary(program, shader->mHash);
+                mErrors.erase(shader->mName);
+                ++mReloaded;
+            }
+            iter = mReloads.erase(iter);
+        }
+    }
+
+    // Returns 0 if there is no usable binary.
+    static GLuint restoreBinary(std::uint64_t hash)
+    {
+#ifdef __APPLE__
+        return 0;
+#else
+        std::ifstream file(binaryPath(hash), std::ios::binary);
+        if(!file) return 0;
+        auto read = [&](auto &value) {
+            return static_cast<bool>(
+                file.read(reinterpret_cast<char *>(&value), sizeof(value)));
+        };
+        char magic[4];
+        std::uint32_t version, format, size;
+        std::uint64_t source_hash, driver_hash;
+        if(!file.read(magic, 4) || std::memcmp(magic, "LPGB", 4) != 0) return 0;
+        if(!read(version) || version != kProgramBinaryVersion) return 0;
+        if(!read(source_hash) || source_hash != hash) return 0;
+        if(!read(driver_hash) || driver_hash != driverHash()) return 0;
+        if(!read(format) || !read(size) || size == 0) return 0;
+        std::vector<char> binary(size);
+        if(!file.read(binary.data(), size)) return 0;
+
+        const auto program = glCreateProgram();
+        glProgramBinary(program, format, binary.data(),
+            static_cast<GLsizei>(size));
+        // The driver may reject binaries, e.g. after an update.
+        GLint status = GL_FALSE;
+        glGetProgramiv(program, GL_LINK_STATUS, &status);
+        while(glGetError() != GL_NO_ERROR) { }
+        if(status == GL_TRUE) return program;
+        glDeleteProgram(program);
+        return 0;
+#endif
+    }
+
+    /**
+     * \brief Write a program binary through a temporary file, so that a
+     * concurrently starting instance never reads a partial one.
+     */
+    static bool saveBinary(GLuint program, std::uint64_t hash)
+    {
+#ifdef __APPLE__
+        return false;
+#else
+        GLint length = 0;
+        glGetProgramiv(program, GL_PROGRAM_BINARY_LENGTH, &length);
+        if(length <= 0) return false;
+        std::vector<char> binary(length);
+        GLenum format = 0;
+        glGetProgramBinary(program, length, &length, &format, binary.data());
+        if(length <= 0) return false;
+
+        std::error_code ec;
+        std::filesystem::create_directories(kShaderCacheDirectory, ec);
+        const auto path = binaryPath(hash);
+        const auto temp_path = path + ".tmp" + std::to_string(
+            std::hash<std::thread::id>()(std::this_thread::get_id()));
+        {
+            std::ofstream file(temp_path, std::ios::binary);
+            if(!file) return false;
+            auto write = [&](auto value) {
+                file.write(reinterpret_cast<const char *>(&value),
+                    sizeof(value));
+            };
+            file.write("LPGB", 4);
+            write(kProgramBinaryVersion);
+            write(hash);
+            write(driverHash());
+            write(static_cast<std::uint32_t>(format));
+            write(static_cast<std::uint32_t>(length));
+            file.write(binary.data(), length);
+            if(!file) return false;
+        }
+        std::filesystem::rename(temp_path, path, ec);
+        if(!ec) return true;
+        std::filesystem::remove(temp_path, ec);
+        return false;
+#endif
+    }
+
+public:
+    std::size_t size() const { return mPrograms.size(); }
+    std::uint64_t hits() const { return mHits; }
+    std::uint64_t compiled() const { return mCompiled; }
+    std::uint64_t restored() const { return mRestored; }
+
+    /**
+     * \brief Get the program for a pair of shader sources, building it if no
+     * program with the same sources exists. The name is used in error
+     * messages. Returns nullptr if the sources do not compile or link.
+     */
+    ShaderHandle acquire(const std::string &vertex_source,
+        const std::string &fragment_source, const std::string &name)
+    {
+        const auto hash = sourceHash(vertex_source, fragment_source);
+        auto iter = mPrograms.find(hash);
+        if(iter != mPrograms.end())
+        {
+            ++mHits;
+            return iter->second;
+        }
+
+        const auto start = std::chrono::steady_clock::now();
+        const auto binaries = mUseBinaries && programBinariesSupported();
+        auto shader = std::make_shared<Shader>();
+        shader->mName = name;
+        shader->mHash = hash;
+        shader->mVertexSource = vertex_source;
+        shader->mFragmentSource = fragment_source;
+        if(binaries) shader->mProgram = restoreBinary(hash);
+        shader->mFromBinary = shader->mProgram != 0;
+        if(!shader->mProgram)
+        {
+            auto build = startBuild(vertex_source, fragment_source, binaries);
+            std::string error;
+            shader->mProgram = finishBuild(build, error);
+            if(!shader->mProgram)
+            {
+                reportError(name, error);
+                return nullptr;
+            }
+            if(binaries) saveBinary(shader->mProgram, hash);
+        }
+        mErrors.erase(name);
+        shader->queryLocations();
+        ++(shader->mFromBinary ? mRestored : mCompiled);
+        const std::chrono::duration<double, std::milli> ms =
+            std::chrono::steady_clock::now() - start;
+        mBuildMs += ms.count();
+
+        mPrograms[hash] = shader;
+        return shader;
+    }
+
+    /**
+     * \brief Like acquire(), with the sources read from files. The defines
+     * are put in front of both sources, and the variant is added to the name
+     * to tell programs built from the same files apart.
+     */
+    ShaderHandle load(const std::string &vertex_path,
+        const std::string &fragment_path, const std::string &defines = { },
+        const std::string &variant = { })
+    {
+        std::string vertex_source, fragment_source;
+        if(!readFileToString(vertex_path, vertex_source) ||
+            !readFileToString(fragment_path, fragment_source))
+        {
+            std::cerr << "Cannot read shader " << vertex_path << " or "
+                << fragment_path << std::endl;
+            return nullptr;
+        }
+        auto name = vertex_path + " + " + fragment_path;
+        if(!variant.empty()) name += " [" + variant + "]";
+        auto shader = acquire(injectDefines(vertex_source, defines),
+            injectDefines(fragment_source, defines), name);
+        if(!shader) return nullptr;
+        shader->mDefines = defines;
+
+        const std::pair<std::string, GLenum> files[] = {
+            { vertex_path, GL_VERTEX_SHADER },
+            { fragment_path, GL_FRAGMENT_SHADER } };
+        for(auto &&file : files)
+        {
+            std::error_code ec;
+            auto path = std::filesystem::weakly_canonical(file.first, ec);
+            const auto key = ec ? file.first : path.string();
+            const auto range = mWatched.equal_range(key);
+            const auto known = std::any_of(range.first, range.second,
+                [&](const auto &w) {
+                    return w.second.shader.lock() == shader &&
+                        w.second.stage == file.second;
+                });
+            if(!known) mWatched.insert({ key, { shader, file.second } });
+            mWatcher.watch(key);
+        }
+        return shader;
+    }
+
+    /**
+     * \brief Pick up changed shader files. Call once per frame on the render
+     * thread; never waits for the compiler.
+     */
+    void update()
+    {
+        finishReloads();
+        startReloads();
+    }
+
+    /**
+     * \brief Drop every program that is not in use.
+     */
+    void clearUnused()
+    {
+        for(auto iter = mPrograms.begin(); iter != mPrograms.end(); )
+        {
+            if(iter->second.use_count() == 1) iter = mPrograms.erase(iter);
+            else ++iter;
+        }
+    }
+
+    void emitControlWidgets()
+    {
+        if(programBinariesSupported())
+            ImGui::Checkbox("Program Binaries", &mUseBinaries);
+        else
+            ImGui::Text("Program binaries not supported");
+        ImGui::Text("%zu programs: %llu compiled, %llu restored, %llu hits",
+            mPrograms.size(),
+            static_cast<unsigned long long>(mCompiled),
+            static_cast<unsigned long long>(mRestored),
+            static_cast<unsigned long long>(mHits));
+        ImGui::Text("Build time: %.1f ms", mBuildMs);
+        ImGui::Checkbox("Hot Reload", &mHotReload);
+        ImGui::SameLine();
+        ImGui::Text("%llu reloaded, %zu building",
+            static_cast<unsigned long long>(mReloaded), mReloads.size());
+        for(auto &&program : mPrograms)
+        {
+            ImGui::BulletText("%s (%s, %zu uniforms)",
+                program.second->name().c_str(),
+                program.second->fromBinary() ? "binary" : "source",
+                program.second->mUniforms.size());
+        }
+        if(ImGui::Button("Clear Unused")) clearUnused();
+    }
+
+    /**
+     * \brief Show the messages of shaders that failed to build in a window
+     * of their own, as long as there are any.
+     */
+    void emitErrorWindow()
+    {
+        if(mErrors.empty()) return;
+        ImGui::SetNextWindowSize(ImVec2(480, 240), ImGuiCond_FirstUseEver);
+        if(ImGui::Begin("Shader Errors"))
+        {
+            for(auto &&error : mErrors)
+            {
+                ImGui::TextColored(ImVec4(1, 0.4f, 0.4f, 1), "%s",
+                    error.first.c_str());
+                ImGui::TextWrapped("%s", error.second.c_str());
+                ImGui::Separator();
+            }
+            ImGui::TextDisabled("The previous program stays in use.");
+        }
+        ImGui::End();
+    }
+};
+
+inline ShaderCache gShaderCache;
@@ -0,0 +1,328 @@
+#pragma once
+
+// Included by lab08_framework.hpp after lab08_shader.hpp.
+
+#include <chrono>
+#include <cstdint>
+#include <fstream>
+#include <map>
+#include <sstream>
+#include <string>
+
+/*****************************************************************************/
+// ShaderKey
+/*****************************************************************************/
+
+// Optional features of an uber shader, one bit each in ShaderKey
+enum class ShaderFeature
+{
+    TEXTURE,
+    NORMAL_MAP,
+    DIRECTIONAL_LIGHTS,
+    FOG_LINEAR,
+    FOG_EXP,
+    FOG_EXP2,
+    SHADOW_CASCADES,
+    SHADOW_CUBE,
+    SH_AMBIENT,
+    COUNT
+};
+
+inline const char * shaderFeatureName(ShaderFeature feature)
+{
+    switch(feature)
+    {
+        case ShaderFeature::TEXTURE: return "texture";
+        case ShaderFeature::NORMAL_MAP: return "normal_map";
+        case ShaderFeature::DIRECTIONAL_LIGHTS: return "directional";
+        case ShaderFeature::FOG_LINEAR: return "fog_linear";
+        case ShaderFeature::FOG_EXP: return "fog_exp";
+        case ShaderFeature::FOG_EXP2: return "fog_exp2";
+        case ShaderFeature::SHADOW_CASCADES: return "shadow_cascades";
+        case ShaderFeature::SHADOW_CUBE: return "shadow_cube";
+        case ShaderFeature::SH_AMBIENT: return "sh_ambient";
+        default: return "?";
+    }
+}
+
+// The preprocessor symbol switching the feature on
+inline const char * shaderFeatureDefine(ShaderFeature feature)
+{
+    switch(feature)
+    {
+        case ShaderFeature::TEXTURE: return "TEXTURED";
+        case ShaderFeature::NORMAL_MAP: return "NORMAL_MAP";
+        case ShaderFeature::DIRECTIONAL_LIGHTS: return "DIRECTIONAL_LIGHTS";
+        case ShaderFeature::FOG_LINEAR: return "FOG_LINEAR";
+        case ShaderFeature::FOG_EXP: return "FOG_EXP";
+        case ShaderFeature::FOG_EXP2: return "FOG_EXP2";
+        case ShaderFeature::SHADOW_CASCADES: return "SHADOW_CASCADES";
+        case ShaderFeature::SHADOW_CUBE: return "SHADOW_CUBE";
+        case ShaderFeature::SH_AMBIENT: return "SH_AMBIENT";
+        default: return "";
+    }
+}
+
+constexpr int kMaxShaderLights = 8;
+
+/**
+ * \brief Selects a permutation of an uber shader: a set of features and the
+ * number of lights. Written as e.g. "lights=2 texture fog_exp2" in manifests.
+ */
+struct ShaderKey
+{
+    std::uint32_t features = 0;
+    int lights = 0;
+
+    bool has(ShaderFeature feature) const
+    {
+        return features & (1u << static_cast<int>(feature));
+    }
+
+    void set(ShaderFeature feature, bool on = true)
+    {
+        const auto bit = 1u << static_cast<int>(feature);
+        features = on ? features | bit : features & ~bit;
+    }
+
+    std::uint32_t packed() const
+    {
+        return features | static_cast<std::uint32_t>(lights) << 16;
+    }
+
+    std::string defines() const
+    {
+        auto out = "#define NUM_LIGHTS " + std::to_string(lights) + "\n";
+        for(int i = 0; i < static_cast<int>(ShaderFeature::COUNT); ++i)
+        {
+            if(has(static_cast<ShaderFeature>(i)))
+            {
+                out += "#define ";
+                out += shaderFeatureDefine(static_cast<ShaderFeature>(i));
+                out += "\n";
+            }
+        }
+        return out;
+    }
+
+    std::string name() const
+    {
+        auto out = "lights=" + std::to_string(lights);
+        for(int i = 0; i < static_cast<int>(ShaderFeature::COUNT); ++i)
+        {
+            if(has(static_cast<ShaderFeature>(i)))
+            {
+                out += " ";
+                out += shaderFeatureName(static_cast<ShaderFeature>(i));
+            }
+        }
+        return out;
+    }
+
+    /**
+     * \brief Parse a key written by name(). Returns false with a reason for
+     * unknown words.
+     */
+    static bool parse(const std::string &text, ShaderKey &key,
+        std::string &error)
+    {
+        key = { };
+        std::istringstream words(text);
+        std::string word;
+        while(words >> word)
+        {
+            if(word.compare(0, 7, "lights=") == 0)
+            {
+                key.lights = std::atoi(word.c_str() + 7);
+                if(key.lights < 0 || key.lights > kMaxShaderLights)
+                {
+                    error = "bad light count " + word;
+                    return false;
+                }
+                continue;
+            }
+            auto known = false;
+            for(int i = 0; i < static_cast<int>(ShaderFeature::COUNT); ++i)
+            {
+                const auto feature = static_cast<ShaderFeature>(i);
+                if(word == shaderFeatureName(feature))
+                {
+                    key.set(feature);
+                    known = true;
+                }
+            }
+            if(!known)
+            {
+                error = "unknown feature " + word;
+                return false;
+            }
+        }
+        return true;
+    }
+};
+
+/**
+ * \brief The part of the key given by the fixed-function state of a pass:
+ * which lights are enabled, whether they are all directional, and the fog.
+ * Reading it takes a query of the driver per light, so DrawQueue reads it
+ * once per pass rather than for each object.
+ */
+struct SceneShading
+{
+    ShaderKey key;
+    // For each light up to the last enabled one whether it is enabled, for
+    // the lightEnabled uniform
+    GLfloat lightEnabled[kMaxShaderLights] { };
+    bool texturing = false;
+
+    // The same with only those of the enabled lights in mask, e.g. the lights
+    // assigned to an object.
+    SceneShading withLights(std::uint32_t mask) const
+    {
+        auto shading = *this;
+        // Without lighting, or lighting with only the ambient and emission
+        if(key.lights == 0) return shading;
+        shading.key.lights = 1;
+        for(int i = 0; i < kMaxShaderLights; ++i)
+        {
+            if(!(mask & (1u << i))) shading.lightEnabled[i] = 0;
+            else if(lightEnabled[i] != 0) shading.key.lights = i + 1;
+        }
+        return shading;
+    }
+};
+
+inline SceneShading currentSceneShading()
+{
+    SceneShading shading;
+    auto &&key = shading.key;
+    if(glIsEnabled(GL_LIGHTING))
+    {
+        auto directional = true;
+        for(int i = 0; i < kMaxShaderLights; ++i)
+        {
+            if(!glIsEnabled(GL_LIGHT0 + i)) continue;
+            shading.lightEnabled[i] = 1;
+            key.lights = i + 1;
+            GLfloat position[4];
+            glGetLightfv(GL_LIGHT0 + i, GL_POSITION, position);
+            if(position[3] != 0) directional = false;
+        }
+        // Lighting without lights still adds the ambient and emission.
+        if(key.lights == 0) key.lights = 1;
+        key.set(ShaderFeature::DIRECTIONAL_LIGHTS, directional);
+    }
+    if(glIsEnabled(GL_FOG))
+    {
+        GLint mode = GL_EXP;
+        glGetIntegerv(GL_FOG_MODE, &mode);
+        key.set(mode == GL_LINEAR ? ShaderFeature::FOG_LINEAR :
+            mode == GL_EXP2 ? ShaderFeature::FOG_EXP2 : ShaderFeature::FOG_EXP);
+    }
+    shading.texturing = glIsEnabled(GL_TEXTURE_2D);
+    return shading;
+}
+
+/*****************************************************************************/
+// ShaderPermutations
+/*****************************************************************************/
+
+/**
+ * \brief The variants of an uber shader, each built with the defines of its
+ * ShaderKey through gShaderCache when first used, and kept by key. Variants
+ * used in a session can be written to a manifest and built ahead of time on
+ * the next start, which is nearly free once their binaries are cached.
+ */
+class ShaderPermutations
+{
+    std::string mVertexPath;
+    std::string mFragmentPath;
+    // nullptr for variants which failed to build, so they are not retried
+    // every frame. Hot reload fixes them in gShaderCache.
+    std::map<std::uint32_t, std::pair<ShaderKey, ShaderHandle>> mVariants;
+    double mPrewarmMs = 0;
+
+public:
+    ShaderPermutations(std::string vertex_path, std::string fragment_path)
+        : mVertexPath(std::move(vertex_path))
+        , mFragmentPath(std::move(fragment_path))
+    {
+    }
+
+    std::size_t size() const { return mVariants.size(); }
+
+    // Returns nullptr if the variant does not build.
+    const ShaderHandle & acquire(const ShaderKey &key)
+    {
+        auto iter = mVariants.find(key.packed());
+        if(iter != mVariants.end()) return iter->second.second;
+        auto &&variant = mVariants[key.packed()];
+        variant.first = key;
+        variant.second = gShaderCache.load(mVertexPath, mFragmentPath,
+            key.defines(), key.name());
+        return variant.second;
+    }
+
+    /**
+     * \brief Build the variants listed in a manifest, one key per line.
+     * Empty lines and lines starting with # are skipped. Returns the number
+     * of variants built.
+     */
+    int prewarm(const std::string &manifest_path)
+    {
+        std::ifstream manifest(manifest_path);
+        if(!manifest)
+        {
+            std::cerr << "Cannot open shader manifest " << manifest_path
+                << std::endl;
+            return 0;
+        }
+        const auto start = std::chrono::steady_clock::now();
+        int built = 0;
+        std::string line;
+        for(int number = 1; std::getline(manifest, line); ++number)
+        {
+            if(line.empty() || line[0] == '#') continue;
+            ShaderKey key;
+            std::string error;
+            if(!ShaderKey::parse(line, key, error))
+            {
+                std::cerr << manifest_path << ":" << number << ": " << error
+                    << std::endl;
+                continue;
+            }
+            if(acquire(key)) ++built;
+        }
+        const std::chrono::duration<double, std::milli> ms =
+            std::chrono::steady_clock::now() - start;
+        mPrewarmMs = ms.count();
+        return built;
+    }
+
+    /**
+     * \brief Write the keys of all variants used so far as a manifest.
+     */
+    bool saveManifest(const std::string &manifest_path) const
+    {
+        std::ofstream manifest(manifest_path);
+        manifest << "# Variants of " << mVertexPath << " + " << mFragmentPath
+            << " built at startup\n";
+        for(auto &&variant : mVariants)
+        {
+            if(variant.second.second)
+                manifest << variant.second.first.name() << "\n";
+        }
+        return static_cast<bool>(manifest);
+    }
+
+    void emitControlWidgets()
+    {
+        ImGui::Text("%zu variants, prewarmed in %.1f ms", mVariants.size(),
+            mPrewarmMs);
+        for(auto &&variant : mVariants)
+        {
+            ImGui::BulletText("%s%s", variant.second.first.name().c_str(),
+                variant.second.second ? "" : " (failed)");
+        }
+    }
+};
@@ -1,39 +1,13 @@
 ﻿#include "lab08_framework.hpp"
 
+#include <random>
+
+#include "lab08_path_tracer.hpp"
+
 /*****************************************************************************/
 // Scene Objects
 /*****************************************************************************/
 
-struct Material
-{
-    // These are default values as said in
-    // https://www.khronos.org/registry/OpenGL-Refpages/gl2.1/xhtml/glMaterial.xml
-
-    glm::vec4 ambient { 0.2f, 0.2f, 0.2f, 1.0f };
-    glm::vec4 diffuse { 0.8f, 0.8f, 0.8f, 1.0f };
-    glm::vec4 specular { 0, 0, 0, 1 };
-    glm::vec4 emission { 0, 0, 0, 1 };
-    float shininess = 0;
-
-    void emitControlWidgets()
-    {
-        ImGui::SliderFloat4("Ambient", &ambient.x, 0, 1);
-        ImGui::SliderFloat4("Diffuse", &diffuse.x, 0, 1);
-        ImGui::SliderFloat4("Specular", &specular.x, 0, 1);
-        ImGui::SliderFloat4("Emission", &emission.x, 0, 1);
-        ImGui::SliderFloat("Shininess", &shininess, 0, 128);
-    }
-
-    void apply()
-    {
-        glMaterialfv(GL_FRONT, GL_AMBIENT, &ambient.x);
-        glMaterialfv(GL_FRONT, GL_DIFFUSE, &diffuse.x);
-        glMaterialfv(GL_FRONT, GL_SPECULAR, &specular.x);
-        glMaterialfv(GL_FRONT, GL_EMISSION, &emission.x);
-        glMaterialfv(GL_FRONT, GL_SHININESS, &shininess);
-    }
-};
-
 class Light : public Object
 {
 public:
@@ -44,6 +18,13 @@ public:
     glm::vec4 specular { 1, 1, 1, 1 };
     bool directional = true;
     int light_idx = GL_LIGHT0;
+    // Constant, linear and quadratic, of point lights only
+    glm::vec3 attenuation { 1, 0, 0 };
+    // How far the light reaches for DrawQueue, 0 to derive it from the
+    // attenuation
+    float range = 0;
+    // Cast the shadows of ShadowMaps
+    bool shadows = false;
 
     Light() = default;
 
@@ -60,6 +41,15 @@ public:
         ImGui::SliderFloat4("Diffuse", &diffuse.x, 0, 1);
         ImGui::SliderFloat4("Specular", &specular.x, 0, 1);
         ImGui::Checkbox("Directional", &directional);
+        ImGui::SliderFloat3("Attenuation", &attenuation.x, 0, 2);
+        ImGui::SliderFloat("Range", &range, 0, 100);
+    }
+
+    // The position given to glLight() by draw(), in world space
+    glm::vec4 worldPosition() const
+    {
+        return localToWorldMatrix() *
+            glm::vec4(mPosition, directional ? 0.f : 1.f);
     }
 
     void draw(float dt) override
@@ -69,24 +59,235 @@ public:
         glLightfv(light_idx, GL_SPECULAR, &specular.x);
         glm::vec4 pos { mPosition, directional ? 0 : 1 };
         glLightfv(light_idx, GL_POSITION, &pos.x);
+        glLightf(light_idx, GL_CONSTANT_ATTENUATION, attenuation.x);
+        glLightf(light_idx, GL_LINEAR_ATTENUATION, attenuation.y);
+        glLightf(light_idx, GL_QUADRATIC_ATTENUATION, attenuation.z);
+    }
+
+    // Where the light is and how far it reaches, in the eye space of view
+    LightInfluence influence(const glm::mat4 &view) const
+    {
+        LightInfluence influence;
+        influence.index = light_idx - GL_LIGHT0;
+        influence.position = glm::vec3(view * worldPosition());
+        influence.intensity = std::max({ diffuse.x, diffuse.y, diffuse.z });
+        if(!directional)
+        {
+            influence.attenuation = attenuation;
+            influence.radius = range > 0 ? range :
+                attenuationRadius(influence.intensity, attenuation);
+        }
+        return influence;
+    }
+
+    bool affectsOtherDraws() const override
+    {
+        return true;
+    }
+
+    void rasterize(SoftwareRenderer &renderer) override
+    {
+        SoftwareLight light;
+        std::copy_n(&ambient.x, 4, light.ambient);
+        std::copy_n(&diffuse.x, 4, light.diffuse);
+        std::copy_n(&specular.x, 4, light.specular);
+        const glm::vec4 pos { mPosition, directional ? 0.f : 1.f };
+        std::copy_n(&pos.x, 4, light.position);
+        std::copy_n(&attenuation.x, 3, light.attenuation);
+        renderer.setLight(light_idx - GL_LIGHT0, light);
+    }
+};
+
+// A lit square in the XZ plane, split into cells so that per-vertex lighting
+// also shows some shape of the lights.
+class Floor : public Object
+{
+    float mHalfSize = 20;
+    int mCells = 32;
+
+public:
+    Floor() = default;
+
+    explicit Floor(float half_size)
+        : mHalfSize(half_size)
+    {
+    }
+
+    float boundingRadius() const override
+    {
+        return mHalfSize * 1.4142136f;
+    }
+
+    void draw(float dt) override
+    {
+        const auto step = 2 * mHalfSize / mCells;
+        glNormal3f(0, 1, 0);
+        for(int z = 0; z < mCells; ++z)
+        {
+            glBegin(GL_QUAD_STRIP);
+            for(int x = 0; x <= mCells; ++x)
+            {
+                glTexCoord2f(1.f * x / mCells, 1.f * z / mCells);
+                glVertex3f(-mHalfSize + x * step, 0, -mHalfSize + z * step);
+                glTexCoord2f(1.f * x / mCells, 1.f * (z + 1) / mCells);
+                glVertex3f(-mHalfSize + x * step, 0,
+                    -mHalfSize + (z + 1) * step);
+            }
+            glEnd();
+        }
+    }
+
+    void rasterize(SoftwareRenderer &renderer) override
+    {
+        const auto step = 2 * mHalfSize / mCells;
+        auto vertex = [&](int x, int z) {
+            return SoftwareVertex { { -mHalfSize + x * step, 0,
+                -mHalfSize + z * step }, { 0, 1, 0 },
+                { 1.f * x / mCells, 1.f * z / mCells } };
+        };
+        std::vector<SoftwareVertex> v;
+        for(int z = 0; z < mCells; ++z)
+        {
+            for(int x = 0; x < mCells; ++x)
+            {
+                v.insert(v.end(), { vertex(x, z), vertex(x, z + 1),
+                    vertex(x + 1, z + 1), vertex(x, z), vertex(x + 1, z + 1),
+                    vertex(x + 1, z) });
+            }
+        }
+        renderer.drawTriangles(v.data(), v.size());
     }
 };
 
 Object gSceneRoot;
 auto *gAxis = gSceneRoot.addChild<Axis>();
 auto *gGround = gSceneRoot.addChild<MeshGround>();
-Material gMaterial;
 
 // An observer camera which shows the world and the camera you are tweaking
 auto *gLeftCamera = gSceneRoot.addChild<PerspectiveCamera>();
+// Dropped images are applied to this
+Sphere *gSphere = nullptr;
+// The last of them decoded for the renderers on the CPU
+std::future<std::shared_ptr<const Image>> gSphereImage;
+// Or packed into this atlas and shown on small spheres
+TextureAtlas gTextureAtlas;
+bool gDropIntoAtlas = false;
+std::vector<Sphere *> gAtlasSpheres;
+// Or streamed, keeping only the mip levels the big sphere needs
+bool gDropStreamed = false;
+// Or used as the normal map of the material
+bool gDropNormalMap = false;
+// Or projected for the ambient light of the uber shader
+bool gDropEnvironment = false;
 
 Object *activeObject(GLFWwindow *window)
 {
     return gLeftCamera;
 }
 
-// Texture gCubeTex;
-// Shader mBlinnPhong;
+// Per-pixel lighting for the spheres, specialised for each of them
+ShaderPermutations gUberShader("blinn.vert", "blinn.frag");
+const char *gUberShaderManifest = "blinn.permutations";
+bool gUseUberShader = false;
+
+// Many point lights circling above a floor, shaded with a cluster grid
+ClusteredLights gClusteredLights;
+ShaderHandle gClusteredShader;
+bool gUseClusteredLights = false;
+int gClusteredLightCount = 1024;
+float gClusteredLightRadius = 4;
+Floor *gFloor = nullptr;
+
+// Shadows of gLight on the objects drawn with the uber shader
+Light *gLight = nullptr;
+ShadowMaps gShadows;
+// Ambient light of the objects drawn with the uber shader
+EnvironmentLight gEnvironment;
+bool gUseEnvironment = false;
+
+// Orbits of the clustered lights around the Y axis
+struct LightOrbit
+{
+    float distance;
+    float height;
+    float angle;
+    float speed;
+};
+std::vector<LightOrbit> gLightOrbits;
+
+// The GL lights of the scene, gLight first
+std::vector<Light *> gLights;
+// Enable for each object only the lights reaching it, on the forward path
+bool gAssignLights = false;
+int gMaxLightsPerObject = 4;
+std::vector<LightInfluence> gLightInfluences;
+// Small spheres lit by the local lights
+std::vector<Sphere *> gLocalSpheres;
+
+void updateSphereShaders()
+{
+    auto apply = [](Object *object) {
+        if(gUseClusteredLights && ClusteredLights::supported())
+            object->setShader(gClusteredShader);
+        else if(gUseUberShader) object->setShader(&gUberShader);
+        else object->setShader(ShaderHandle());
+    };
+    apply(gSphere);
+    for(auto &&sphere : gAtlasSpheres) apply(sphere);
+    for(auto &&sphere : gLocalSpheres) apply(sphere);
+    if(gFloor) apply(gFloor);
+}
+
+// Something to see lights and shadows on, added when first needed
+void addFloor()
+{
+    if(gFloor) return;
+    gFloor = gSceneRoot.addChild<Floor>(20.f);
+    gFloor->position().y = -6;
+    updateSphereShaders();
+}
+
+// Add or remove lights to reach gClusteredLightCount.
+void resizeClusteredLights()
+{
+    std::mt19937 random(static_cast<unsigned>(gClusteredLights.size()));
+    std::uniform_real_distribution<float> unit(0, 1);
+    // Fewer lights are chosen again, so that the set does not depend on
+    // the history of the slider.
+    if(gClusteredLights.size() > static_cast<std::size_t>(
+        gClusteredLightCount))
+    {
+        gClusteredLights.clear();
+        gLightOrbits.clear();
+    }
+    while(gClusteredLights.size() < static_cast<std::size_t>(
+        gClusteredLightCount))
+    {
+        const LightOrbit orbit { 2 + 18 * std::sqrt(unit(random)),
+            -5 + 3 * unit(random), 6.2831853f * unit(random),
+            0.2f + 0.8f * unit(random) };
+        // Saturated colors of about equal brightness
+        const auto hue = 6 * unit(random);
+        const glm::vec3 color {
+            std::clamp(std::abs(hue - 3) - 1, 0.f, 1.f),
+            std::clamp(2 - std::abs(hue - 2), 0.f, 1.f),
+            std::clamp(2 - std::abs(hue - 4), 0.f, 1.f) };
+        gClusteredLights.add({ }, gClusteredLightRadius, color);
+        gLightOrbits.push_back(orbit);
+    }
+}
+
+void updateClusteredLights(float dt)
+{
+    for(std::size_t i = 0; i < gLightOrbits.size(); ++i)
+    {
+        auto &&orbit = gLightOrbits[i];
+        orbit.angle += orbit.speed * dt;
+        gClusteredLights.setPosition(i, { orbit.distance * std::cos(orbit.angle),
+            orbit.height, orbit.distance * std::sin(orbit.angle) });
+        gClusteredLights.setRadius(i, gClusteredLightRadius);
+    }
+}
 
 /*****************************************************************************/
 // Scene Creation
@@ -107,12 +308,18 @@ void initScene()
     gLeftCamera->setZFar(1000);
     gLeftCamera->addChild<Axis>();
 
-    gSceneRoot.addChild<Light>()->position().z = 10;
-    gSceneRoot.addChild<Sphere>(5.f);
+    gLight = gSceneRoot.addChild<Light>();
+    gLight->position().z = 10;
+    gLights.push_back(gLight);
+    gSphere = gSceneRoot.addChild<Sphere>(5.f);
+    gSphere->setCastsShadows(true);
+
+    // The deferred path is only offered if the context can render to its
+    // G-buffer.
+    DeferredRenderer::supported();
 
-    // gCubeTex.create();
-    // mBlinnPhong.load("blinn.vert", "blinn.frag");
-    // gCube->setShader(&mBlinnPhong);
+    // Build the variants used last time before the first frame needs them.
+    gUberShader.prewarm(gUberShaderManifest);
 }
 
 /*****************************************************************************/
@@ -154,41 +361,257 @@ void update(GLFWwindow *window, float dt)
 /*****************************************************************************/
 
 bool gEnableNormalize = false;
+// Vertex format of the meshes imported by drag & drop
+VertexQuantization gImportQuantization = VertexQuantization::NONE;
 bool gEnableLighting = true;
+bool gEnableFog = false;
+// Forward or deferred shading, switchable to compare their costs, or the
+// scene drawn or path traced on the CPU
+enum class RenderPath { FORWARD, DEFERRED, SOFTWARE, PATH_TRACED };
+RenderPath gRenderPath = RenderPath::FORWARD;
+DeferredRenderer gDeferredRenderer;
+SoftwareRasterizer gSoftwareRasterizer;
+std::vector<std::uint8_t> gSoftwarePixels;
+PathTracer gPathTracer;
+PathTracer::Settings gPathSettings;
+// Captured when path tracing starts or on request, not every frame
+std::shared_ptr<const PathTracerScene> gPathScene;
+bool gRestartPathTracer = false;
+GLuint gPathTexture = 0;
+int gPathTextureWidth = 0;
+int gPathTextureHeight = 0;
+GpuTimer gSceneTimer;
 // enable first light, disable others
 bool gEnabledLights[8] { true, false };
 
-void drawViewport(float dt)
+// Fill the free GL lights with attenuated point lights over the floor, and
+// cover the floor with spheres, so that each sphere is reached by a few.
+void addLocalLights()
 {
-    glViewport(0, 0, gFramebufferWidth, gFramebufferHeight);
+    if(!gLocalSpheres.empty()) return;
+    addFloor();
+    for(int i = 1; i < kMaxShaderLights; ++i)
+    {
+        auto *light = gSceneRoot.addChild<Light>(GL_LIGHT0 + i);
+        const auto angle = 6.2831853f * i / (kMaxShaderLights - 1);
+        // draw() gives the position to glLight() again in local space, so
+        // the light ends up at twice it, see worldPosition().
+        light->position() = glm::vec3 { 5 * std::cos(angle), -1.75f,
+            5 * std::sin(angle) };
+        light->directional = false;
+        light->attenuation = { 1, 0, 0.5f };
+        // Less than 2% of the light is left at the range.
+        light->range = 10;
+        const auto hue = 6.f * i / (kMaxShaderLights - 1);
+        light->diffuse = { std::clamp(std::abs(hue - 3) - 1, 0.f, 1.f),
+            std::clamp(2 - std::abs(hue - 2), 0.f, 1.f),
+            std::clamp(2 - std::abs(hue - 4), 0.f, 1.f), 1 };
+        light->specular = light->diffuse;
+        gLights.push_back(light);
+        gEnabledLights[i] = true;
+    }
+    for(int z = -3; z <= 3; ++z)
+    {
+        for(int x = -3; x <= 3; ++x)
+        {
+            auto *sphere = gSceneRoot.addChild<Sphere>(1.f);
+            sphere->position() = { x * 5.5f, -5, z * 5.5f };
+            gLocalSpheres.push_back(sphere);
+        }
+    }
+    updateSphereShaders();
+}
+
+// Draw the scene with gSoftwareRasterizer from the matrices and options
+// given to OpenGL, then copy the result into the framebuffer.
+void rasterizeScene()
+{
+    auto &&raster = gSoftwareRasterizer;
+    raster.resize(gFramebufferWidth, gFramebufferHeight);
+    GLfloat clear_color[4], projection[16];
+    glGetFloatv(GL_COLOR_CLEAR_VALUE, clear_color);
+    glGetFloatv(GL_PROJECTION_MATRIX, projection);
+    raster.clear(clear_color[0], clear_color[1], clear_color[2],
+        clear_color[3]);
+    raster.setProjection(projection);
+    raster.setTexturing(true);
+    raster.setLighting(gEnableLighting);
+    // Lights only affect what is drawn after them, as glPopAttrib() in
+    // render() restores the defaults every frame.
+    raster.resetLights();
+    for(auto i = 0; i < 8; ++i)
+        raster.enableLight(i, gEnabledLights[i]);
+    gSceneRoot.rasterizeHierarchy(raster, gLeftCamera->worldToLocalMatrix());
+    raster.finish();
 
+    gSoftwarePixels.resize(std::size_t(4) * raster.width() * raster.height());
+    raster.readPixels(gSoftwarePixels.data());
+    glPushAttrib(GL_ENABLE_BIT);
+    glDisable(GL_DEPTH_TEST);
+    glDisable(GL_TEXTURE_2D);
+    glDisable(GL_LIGHTING);
+    glDisable(GL_FOG);
+    glWindowPos2i(0, 0);
+    glDrawPixels(raster.width(), raster.height(), GL_RGBA, GL_UNSIGNED_BYTE,
+        gSoftwarePixels.data());
+    glPopAttrib();
+}
+
+// Capture the scene for the path tracer, with the options given to OpenGL.
+void capturePathScene()
+{
+    auto scene = std::make_shared<PathTracerScene>();
+    for(auto i = 0; i < 8; ++i)
+        scene->enableLight(i, gEnableLighting && gEnabledLights[i]);
+    gSceneRoot.rasterizeHierarchy(*scene, glm::mat4(1.f));
+    scene->build();
+    gPathScene = std::move(scene);
+}
+
+// Path trace the scene in the background, restarting whenever the camera
+// moves, and draw the passes finished so far over the window.
+void traceScene()
+{
+    if(!gPathScene) capturePathScene();
+    PathCamera camera;
+    std::copy_n(value_ptr(gLeftCamera->localToWorldMatrix()), 16,
+        camera.eyeToWorld);
+    glGetFloatv(GL_PROJECTION_MATRIX, camera.projection);
+    if(gRestartPathTracer || !gPathTracer.matches(gPathScene, camera,
+        gFramebufferWidth, gFramebufferHeight))
+    {
+        gPathTracer.restart(gPathScene, camera, gPathSettings,
+            gFramebufferWidth, gFramebufferHeight);
+        gRestartPathTracer = false;
+    }
+
+    if(!gPathTexture)
+    {
+        glGenTextures(1, &gPathTexture);
+        gTextureBinder.bind(gPathTexture);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+    }
+    gTextureBinder.bind(gPathTexture);
+    if(gPathTracer.update())
+    {
+        const auto width = gPathTracer.width();
+        const auto height = gPathTracer.height();
+        if(width != gPathTextureWidth || height != gPathTextureHeight)
+        {
+            glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA8, width, height, 0,
+                GL_RGBA, GL_UNSIGNED_BYTE, gPathTracer.pixels().data());
+            gPathTextureWidth = width;
+            gPathTextureHeight = height;
+        }
+        else
+        {
+            glTexSubImage2D(GL_TEXTURE_2D, 0, 0, 0, width, height, GL_RGBA,
+                GL_UNSIGNED_BYTE, gPathTracer.pixels().data());
+        }
+    }
+    if(!gPathTextureWidth) return;
+
+    glPushAttrib(GL_ENABLE_BIT | GL_CURRENT_BIT);
+    glDisable(GL_DEPTH_TEST);
+    glDisable(GL_LIGHTING);
+    glDisable(GL_FOG);
+    glEnable(GL_TEXTURE_2D);
     glMatrixMode(GL_PROJECTION);
-    // Reset the matrix
+    glPushMatrix();
     glLoadIdentity();
-    // Apply projection matrix
-    gLeftCamera->applyProjectionMatrix();
-
     glMatrixMode(GL_MODELVIEW);
-    // Reset the matrix
+    glPushMatrix();
     glLoadIdentity();
-    // Apply camera world-to-local transformation
-    gLeftCamera->applyWorldToLocalMatrix();
+    glColor3f(1, 1, 1);
+    glBegin(GL_QUADS);
+    glTexCoord2f(0, 0); glVertex2f(-1, -1);
+    glTexCoord2f(1, 0); glVertex2f(1, -1);
+    glTexCoord2f(1, 1); glVertex2f(1, 1);
+    glTexCoord2f(0, 1); glVertex2f(-1, 1);
+    glEnd();
+    glPopMatrix();
+    glMatrixMode(GL_PROJECTION);
+    glPopMatrix();
+    glMatrixMode(GL_MODELVIEW);
+    glPopAttrib();
+}
 
-    // Draw the scene hierarchy
-    glEnable(GL_DEPTH_TEST);
-    glEnable(GL_TEXTURE_2D);
-    // Normalize the normals after scaling the objects to get correct lighting
-    if(gEnableNormalize) glEnable(GL_NORMALIZE);
-    if(gEnableLighting) glEnable(GL_LIGHTING);
-    for(auto i = 0; i < 8; ++i)
+// The scene along the chosen render path
+void drawScene(float dt)
+{
+    ProfileScope scope("Scene");
+    GpuProfileScope gpu_scope("Scene");
+    gSceneTimer.begin();
+    if(gRenderPath == RenderPath::SOFTWARE)
     {
-        if(gEnabledLights[i])
-            glEnable(GL_LIGHT0 + i);
+        rasterizeScene();
     }
+    else if(gRenderPath == RenderPath::PATH_TRACED)
+    {
+        traceScene();
+    }
+    else if(gRenderPath == RenderPath::DEFERRED)
+    {
+        gDeferredRenderer.beginGeometry();
+        gDrawQueue.draw(gSceneRoot, gLeftCamera->worldToLocalMatrix(), dt);
+        gDeferredRenderer.endGeometry();
+        gDeferredRenderer.drawFixedFunctionLights();
+        if(gUseClusteredLights)
+        {
+            updateClusteredLights(dt);
+            gDeferredRenderer.drawPointLights(gClusteredLights);
+        }
+        gDeferredRenderer.composite();
+        if(gUseClusteredLights) gClusteredLights.drawMarkers();
+    }
+    else
+    {
+        if(gUseClusteredLights && gClusteredShader)
+        {
+            updateClusteredLights(dt);
+            // The modelview only holds the camera transformation here.
+            gClusteredLights.update();
+            gClusteredLights.apply(*gClusteredShader);
+            gClusteredLights.drawMarkers();
+        }
+        if(gLight->shadows && glIsEnabled(GL_LIGHTING) &&
+            glIsEnabled(gLight->light_idx))
+        {
+            gShadows.render(gLight->light_idx, gLight->worldPosition(),
+                gSceneRoot);
+            gShadowMaps = &gShadows;
+        }
+        if(gUseEnvironment)
+        {
+            gEnvironment.setEyeToWorld(gLeftCamera->localToWorldMatrix());
+            gEnvironmentLight = &gEnvironment;
+        }
+        gLightInfluences.clear();
+        if(gAssignLights && glIsEnabled(GL_LIGHTING))
+        {
+            const auto view = gLeftCamera->worldToLocalMatrix();
+            for(auto &&light : gLights)
+            {
+                if(glIsEnabled(light->light_idx))
+                    gLightInfluences.push_back(light->influence(view));
+            }
+            gDrawQueue.setLights(&gLightInfluences, gMaxLightsPerObject);
+        }
+        gDrawQueue.draw(gSceneRoot, gLeftCamera->worldToLocalMatrix(), dt);
+        gDrawQueue.setLights(nullptr, kMaxShaderLights);
+        gShadowMaps = nullptr;
+        gEnvironmentLight = nullptr;
+    }
+    gSceneTimer.end();
+}
 
-    gMaterial.apply();
-    gSceneRoot.drawHierarchyTransformed(dt);
-
+// The Scene Control window
+void emitSceneControls()
+{
+    ProfileScope scope("Build UI");
     using namespace ImGui;
     if(Begin("Scene Control"))
     {
@@ -211,6 +634,8 @@ void drawViewport(float dt)
             Checkbox("GL_NORMALIZE", &gEnableNormalize);
             SameLine();
             Checkbox("GL_LIGHTING", &gEnableLighting);
+            SameLine();
+            Checkbox("GL_FOG", &gEnableFog);
             for(auto i = 0; i < 8; ++i)
             {
                 static char name[] = "GL_LIGHT#";
@@ -221,16 +646,270 @@ void drawViewport(float dt)
             PopID();
         }
 
+        if(CollapsingHeader("Render Path"))
+        {
+            PushID("path");
+            static const char *path_names[] = {
+                "Forward", "Deferred", "Software", "Path Traced"
+            };
+            if(BeginCombo("Shading",
+                path_names[static_cast<int>(gRenderPath)]))
+            {
+                for(int i = 0; i < 4; ++i)
+                {
+                    const auto path = static_cast<RenderPath>(i);
+                    if(path == RenderPath::DEFERRED &&
+                        !DeferredRenderer::supported())
+                        continue;
+                    if(Selectable(path_names[i], path == gRenderPath))
+                        gRenderPath = path;
+                }
+                EndCombo();
+            }
+            if(GpuTimer::supported())
+            {
+                Text("Scene: %.2f ms GPU, frame: %.2f ms",
+                    gSceneTimer.milliseconds(), 1000 / GetIO().Framerate);
+            }
+            else
+            {
+                Text("Scene: n/a GPU, frame: %.2f ms",
+                    1000 / GetIO().Framerate);
+            }
+            if(gRenderPath == RenderPath::DEFERRED)
+                gDeferredRenderer.emitControlWidgets();
+            if(gRenderPath == RenderPath::SOFTWARE)
+            {
+                auto &&raster = gSoftwareRasterizer;
+                Text("%zu triangles, %zu lines, %zu in tiles",
+                    raster.triangles(), raster.lines(), raster.binned());
+                Text("Tiles: %.2f ms on %zu threads",
+                    raster.finishMilliseconds(), workerPool().size());
+                TextUnformatted("Images dropped now are also decoded for "
+                    "the CPU.");
+            }
+            if(gRenderPath == RenderPath::PATH_TRACED)
+            {
+                if(Button("Rebuild Scene"))
+                {
+                    capturePathScene();
+                    gRestartPathTracer = true;
+                }
+                gRestartPathTracer |= SliderInt("Max Bounces",
+                    &gPathSettings.maxBounces, 0, 16);
+                gRestartPathTracer |= ColorEdit3("Sky", gPathSettings.sky);
+                if(gPathScene)
+                {
+                    Text("%zu triangles, %zu nodes",
+                        gPathScene->triangleCount(), gPathScene->nodeCount());
+                }
+                Text("%d samples, %.1f ms per pass", gPathTracer.samples(),
+                    gPathTracer.passMilliseconds());
+                Text("%.2f Mrays/s on %zu threads",
+                    gPathTracer.raysPerSecond() / 1e6, workerPool().size());
+                TextUnformatted("Moving the camera restarts, changes to "
+                    "the scene need a rebuild.");
+            }
+            PopID();
+        }
+
+        if(CollapsingHeader("Mesh Import"))
+        {
+            PushID("import");
+            auto format = static_cast<int>(gImportQuantization);
+            Combo("Vertex Format", &format,
+                "Float\0Quantized (oct8 normals)\0Quantized (oct16 normals)\0");
+            gImportQuantization = static_cast<VertexQuantization>(format);
+            PopID();
+        }
+
+        if(CollapsingHeader("Texture Cache"))
+        {
+            PushID("texcache");
+            gTextureCache.emitControlWidgets();
+            Separator();
+            gTextureUploader.emitControlWidgets();
+            PopID();
+        }
+        if(CollapsingHeader("Texture Atlas"))
+        {
+            PushID("atlas");
+            Checkbox("Pack Dropped Images", &gDropIntoAtlas);
+            gTextureAtlas.emitControlWidgets();
+            Text("Texture binds: %llu, skipped: %llu",
+                static_cast<unsigned long long>(gTextureBinder.binds()),
+                static_cast<unsigned long long>(gTextureBinder.skipped()));
+            PopID();
+        }
+        if(CollapsingHeader("Texture Streaming"))
+        {
+            PushID("streaming");
+            Checkbox("Stream Dropped Images", &gDropStreamed);
+            gTextureStreamer.emitControlWidgets();
+            PopID();
+        }
+
+        if(CollapsingHeader("Shaders"))
+        {
+            PushID("shaders");
+            if(Checkbox("Blinn-Phong Spheres", &gUseUberShader))
+                updateSphereShaders();
+            SameLine();
+            Checkbox("Drop as Normal Map", &gDropNormalMap);
+            gUberShader.emitControlWidgets();
+            if(Button("Save Manifest"))
+                gUberShader.saveManifest(gUberShaderManifest);
+            Separator();
+            gShaderCache.emitControlWidgets();
+            PopID();
+        }
+
+        if(CollapsingHeader("Clustered Lights"))
+        {
+            PushID("clustered");
+            if(Checkbox("Enable", &gUseClusteredLights))
+            {
+                if(!gClusteredShader && ClusteredLights::supported())
+                    gClusteredShader = gShaderCache.load(
+                        "blinn.vert", "clustered.frag");
+                addFloor();
+                resizeClusteredLights();
+                updateSphereShaders();
+            }
+            if(SliderInt("Lights", &gClusteredLightCount, 0, 8192))
+                resizeClusteredLights();
+            SliderFloat("Radius", &gClusteredLightRadius, 0.5f, 20);
+            gClusteredLights.emitControlWidgets();
+            PopID();
+        }
+
+        if(CollapsingHeader("Shadows"))
+        {
+            PushID("shadows");
+            if(!ShadowMaps::supported())
+            {
+                TextWrapped("Needs OpenGL 3.0 or GL_ARB_framebuffer_object, "
+                    "GL_ARB_texture_float and GL_ARB_texture_rg");
+            }
+            else
+            {
+                // Received by the uber shader on the forward path only
+                if(Checkbox("Light Casts Shadows", &gLight->shadows) &&
+                    gLight->shadows)
+                {
+                    addFloor();
+                    gUseUberShader = true;
+                    updateSphereShaders();
+                }
+                gShadows.emitControlWidgets();
+            }
+            PopID();
+        }
+
+        if(CollapsingHeader("Environment"))
+        {
+            PushID("environment");
+            // Received by the uber shader on the forward path only
+            if(Checkbox("Ambient from Environment", &gUseEnvironment) &&
+                gUseEnvironment)
+            {
+                gUseUberShader = true;
+                updateSphereShaders();
+            }
+            SameLine();
+            Checkbox("Drop as Environment", &gDropEnvironment);
+            gEnvironment.emitControlWidgets();
+            PopID();
+        }
+
+        if(CollapsingHeader("Light Assignment"))
+        {
+            PushID("assignment");
+            // On the forward path only
+            Checkbox("Assign Lights per Object", &gAssignLights);
+            SliderInt("Max Lights", &gMaxLightsPerObject, 1,
+                kMaxShaderLights);
+            if(Button("Add Local Lights")) addLocalLights();
+            if(gAssignLights)
+            {
+                Text("%.2f of %zu lights per object",
+                    gDrawQueue.lightsPerObject(), gLightInfluences.size());
+            }
+            PopID();
+        }
+
+        if(CollapsingHeader("Frame Capture"))
+        {
+            PushID("capture");
+            gFrameCapture.emitControlWidgets(gFramebufferWidth,
+                gFramebufferHeight);
+            PopID();
+        }
+
+        if(CollapsingHeader("Profiler"))
+        {
+            PushID("profiler");
+            gProfiler.emitControlWidgets();
+            PopID();
+        }
+
         if(CollapsingHeader("Material", ImGuiTreeNodeFlags_DefaultOpen))
         {
             PushID("mat");
-            gMaterial.emitControlWidgets();
+            gMaterials.emitControlWidgets();
             PopID();
         }
 
         gSceneRoot.renderControlWidgetHierarchy();
     }
     End();
+
+    gShaderCache.emitErrorWindow();
+}
+
+void drawViewport(float dt)
+{
+    glViewport(0, 0, gFramebufferWidth, gFramebufferHeight);
+
+    glMatrixMode(GL_PROJECTION);
+    // Reset the matrix
+    glLoadIdentity();
+    // Apply projection matrix
+    gLeftCamera->applyProjectionMatrix();
+
+    glMatrixMode(GL_MODELVIEW);
+    // Reset the matrix
+    glLoadIdentity();
+    // Apply camera world-to-local transformation
+    gLeftCamera->applyWorldToLocalMatrix();
+
+    // Draw the scene hierarchy
+    glEnable(GL_DEPTH_TEST);
+    glEnable(GL_TEXTURE_2D);
+    // Normalize the normals after scaling the objects to get correct lighting
+    if(gEnableNormalize) glEnable(GL_NORMALIZE);
+    if(gEnableLighting) glEnable(GL_LIGHTING);
+    for(auto i = 0; i < 8; ++i)
+    {
+        if(gEnabledLights[i])
+            glEnable(GL_LIGHT0 + i);
+    }
+    if(gEnableFog)
+    {
+        glEnable(GL_FOG);
+        glFogi(GL_FOG_MODE, GL_EXP2);
+        glFogf(GL_FOG_DENSITY, 0.02f);
+    }
+
+    // Pick up an environment projected in the background, images decoded
+    // for the atlas and an image decoded for the CPU renderers.
+    gEnvironment.update();
+    gTextureAtlas.update();
+    if(gSphereImage.valid() && gSphereImage.wait_for(
+        std::chrono::seconds(0)) == std::future_status::ready)
+        gSphere->setTextureImage(gSphereImage.get());
+    drawScene(dt);
+    emitSceneControls();
 }
 
 void render(float dt)
@@ -254,6 +933,15 @@ const char *gWindowTitle = "Lab 8";
 
 void framebuffer_size_callback(GLFWwindow *window, int width, int height)
 {
+    // Frames are captured at the size recording started with, so a new size,
+    // or none while minimized, ends the recording.
+    if(gFrameCapture.recording() &&
+        (width != gFramebufferWidth || height != gFramebufferHeight))
+    {
+        gFrameCapture.stop();
+        std::cerr << "Recording stopped, the framebuffer was resized"
+            << std::endl;
+    }
     // Record the correct size of the viewport
     gFramebufferWidth = width;
     gFramebufferHeight = height;
@@ -315,9 +1003,78 @@ void character_callback(GLFWwindow* window, unsigned int codepoint)
 // File Drop Handler
 /*****************************************************************************/
 
+bool hasExtension(const std::string &path, const char *ext)
+{
+    const auto dot = path.find_last_of('.');
+    if(dot == std::string::npos) return false;
+    auto suffix = path.substr(dot + 1);
+    for(auto &&c : suffix) c = static_cast<char>(tolower(c));
+    return suffix == ext;
+}
+
+// Decoded on the worker pool for the software rasterizer and the path
+// tracer, nullptr on failure
+std::future<std::shared_ptr<const Image>> loadImageAsync(
+    const std::string &path)
+{
+    return workerPool().submit([path]() -> std::shared_ptr<const Image> {
+        ProfileScope scope("Decode Image");
+        auto image = std::make_shared<Image>();
+        std::string error;
+        if(loadImageFile(path, *image, error)) return image;
+        std::cerr << "Failed to load " << path << ": " << error
+            << std::endl;
+        return nullptr;
+    });
+}
+
 void drop_callback(GLFWwindow* window, int count, const char** paths)
 {
-    // gCubeTex.loadFromFile(paths[0]);
+    for(auto i = 0; i < count; ++i)
+    {
+        // Meshes are imported in the background so that the window stays
+        // responsive while large files load.
+        if(hasExtension(paths[i], "obj"))
+        {
+            auto *mesh = gSceneRoot.addChild<Mesh>();
+            mesh->setCastsShadows(true);
+            mesh->loadFromObjAsync(paths[i], gImportQuantization);
+        }
+        else if(gDropIntoAtlas)
+        {
+            gTextureAtlas.insertFromFileAsync(paths[i],
+                [](AtlasRegionHandle region) {
+                    // Line up the spheres in front of the big one.
+                    const auto n = static_cast<int>(gAtlasSpheres.size());
+                    auto *sphere = gSceneRoot.addChild<Sphere>(1.f);
+                    sphere->position() = { -8.f + 2.5f * (n % 7),
+                        -4.f + 2.5f * (n / 7), 7.f };
+                    sphere->setTexture(std::move(region));
+                    sphere->setCastsShadows(true);
+                    gAtlasSpheres.push_back(sphere);
+                    updateSphereShaders();
+                });
+        }
+        else if(gDropNormalMap)
+        {
+            auto material = gMaterials[gSphere->material()];
+            material.normalMap = gTextureCache.acquireAsync(paths[i]);
+            gMaterials.update(gSphere->material(), material);
+        }
+        else if(gDropEnvironment)
+            gEnvironment.load(paths[i]);
+        else if(gDropStreamed)
+            gSphere->setTexture(gTextureStreamer.open(paths[i]));
+        // Images are decoded in the background as well and uploaded over
+        // the next frames; the sphere shows a placeholder meanwhile.
+        else if(auto texture = gTextureCache.acquireAsync(paths[i]))
+        {
+            gSphere->setTexture(std::move(texture));
+            if(gRenderPath == RenderPath::SOFTWARE ||
+                gRenderPath == RenderPath::PATH_TRACED)
+                gSphereImage = loadImageAsync(paths[i]);
+        }
+    }
 }
 
 /*****************************************************************************/
@@ -0,0 +1,577 @@
+#pragma once
+
+// Included by lab08_framework.hpp after Object.
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+
+/*****************************************************************************/
+// ShadowMaps
+/*****************************************************************************/
+
+/**
+ * \brief Shadow maps of one light, received by the variants of permutations
+ * while gShadowMaps points to them.
+ *
+ * A directional light gets cascaded shadow maps: the view frustum up to the
+ * shadow distance is split into slices, each covered by an orthographic
+ * depth map in one quarter of an atlas. A map is fitted to a bounding sphere
+ * of its slice and moved in whole texels, so that its edges neither grow
+ * nor crawl when the camera turns or moves. A point light gets a cube map
+ * holding the distance to the nearest caster.
+ *
+ * Only the casters which can throw a shadow into a map are drawn into it,
+ * and a map is only drawn again when its matrix or the transformation of
+ * one of these casters changed. Casters animated inside draw() are not
+ * noticed.
+ */
+class ShadowMaps
+{
+    static constexpr int kMaxCascades = 4;
+    static constexpr int kCubeFaces = 6;
+    static constexpr float kCubeNear = 0.05f;
+    // Shadow maps are sampled from these, out of the way of the material,
+    // clustered lights and G-buffer textures.
+    static constexpr int kAtlasUnit = 6;
+    static constexpr int kCubeUnit = 7;
+
+    struct Caster
+    {
+        Object *object;
+        glm::mat4 localToWorld;
+        glm::vec3 center;
+        float radius;
+    };
+
+    // Settings
+    int mCascadeCount = 4;
+    // Texels on a side of each cascade, and of each cube face
+    int mCascadeSize = 1024;
+    int mCubeSize = 512;
+    // Eye depth up to which directional lights cast shadows
+    float mShadowDistance = 60;
+    // 0 splits the cascades uniformly, 1 logarithmically
+    float mSplitLambda = 0.75f;
+    // Distance up to which point lights cast shadows
+    float mCubeRange = 50;
+    float mCubeBias = 0.1f;
+
+    GLuint mAtlas = 0;
+    GLuint mAtlasFramebuffer = 0;
+    int mAtlasSize = 0;
+    GLuint mCube = 0;
+    GLuint mCubeDepth = 0;
+    GLuint mCubeFramebuffer = 0;
+    int mAllocatedCubeSize = 0;
+    ShaderHandle mDistance;
+    // Not retried every frame if it fails to build
+    bool mShaderLoaded = false;
+
+    // The light of the last render(), as a GL_LIGHT0 + i offset
+    int mLight = -1;
+    bool mDirectional = true;
+    glm::vec3 mLightPosition { 0, 0, 0 };
+    glm::mat4 mEyeToWorld { 1 };
+    // Eye space to the texture coordinates and depth of each cascade
+    glm::mat4 mCascadeMatrices[kMaxCascades];
+    // Eye depth at which each cascade ends
+    float mCascadeEnds[kMaxCascades] { };
+    // Receivers are looked up this far out along their normal, 1.5 texels
+    // of each cascade, against acne on surfaces facing away from the light.
+    float mNormalOffsets[kMaxCascades] { };
+    // What each map was last drawn with; 0 if it is not drawn yet
+    std::uint64_t mCascadeSignatures[kMaxCascades] { };
+    std::uint64_t mFaceSignatures[kCubeFaces] { };
+
+    std::vector<Object *> mObjects;
+    std::vector<Caster> mCasters;
+    std::vector<const Caster *> mVisible;
+
+    // Statistics of the last frame
+    int mMapsDrawn = 0;
+    int mMapsCached = 0;
+    int mCastersDrawn = 0;
+
+    // FNV-1a over the matrix and the casters a map is drawn with
+    static std::uint64_t signature(const glm::mat4 &matrix,
+        const std::vector<const Caster *> &casters)
+    {
+        std::uint64_t hash = 14695981039346656037ull;
+        auto add = [&](const void *data, std::size_t size) {
+            auto *bytes = static_cast<const unsigned char *>(data);
+            for(std::size_t i = 0; i < size; ++i)
+                hash = (hash ^ bytes[i]) * 1099511628211ull;
+        };
+        add(glm::value_ptr(matrix), 16 * sizeof(float));
+        for(auto *caster : casters)
+        {
+            add(&caster->object, sizeof(caster->object));
+            add(glm::value_ptr(caster->localToWorld), 16 * sizeof(float));
+            add(&caster->radius, sizeof(caster->radius));
+        }
+        return hash;
+    }
+
+    void releaseAtlas()
+    {
+        if(mAtlas)
+        {
+            glDeleteFramebuffers(1, &mAtlasFramebuffer);
+            glDeleteTextures(1, &mAtlas);
+        }
+        mAtlas = mAtlasFramebuffer = 0;
+        mAtlasSize = 0;
+        std::fill(mCascadeSignatures, mCascadeSignatures + kMaxCascades, 0);
+    }
+
+    void releaseCube()
+    {
+        if(mCube)
+        {
+            glDeleteFramebuffers(1, &mCubeFramebuffer);
+            glDeleteRenderbuffers(1, &mCubeDepth);
+            glDeleteTextures(1, &mCube);
+        }
+        mCube = mCubeDepth = mCubeFramebuffer = 0;
+        mAllocatedCubeSize = 0;
+        std::fill(mFaceSignatures, mFaceSignatures + kCubeFaces, 0);
+    }
+
+    // 2 x 2 cascades of mCascadeSize, compared with the depth when sampled
+    void allocateAtlas()
+    {
+        releaseAtlas();
+        mAtlasSize = 2 * mCascadeSize;
+        glActiveTexture(GL_TEXTURE0 + kAtlasUnit);
+        glGenTextures(1, &mAtlas);
+        glBindTexture(GL_TEXTURE_2D, mAtlas);
+        // Filtering blends four comparisons.
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_COMPARE_MODE,
+            GL_COMPARE_REF_TO_TEXTURE);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_COMPARE_FUNC, GL_LEQUAL);
+        glTexImage2D(GL_TEXTURE_2D, 0, GL_DEPTH_COMPONENT24, mAtlasSize,
+            mAtlasSize, 0, GL_DEPTH_COMPONENT, GL_UNSIGNED_INT, nullptr);
+        glActiveTexture(GL_TEXTURE0);
+
+        glGenFramebuffers(1, &mAtlasFramebuffer);
+        glBindFramebuffer(GL_FRAMEBUFFER, mAtlasFramebuffer);
+        glFramebufferTexture2D(GL_FRAMEBUFFER, GL_DEPTH_ATTACHMENT,
+            GL_TEXTURE_2D, mAtlas, 0);
+        glDrawBuffer(GL_NONE);
+        glReadBuffer(GL_NONE);
+        if(glCheckFramebufferStatus(GL_FRAMEBUFFER) != GL_FRAMEBUFFER_COMPLETE)
+            std::cerr << "Shadow atlas is incomplete" << std::endl;
+    }
+
+    // Distances divided by mCubeRange, with a depth buffer shared by the faces
+    void allocateCube()
+    {
+        releaseCube();
+        mAllocatedCubeSize = mCubeSize;
+        glActiveTexture(GL_TEXTURE0 + kCubeUnit);
+        glGenTextures(1, &mCube);
+        glBindTexture(GL_TEXTURE_CUBE_MAP, mCube);
+        glTexParameteri(GL_TEXTURE_CUBE_MAP, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+        glTexParameteri(GL_TEXTURE_CUBE_MAP, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+        glTexParameteri(GL_TEXTURE_CUBE_MAP, GL_TEXTURE_WRAP_S,
+            GL_CLAMP_TO_EDGE);
+        glTexParameteri(GL_TEXTURE_CUBE_MAP, GL_TEXTURE_WRAP_T,
+            GL_CLAMP_TO_EDGE);
+        glTexParameteri(GL_TEXTURE_CUBE_MAP, GL_TEXTURE_WRAP_R,
+            GL_CLAMP_TO_EDGE);
+        for(int face = 0; face < kCubeFaces; ++face)
+            glTexImage2D(GL_TEXTURE_CUBE_MAP_POSITIVE_X + face, 0, GL_R32F,
+                mCubeSize, mCubeSize, 0, GL_RED, GL_FLOAT, nullptr);
+        glActiveTexture(GL_TEXTURE0);
+
+        glGenRenderbuffers(1, &mCubeDepth);
+        glBindRenderbuffer(GL_RENDERBUFFER, mCubeDepth);
+        glRenderbufferStorage(GL_RENDERBUFFER, GL_DEPTH_COMPONENT24,
+            mCubeSize, mCubeSize);
+        glGenFramebuffers(1, &mCubeFramebuffer);
+        glBindFramebuffer(GL_FRAMEBUFFER, mCubeFramebuffer);
+        glFramebufferRenderbuffer(GL_FRAMEBUFFER, GL_DEPTH_ATTACHMENT,
+            GL_RENDERBUFFER, mCubeDepth);
+        glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0,
+            GL_TEXTURE_CUBE_MAP_POSITIVE_X, mCube, 0);
+        if(glCheckFramebufferStatus(GL_FRAMEBUFFER) != GL_FRAMEBUFFER_COMPLETE)
+            std::cerr << "Shadow cube map is incomplete" << std::endl;
+    }
+
+    void collectCasters(Object &root)
+    {
+        mObjects.clear();
+        root.collectShadowCasters(mObjects);
+        mCasters.clear();
+        for(auto *object : mObjects)
+        {
+            const auto m = object->localToWorldMatrix();
+            const auto scale = std::max({ glm::length(glm::vec3(m[0])),
+                glm::length(glm::vec3(m[1])), glm::length(glm::vec3(m[2])) });
+            mCasters.push_back({ object, m, glm::vec3(m[3]),
+                object->boundingRadius() * scale });
+        }
+    }
+
+    // Draw the visible casters with the current projection, depth only
+    // unless a shader is bound.
+    void drawCasters(const glm::mat4 &view)
+    {
+        glMatrixMode(GL_MODELVIEW);
+        for(auto *caster : mVisible)
+        {
+            glLoadMatrixf(glm::value_ptr(view * caster->localToWorld));
+            caster->object->draw(0);
+        }
+        mCastersDrawn += static_cast<int>(mVisible.size());
+    }
+
+    void renderCascades(const glm::mat4 &projection)
+    {
+        if(mAtlasSize != 2 * mCascadeSize) allocateAtlas();
+
+        // Planes of the view frustum, read from the projection
+        const auto near = projection[3][2] / (projection[2][2] - 1);
+        const auto far = std::min(projection[3][2] / (projection[2][2] + 1),
+            std::max(mShadowDistance, near + 1));
+        const auto inverse_projection = glm::inverse(projection);
+
+        const auto to_light = glm::normalize(mLightPosition);
+        const auto up = std::abs(to_light.y) > 0.99f ?
+            glm::vec3(1, 0, 0) : glm::vec3(0, 1, 0);
+        const auto light_view = glm::lookAt(glm::vec3(0, 0, 0), -to_light, up);
+
+        glBindFramebuffer(GL_FRAMEBUFFER, mAtlasFramebuffer);
+        auto begin = near;
+        for(int c = 0; c < mCascadeCount; ++c)
+        {
+            // Practical split scheme: a blend of logarithmic and uniform
+            const auto t = (c + 1.f) / mCascadeCount;
+            const auto end = mSplitLambda * near * std::pow(far / near, t) +
+                (1 - mSplitLambda) * (near + (far - near) * t);
+            mCascadeEnds[c] = end;
+
+            // Bounding sphere of the slice. It only depends on the
+            // projection, so it keeps its size while the camera moves.
+            glm::vec3 corners[8];
+            glm::vec3 center { 0, 0, 0 };
+            for(int i = 0; i < 8; ++i)
+            {
+                auto corner = inverse_projection * glm::vec4(
+                    i & 1 ? 1.f : -1.f, i & 2 ? 1.f : -1.f, -1, 1);
+                const auto on_near = glm::vec3(corner) / corner.w;
+                corners[i] = on_near * ((i & 4 ? end : begin) / near);
+                center += corners[i];
+            }
+            center /= 8.f;
+            auto radius = 0.f;
+            for(auto &&corner : corners)
+                radius = std::max(radius, glm::length(corner - center));
+            radius = std::ceil(radius * 16) / 16;
+            begin = end;
+
+            // Snap the center to whole texels of the map.
+            auto light_center = glm::vec3(light_view *
+                (mEyeToWorld * glm::vec4(center, 1)));
+            const auto texel = 2 * radius / mCascadeSize;
+            mNormalOffsets[c] = 1.5f * texel;
+            light_center.x = std::floor(light_center.x / texel) * texel;
+            light_center.y = std::floor(light_center.y / texel) * texel;
+
+            // Casters beside the map or beyond the slice cannot shadow it;
+            // those between it and the light extend the depth range.
+            auto depth_near = -light_center.z - radius;
+            const auto depth_far = -light_center.z + radius;
+            mVisible.clear();
+            for(auto &&caster : mCasters)
+            {
+                const auto p = glm::vec3(light_view *
+                    glm::vec4(caster.center, 1));
+                const auto reach = radius + caster.radius;
+                if(std::abs(p.x - light_center.x) > reach ||
+                    std::abs(p.y - light_center.y) > reach ||
+                    -p.z - caster.radius > depth_far)
+                    continue;
+                depth_near = std::min(depth_near, -p.z - caster.radius);
+                mVisible.push_back(&caster);
+            }
+            const auto light_projection = glm::ortho(
+                light_center.x - radius, light_center.x + radius,
+                light_center.y - radius, light_center.y + radius,
+                depth_near, depth_far);
+
+            // Eye space to [0, 1] within the quarter of the atlas
+            auto to_atlas = glm::translate(glm::mat4(1), glm::vec3(
+                0.5f * (c % 2), 0.5f * (c / 2), 0));
+            to_atlas = glm::scale(to_atlas, glm::vec3(0.5f, 0.5f, 1));
+            to_atlas = glm::translate(to_atlas, glm::vec3(0.5f));
+            to_atlas = glm::scale(to_atlas, glm::vec3(0.5f));
+            mCascadeMatrices[c] = to_atlas * light_projection * light_view *
+                mEyeToWorld;
+
+            const auto matrix = light_projection * light_view;
+            const auto hash = signature(matrix, mVisible);
+            if(hash == mCascadeSignatures[c])
+            {
+                ++mMapsCached;
+                continue;
+            }
+            mCascadeSignatures[c] = hash;
+            ++mMapsDrawn;
+
+            glViewport(c % 2 * mCascadeSize, c / 2 * mCascadeSize,
+                mCascadeSize, mCascadeSize);
+            glScissor(c % 2 * mCascadeSize, c / 2 * mCascadeSize,
+                mCascadeSize, mCascadeSize);
+            glClear(GL_DEPTH_BUFFER_BIT);
+            glMatrixMode(GL_PROJECTION);
+            glLoadMatrixf(glm::value_ptr(light_projection));
+            drawCasters(light_view);
+        }
+    }
+
+    void renderCube()
+    {
+        if(!mShaderLoaded)
+        {
+            mShaderLoaded = true;
+            mDistance = gShaderCache.load("shadow_distance.vert",
+                "shadow_distance.frag");
+        }
+        if(!mDistance) return;
+        if(mAllocatedCubeSize != mCubeSize) allocateCube();
+
+        // Looking along +X, -X, +Y, -Y, +Z and -Z, as the faces are laid out
+        static const glm::vec3 directions[kCubeFaces] = {
+            { 1, 0, 0 }, { -1, 0, 0 }, { 0, 1, 0 },
+            { 0, -1, 0 }, { 0, 0, 1 }, { 0, 0, -1 }
+        };
+        static const glm::vec3 ups[kCubeFaces] = {
+            { 0, -1, 0 }, { 0, -1, 0 }, { 0, 0, 1 },
+            { 0, 0, -1 }, { 0, -1, 0 }, { 0, -1, 0 }
+        };
+        const auto projection = glm::perspective(glm::radians(90.f), 1.f,
+            kCubeNear, mCubeRange);
+
+        glBindFramebuffer(GL_FRAMEBUFFER, mCubeFramebuffer);
+        glViewport(0, 0, mCubeSize, mCubeSize);
+        glScissor(0, 0, mCubeSize, mCubeSize);
+        glClearColor(1, 1, 1, 1);
+        glMatrixMode(GL_PROJECTION);
+        glLoadMatrixf(glm::value_ptr(projection));
+        glUseProgram(mDistance->programId());
+        glUniform1f(mDistance->uniform("shadowRange"), mCubeRange);
+        const auto diagonal = 1.4142136f;
+        for(int face = 0; face < kCubeFaces; ++face)
+        {
+            const auto view = glm::lookAt(mLightPosition,
+                mLightPosition + directions[face], ups[face]);
+            // Casters outside the 90 degree frustum of the face or beyond
+            // the range cannot shadow it.
+            mVisible.clear();
+            for(auto &&caster : mCasters)
+            {
+                const auto p = glm::vec3(view * glm::vec4(caster.center, 1));
+                const auto r = caster.radius * diagonal;
+                if(p.x + p.z > r || p.z - p.x > r || p.y + p.z > r ||
+                    p.z - p.y > r || -p.z + caster.radius < kCubeNear ||
+                    glm::length(p) - caster.radius > mCubeRange)
+                    continue;
+                mVisible.push_back(&caster);
+            }
+
+            const auto hash = signature(projection * view, mVisible);
+            if(hash == mFaceSignatures[face])
+            {
+                ++mMapsCached;
+                continue;
+            }
+            mFaceSignatures[face] = hash;
+            ++mMapsDrawn;
+
+            glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0,
+                GL_TEXTURE_CUBE_MAP_POSITIVE_X + face, mCube, 0);
+            glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
+            drawCasters(view);
+        }
+        glUseProgram(0);
+    }
+
+public:
+    ShadowMaps() = default;
+    ShadowMaps(const ShadowMaps &) = delete;
+    ShadowMaps & operator=(const ShadowMaps &) = delete;
+
+    ~ShadowMaps()
+    {
+        releaseAtlas();
+        releaseCube();
+    }
+
+    /**
+     * \brief Whether the context can render the depth atlas and the R32F
+     * cube map of distances. The first call must be made on the render
+     * thread.
+     */
+    static bool supported()
+    {
+        static const bool supported = [] {
+            // Core since OpenGL 3.0. Older contexts leave the version at 0.
+            GLint major = 0;
+            glGetIntegerv(GL_MAJOR_VERSION, &major);
+            return major >= 3 ||
+                (hasGLExtension("GL_ARB_framebuffer_object") &&
+                hasGLExtension("GL_ARB_texture_float") &&
+                hasGLExtension("GL_ARB_texture_rg"));
+        }();
+        return supported;
+    }
+
+    /**
+     * \brief Bring the maps of a light up to date for the current view. The
+     * projection and modelview must hold the camera transformation, as for
+     * drawing the scene.
+     * \param light The GL_LIGHTi casting the shadows.
+     * \param position Its position in world space, with w = 0 if it is
+     * directional.
+     * \param root The hierarchy whose objects with castsShadows() are drawn.
+     */
+    void render(int light, const glm::vec4 &position, Object &root)
+    {
+        mLight = light - GL_LIGHT0;
+        mDirectional = position.w == 0;
+        mLightPosition = glm::vec3(position);
+        mMapsDrawn = mMapsCached = mCastersDrawn = 0;
+
+        glm::mat4 view, projection;
+        glGetFloatv(GL_MODELVIEW_MATRIX, glm::value_ptr(view));
+        glGetFloatv(GL_PROJECTION_MATRIX, glm::value_ptr(projection));
+        mEyeToWorld = glm::inverse(view);
+        collectCasters(root);
+
+        GLint framebuffer = 0;
+        glGetIntegerv(GL_FRAMEBUFFER_BINDING, &framebuffer);
+        glPushAttrib(GL_ENABLE_BIT | GL_COLOR_BUFFER_BIT |
+            GL_DEPTH_BUFFER_BIT | GL_POLYGON_BIT | GL_VIEWPORT_BIT |
+            GL_SCISSOR_BIT | GL_TRANSFORM_BIT);
+        glMatrixMode(GL_PROJECTION);
+        glPushMatrix();
+        glMatrixMode(GL_MODELVIEW);
+        glPushMatrix();
+        glDisable(GL_LIGHTING);
+        glDisable(GL_TEXTURE_2D);
+        glDisable(GL_FOG);
+        glDisable(GL_BLEND);
+        glDisable(GL_CULL_FACE);
+        glEnable(GL_DEPTH_TEST);
+        glDepthFunc(GL_LESS);
+        glDepthMask(GL_TRUE);
+        glEnable(GL_SCISSOR_TEST);
+
+        if(mDirectional)
+        {
+            // Depth only, pushed back against acne on sloped surfaces
+            glColorMask(GL_FALSE, GL_FALSE, GL_FALSE, GL_FALSE);
+            glEnable(GL_POLYGON_OFFSET_FILL);
+            glPolygonOffset(2, 4);
+            renderCascades(projection);
+        }
+        else
+        {
+            renderCube();
+        }
+
+        glMatrixMode(GL_PROJECTION);
+        glPopMatrix();
+        glMatrixMode(GL_MODELVIEW);
+        glPopMatrix();
+        glPopAttrib();
+        glBindFramebuffer(GL_FRAMEBUFFER, framebuffer);
+    }
+
+    // Whether a variant with the lights of the key receives these shadows
+    bool receivedBy(const ShaderKey &key) const
+    {
+        if(mLight < 0 || mLight >= key.lights) return false;
+        if(!glIsEnabled(GL_LIGHT0 + mLight)) return false;
+        return mDirectional ? mAtlas != 0 : mCube != 0 && mDistance;
+    }
+
+    bool directional() const { return mDirectional; }
+
+    // Bind the maps and set the uniforms of blinn.frag for them.
+    void apply(const Shader &shader) const
+    {
+        glUniform1i(shader.uniform("shadowLight"), mLight);
+        if(mDirectional)
+        {
+            glActiveTexture(GL_TEXTURE0 + kAtlasUnit);
+            glBindTexture(GL_TEXTURE_2D, mAtlas);
+            glUniform1i(shader.uniform("shadowAtlas"), kAtlasUnit);
+            glUniformMatrix4fv(shader.uniform("shadowMatrix"), mCascadeCount,
+                GL_FALSE, glm::value_ptr(mCascadeMatrices[0]));
+            glUniform1fv(shader.uniform("shadowEnds"), mCascadeCount,
+                mCascadeEnds);
+            glUniform1fv(shader.uniform("shadowNormalOffsets"), mCascadeCount,
+                mNormalOffsets);
+            glUniform1i(shader.uniform("shadowCascades"), mCascadeCount);
+            glUniform1f(shader.uniform("shadowTexel"), 1.f / mAtlasSize);
+        }
+        else
+        {
+            glActiveTexture(GL_TEXTURE0 + kCubeUnit);
+            glBindTexture(GL_TEXTURE_CUBE_MAP, mCube);
+            glUniform1i(shader.uniform("shadowCube"), kCubeUnit);
+            glUniformMatrix4fv(shader.uniform("shadowEyeToWorld"), 1,
+                GL_FALSE, glm::value_ptr(mEyeToWorld));
+            glUniform3fv(shader.uniform("shadowLightPosition"), 1,
+                &mLightPosition.x);
+            glUniform1f(shader.uniform("shadowRange"), mCubeRange);
+            glUniform1f(shader.uniform("shadowBias"), mCubeBias);
+            glUniform1f(shader.uniform("shadowTexel"), 2.f / mCubeSize);
+        }
+        glActiveTexture(GL_TEXTURE0);
+    }
+
+    void emitControlWidgets()
+    {
+        ImGui::Text("Maps drawn: %d, cached: %d, casters drawn: %d",
+            mMapsDrawn, mMapsCached, mCastersDrawn);
+        ImGui::SliderInt("Cascades", &mCascadeCount, 1, kMaxCascades);
+        auto size = mCascadeSize == 512 ? 0 : mCascadeSize == 1024 ? 1 : 2;
+        if(ImGui::Combo("Cascade Size", &size, "512\0" "1024\0" "2048\0"))
+            mCascadeSize = 512 << size;
+        ImGui::SliderFloat("Distance", &mShadowDistance, 5, 200);
+        ImGui::SliderFloat("Split Lambda", &mSplitLambda, 0, 1);
+        if(mDirectional)
+        {
+            for(int c = 0; c < mCascadeCount; ++c)
+            {
+                ImGui::BulletText("Cascade %d ends at %.1f", c,
+                    mCascadeEnds[c]);
+            }
+        }
+        size = mCubeSize == 256 ? 0 : mCubeSize == 512 ? 1 : 2;
+        if(ImGui::Combo("Cube Size", &size, "256\0" "512\0" "1024\0"))
+            mCubeSize = 256 << size;
+        ImGui::SliderFloat("Cube Range", &mCubeRange, 5, 200);
+        ImGui::SliderFloat("Cube Bias", &mCubeBias, 0, 1);
+    }
+};
+
+inline void addShadowFeatures(ShaderKey &key)
+{
+    if(!gShadowMaps->receivedBy(key)) return;
+    key.set(gShadowMaps->directional() ?
+        ShaderFeature::SHADOW_CASCADES : ShaderFeature::SHADOW_CUBE);
+}
+
+inline void applyShadowMaps(const Shader &shader)
+{
+    gShadowMaps->apply(shader);
+}
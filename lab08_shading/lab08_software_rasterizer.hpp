@@ -0,0 +1,1014 @@
+#pragma once
+
+// A rasterizer running on the CPU. Independent of OpenGL and GLM so that it
+// can be used by the tools on machines without a GPU.
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+#include <vector>
+
+#include "lab08_image.hpp"
+#include "lab08_thread_pool.hpp"
+
+/*****************************************************************************/
+// SoftwareRasterizer
+/*****************************************************************************/
+
+struct SoftwareVertex
+{
+    float position[3];
+    float normal[3];
+    float texcoord[2];
+};
+
+// The parameters of glLight(), with the position as given to it
+struct SoftwareLight
+{
+    float position[4] { 0, 0, 1, 0 };
+    float ambient[4] { 0, 0, 0, 1 };
+    float diffuse[4] { 1, 1, 1, 1 };
+    float specular[4] { 1, 1, 1, 1 };
+    // Constant, linear and quadratic
+    float attenuation[3] { 1, 0, 0 };
+};
+
+// The parameters of glMaterial(), with the same defaults
+struct SoftwareMaterial
+{
+    float ambient[4] { 0.2f, 0.2f, 0.2f, 1 };
+    float diffuse[4] { 0.8f, 0.8f, 0.8f, 1 };
+    float specular[4] { 0, 0, 0, 1 };
+    float emission[4] { 0, 0, 0, 1 };
+    float shininess = 0;
+};
+
+/**
+ * \brief The state and drawing commands that Object::rasterize() issues,
+ * shared by the backends drawing without OpenGL: the modelview, lights,
+ * material, color and texture as OpenGL keeps them, and the primitives
+ * drawn with them.
+ */
+class SoftwareRenderer
+{
+public:
+    static constexpr int kMaxLights = 8;
+
+protected:
+    // Column-major, as glLoadMatrixf()
+    static void multiply(const float *a, const float *b, float *out)
+    {
+        float result[16];
+        for(int c = 0; c < 4; ++c)
+        {
+            for(int r = 0; r < 4; ++r)
+            {
+                result[c * 4 + r] = a[r] * b[c * 4] + a[4 + r] * b[c * 4 + 1] +
+                    a[8 + r] * b[c * 4 + 2] + a[12 + r] * b[c * 4 + 3];
+            }
+        }
+        std::memcpy(out, result, sizeof(result));
+    }
+
+    static void transform(const float *m, const float *p, float w, float *out)
+    {
+        for(int r = 0; r < 4; ++r)
+            out[r] = m[r] * p[0] + m[4 + r] * p[1] + m[8 + r] * p[2] +
+                m[12 + r] * w;
+    }
+
+    float mModelView[16] { 1, 0, 0, 0, 0, 1, 0, 0, 0, 0, 1, 0, 0, 0, 0, 1 };
+    // Inverse transpose of the upper 3 x 3 of the modelview
+    float mNormalMatrix[9] { 1, 0, 0, 0, 1, 0, 0, 0, 1 };
+    // Positions in the space of the modelview, as glLight() keeps them
+    SoftwareLight mLights[kMaxLights];
+    SoftwareMaterial mMaterial;
+    float mCurrentColor[4] { 1, 1, 1, 1 };
+    const Image *mTexture = nullptr;
+    // Set by every change of the state above except the modelview
+    bool mStateChanged = true;
+
+    void transformPosition(const float *p, float *out) const
+    {
+        float result[4];
+        transform(mModelView, p, 1, result);
+        std::copy_n(result, 3, out);
+    }
+
+    void transformNormal(const float *n, float *out) const
+    {
+        const auto *m = mNormalMatrix;
+        const float result[3] = {
+            m[0] * n[0] + m[3] * n[1] + m[6] * n[2],
+            m[1] * n[0] + m[4] * n[1] + m[7] * n[2],
+            m[2] * n[0] + m[5] * n[1] + m[8] * n[2],
+        };
+        std::copy_n(result, 3, out);
+    }
+
+public:
+    SoftwareRenderer()
+    {
+        resetLights();
+    }
+
+    virtual ~SoftwareRenderer() = default;
+
+    virtual void setModelView(const float *matrix)
+    {
+        std::copy_n(matrix, 16, mModelView);
+        // Inverse transpose through the cofactors
+        const auto *m = mModelView;
+        float cofactors[9] = {
+            m[5] * m[10] - m[6] * m[9], m[6] * m[8] - m[4] * m[10],
+            m[4] * m[9] - m[5] * m[8],
+            m[2] * m[9] - m[1] * m[10], m[0] * m[10] - m[2] * m[8],
+            m[1] * m[8] - m[0] * m[9],
+            m[1] * m[6] - m[2] * m[5], m[2] * m[4] - m[0] * m[6],
+            m[0] * m[5] - m[1] * m[4],
+        };
+        const auto determinant = m[0] * cofactors[0] + m[1] * cofactors[1] +
+            m[2] * cofactors[2];
+        const auto inverse = determinant != 0 ? 1 / determinant : 0.f;
+        // cofactors[3 * i + j] belongs to row j, column i of the result.
+        for(int i = 0; i < 3; ++i)
+        {
+            for(int j = 0; j < 3; ++j)
+                mNormalMatrix[i * 3 + j] = cofactors[i * 3 + j] * inverse;
+        }
+    }
+
+    const float * modelView() const { return mModelView; }
+
+    // The position is transformed by the current modelview, as glLight()
+    // does.
+    void setLight(int index, const SoftwareLight &light)
+    {
+        mLights[index] = light;
+        transform(mModelView, light.position, light.position[3],
+            mLights[index].position);
+        mStateChanged = true;
+    }
+
+    // The defaults of glLight(): only light 0 is white.
+    void resetLights()
+    {
+        for(int i = 0; i < kMaxLights; ++i)
+        {
+            mLights[i] = SoftwareLight();
+            if(i == 0) continue;
+            std::fill_n(mLights[i].diffuse, 3, 0.f);
+            std::fill_n(mLights[i].specular, 3, 0.f);
+        }
+        mStateChanged = true;
+    }
+
+    void setMaterial(const SoftwareMaterial &material)
+    {
+        mMaterial = material;
+        mStateChanged = true;
+    }
+
+    const SoftwareMaterial & material() const { return mMaterial; }
+
+    // The color of lines and of unlit triangles
+    void setColor(float r, float g, float b, float a = 1)
+    {
+        mCurrentColor[0] = r;
+        mCurrentColor[1] = g;
+        mCurrentColor[2] = b;
+        mCurrentColor[3] = a;
+        mStateChanged = true;
+    }
+
+    // nullptr draws untextured. The image must live as long as the
+    // primitives drawn with it are used.
+    void setTexture(const Image *image)
+    {
+        if(image && image->pixels.empty()) image = nullptr;
+        if(image == mTexture) return;
+        mTexture = image;
+        mStateChanged = true;
+    }
+
+    // Every three vertices form a triangle.
+    virtual void drawTriangles(const SoftwareVertex *vertices,
+        std::size_t count) = 0;
+
+    // Every three indices form a triangle.
+    virtual void drawIndexed(const SoftwareVertex *vertices,
+        std::size_t vertex_count, const std::uint32_t *indices,
+        std::size_t index_count) = 0;
+
+    // Every two vertices form a line.
+    virtual void drawLines(const SoftwareVertex *vertices,
+        std::size_t count) = 0;
+};
+
+/**
+ * \brief Draws triangles and lines into its own color and depth buffers with
+ * a small part of the OpenGL state: matrices, a depth test with GL_LESS,
+ * lights and materials shaded per pixel as blinn.frag does, and a texture
+ * modulating the color. Lines and unlit triangles take the current color.
+ *
+ * Primitives are transformed, clipped at the near plane and set up when
+ * they are drawn, then binned to the tiles of the screen they overlap.
+ * finish() rasterizes every tile as one task of the worker pool, in the
+ * order the primitives were drawn, so no two threads touch the same pixel.
+ * Coverage and depth are tested for four pixels at once with SSE2.
+ *
+ * Like glReadPixels(), the rows of the buffers go from bottom to top.
+ */
+class SoftwareRasterizer : public SoftwareRenderer
+{
+public:
+    static constexpr int kTileSize = 64;
+
+private:
+    struct Vec3
+    {
+        float x, y, z;
+    };
+
+    static Vec3 add(Vec3 a, Vec3 b)
+    {
+        return { a.x + b.x, a.y + b.y, a.z + b.z };
+    }
+    static Vec3 scale(Vec3 a, float s) { return { a.x * s, a.y * s, a.z * s }; }
+    static float dot(Vec3 a, Vec3 b)
+    {
+        return a.x * b.x + a.y * b.y + a.z * b.z;
+    }
+    static Vec3 normalize(Vec3 a)
+    {
+        const auto length_squared = dot(a, a);
+        return length_squared > 0 ? scale(a, 1 / std::sqrt(length_squared)) : a;
+    }
+
+    // What the pixels of a primitive are shaded with
+    struct DrawState
+    {
+        SoftwareMaterial material;
+        // The enabled lights, with their positions in eye space
+        SoftwareLight lights[kMaxLights];
+        int lightCount = 0;
+        // Emission and the ambient light of the light model
+        float sceneColor[4] { };
+        float color[4] { 1, 1, 1, 1 };
+        const Image *texture = nullptr;
+        bool lighting = false;
+    };
+
+    // A vertex after the modelview and projection
+    struct ClipVertex
+    {
+        float clip[4];
+        float eye[3];
+        float normal[3];
+        float texcoord[2];
+    };
+
+    // Depth, 1 / w, then the eye position, normal and texture coordinates
+    // divided by w
+    static constexpr int kPlanes = 10;
+
+    struct Triangle
+    {
+        // Edge functions a (x - x0) + b (y - y0), not negative inside. The
+        // origin is the lower end point of the edge so that two triangles
+        // sharing an edge compute values of exactly opposite sign and leave
+        // no gaps between them.
+        float edgeA[3], edgeB[3], edgeX[3], edgeY[3];
+        // Each interpolated value is a (x - x0) + b (y - y0) + c with the
+        // first vertex at (x0, y0).
+        float planes[kPlanes][3];
+        float originX, originY;
+        int minX, minY, maxX, maxY;
+        std::uint32_t state;
+    };
+
+    struct Line
+    {
+        float x0, y0, z0, x1, y1, z1;
+        std::uint32_t state;
+    };
+
+    // Bins refer to lines with this bit set, triangles otherwise.
+    static constexpr std::uint32_t kLineBit = 0x80000000u;
+
+    int mWidth = 0;
+    int mHeight = 0;
+    int mTilesX = 0;
+    int mTilesY = 0;
+    // Row length of the buffers, padded to whole tiles
+    int mStride = 0;
+    std::vector<std::uint8_t> mColor;
+    std::vector<float> mDepth;
+    std::vector<std::vector<std::uint32_t>> mBins;
+
+    float mProjection[16] { 1, 0, 0, 0, 0, 1, 0, 0, 0, 0, 1, 0, 0, 0, 0, 1 };
+    float mModelViewProjection[16] { 1, 0, 0, 0, 0, 1, 0, 0, 0, 0, 1, 0,
+        0, 0, 0, 1 };
+
+    bool mLightEnabled[kMaxLights] { };
+    float mLightModelAmbient[4] { 0.2f, 0.2f, 0.2f, 1 };
+    bool mLighting = false;
+    bool mTexturing = false;
+    std::vector<DrawState> mStates;
+
+    std::vector<ClipVertex> mTransformed;
+    std::vector<Triangle> mTriangles;
+    std::vector<Line> mLines;
+
+    bool mClearPending = false;
+    std::uint8_t mClearColor[4] { };
+
+    // Statistics of the last finish()
+    std::size_t mLastTriangles = 0;
+    std::size_t mLastLines = 0;
+    std::size_t mLastBinned = 0;
+    double mLastFinishMs = 0;
+
+    std::uint32_t currentState()
+    {
+        if(mStateChanged || mStates.empty())
+        {
+            DrawState state;
+            state.material = mMaterial;
+            std::copy_n(mCurrentColor, 4, state.color);
+            state.texture = mTexturing ? mTexture : nullptr;
+            state.lighting = mLighting;
+            for(int i = 0; i < kMaxLights; ++i)
+            {
+                if(mLightEnabled[i])
+                    state.lights[state.lightCount++] = mLights[i];
+            }
+            for(int c = 0; c < 4; ++c)
+            {
+                state.sceneColor[c] = mMaterial.emission[c] +
+                    mLightModelAmbient[c] * mMaterial.ambient[c];
+            }
+            mStates.push_back(state);
+            mStateChanged = false;
+        }
+        return static_cast<std::uint32_t>(mStates.size() - 1);
+    }
+
+    ClipVertex transformVertex(const SoftwareVertex &v) const
+    {
+        ClipVertex out;
+        transform(mModelViewProjection, v.position, 1, out.clip);
+        transformPosition(v.position, out.eye);
+        transformNormal(v.normal, out.normal);
+        std::copy_n(v.texcoord, 2, out.texcoord);
+        return out;
+    }
+
+    static ClipVertex lerp(const ClipVertex &a, const ClipVertex &b, float t)
+    {
+        ClipVertex out;
+        auto *pa = &a.clip[0];
+        auto *pb = &b.clip[0];
+        auto *po = &out.clip[0];
+        for(std::size_t i = 0; i < sizeof(ClipVertex) / sizeof(float); ++i)
+            po[i] = pa[i] + (pb[i] - pa[i]) * t;
+        return out;
+    }
+
+    // Distance to the near plane z = -w, not negative in front of it
+    static float nearDistance(const ClipVertex &v)
+    {
+        return v.clip[2] + v.clip[3];
+    }
+
+    void toScreen(const ClipVertex &v, float &x, float &y, float &z,
+        float &inverse_w) const
+    {
+        inverse_w = 1 / v.clip[3];
+        x = (v.clip[0] * inverse_w * 0.5f + 0.5f) * mWidth;
+        y = (v.clip[1] * inverse_w * 0.5f + 0.5f) * mHeight;
+        z = v.clip[2] * inverse_w * 0.5f + 0.5f;
+    }
+
+    void bin(std::uint32_t primitive, int min_x, int min_y, int max_x,
+        int max_y)
+    {
+        for(int ty = min_y / kTileSize; ty <= max_y / kTileSize; ++ty)
+        {
+            for(int tx = min_x / kTileSize; tx <= max_x / kTileSize; ++tx)
+                mBins[ty * mTilesX + tx].push_back(primitive);
+        }
+    }
+
+    void setupTriangle(const ClipVertex *v[3], std::uint32_t state)
+    {
+        float x[3], y[3], z[3], inverse_w[3];
+        for(int i = 0; i < 3; ++i)
+            toScreen(*v[i], x[i], y[i], z[i], inverse_w[i]);
+        auto area = (x[1] - x[0]) * (y[2] - y[0]) -
+            (x[2] - x[0]) * (y[1] - y[0]);
+        if(!(area != 0)) return;
+        // Wind counterclockwise, so that the inside is positive.
+        int order[3] = { 0, 1, 2 };
+        if(area < 0)
+        {
+            std::swap(order[1], order[2]);
+            area = -area;
+        }
+
+        Triangle t;
+        t.state = state;
+        const auto min_x = std::min({ x[0], x[1], x[2] });
+        const auto max_x = std::max({ x[0], x[1], x[2] });
+        const auto min_y = std::min({ y[0], y[1], y[2] });
+        const auto max_y = std::max({ y[0], y[1], y[2] });
+        t.minX = std::max(0, static_cast<int>(std::floor(min_x)));
+        t.minY = std::max(0, static_cast<int>(std::floor(min_y)));
+        t.maxX = std::min(mWidth - 1, static_cast<int>(std::ceil(max_x)));
+        t.maxY = std::min(mHeight - 1, static_cast<int>(std::ceil(max_y)));
+        if(t.minX > t.maxX || t.minY > t.maxY) return;
+
+        for(int e = 0; e < 3; ++e)
+        {
+            const auto j = order[(e + 1) % 3];
+            const auto k = order[(e + 2) % 3];
+            t.edgeA[e] = y[j] - y[k];
+            t.edgeB[e] = x[k] - x[j];
+            const auto lower = std::make_pair(y[j], x[j]) <
+                std::make_pair(y[k], x[k]) ? j : k;
+            t.edgeX[e] = x[lower];
+            t.edgeY[e] = y[lower];
+        }
+        t.originX = x[order[0]];
+        t.originY = y[order[0]];
+
+        // A value interpolated with the barycentric coordinates edge / area
+        float values[kPlanes][3];
+        for(int e = 0; e < 3; ++e)
+        {
+            const auto &vertex = *v[order[e]];
+            const auto w = inverse_w[order[e]];
+            values[0][e] = z[order[e]];
+            values[1][e] = w;
+            for(int i = 0; i < 3; ++i)
+            {
+                values[2 + i][e] = vertex.eye[i] * w;
+                values[5 + i][e] = vertex.normal[i] * w;
+            }
+            values[8][e] = vertex.texcoord[0] * w;
+            values[9][e] = vertex.texcoord[1] * w;
+        }
+        const auto inverse_area = 1 / area;
+        for(int p = 0; p < kPlanes; ++p)
+        {
+            float a = 0, b = 0;
+            for(int e = 0; e < 3; ++e)
+            {
+                a += values[p][e] * t.edgeA[e];
+                b += values[p][e] * t.edgeB[e];
+            }
+            t.planes[p][0] = a * inverse_area;
+            t.planes[p][1] = b * inverse_area;
+            t.planes[p][2] = values[p][0];
+        }
+
+        bin(static_cast<std::uint32_t>(mTriangles.size()), t.minX, t.minY,
+            t.maxX, t.maxY);
+        mTriangles.push_back(t);
+    }
+
+    // Clip at the near plane, which may turn the triangle into a quad.
+    void assembleTriangle(const ClipVertex &a, const ClipVertex &b,
+        const ClipVertex &c, std::uint32_t state)
+    {
+        const ClipVertex *in[3] = { &a, &b, &c };
+        float d[3];
+        int inside = 0;
+        for(int i = 0; i < 3; ++i)
+        {
+            d[i] = nearDistance(*in[i]);
+            if(d[i] >= 0) ++inside;
+        }
+        if(inside == 0) return;
+        if(inside == 3)
+        {
+            setupTriangle(in, state);
+            return;
+        }
+        ClipVertex clipped[4];
+        int count = 0;
+        for(int i = 0; i < 3; ++i)
+        {
+            const auto j = (i + 1) % 3;
+            if(d[i] >= 0) clipped[count++] = *in[i];
+            if((d[i] >= 0) != (d[j] >= 0))
+                clipped[count++] = lerp(*in[i], *in[j], d[i] / (d[i] - d[j]));
+        }
+        for(int i = 1; i + 1 < count; ++i)
+        {
+            const ClipVertex *fan[3] = { &clipped[0], &clipped[i],
+                &clipped[i + 1] };
+            setupTriangle(fan, state);
+        }
+    }
+
+    void assembleLine(ClipVertex a, ClipVertex b, std::uint32_t state)
+    {
+        const auto da = nearDistance(a);
+        const auto db = nearDistance(b);
+        if(da < 0 && db < 0) return;
+        if(da < 0) a = lerp(a, b, da / (da - db));
+        if(db < 0) b = lerp(b, a, db / (db - da));
+
+        Line line;
+        float w;
+        toScreen(a, line.x0, line.y0, line.z0, w);
+        toScreen(b, line.x1, line.y1, line.z1, w);
+        line.state = state;
+        const auto min_x = std::max(0, static_cast<int>(
+            std::floor(std::min(line.x0, line.x1))));
+        const auto min_y = std::max(0, static_cast<int>(
+            std::floor(std::min(line.y0, line.y1))));
+        const auto max_x = std::min(mWidth - 1, static_cast<int>(
+            std::ceil(std::max(line.x0, line.x1))));
+        const auto max_y = std::min(mHeight - 1, static_cast<int>(
+            std::ceil(std::max(line.y0, line.y1))));
+        if(min_x > max_x || min_y > max_y) return;
+        bin(static_cast<std::uint32_t>(mLines.size()) | kLineBit, min_x,
+            min_y, max_x, max_y);
+        mLines.push_back(line);
+    }
+
+    static void toBytes(const float *color, std::uint8_t *out)
+    {
+        for(int c = 0; c < 4; ++c)
+        {
+            out[c] = static_cast<std::uint8_t>(
+                std::min(std::max(color[c], 0.f), 1.f) * 255 + 0.5f);
+        }
+    }
+
+    static float sampleChannel(const Image &image, int x0, int y0, int x1,
+        int y1, float fx, float fy, int c)
+    {
+        auto texel = [&](int x, int y) {
+            return image.pixels[(std::size_t(y) * image.width + x) * 4 + c];
+        };
+        const auto top = texel(x0, y0) + (texel(x1, y0) - texel(x0, y0)) * fx;
+        const auto bottom = texel(x0, y1) +
+            (texel(x1, y1) - texel(x0, y1)) * fx;
+        return (top + (bottom - top) * fy) * (1 / 255.f);
+    }
+
+    // Bilinear with GL_REPEAT. Row 0 of the image is at t = 0, as uploaded
+    // with glTexImage2D().
+    static void sample(const Image &image, float s, float t, float *rgba)
+    {
+        const auto x = s * image.width - 0.5f;
+        const auto y = t * image.height - 0.5f;
+        const auto fx0 = std::floor(x);
+        const auto fy0 = std::floor(y);
+        auto wrap = [](int i, int n) { i %= n; return i < 0 ? i + n : i; };
+        const auto x0 = wrap(static_cast<int>(fx0), image.width);
+        const auto y0 = wrap(static_cast<int>(fy0), image.height);
+        const auto x1 = wrap(x0 + 1, image.width);
+        const auto y1 = wrap(y0 + 1, image.height);
+        for(int c = 0; c < 4; ++c)
+        {
+            rgba[c] = sampleChannel(image, x0, y0, x1, y1, x - fx0, y - fy0,
+                c);
+        }
+    }
+
+    // The lighting of blinn.frag
+    static void shade(const DrawState &state, const float *eye,
+        const float *normal, const float *texcoord, std::uint8_t *out)
+    {
+        float color[4];
+        if(state.lighting)
+        {
+            const auto &m = state.material;
+            const auto n = normalize({ normal[0], normal[1], normal[2] });
+            const Vec3 v { eye[0], eye[1], eye[2] };
+            const auto e = normalize(scale(v, -1));
+            std::copy_n(state.sceneColor, 4, color);
+            for(int i = 0; i < state.lightCount; ++i)
+            {
+                const auto &light = state.lights[i];
+                const auto *p = light.position;
+                Vec3 l { p[0] - v.x * p[3], p[1] - v.y * p[3],
+                    p[2] - v.z * p[3] };
+                const auto distance = std::sqrt(dot(l, l));
+                l = normalize(l);
+                auto attenuation = 1.f;
+                if(p[3] != 0)
+                {
+                    attenuation /= light.attenuation[0] +
+                        light.attenuation[1] * distance +
+                        light.attenuation[2] * distance * distance;
+                }
+                const auto h = normalize(add(l, e));
+                const auto diffuse = std::max(dot(n, l), 0.f);
+                const auto specular = diffuse > 0 ? std::pow(
+                    std::max(dot(n, h), 0.f), m.shininess) : 0.f;
+                for(int c = 0; c < 3; ++c)
+                {
+                    color[c] += attenuation * (
+                        light.ambient[c] * m.ambient[c] +
+                        light.diffuse[c] * m.diffuse[c] * diffuse +
+                        light.specular[c] * m.specular[c] * specular);
+                }
+            }
+            for(int c = 0; c < 3; ++c)
+                color[c] = std::min(std::max(color[c], 0.f), 1.f);
+            color[3] = m.diffuse[3];
+        }
+        else
+        {
+            std::copy_n(state.color, 4, color);
+        }
+        if(state.texture)
+        {
+            float texel[4];
+            sample(*state.texture, texcoord[0], texcoord[1], texel);
+            for(int c = 0; c < 4; ++c) color[c] *= texel[c];
+        }
+        toBytes(color, out);
+    }
+
+    /**
+     * \brief Test four pixels of a row starting at (x, y) against the edges
+     * and the depth buffer. Returns a bit for each pixel that passes and
+     * their depths in z.
+     */
+    static int cover4(const Triangle &t, int x, int y, const float *depth,
+        float *z)
+    {
+        const auto py = y + 0.5f;
+#ifdef LAB_IMAGE_SSE2
+        const auto px = _mm_add_ps(_mm_set1_ps(x + 0.5f),
+            _mm_set_ps(3, 2, 1, 0));
+        auto inside = _mm_castsi128_ps(_mm_set1_epi32(-1));
+        for(int e = 0; e < 3; ++e)
+        {
+            const auto value = _mm_add_ps(
+                _mm_mul_ps(_mm_set1_ps(t.edgeA[e]),
+                    _mm_sub_ps(px, _mm_set1_ps(t.edgeX[e]))),
+                _mm_set1_ps(t.edgeB[e] * (py - t.edgeY[e])));
+            inside = _mm_and_ps(inside,
+                _mm_cmpge_ps(value, _mm_setzero_ps()));
+        }
+        const auto depths = _mm_add_ps(
+            _mm_mul_ps(_mm_set1_ps(t.planes[0][0]),
+                _mm_sub_ps(px, _mm_set1_ps(t.originX))),
+            _mm_set1_ps(t.planes[0][1] * (py - t.originY) + t.planes[0][2]));
+        inside = _mm_and_ps(inside, _mm_cmplt_ps(depths,
+            _mm_loadu_ps(depth)));
+        _mm_storeu_ps(z, depths);
+        return _mm_movemask_ps(inside);
+#else
+        int mask = 0;
+        for(int i = 0; i < 4; ++i)
+        {
+            const auto px = x + i + 0.5f;
+            auto covered = true;
+            for(int e = 0; e < 3; ++e)
+            {
+                if(t.edgeA[e] * (px - t.edgeX[e]) +
+                    t.edgeB[e] * (py - t.edgeY[e]) < 0)
+                    covered = false;
+            }
+            z[i] = t.planes[0][0] * (px - t.originX) +
+                (t.planes[0][1] * (py - t.originY) + t.planes[0][2]);
+            if(covered && z[i] < depth[i]) mask |= 1 << i;
+        }
+        return mask;
+#endif
+    }
+
+    // Primitive visible in each pixel of a tile, kNone for the clear color
+    using TileIds = std::uint32_t[kTileSize * kTileSize];
+    static constexpr std::uint32_t kNone = 0xffffffffu;
+
+    void rasterizeTriangle(std::uint32_t id, int tile_x0, int tile_y0,
+        TileIds &ids)
+    {
+        const auto &t = mTriangles[id];
+        // Rows of the tile start at multiples of 4.
+        const auto x0 = std::max(t.minX, tile_x0) & ~3;
+        const auto x1 = std::min(t.maxX, tile_x0 + kTileSize - 1);
+        const auto y0 = std::max(t.minY, tile_y0);
+        const auto y1 = std::min(t.maxY, tile_y0 + kTileSize - 1);
+        for(int y = y0; y <= y1; ++y)
+        {
+            auto *depth = &mDepth[std::size_t(y) * mStride];
+            auto *row = &ids[(y - tile_y0) * kTileSize];
+            for(int x = x0; x <= x1; x += 4)
+            {
+                float z[4];
+                const auto mask = cover4(t, x, y, depth + x, z);
+                for(int i = 0; i < 4; ++i)
+                {
+                    if(mask & 1 << i)
+                    {
+                        depth[x + i] = z[i];
+                        row[x + i - tile_x0] = id;
+                    }
+                }
+            }
+        }
+    }
+
+    void rasterizeLine(std::uint32_t id, int tile_x0, int tile_y0,
+        TileIds &ids)
+    {
+        const auto &line = mLines[id & ~kLineBit];
+        const auto dx = line.x1 - line.x0;
+        const auto dy = line.y1 - line.y0;
+        // Clip the parameter range to the tile (Liang-Barsky), so that long
+        // lines only cost the pixels they cover in it.
+        float t0 = 0, t1 = 1;
+        auto clip = [&](float p, float q) {
+            if(p == 0) return q >= 0;
+            const auto r = q / p;
+            if(p < 0) t0 = std::max(t0, r);
+            else t1 = std::min(t1, r);
+            return t0 <= t1;
+        };
+        const auto tile_x1 = float(std::min(tile_x0 + kTileSize, mWidth));
+        const auto tile_y1 = float(std::min(tile_y0 + kTileSize, mHeight));
+        if(!clip(-dx, line.x0 - tile_x0) || !clip(dx, tile_x1 - line.x0) ||
+            !clip(-dy, line.y0 - tile_y0) || !clip(dy, tile_y1 - line.y0))
+            return;
+        // One pixel per step along the major axis
+        const auto length = std::max(std::abs(dx), std::abs(dy));
+        if(length < 1e-6f) return;
+        const auto first = static_cast<int>(std::floor(t0 * length));
+        const auto last = static_cast<int>(std::ceil(t1 * length));
+        for(int i = first; i <= last; ++i)
+        {
+            const auto t = std::min(i / length, 1.f);
+            const auto x = static_cast<int>(std::floor(line.x0 + dx * t));
+            const auto y = static_cast<int>(std::floor(line.y0 + dy * t));
+            if(x < tile_x0 || y < tile_y0 || x >= tile_x1 || y >= tile_y1)
+                continue;
+            const auto z = line.z0 + (line.z1 - line.z0) * t;
+            auto &depth = mDepth[std::size_t(y) * mStride + x];
+            if(!(z < depth)) continue;
+            depth = z;
+            ids[(y - tile_y0) * kTileSize + x - tile_x0] = id;
+        }
+    }
+
+    void shadePixel(std::uint32_t id, int x, int y, std::uint8_t *out) const
+    {
+        if(id & kLineBit)
+        {
+            toBytes(mStates[mLines[id & ~kLineBit].state].color, out);
+            return;
+        }
+        const auto &t = mTriangles[id];
+        const auto px = x + 0.5f - t.originX;
+        const auto py = y + 0.5f - t.originY;
+        float values[kPlanes];
+        for(int p = 1; p < kPlanes; ++p)
+        {
+            values[p] = t.planes[p][0] * px + t.planes[p][1] * py +
+                t.planes[p][2];
+        }
+        // Back from the values divided by w
+        const auto w = 1 / values[1];
+        for(int p = 2; p < kPlanes; ++p) values[p] *= w;
+        shade(mStates[t.state], values + 2, values + 5, values + 8, out);
+    }
+
+    /**
+     * \brief Resolve the visibility of the tile first and shade every pixel
+     * once, so that overdraw only costs the depth test.
+     */
+    void renderTile(int tile)
+    {
+        const auto tile_x0 = tile % mTilesX * kTileSize;
+        const auto tile_y0 = tile / mTilesX * kTileSize;
+        TileIds ids;
+        std::fill_n(ids, kTileSize * kTileSize, kNone);
+        if(mClearPending)
+        {
+            for(int y = tile_y0; y < tile_y0 + kTileSize; ++y)
+            {
+                std::fill_n(&mDepth[std::size_t(y) * mStride + tile_x0],
+                    kTileSize, 1.f);
+            }
+        }
+        for(auto primitive : mBins[tile])
+        {
+            if(primitive & kLineBit)
+                rasterizeLine(primitive, tile_x0, tile_y0, ids);
+            else
+                rasterizeTriangle(primitive, tile_x0, tile_y0, ids);
+        }
+        for(int y = 0; y < kTileSize; ++y)
+        {
+            auto *color = &mColor[
+                (std::size_t(tile_y0 + y) * mStride + tile_x0) * 4];
+            for(int x = 0; x < kTileSize; ++x)
+            {
+                const auto id = ids[y * kTileSize + x];
+                if(id != kNone)
+                    shadePixel(id, tile_x0 + x, tile_y0 + y, color + x * 4);
+                else if(mClearPending)
+                    std::copy_n(mClearColor, 4, color + x * 4);
+            }
+        }
+    }
+
+public:
+    SoftwareRasterizer() = default;
+
+    /**
+     * \brief Set the size of the buffers and the viewport, which covers
+     * them. The contents are undefined until the next clear().
+     */
+    void resize(int width, int height)
+    {
+        if(width == mWidth && height == mHeight) return;
+        mWidth = width;
+        mHeight = height;
+        mTilesX = (width + kTileSize - 1) / kTileSize;
+        mTilesY = (height + kTileSize - 1) / kTileSize;
+        mStride = mTilesX * kTileSize;
+        const auto pixels = std::size_t(mStride) * mTilesY * kTileSize;
+        mColor.assign(pixels * 4, 0);
+        mDepth.assign(pixels, 1.f);
+        mBins.assign(std::size_t(mTilesX) * mTilesY, { });
+        mTriangles.clear();
+        mLines.clear();
+    }
+
+    int width() const { return mWidth; }
+    int height() const { return mHeight; }
+
+    // Clear the color and the depth to 1 when the tiles are rasterized.
+    void clear(float r, float g, float b, float a)
+    {
+        const float rgba[4] = { r, g, b, a };
+        toBytes(rgba, mClearColor);
+        mClearPending = true;
+    }
+
+    void setProjection(const float *matrix)
+    {
+        std::copy_n(matrix, 16, mProjection);
+        multiply(mProjection, mModelView, mModelViewProjection);
+    }
+
+    void setModelView(const float *matrix) override
+    {
+        SoftwareRenderer::setModelView(matrix);
+        multiply(mProjection, mModelView, mModelViewProjection);
+    }
+
+    void setLighting(bool enabled)
+    {
+        mLighting = enabled;
+        mStateChanged = true;
+    }
+
+    void enableLight(int index, bool enabled)
+    {
+        mLightEnabled[index] = enabled;
+        mStateChanged = true;
+    }
+
+    // Like GL_TEXTURE_2D, off by default
+    void setTexturing(bool enabled)
+    {
+        mTexturing = enabled;
+        mStateChanged = true;
+    }
+
+    void drawTriangles(const SoftwareVertex *vertices,
+        std::size_t count) override
+    {
+        const auto state = currentState();
+        for(std::size_t i = 0; i + 2 < count; i += 3)
+        {
+            assembleTriangle(transformVertex(vertices[i]),
+                transformVertex(vertices[i + 1]),
+                transformVertex(vertices[i + 2]), state);
+        }
+    }
+
+    // Large meshes are transformed on the worker pool.
+    void drawIndexed(const SoftwareVertex *vertices, std::size_t vertex_count,
+        const std::uint32_t *indices, std::size_t index_count) override
+    {
+        const auto state = currentState();
+        mTransformed.resize(vertex_count);
+        workerPool().parallelFor(vertex_count, 4096,
+            [&](std::size_t begin, std::size_t end) {
+            for(auto i = begin; i < end; ++i)
+                mTransformed[i] = transformVertex(vertices[i]);
+        });
+        for(std::size_t i = 0; i + 2 < index_count; i += 3)
+        {
+            assembleTriangle(mTransformed[indices[i]],
+                mTransformed[indices[i + 1]], mTransformed[indices[i + 2]],
+                state);
+        }
+    }
+
+    // One pixel wide and unlit
+    void drawLines(const SoftwareVertex *vertices, std::size_t count) override
+    {
+        const auto state = currentState();
+        for(std::size_t i = 0; i + 1 < count; i += 2)
+        {
+            assembleLine(transformVertex(vertices[i]),
+                transformVertex(vertices[i + 1]), state);
+        }
+    }
+
+    /**
+     * \brief Rasterize everything drawn since the last call, one tile per
+     * task on the worker pool, and block until done.
+     */
+    void finish()
+    {
+        const auto start = std::chrono::steady_clock::now();
+        mLastBinned = 0;
+        for(auto &&bin : mBins) mLastBinned += bin.size();
+        workerPool().parallelFor(mBins.size(), 1,
+            [&](std::size_t begin, std::size_t end) {
+            for(auto tile = begin; tile < end; ++tile)
+                renderTile(static_cast<int>(tile));
+        });
+        mClearPending = false;
+        mLastTriangles = mTriangles.size();
+        mLastLines = mLines.size();
+        mTriangles.clear();
+        mLines.clear();
+        for(auto &&bin : mBins) bin.clear();
+        mStates.clear();
+        mStateChanged = true;
+        const std::chrono::duration<double, std::milli> ms =
+            std::chrono::steady_clock::now() - start;
+        mLastFinishMs = ms.count();
+    }
+
+    // Copy the color buffer as tightly packed RGBA rows, bottom to top.
+    void readPixels(std::uint8_t *rgba) const
+    {
+        for(int y = 0; y < mHeight; ++y)
+        {
+            std::copy_n(&mColor[std::size_t(y) * mStride * 4],
+                std::size_t(mWidth) * 4,
+                rgba + std::size_t(y) * mWidth * 4);
+        }
+    }
+
+    // Counts of the last finish()
+    std::size_t triangles() const { return mLastTriangles; }
+    std::size_t lines() const { return mLastLines; }
+    // Primitives summed over the tiles they were binned to
+    std::size_t binned() const { return mLastBinned; }
+    double finishMilliseconds() const { return mLastFinishMs; }
+};
+
+/**
+ * \brief The sphere drawn by gluSphere() with texture coordinates, as
+ * indexed triangles.
+ */
+inline void buildSoftwareSphere(float radius, int slices, int stacks,
+    std::vector<SoftwareVertex> &vertices, std::vector<std::uint32_t> &indices)
+{
+    vertices.clear();
+    indices.clear();
+    const auto pi = 3.14159265358979f;
+    for(int i = 0; i <= stacks; ++i)
+    {
+        const auto rho = i * pi / stacks;
+        for(int j = 0; j <= slices; ++j)
+        {
+            const auto theta = j == slices ? 0 : j * 2 * pi / slices;
+            const auto x = -std::sin(theta) * std::sin(rho);
+            const auto y = std::cos(theta) * std::sin(rho);
+            const auto z = std::cos(rho);
+            vertices.push_back({ { x * radius, y * radius, z * radius },
+                { x, y, z },
+                { 1.f * j / slices, 1 - 1.f * i / stacks } });
+        }
+    }
+    const auto row = static_cast<std::uint32_t>(slices + 1);
+    for(std::uint32_t i = 0; i < static_cast<std::uint32_t>(stacks); ++i)
+    {
+        for(std::uint32_t j = 0; j < static_cast<std::uint32_t>(slices); ++j)
+        {
+            const auto a = i * row + j;
+            const auto b = a + row;
+            indices.insert(indices.end(), { a, b, a + 1, a + 1, b, b + 1 });
+        }
+    }
+}
@@ -0,0 +1,127 @@
+#pragma once
+
+// Irradiance from an environment image as spherical harmonics. Independent
+// of OpenGL so that it can be used by the tools and run on worker threads.
+
+#include <cmath>
+#include <mutex>
+
+#include "lab08_image.hpp"
+
+/*****************************************************************************/
+// ShIrradiance
+/*****************************************************************************/
+
+/**
+ * \brief The irradiance of a distant environment, divided by pi, as the nine
+ * spherical harmonics of bands 0 to 2. Multiplied by a diffuse reflectance
+ * this is the light reflected from a surface, see "An Efficient
+ * Representation for Irradiance Environment Maps", Ramamoorthi & Hanrahan
+ * 2001.
+ *
+ * The coefficients already include the constants of the basis functions
+ * and the convolution with the cosine, so that evaluating them for a unit
+ * normal (x, y, z) is the sum of the RGB coefficients times
+ *
+ *     1, y, z, x, xy, yz, 3z^2 - 1, xz, x^2 - y^2
+ *
+ * as shAmbient() in blinn.frag does.
+ */
+struct ShIrradiance
+{
+    float coefficients[9][3] { };
+
+    void evaluate(const float n[3], float rgb[3]) const
+    {
+        const float basis[9] = { 1, n[1], n[2], n[0], n[0] * n[1],
+            n[1] * n[2], 3 * n[2] * n[2] - 1, n[0] * n[2],
+            n[0] * n[0] - n[1] * n[1] };
+        for(int c = 0; c < 3; ++c)
+        {
+            rgb[c] = 0;
+            for(int k = 0; k < 9; ++k) rgb[c] += coefficients[k][c] * basis[k];
+        }
+    }
+};
+
+/**
+ * \brief Project an equirectangular environment of linear radiance. The top
+ * row looks along +y and the center of the image along -z. Rows are spread
+ * over the worker pool; every texel adds its color times the nine basis
+ * functions with Texel4 arithmetic.
+ */
+inline ShIrradiance projectIrradiance(const LinearImage &environment)
+{
+    const auto pi = 3.14159265358979;
+    const auto width = environment.width;
+    const auto height = environment.height;
+    // Directions of the columns, shared by all rows
+    std::vector<float> sin_phi(width), cos_phi(width);
+    for(int x = 0; x < width; ++x)
+    {
+        const auto phi = 2 * pi * ((x + 0.5) / width - 0.5);
+        sin_phi[x] = static_cast<float>(std::sin(phi));
+        cos_phi[x] = static_cast<float>(std::cos(phi));
+    }
+
+    double sums[9][3] { };
+    std::mutex sums_mutex;
+    workerPool().parallelFor(static_cast<std::size_t>(height), 8,
+        [&](std::size_t begin, std::size_t end) {
+        double range_sums[9][3] { };
+        for(auto y = begin; y < end; ++y)
+        {
+            const auto theta = pi * (y + 0.5) / height;
+            const auto sin_theta = static_cast<float>(std::sin(theta));
+            const auto cos_theta = static_cast<float>(std::cos(theta));
+            Texel4 row_sums[9];
+            for(auto &&s : row_sums) s = zeroTexel();
+            const auto *texel = environment.row(static_cast<int>(y));
+            for(int x = 0; x < width; ++x, texel += 4)
+            {
+                const auto dx = sin_theta * sin_phi[x];
+                const auto dy = cos_theta;
+                const auto dz = -sin_theta * cos_phi[x];
+                const float basis[9] = { 1, dy, dz, dx, dx * dy, dy * dz,
+                    3 * dz * dz - 1, dx * dz, dx * dx - dy * dy };
+                const auto color = loadTexel(texel);
+                for(int k = 0; k < 9; ++k)
+                    row_sums[k] = row_sums[k] + color * basis[k];
+            }
+            // Solid angle of the texels of the row
+            const auto weight = 2 * pi / width * pi / height * sin_theta;
+            for(int k = 0; k < 9; ++k)
+            {
+                float rgba[4];
+                storeTexel(rgba, row_sums[k]);
+                for(int c = 0; c < 3; ++c)
+                    range_sums[k][c] += rgba[c] * weight;
+            }
+        }
+        std::lock_guard<std::mutex> lock(sums_mutex);
+        for(int k = 0; k < 9; ++k)
+        {
+            for(int c = 0; c < 3; ++c) sums[k][c] += range_sums[k][c];
+        }
+    });
+
+    // The squares of the normalization constants of the basis functions,
+    // once for the projection and once for the evaluation, times the
+    // convolution with the cosine divided by pi: 1, 2/3 and 1/4 per band.
+    const double k0 = 1 / (4 * pi);
+    const double k1 = 3 / (4 * pi) * 2 / 3;
+    const double k2 = 15 / (4 * pi) / 4;
+    const double k20 = 5 / (16 * pi) / 4;
+    const double k22 = 15 / (16 * pi) / 4;
+    const double scales[9] = { k0, k1, k1, k1, k2, k2, k20, k2, k22 };
+    ShIrradiance irradiance;
+    for(int k = 0; k < 9; ++k)
+    {
+        for(int c = 0; c < 3; ++c)
+        {
+            irradiance.coefficients[k][c] =
+                static_cast<float>(sums[k][c] * scales[k]);
+        }
+    }
+    return irradiance;
+}
@@ -0,0 +1,293 @@
+#pragma once
+
+// Included by lab08_framework.hpp after the definition of Texture.
+
+#include <algorithm>
+#include <chrono>
+#include <deque>
+#include <functional>
+#include <future>
+#include <memory>
+#include <string>
+#include <vector>
+
+// The implementation is compiled once in third_party/stb_rect_pack.cpp and
+// shared with ImGui.
+#include "../third_party/imgui-1.73/imstb_rectpack.h"
+
+/*****************************************************************************/
+// TextureAtlas
+/*****************************************************************************/
+
+/**
+ * \brief Where a texture packed into a TextureAtlas ended up. The atlas
+ * updates it in place when defragmenting, so always read it right before
+ * use. Texture coordinates in [0, 1] map to [uvMin, uvMax] on the page.
+ */
+struct AtlasRegion
+{
+    Texture *page = nullptr;
+    int x = 0;
+    int y = 0;
+    int width = 0;
+    int height = 0;
+    glm::vec2 uvMin { 0 };
+    glm::vec2 uvMax { 1 };
+};
+
+// The region stays allocated as long as a handle to it exists.
+using AtlasRegionHandle = std::shared_ptr<AtlasRegion>;
+
+/**
+ * \brief Packs many small textures, such as decals and sprites, into large
+ * pages with the skyline packer of stb_rect_pack, so that objects using them
+ * can be drawn one after another without switching textures. Textures are
+ * inserted one at a time into the first page with room, opening new pages
+ * as needed. Freed space is only reclaimed by defragment(), which repacks
+ * the live regions from scratch.
+ *
+ * Each region is surrounded by a gutter repeating its edge texels so that
+ * bilinear filtering does not bleed in neighbours. Pages have no mip levels
+ * and texture coordinates must stay within [0, 1]; wrapping is not possible
+ * inside an atlas.
+ */
+class TextureAtlas
+{
+    struct Page
+    {
+        std::unique_ptr<Texture> texture;
+        stbrp_context context;
+        std::vector<stbrp_node> nodes;
+    };
+
+    struct Entry
+    {
+        std::weak_ptr<AtlasRegion> region;
+        // Kept for repacking during defragmentation
+        Image image;
+    };
+
+    // An image file decoded on the worker pool, packed by update()
+    struct Load
+    {
+        std::future<Image> image;
+        std::function<void(AtlasRegionHandle)> done;
+    };
+
+    int mPageSize = 1024;
+    int mGutter = 2;
+    std::vector<std::unique_ptr<Page>> mPages;
+    std::vector<Entry> mEntries;
+    std::deque<Load> mLoads;
+
+    void resetPage(Page &page)
+    {
+        page.nodes.resize(mPageSize);
+        stbrp_init_target(&page.context, mPageSize, mPageSize,
+            page.nodes.data(), static_cast<int>(page.nodes.size()));
+    }
+
+    Page & addPage()
+    {
+        auto page = std::make_unique<Page>();
+        page->texture = std::make_unique<Texture>();
+        page->texture->allocate(mPageSize, mPageSize);
+        resetPage(*page);
+        mPages.push_back(std::move(page));
+        return *mPages.back();
+    }
+
+    stbrp_rect paddedRect(const Image &image) const
+    {
+        stbrp_rect rect { };
+        rect.w = static_cast<stbrp_coord>(image.width + 2 * mGutter);
+        rect.h = static_cast<stbrp_coord>(image.height + 2 * mGutter);
+        return rect;
+    }
+
+    // Copy the image with its gutter to a packed rectangle and update the
+    // region to point there.
+    void place(Page &page, const stbrp_rect &rect, const Image &image,
+        AtlasRegion &region)
+    {
+        const auto w = rect.w, h = rect.h;
+        std::vector<std::uint8_t> padded(std::size_t(4) * w * h);
+        for(int y = 0; y < h; ++y)
+        {
+            const auto sy = std::min(std::max(y - mGutter, 0), image.height - 1);
+            for(int x = 0; x < w; ++x)
+            {
+                const auto sx = std::min(std::max(x - mGutter, 0), image.width - 1);
+                std::copy_n(&image.pixels[(std::size_t(sy) * image.width + sx) * 4],
+                    4, &padded[(std::size_t(y) * w + x) * 4]);
+            }
+        }
+        page.texture->updateRegion(rect.x, rect.y, w, h, padded.data());
+
+        region.page = page.texture.get();
+        region.x = rect.x + mGutter;
+        region.y = rect.y + mGutter;
+        region.width = image.width;
+        region.height = image.height;
+        const auto size = static_cast<float>(mPageSize);
+        region.uvMin = glm::vec2(region.x, region.y) / size;
+        region.uvMax = glm::vec2(region.x + region.width,
+            region.y + region.height) / size;
+    }
+
+public:
+    explicit TextureAtlas(int page_size = 1024, int gutter = 2)
+        : mPageSize(page_size)
+        , mGutter(gutter)
+    {
+    }
+
+    TextureAtlas(const TextureAtlas &) = delete;
+    TextureAtlas & operator=(const TextureAtlas &) = delete;
+
+    int pageSize() const { return mPageSize; }
+    std::size_t pageCount() const { return mPages.size(); }
+    Texture * page(std::size_t i) const { return mPages[i]->texture.get(); }
+
+    /**
+     * \brief Pack an RGBA image. Returns nullptr if it does not fit into an
+     * empty page.
+     */
+    AtlasRegionHandle insert(Image image)
+    {
+        auto rect = paddedRect(image);
+        if(rect.w > mPageSize || rect.h > mPageSize)
+        {
+            std::cerr << "Texture of " << image.width << "x" << image.height
+                << " does not fit into atlas pages of " << mPageSize
+                << std::endl;
+            return nullptr;
+        }
+
+        Page *target = nullptr;
+        for(auto &&page : mPages)
+        {
+            if(stbrp_pack_rects(&page->context, &rect, 1))
+            {
+                target = page.get();
+                break;
+            }
+        }
+        if(!target)
+        {
+            target = &addPage();
+            stbrp_pack_rects(&target->context, &rect, 1);
+        }
+
+        auto region = std::make_shared<AtlasRegion>();
+        place(*target, rect, image, *region);
+        mEntries.push_back({ region, std::move(image) });
+        return region;
+    }
+
+    /**
+     * \brief Decode an image file on the worker pool and pack it once
+     * update() sees it decoded, which then calls done with the region on
+     * the render thread. done is not called if the file cannot be loaded or
+     * does not fit.
+     */
+    void insertFromFileAsync(const std::string &path,
+        std::function<void(AtlasRegionHandle)> done)
+    {
+        auto image = workerPool().submit([path]() {
+            ProfileScope scope("Decode Image");
+            Image image;
+            std::string error;
+            if(!loadImageFile(path, image, error))
+            {
+                std::cerr << "Cannot load texture " << path << ": " << error
+                    << std::endl;
+            }
+            return image;
+        });
+        mLoads.push_back({ std::move(image), std::move(done) });
+    }
+
+    // Pack the images decoded since the last call, in the order requested.
+    void update()
+    {
+        while(!mLoads.empty() && mLoads.front().image.wait_for(
+            std::chrono::seconds(0)) == std::future_status::ready)
+        {
+            auto load = std::move(mLoads.front());
+            mLoads.pop_front();
+            auto image = load.image.get();
+            if(image.pixels.empty()) continue;
+            if(auto region = insert(std::move(image)))
+                load.done(std::move(region));
+        }
+    }
+
+    /**
+     * \brief Repack all regions still in use into as few pages as possible,
+     * tallest first, and release the pages no longer needed.
+     */
+    void defragment()
+    {
+        mEntries.erase(std::remove_if(mEntries.begin(), mEntries.end(),
+            [](const Entry &e) { return e.region.expired(); }),
+            mEntries.end());
+
+        std::vector<stbrp_rect> rects(mEntries.size());
+        for(std::size_t i = 0; i < mEntries.size(); ++i)
+        {
+            rects[i] = paddedRect(mEntries[i].image);
+            rects[i].id = static_cast<int>(i);
+        }
+
+        std::size_t used_pages = 0;
+        while(!rects.empty())
+        {
+            if(used_pages == mPages.size()) addPage();
+            auto &&page = *mPages[used_pages++];
+            page.texture->allocate(mPageSize, mPageSize);
+            resetPage(page);
+            stbrp_pack_rects(&page.context, rects.data(),
+                static_cast<int>(rects.size()));
+            for(auto &&rect : rects)
+            {
+                if(!rect.was_packed) continue;
+                auto &&entry = mEntries[rect.id];
+                place(page, rect, entry.image, *entry.region.lock());
+            }
+            rects.erase(std::remove_if(rects.begin(), rects.end(),
+                [](const stbrp_rect &r) { return r.was_packed != 0; }),
+                rects.end());
+        }
+        mPages.resize(used_pages);
+    }
+
+    // Fraction of the page area covered by regions still in use
+    float occupancy() const
+    {
+        if(mPages.empty()) return 0;
+        double used = 0;
+        for(auto &&entry : mEntries)
+        {
+            if(entry.region.expired()) continue;
+            used += double(entry.image.width + 2 * mGutter) *
+                (entry.image.height + 2 * mGutter);
+        }
+        return static_cast<float>(
+            used / (double(mPageSize) * mPageSize * mPages.size()));
+    }
+
+    std::size_t regionCount() const
+    {
+        return std::count_if(mEntries.begin(), mEntries.end(),
+            [](const Entry &e) { return !e.region.expired(); });
+    }
+
+    void emitControlWidgets()
+    {
+        ImGui::Text("%zu regions on %zu pages of %dx%d, %.1f%% occupied",
+            regionCount(), mPages.size(), mPageSize, mPageSize,
+            occupancy() * 100);
+        if(ImGui::Button("Defragment")) defragment();
+    }
+};
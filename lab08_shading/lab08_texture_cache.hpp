@@ -0,0 +1,349 @@
+#pragma once
+
+// Included by lab08_framework.hpp after the definition of Texture.
+
+#include <cstdint>
+#include <filesystem>
+#include <string>
+#include <unordered_map>
+
+/*****************************************************************************/
+// TextureCache
+/*****************************************************************************/
+
+/**
+ * \brief Deduplicates textures loaded from files. Textures are identified by
+ * the hash of the file content, so the same image is decoded and uploaded
+ * once no matter how many objects, materials or differently spelled paths
+ * refer to it. The canonical path of a file is remembered together with its
+ * size and modification time to skip reading files that were seen before.
+ *
+ * Textures nobody holds a handle to stay resident until the cache exceeds
+ * its memory budget, then the least recently used ones are evicted.
+ */
+class TextureCache
+{
+    struct Entry
+    {
+        TextureHandle texture;
+        std::size_t bytes = 0;
+        std::uint64_t lastUse = 0;
+    };
+
+    struct PathInfo
+    {
+        std::uint64_t hash = 0;
+        std::uintmax_t fileSize = 0;
+        std::filesystem::file_time_type writeTime;
+    };
+
+    std::unordered_map<std::uint64_t, Entry> mEntries;
+    std::unordered_map<std::string, PathInfo> mPaths;
+    // Asynchronous loads which have not been decoded yet, by path
+    std::unordered_map<std::string, std::weak_ptr<Texture>> mLoading;
+
+    std::size_t mBudget = std::size_t(256) << 20;
+    std::size_t mResidentBytes = 0;
+    std::uint64_t mUseCounter = 0;
+
+    std::uint64_t mHits = 0;
+    std::uint64_t mMisses = 0;
+    std::uint64_t mEvictions = 0;
+
+    TextureHandle hit(Entry &entry)
+    {
+        ++mHits;
+        entry.lastUse = ++mUseCounter;
+        return entry.texture;
+    }
+
+    TextureHandle insert(std::uint64_t hash, TextureHandle texture)
+    {
+        auto &&e = mEntries[hash];
+        e.texture = texture;
+        e.bytes = texture->bytes();
+        e.lastUse = ++mUseCounter;
+        mResidentBytes += e.bytes;
+        trim();
+        return texture;
+    }
+
+    TextureHandle acquireContainer(const std::string &path,
+        const std::string &key, std::uintmax_t file_size,
+        std::filesystem::file_time_type write_time)
+    {
+        TextureData data;
+        std::string error;
+        if(!loadTextureData(key, TextureLoadOptions::current(), data, error))
+        {
+            std::cerr << "Cannot load texture " << path << ": " << error
+                << std::endl;
+            return nullptr;
+        }
+        mPaths[key] = { data.hash, file_size, write_time };
+
+        auto entry = mEntries.find(data.hash);
+        if(entry != mEntries.end()) return hit(entry->second);
+
+        ++mMisses;
+        auto texture = std::make_shared<Texture>();
+        texture->upload(data);
+        return insert(data.hash, std::move(texture));
+    }
+
+public:
+    void setBudget(std::size_t bytes)
+    {
+        mBudget = bytes;
+        trim();
+    }
+
+    std::size_t budget() const { return mBudget; }
+    std::size_t residentBytes() const { return mResidentBytes; }
+    std::size_t size() const { return mEntries.size(); }
+    std::uint64_t hits() const { return mHits; }
+    std::uint64_t misses() const { return mMisses; }
+    std::uint64_t evictions() const { return mEvictions; }
+
+    float hitRate() const
+    {
+        const auto total = mHits + mMisses;
+        return total ? static_cast<float>(mHits) / total : 0.f;
+    }
+
+    /**
+     * \brief Get the texture for an image file, loading it if no file with
+     * the same content was loaded before. Returns nullptr if the file cannot
+     * be read or decoded.
+     */
+    TextureHandle acquire(const std::string &path)
+    {
+        namespace fs = std::filesystem;
+
+        std::error_code ec;
+        const auto canonical = fs::weakly_canonical(path, ec).string();
+        const auto key = ec ? path : canonical;
+        const auto file_size = fs::file_size(key, ec);
+        if(ec)
+        {
+            std::cerr << "Cannot open texture " << path << std::endl;
+            return nullptr;
+        }
+        const auto write_time = fs::last_write_time(key, ec);
+
+        // Known path whose file did not change since it was hashed
+        auto known = mPaths.find(key);
+        if(known != mPaths.end() &&
+            known->second.fileSize == file_size &&
+            known->second.writeTime == write_time)
+        {
+            auto entry = mEntries.find(known->second.hash);
+            if(entry != mEntries.end()) return hit(entry->second);
+        }
+
+        // Containers are identified by the hash of their source image stored
+        // in the header, so they are only mapped rather than read.
+        if(isTextureContainerPath(key)) return acquireContainer(path, key,
+            file_size, write_time);
+
+        std::ifstream file(key, std::ios::binary);
+        std::vector<char> content(file_size);
+        if(!file.read(content.data(), content.size()))
+        {
+            std::cerr << "Cannot read texture " << path << std::endl;
+            return nullptr;
+        }
+        const auto hash = hashBytes(content.data(), content.size());
+        mPaths[key] = { hash, file_size, write_time };
+
+        // Same content under another name
+        auto entry = mEntries.find(hash);
+        if(entry != mEntries.end()) return hit(entry->second);
+
+        ++mMisses;
+        auto texture = std::make_shared<Texture>();
+        if(!texture->loadFromMemory(content.data(), content.size(), key))
+        {
+            std::cerr << "Cannot decode texture " << path << ": "
+                << texture->error() << std::endl;
+            return nullptr;
+        }
+
+        return insert(hash, std::move(texture));
+    }
+
+    /**
+     * \brief Like acquire(), but the file is read and decoded on the worker
+     * pool by gTextureUploader. The returned texture binds the fallback
+     * texture until it is ready. When the content turns out to be a
+     * duplicate, the texture becomes an alias of the resident one instead of
+     * being uploaded again.
+     */
+    TextureHandle acquireAsync(const std::string &path)
+    {
+        namespace fs = std::filesystem;
+
+        std::error_code ec;
+        const auto canonical = fs::weakly_canonical(path, ec).string();
+        const auto key = ec ? path : canonical;
+        const auto file_size = fs::file_size(key, ec);
+        if(ec)
+        {
+            std::cerr << "Cannot open texture " << path << std::endl;
+            return nullptr;
+        }
+        const auto write_time = fs::last_write_time(key, ec);
+
+        auto known = mPaths.find(key);
+        if(known != mPaths.end() &&
+            known->second.fileSize == file_size &&
+            known->second.writeTime == write_time)
+        {
+            auto entry = mEntries.find(known->second.hash);
+            if(entry != mEntries.end()) return hit(entry->second);
+        }
+
+        // Already being loaded
+        auto loading = mLoading.find(key);
+        if(loading != mLoading.end())
+        {
+            auto texture = loading->second.lock();
+            if(texture && texture->pending())
+            {
+                ++mHits;
+                return texture;
+            }
+            mLoading.erase(loading);
+        }
+
+        auto texture = std::make_shared<Texture>();
+        mLoading[key] = texture;
+        std::weak_ptr<Texture> weak = texture;
+        gTextureUploader.load(*texture, key,
+            [this, weak, key, file_size, write_time](std::uint64_t hash) {
+                mLoading.erase(key);
+                mPaths[key] = { hash, file_size, write_time };
+                auto texture = weak.lock();
+                auto entry = mEntries.find(hash);
+                if(entry != mEntries.end())
+                {
+                    texture->mAlias = hit(entry->second);
+                    return false;
+                }
+                ++mMisses;
+                insert(hash, std::move(texture));
+                return true;
+            });
+        return texture;
+    }
+
+    /**
+     * \brief Evict unreferenced textures, least recently used first, until
+     * the resident size fits into the budget.
+     */
+    void trim()
+    {
+        while(mResidentBytes > mBudget)
+        {
+            auto victim = mEntries.end();
+            for(auto iter = mEntries.begin(); iter != mEntries.end(); ++iter)
+            {
+                // Only the cache itself holds the texture.
+                if(iter->second.texture.use_count() != 1) continue;
+                if(victim == mEntries.end() ||
+                    iter->second.lastUse < victim->second.lastUse)
+                    victim = iter;
+            }
+            if(victim == mEntries.end()) break;
+            mResidentBytes -= victim->second.bytes;
+            mEntries.erase(victim);
+            ++mEvictions;
+        }
+    }
+
+    /**
+     * \brief Drop every texture that is not in use, regardless of the budget.
+     */
+    void clearUnused()
+    {
+        for(auto iter = mEntries.begin(); iter != mEntries.end(); )
+        {
+            if(iter->second.texture.use_count() == 1)
+            {
+                mResidentBytes -= iter->second.bytes;
+                iter = mEntries.erase(iter);
+                ++mEvictions;
+            }
+            else
+            {
+                ++iter;
+            }
+        }
+    }
+
+    /**
+     * \brief Change the filtering of every resident texture.
+     */
+    void setFiltering(TextureFiltering filtering)
+    {
+        for(auto &&entry : mEntries) entry.second.texture->setFiltering(filtering);
+    }
+
+    void emitControlWidgets()
+    {
+        if(ImGui::BeginCombo("Filtering", textureFilteringName(gTextureFiltering)))
+        {
+            for(auto f : { TextureFiltering::NEAREST, TextureFiltering::BILINEAR,
+                TextureFiltering::TRILINEAR, TextureFiltering::ANISOTROPIC })
+            {
+                if(ImGui::Selectable(textureFilteringName(f), f == gTextureFiltering))
+                {
+                    gTextureFiltering = f;
+                    setFiltering(f);
+                }
+            }
+            ImGui::EndCombo();
+        }
+        if(ImGui::BeginCombo("Compression",
+            textureCompressionName(gTextureCompression)))
+        {
+            for(auto c : { TextureCompression::NONE, TextureCompression::S3TC,
+                TextureCompression::BC7 })
+            {
+                if(ImGui::Selectable(textureCompressionName(c),
+                    c == gTextureCompression))
+                    gTextureCompression = c;
+            }
+            ImGui::EndCombo();
+        }
+        if(supportedCompression(gTextureCompression) != gTextureCompression)
+        {
+            ImGui::Text("Not supported, using %s", textureCompressionName(
+                supportedCompression(gTextureCompression)));
+        }
+        ImGui::Checkbox("Disk Cache", &gTextureDiskCache);
+        if(ImGui::BeginCombo("Mip Filter", mipFilterName(gMipFilter)))
+        {
+            for(auto f : { MipFilter::BOX, MipFilter::KAISER })
+            {
+                if(ImGui::Selectable(mipFilterName(f), f == gMipFilter))
+                    gMipFilter = f;
+            }
+            ImGui::EndCombo();
+        }
+
+        auto budget_mib = static_cast<int>(mBudget >> 20);
+        if(ImGui::DragInt("Budget (MiB)", &budget_mib, 1, 0, 1 << 16))
+            setBudget(std::size_t(budget_mib) << 20);
+        ImGui::Text("%zu textures, %.1f MiB resident",
+            mEntries.size(), mResidentBytes / 1048576.0);
+        ImGui::Text("Hit rate: %.1f%% (%llu hits, %llu misses), %llu evicted",
+            hitRate() * 100,
+            static_cast<unsigned long long>(mHits),
+            static_cast<unsigned long long>(mMisses),
+            static_cast<unsigned long long>(mEvictions));
+        if(ImGui::Button("Clear Unused")) clearUnused();
+    }
+};
+
+inline TextureCache gTextureCache;
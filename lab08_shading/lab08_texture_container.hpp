@@ -0,0 +1,402 @@
+#pragma once
+
+// A container for textures in the format they are uploaded in, so that they
+// can be mapped into memory and passed to OpenGL without decoding. Built by
+// tools/texture_convert. Independent of OpenGL so that it can be used by the
+// tools and run on worker threads.
+
+#include <algorithm>
+#include <cctype>
+#include <climits>
+#include <cstdint>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <string>
+#include <thread>
+#include <vector>
+
+#ifdef _WIN32
+#   ifndef WIN32_LEAN_AND_MEAN
+#       define WIN32_LEAN_AND_MEAN
+#   endif
+#   ifndef NOMINMAX
+#       define NOMINMAX
+#   endif
+#   include <Windows.h>
+#else
+#   include <fcntl.h>
+#   include <sys/mman.h>
+#   include <sys/stat.h>
+#   include <unistd.h>
+#endif
+
+#include "lab08_block_compression.hpp"
+
+// 64-bit FNV-1a, good enough to tell image files apart.
+inline std::uint64_t hashBytes(const void *data, std::size_t size,
+    std::uint64_t hash = 0xcbf29ce484222325ull)
+{
+    const auto *bytes = static_cast<const unsigned char *>(data);
+    for(std::size_t i = 0; i < size; ++i)
+    {
+        hash ^= bytes[i];
+        hash *= 0x100000001b3ull;
+    }
+    return hash;
+}
+
+/*****************************************************************************/
+// MappedFile
+/*****************************************************************************/
+
+/**
+ * \brief A file mapped read-only into memory. Pages are read from disk when
+ * first touched.
+ */
+class MappedFile
+{
+    const std::uint8_t *mData = nullptr;
+    std::size_t mSize = 0;
+#ifdef _WIN32
+    HANDLE mFile = INVALID_HANDLE_VALUE;
+    HANDLE mMapping = nullptr;
+#endif
+
+    void close()
+    {
+#ifdef _WIN32
+        if(mData) UnmapViewOfFile(mData);
+        if(mMapping) CloseHandle(mMapping);
+        if(mFile != INVALID_HANDLE_VALUE) CloseHandle(mFile);
+        mFile = INVALID_HANDLE_VALUE;
+        mMapping = nullptr;
+#else
+        if(mData) munmap(const_cast<std::uint8_t *>(mData), mSize);
+#endif
+        mData = nullptr;
+        mSize = 0;
+    }
+
+public:
+    MappedFile() = default;
+    MappedFile(const MappedFile &) = delete;
+    MappedFile & operator=(const MappedFile &) = delete;
+    ~MappedFile() { close(); }
+
+    bool open(const std::string &path)
+    {
+        close();
+#ifdef _WIN32
+        mFile = CreateFileA(path.c_str(), GENERIC_READ, FILE_SHARE_READ,
+            nullptr, OPEN_EXISTING, FILE_FLAG_SEQUENTIAL_SCAN, nullptr);
+        LARGE_INTEGER size;
+        if(mFile == INVALID_HANDLE_VALUE || !GetFileSizeEx(mFile, &size) ||
+            size.QuadPart == 0)
+        {
+            close();
+            return false;
+        }
+        mMapping = CreateFileMappingA(mFile, nullptr, PAGE_READONLY, 0, 0,
+            nullptr);
+        if(mMapping)
+        {
+            mData = static_cast<const std::uint8_t *>(
+                MapViewOfFile(mMapping, FILE_MAP_READ, 0, 0, 0));
+        }
+        if(!mData)
+        {
+            close();
+            return false;
+        }
+        mSize = static_cast<std::size_t>(size.QuadPart);
+#else
+        const auto fd = ::open(path.c_str(), O_RDONLY);
+        if(fd < 0) return false;
+        struct stat info;
+        if(fstat(fd, &info) != 0 || info.st_size == 0)
+        {
+            ::close(fd);
+            return false;
+        }
+        auto *data = mmap(nullptr, static_cast<std::size_t>(info.st_size),
+            PROT_READ, MAP_PRIVATE, fd, 0);
+        // The mapping stays valid after closing the descriptor.
+        ::close(fd);
+        if(data == MAP_FAILED) return false;
+        mData = static_cast<const std::uint8_t *>(data);
+        mSize = static_cast<std::size_t>(info.st_size);
+        // Start reading ahead right away.
+        madvise(data, mSize, MADV_WILLNEED);
+#endif
+        return true;
+    }
+
+    const std::uint8_t * data() const { return mData; }
+    std::size_t size() const { return mSize; }
+
+    /**
+     * \brief Touch every page so that the disk is read on the calling
+     * thread rather than by whoever uses the data later.
+     */
+    void prefetch(std::size_t offset, std::size_t bytes) const
+    {
+        constexpr std::size_t kPage = 4096;
+        volatile std::uint8_t sink = 0;
+        for(std::size_t i = 0; i < bytes; i += kPage) sink ^= mData[offset + i];
+        if(bytes) sink ^= mData[offset + bytes - 1];
+    }
+};
+
+/*****************************************************************************/
+// TextureContainer
+/*****************************************************************************/
+
+/*
+ * File layout, little endian:
+ *     char[4]  "CGTX"
+ *     u32      version
+ *     u32      format, see ContainerFormat
+ *     u32      width
+ *     u32      height
+ *     u32      level count
+ *     u64      hash of the source image file
+ *     per level: u64 offset, u64 byte count, u32 width, u32 height
+ *     level data, each level starting at a multiple of kContainerAlignment
+ *
+ * Levels are stored from the base level down, as RGBA8 rows or rows of
+ * blocks without padding, exactly as glTexImage2D() and
+ * glCompressedTexImage2D() take them.
+ */
+
+constexpr std::uint32_t kContainerVersion = 1;
+constexpr std::size_t kContainerAlignment = 64;
+constexpr std::size_t kContainerHeaderBytes = 32;
+constexpr std::size_t kContainerLevelBytes = 24;
+
+enum class ContainerFormat : std::uint32_t
+{
+    RGBA8,
+    BC1,
+    BC3,
+    BC7,
+};
+
+inline bool isBlockCompressed(ContainerFormat format)
+{
+    return format != ContainerFormat::RGBA8;
+}
+
+inline BlockFormat containerBlockFormat(ContainerFormat format)
+{
+    return static_cast<BlockFormat>(static_cast<std::uint32_t>(format) - 1);
+}
+
+inline ContainerFormat containerFormat(BlockFormat format)
+{
+    return static_cast<ContainerFormat>(static_cast<std::uint32_t>(format) + 1);
+}
+
+inline const char * containerFormatName(ContainerFormat format)
+{
+    return isBlockCompressed(format) ?
+        blockFormatName(containerBlockFormat(format)) : "RGBA8";
+}
+
+inline bool isTextureContainerPath(const std::string &path)
+{
+    const auto dot = path.find_last_of('.');
+    if(dot == std::string::npos) return false;
+    auto suffix = path.substr(dot + 1);
+    for(auto &&c : suffix) c = static_cast<char>(tolower(c));
+    return suffix == "cgtex";
+}
+
+// A level as stored in a container or to be written into one
+struct ContainerLevel
+{
+    int width = 0;
+    int height = 0;
+    const std::uint8_t *data = nullptr;
+    std::size_t bytes = 0;
+};
+
+/**
+ * \brief A texture container mapped into memory. The levels point into the
+ * mapping, which lives as long as the container.
+ */
+class TextureContainer
+{
+    MappedFile mFile;
+    ContainerFormat mFormat = ContainerFormat::RGBA8;
+    int mWidth = 0;
+    int mHeight = 0;
+    std::uint64_t mSourceHash = 0;
+    std::vector<ContainerLevel> mLevels;
+
+    template <typename T>
+    T read(std::size_t offset) const
+    {
+        T value;
+        std::memcpy(&value, mFile.data() + offset, sizeof(T));
+        return value;
+    }
+
+public:
+    /**
+     * \brief Map a container and check its header and level table. Returns
+     * false with a reason if it is not a valid container.
+     */
+    bool open(const std::string &path, std::string &error)
+    {
+        mLevels.clear();
+        if(!mFile.open(path))
+        {
+            error = "cannot map file";
+            return false;
+        }
+        const auto size = mFile.size();
+        if(size < kContainerHeaderBytes ||
+            std::memcmp(mFile.data(), "CGTX", 4) != 0)
+        {
+            error = "not a texture container";
+            return false;
+        }
+        if(read<std::uint32_t>(4) != kContainerVersion)
+        {
+            error = "unsupported container version";
+            return false;
+        }
+        const auto format = read<std::uint32_t>(8);
+        const auto level_count = read<std::uint32_t>(20);
+        if(format > static_cast<std::uint32_t>(ContainerFormat::BC7) ||
+            level_count == 0 || level_count > 32 ||
+            kContainerHeaderBytes + kContainerLevelBytes * level_count > size)
+        {
+            error = "damaged container header";
+            return false;
+        }
+        const auto width = read<std::uint32_t>(12);
+        const auto height = read<std::uint32_t>(16);
+        if(width == 0 || height == 0 || width > INT_MAX || height > INT_MAX)
+        {
+            error = "damaged container size";
+            return false;
+        }
+        mFormat = static_cast<ContainerFormat>(format);
+        mWidth = static_cast<int>(width);
+        mHeight = static_cast<int>(height);
+        mSourceHash = read<std::uint64_t>(24);
+
+        for(std::uint32_t i = 0; i < level_count; ++i)
+        {
+            const auto entry = kContainerHeaderBytes + kContainerLevelBytes * i;
+            const auto offset = read<std::uint64_t>(entry);
+            const auto bytes = read<std::uint64_t>(entry + 8);
+            ContainerLevel level;
+            level.width = static_cast<int>(read<std::uint32_t>(entry + 16));
+            level.height = static_cast<int>(read<std::uint32_t>(entry + 20));
+            const auto expected = isBlockCompressed(mFormat) ?
+                blockBytes(containerBlockFormat(mFormat)) *
+                    ((level.width + 3) / 4) * ((level.height + 3) / 4) :
+                std::size_t(4) * level.width * level.height;
+            if(offset > size || bytes > size - offset || bytes != expected ||
+                level.width != std::max(mWidth >> i, 1) ||
+                level.height != std::max(mHeight >> i, 1))
+            {
+                mLevels.clear();
+                error = "damaged container level table";
+                return false;
+            }
+            level.data = mFile.data() + offset;
+            level.bytes = static_cast<std::size_t>(bytes);
+            mLevels.push_back(level);
+        }
+        return true;
+    }
+
+    ContainerFormat format() const { return mFormat; }
+    int width() const { return mWidth; }
+    int height() const { return mHeight; }
+    std::uint64_t sourceHash() const { return mSourceHash; }
+    int levelCount() const { return static_cast<int>(mLevels.size()); }
+    const ContainerLevel & level(int i) const { return mLevels[i]; }
+
+    // Read a level from disk on the calling thread.
+    void prefetch(int i) const
+    {
+        mFile.prefetch(mLevels[i].data - mFile.data(), mLevels[i].bytes);
+    }
+
+    // Read all levels from disk on the calling thread.
+    void prefetch() const
+    {
+        for(int i = 0; i < levelCount(); ++i) prefetch(i);
+    }
+};
+
+/**
+ * \brief Write a container. The file is written under a temporary name and
+ * renamed, so that readers never see a partial file. The temporary file is
+ * removed if anything fails.
+ */
+inline bool writeTextureContainer(const std::string &path,
+    ContainerFormat format, std::uint64_t source_hash,
+    const std::vector<ContainerLevel> &levels)
+{
+    if(levels.empty()) return false;
+    const auto temp_path = path + ".tmp" + std::to_string(
+        std::hash<std::thread::id>()(std::this_thread::get_id()));
+    std::error_code ec;
+    {
+        std::ofstream file(temp_path, std::ios::binary);
+        if(!file)
+        {
+            std::filesystem::remove(temp_path, ec);
+            return false;
+        }
+
+        auto write = [&](auto value) {
+            file.write(reinterpret_cast<const char *>(&value), sizeof(value));
+        };
+        auto align = [](std::uint64_t offset) {
+            return (offset + kContainerAlignment - 1) /
+                kContainerAlignment * kContainerAlignment;
+        };
+        file.write("CGTX", 4);
+        write(kContainerVersion);
+        write(static_cast<std::uint32_t>(format));
+        write(static_cast<std::uint32_t>(levels.front().width));
+        write(static_cast<std::uint32_t>(levels.front().height));
+        write(static_cast<std::uint32_t>(levels.size()));
+        write(source_hash);
+
+        std::uint64_t offset = align(kContainerHeaderBytes +
+            kContainerLevelBytes * levels.size());
+        for(auto &&level : levels)
+        {
+            write(offset);
+            write(static_cast<std::uint64_t>(level.bytes));
+            write(static_cast<std::uint32_t>(level.width));
+            write(static_cast<std::uint32_t>(level.height));
+            offset = align(offset + level.bytes);
+        }
+        for(auto &&level : levels)
+        {
+            const auto padding = align(file.tellp()) -
+                static_cast<std::uint64_t>(file.tellp());
+            static const char zeros[kContainerAlignment] = { };
+            file.write(zeros, static_cast<std::streamsize>(padding));
+            file.write(reinterpret_cast<const char *>(level.data),
+                static_cast<std::streamsize>(level.bytes));
+        }
+        file.close();
+        if(file)
+        {
+            std::filesystem::rename(temp_path, path, ec);
+            if(!ec) return true;
+        }
+    }
+    std::filesystem::remove(temp_path, ec);
+    return false;
+}
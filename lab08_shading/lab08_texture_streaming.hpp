@@ -0,0 +1,416 @@
+#pragma once
+
+// Included by lab08_framework.hpp after UploadBudget.
+
+#include <cmath>
+#include <cstdint>
+#include <deque>
+#include <string>
+#include <vector>
+
+/*****************************************************************************/
+// TextureStreamer
+/*****************************************************************************/
+
+/**
+ * \brief Keeps only the mip levels of textures in video memory which the
+ * objects drawn recently need. Objects report the size they are drawn at
+ * with Texture::requestSize() and the finest level needed follows from
+ * that. Missing levels are read and decoded on the worker pool and
+ * uploaded by update(), which also evicts the finest levels of the least
+ * recently used textures when the resident levels exceed the budget.
+ *
+ * Every texture always keeps its small levels, the tail, so there is
+ * always something to draw. The levels in video memory are the contiguous
+ * range from GL_TEXTURE_BASE_LEVEL to the smallest level.
+ *
+ * A request decodes the whole file again. With a compressed texture and
+ * the disk cache on, that is a plain read of the cached mip chain, and
+ * texture containers only read the wanted levels through their mapping.
+ */
+class TextureStreamer
+{
+    // Levels up to this size are loaded first and never evicted.
+    static constexpr int kTailSize = 64;
+
+    struct Stream
+    {
+        TextureHandle texture;
+        std::string path;
+        TextureLoadOptions options;
+
+        // Known after the tail is loaded
+        int levelCount = 0;
+        int tailLevel = 0;
+        GLenum internalFormat = GL_RGBA;
+        bool compressed = false;
+        std::vector<glm::ivec2> sizes;
+        std::vector<std::size_t> levelBytes;
+
+        // Frame in which each level was last needed, for LRU eviction
+        std::vector<std::uint64_t> lastNeeded;
+        int wantedLevel = 0;
+        // Requested and not uploaded yet, including while the levels wait
+        // for gUploadBudget
+        bool inFlight = false;
+        bool failed = false;
+    };
+
+    struct Request
+    {
+        std::shared_ptr<Stream> stream;
+        std::string path;
+        TextureLoadOptions options;
+        // Levels first to last are wanted. Unknown before the tail is
+        // loaded and then chosen by the worker.
+        int first = -1;
+        int last = -1;
+
+        int levelCount = 0;
+        GLenum internalFormat = GL_RGBA;
+        bool compressed = false;
+        std::vector<glm::ivec2> sizes;
+        std::vector<std::size_t> levelBytes;
+        // All levels, of which first to last are uploaded
+        TextureData data;
+        std::string error;
+    };
+
+    std::vector<std::shared_ptr<Stream>> mStreams;
+    MpscQueue<std::unique_ptr<Request>> mDone;
+    std::deque<std::unique_ptr<Request>> mArrived;
+
+    std::size_t mBudgetBytes = 64 << 20;
+    std::size_t mResidentBytes = 0;
+    int mDetailBias = 0;
+    int mMaxInFlight = 4;
+    int mInFlight = 0;
+    std::uint64_t mFrame = 0;
+
+    std::uint64_t mLevelsLoaded = 0;
+    std::uint64_t mLevelsEvicted = 0;
+
+    static void read(Request &request)
+    {
+        auto &&data = request.data;
+        if(!loadTextureData(request.path, request.options, data,
+            request.error))
+            return;
+
+        request.levelCount = data.levelCount();
+        request.internalFormat = data.internalFormat();
+        request.compressed = data.isCompressed();
+        for(int i = 0; i < request.levelCount; ++i)
+        {
+            const auto level = data.level(i);
+            request.sizes.emplace_back(level.width, level.height);
+            request.levelBytes.push_back(level.bytes);
+        }
+        if(request.first < 0)
+        {
+            request.last = request.levelCount - 1;
+            request.first = request.last;
+            while(request.first > 0 &&
+                std::max(request.sizes[request.first - 1].x,
+                    request.sizes[request.first - 1].y) <= kTailSize)
+                --request.first;
+        }
+        request.last = std::min(request.last, request.levelCount - 1);
+        // Only the wanted part of a container is read from disk.
+        if(data.container)
+        {
+            for(int i = request.first; i <= request.last; ++i)
+                data.container->prefetch(i);
+        }
+    }
+
+    void post(std::shared_ptr<Stream> stream, int first, int last)
+    {
+        auto request = std::make_unique<Request>();
+        request->path = stream->path;
+        request->options = stream->options;
+        request->first = first;
+        request->last = last;
+        stream->inFlight = true;
+        request->stream = std::move(stream);
+        ++mInFlight;
+
+        // std::function needs a copyable callable
+        auto shared = std::make_shared<std::unique_ptr<Request>>(
+            std::move(request));
+        workerPool().post([this, shared]() {
+            read(**shared);
+            mDone.push(std::move(*shared));
+        });
+    }
+
+    // Whether the request still matches what was loaded before, i.e. the
+    // file did not change in between.
+    static bool consistent(const Stream &stream, const Request &request)
+    {
+        return request.levelCount == stream.levelCount &&
+            request.internalFormat == stream.internalFormat &&
+            request.levelBytes == stream.levelBytes &&
+            std::equal(request.sizes.begin(), request.sizes.end(),
+                stream.sizes.begin(), [](auto &&a, auto &&b) {
+                    return a.x == b.x && a.y == b.y;
+                });
+    }
+
+    void accept(Request &request)
+    {
+        auto &&stream = *request.stream;
+        auto &&texture = *stream.texture;
+        const auto initial = stream.levelCount == 0;
+        if(request.error.empty() && !initial && !consistent(stream, request))
+            request.error = "file changed while streaming";
+        if(!request.error.empty())
+        {
+            std::cerr << "Cannot stream texture " << stream.path << ": "
+                << request.error << std::endl;
+            stream.failed = true;
+            if(initial) texture.fail(std::move(request.error));
+            return;
+        }
+
+        if(initial)
+        {
+            stream.levelCount = request.levelCount;
+            stream.tailLevel = request.first;
+            stream.internalFormat = request.internalFormat;
+            stream.compressed = request.compressed;
+            stream.sizes = request.sizes;
+            stream.levelBytes = request.levelBytes;
+            stream.lastNeeded.assign(stream.levelCount, 0);
+            stream.wantedLevel = stream.tailLevel;
+            if(texture.mTextureId == 0) texture.create();
+        }
+
+        glBindTexture(GL_TEXTURE_2D, texture.mTextureId);
+        for(int i = request.first; i <= request.last; ++i)
+        {
+            const auto level = request.data.level(i);
+            if(stream.compressed)
+            {
+                glCompressedTexImage2D(GL_TEXTURE_2D, i,
+                    stream.internalFormat, level.width, level.height, 0,
+                    static_cast<GLsizei>(level.bytes), level.data);
+            }
+            else
+            {
+                glTexImage2D(GL_TEXTURE_2D, i, GL_RGBA, level.width,
+                    level.height, 0, GL_RGBA, GL_UNSIGNED_BYTE, level.data);
+            }
+            texture.mBytes += level.bytes;
+            mResidentBytes += level.bytes;
+            ++mLevelsLoaded;
+        }
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_BASE_LEVEL, request.first);
+        glBindTexture(GL_TEXTURE_2D, 0);
+        texture.mBaseLevel = request.first;
+
+        if(initial)
+        {
+            texture.mWidth = stream.sizes.front().x;
+            texture.mHeight = stream.sizes.front().y;
+            texture.setLevels(stream.levelCount);
+            texture.mLoaded = true;
+            texture.mPending = false;
+        }
+    }
+
+    // Drop the finest resident level of a texture.
+    void evict(Stream &stream)
+    {
+        auto &&texture = *stream.texture;
+        const auto level = texture.mBaseLevel;
+        glBindTexture(GL_TEXTURE_2D, texture.mTextureId);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_BASE_LEVEL, level + 1);
+        // Respecifying the level as empty releases its memory.
+        glTexImage2D(GL_TEXTURE_2D, level, GL_RGBA, 0, 0, 0, GL_RGBA,
+            GL_UNSIGNED_BYTE, nullptr);
+        glBindTexture(GL_TEXTURE_2D, 0);
+        texture.mBaseLevel = level + 1;
+        texture.mBytes -= stream.levelBytes[level];
+        mResidentBytes -= stream.levelBytes[level];
+        ++mLevelsEvicted;
+    }
+
+    // The finest level worth showing for a texture drawn this large.
+    int levelForSize(const Stream &stream, float pixels) const
+    {
+        const auto &base = stream.sizes.front();
+        const auto texels = static_cast<float>(std::max(base.x, base.y));
+        const auto level = static_cast<int>(std::floor(
+            std::log2(texels / std::max(pixels, 1.f)))) + mDetailBias;
+        return std::min(std::max(level, 0), stream.tailLevel);
+    }
+
+    // Evict unneeded levels, least recently needed first, until the
+    // resident levels fit into the budget.
+    void enforceBudget()
+    {
+        while(mResidentBytes > mBudgetBytes)
+        {
+            Stream *victim = nullptr;
+            std::uint64_t oldest = mFrame;
+            for(auto &&stream : mStreams)
+            {
+                // Loads in flight expect the resident levels to stay.
+                if(stream->inFlight || stream->levelCount == 0) continue;
+                const auto base = stream->texture->mBaseLevel;
+                if(base >= stream->tailLevel) continue;
+                if(stream->lastNeeded[base] < oldest)
+                {
+                    oldest = stream->lastNeeded[base];
+                    victim = stream.get();
+                }
+            }
+            if(!victim) break;
+            evict(*victim);
+        }
+    }
+
+    // Bytes of the levels from first up to the resident ones
+    static std::size_t missingBytes(const Stream &stream, int first)
+    {
+        std::size_t bytes = 0;
+        for(int i = first; i < stream.texture->mBaseLevel; ++i)
+            bytes += stream.levelBytes[i];
+        return bytes;
+    }
+
+public:
+    std::size_t budgetBytes() const { return mBudgetBytes; }
+    void setBudgetBytes(std::size_t bytes) { mBudgetBytes = bytes; }
+    std::size_t residentBytes() const { return mResidentBytes; }
+
+    /**
+     * \brief Open an image file for streaming. The returned texture shows
+     * the fallback texture until the tail is loaded and gets finer levels
+     * as it is drawn larger. Opening a file again returns the same texture.
+     */
+    TextureHandle open(const std::string &path)
+    {
+        for(auto &&stream : mStreams)
+        {
+            if(stream->path == path && !stream->failed)
+                return stream->texture;
+        }
+
+        auto stream = std::make_shared<Stream>();
+        stream->texture = std::make_shared<Texture>();
+        stream->texture->mStreamed = true;
+        stream->texture->mPending = true;
+        stream->path = path;
+        stream->options = TextureLoadOptions::current();
+        mStreams.push_back(stream);
+        post(std::move(stream), -1, -1);
+        return mStreams.back()->texture;
+    }
+
+    /**
+     * \brief Called once per frame before drawing. Uploads the levels read
+     * since the last frame within gUploadBudget, then looks at the sizes
+     * textures were drawn at in the last frame to evict and request levels.
+     */
+    void update()
+    {
+        ++mFrame;
+
+        std::unique_ptr<Request> request;
+        while(mDone.pop(request)) mArrived.push_back(std::move(request));
+        bool first = true;
+        while(!mArrived.empty())
+        {
+            auto &&front = *mArrived.front();
+            std::size_t bytes = 0;
+            if(front.error.empty())
+            {
+                for(int i = front.first; i <= front.last; ++i)
+                    bytes += front.data.level(i).bytes;
+            }
+            if(gUploadBudget.acquire(bytes) < bytes && !first) break;
+            accept(front);
+            // Only now may the levels be evicted or requested again.
+            front.stream->inFlight = false;
+            --mInFlight;
+            mArrived.pop_front();
+            first = false;
+        }
+
+        // Forget textures nobody else holds.
+        for(auto it = mStreams.begin(); it != mStreams.end(); )
+        {
+            auto &&stream = **it;
+            if(stream.texture.use_count() > 1 || stream.inFlight)
+            {
+                ++it;
+                continue;
+            }
+            mResidentBytes -= stream.texture->mBytes;
+            it = mStreams.erase(it);
+        }
+
+        for(auto &&stream : mStreams)
+        {
+            auto &&texture = *stream->texture;
+            const auto size = texture.mWantedSize;
+            texture.mWantedSize = 0;
+            if(stream->levelCount == 0 || size <= 0) continue;
+            stream->wantedLevel = levelForSize(*stream, size);
+            for(int i = stream->wantedLevel; i < stream->levelCount; ++i)
+                stream->lastNeeded[i] = mFrame;
+        }
+
+        enforceBudget();
+
+        for(auto &&stream : mStreams)
+        {
+            if(mInFlight >= mMaxInFlight) break;
+            if(stream->inFlight || stream->failed ||
+                stream->levelCount == 0 ||
+                stream->lastNeeded[stream->wantedLevel] != mFrame)
+                continue;
+            const auto base = stream->texture->mBaseLevel;
+            // Only load what fits into the budget; the finest levels may
+            // have to wait until other textures are evicted.
+            auto first = stream->wantedLevel;
+            while(first < base &&
+                mResidentBytes + missingBytes(*stream, first) > mBudgetBytes)
+                ++first;
+            if(first < base) post(stream, first, base - 1);
+        }
+    }
+
+    void emitControlWidgets()
+    {
+        auto budget = static_cast<int>(mBudgetBytes >> 20);
+        if(ImGui::SliderInt("Budget (MB)", &budget, 1, 1024))
+            mBudgetBytes = std::size_t(budget) << 20;
+        ImGui::SliderInt("Detail Bias", &mDetailBias, -2, 4);
+        ImGui::Text("%zu textures, %.1f MB resident, %d requests in flight",
+            mStreams.size(), mResidentBytes / 1048576.0, mInFlight);
+        ImGui::Text("%llu levels loaded, %llu evicted",
+            static_cast<unsigned long long>(mLevelsLoaded),
+            static_cast<unsigned long long>(mLevelsEvicted));
+        for(auto &&stream : mStreams)
+        {
+            const auto slash = stream->path.find_last_of("/\\");
+            const auto name = slash == std::string::npos ?
+                stream->path : stream->path.substr(slash + 1);
+            if(stream->levelCount == 0)
+            {
+                ImGui::BulletText("%s: %s", name.c_str(),
+                    stream->failed ? "failed" : "loading");
+                continue;
+            }
+            ImGui::BulletText("%s: levels %d-%d of %d, wants %d, %.1f KB",
+                name.c_str(), stream->texture->mBaseLevel,
+                stream->levelCount - 1, stream->levelCount,
+                stream->wantedLevel, stream->texture->mBytes / 1024.0);
+        }
+    }
+};
+
+inline TextureStreamer gTextureStreamer;
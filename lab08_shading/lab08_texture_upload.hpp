@@ -0,0 +1,689 @@
+#pragma once
+
+// Included by lab08_framework.hpp after the definition of Texture.
+
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <string>
+
+#include "lab08_block_compression.hpp"
+#include "lab08_texture_container.hpp"
+#include "lab08_thread_pool.hpp"
+
+#ifndef GL_COMPRESSED_RGB_S3TC_DXT1_EXT
+#   define GL_COMPRESSED_RGB_S3TC_DXT1_EXT 0x83F0
+#   define GL_COMPRESSED_RGBA_S3TC_DXT5_EXT 0x83F3
+#endif
+#ifndef GL_COMPRESSED_RGBA_BPTC_UNORM
+#   define GL_COMPRESSED_RGBA_BPTC_UNORM 0x8E8C
+#endif
+
+/*****************************************************************************/
+// TextureData
+/*****************************************************************************/
+
+enum class TextureCompression
+{
+    NONE,
+    // BC1, or BC3 for images with alpha
+    S3TC,
+    BC7,
+};
+
+inline const char * textureCompressionName(TextureCompression compression)
+{
+    switch(compression)
+    {
+        case TextureCompression::NONE: return "None";
+        case TextureCompression::S3TC: return "S3TC (BC1/BC3)";
+        case TextureCompression::BC7: return "BC7";
+        default: return "?";
+    }
+}
+
+// Wanted for textures loaded from now on, if the driver supports it
+inline TextureCompression gTextureCompression = TextureCompression::S3TC;
+// Keep compressed mip chains next to the source images
+inline bool gTextureDiskCache = true;
+
+/**
+ * \brief The block formats the context can sample, one bit per BlockFormat.
+ * The first call must be made on the render thread.
+ */
+inline std::uint32_t supportedBlockFormats()
+{
+    static const std::uint32_t formats = []() {
+        std::uint32_t bits = 0;
+        if(hasGLExtension("GL_EXT_texture_compression_s3tc"))
+        {
+            bits |= 1u << static_cast<int>(BlockFormat::BC1);
+            bits |= 1u << static_cast<int>(BlockFormat::BC3);
+        }
+        if(hasGLExtension("GL_ARB_texture_compression_bptc"))
+            bits |= 1u << static_cast<int>(BlockFormat::BC7);
+        return bits;
+    }();
+    return formats;
+}
+
+/**
+ * \brief The compression actually available for the wanted one. Falls back
+ * from BC7 to S3TC to none depending on the extensions of the context.
+ */
+inline TextureCompression supportedCompression(TextureCompression wanted)
+{
+    const auto formats = supportedBlockFormats();
+    const auto bptc = formats & (1u << static_cast<int>(BlockFormat::BC7));
+    const auto s3tc = formats & (1u << static_cast<int>(BlockFormat::BC1));
+    if(wanted == TextureCompression::BC7 && bptc) return wanted;
+    if(wanted != TextureCompression::NONE && s3tc)
+        return TextureCompression::S3TC;
+    return TextureCompression::NONE;
+}
+
+inline GLenum blockFormatToGL(BlockFormat format)
+{
+    switch(format)
+    {
+        case BlockFormat::BC1: return GL_COMPRESSED_RGB_S3TC_DXT1_EXT;
+        case BlockFormat::BC3: return GL_COMPRESSED_RGBA_S3TC_DXT5_EXT;
+        case BlockFormat::BC7: return GL_COMPRESSED_RGBA_BPTC_UNORM;
+        default: return GL_RGBA;
+    }
+}
+
+/**
+ * \brief How an image file is turned into texture levels. Taken from the
+ * globals on the render thread when a load starts, so that workers never
+ * read state the UI may change.
+ */
+struct TextureLoadOptions
+{
+    MipFilter mipFilter = MipFilter::BOX;
+    TextureCompression compression = TextureCompression::NONE;
+    bool diskCache = false;
+    // Block formats the context can sample, for texture containers
+    std::uint32_t blockFormats = 0;
+
+    static TextureLoadOptions current()
+    {
+        TextureLoadOptions options;
+        options.blockFormats = supportedBlockFormats();
+        options.mipFilter = gMipFilter;
+        options.compression = supportedCompression(gTextureCompression);
+        options.diskCache = gTextureDiskCache;
+        return options;
+    }
+};
+
+/**
+ * \brief The levels of a texture ready for upload, either as RGBA8 or
+ * block compressed, decoded or mapped from a texture container.
+ */
+struct TextureData
+{
+    struct PixelsDeleter
+    {
+        void operator()(stbi_uc *p) const { stbi_image_free(p); }
+    };
+
+    // One level as passed to OpenGL. Uploads are split between groups of
+    // rows, which are single rows or rows of 4x4 blocks.
+    struct Level
+    {
+        int width = 0;
+        int height = 0;
+        const std::uint8_t *data = nullptr;
+        std::size_t bytes = 0;
+        int groupRows = 1;
+        std::size_t groupBytes = 0;
+    };
+
+    int width = 0;
+    int height = 0;
+    // Hash of the source file content
+    std::uint64_t hash = 0;
+    // Loaded from a cached compressed mip chain instead of decoded
+    bool fromDiskCache = false;
+
+    // Uncompressed: the decoded base level and the mip levels below it
+    std::unique_ptr<stbi_uc, PixelsDeleter> pixels;
+    std::vector<Image> mips;
+    // Compressed: every level including the base
+    std::vector<CompressedImage> compressed;
+    // Mapped: every level, uploaded straight from the mapping
+    std::shared_ptr<const TextureContainer> container;
+
+    bool isCompressed() const
+    {
+        return container ? isBlockCompressed(container->format()) :
+            !compressed.empty();
+    }
+
+    int levelCount() const
+    {
+        if(container) return container->levelCount();
+        return isCompressed() ?
+            static_cast<int>(compressed.size()) :
+            static_cast<int>(mips.size()) + 1;
+    }
+
+    GLenum internalFormat() const
+    {
+        if(container)
+        {
+            return isCompressed() ?
+                blockFormatToGL(containerBlockFormat(container->format())) :
+                GL_RGBA;
+        }
+        return isCompressed() ?
+            blockFormatToGL(compressed.front().format) : GL_RGBA;
+    }
+
+    Level level(int i) const
+    {
+        Level l;
+        if(container)
+        {
+            auto &&c = container->level(i);
+            l.width = c.width;
+            l.height = c.height;
+            l.data = c.data;
+            l.bytes = c.bytes;
+            if(isCompressed())
+            {
+                l.groupRows = 4;
+                l.groupBytes = blockBytes(
+                    containerBlockFormat(container->format())) *
+                    ((c.width + 3) / 4);
+            }
+            else
+            {
+                l.groupBytes = std::size_t(4) * c.width;
+            }
+        }
+        else if(isCompressed())
+        {
+            auto &&c = compressed[i];
+            l.width = c.width;
+            l.height = c.height;
+            l.data = c.blocks.data();
+            l.bytes = c.bytes();
+            l.groupRows = 4;
+            l.groupBytes = c.blockRowBytes();
+        }
+        else
+        {
+            l.width = i == 0 ? width : mips[i - 1].width;
+            l.height = i == 0 ? height : mips[i - 1].height;
+            l.data = i == 0 ? pixels.get() : mips[i - 1].pixels.data();
+            l.bytes = std::size_t(4) * l.width * l.height;
+            l.groupBytes = std::size_t(4) * l.width;
+        }
+        return l;
+    }
+
+    std::size_t bytes() const
+    {
+        std::size_t total = 0;
+        for(int i = 0; i < levelCount(); ++i) total += level(i).bytes;
+        return total;
+    }
+};
+
+inline std::string compressedCachePath(const std::string &source_path,
+    TextureCompression compression)
+{
+    return source_path + (compression == TextureCompression::BC7 ?
+        ".bc7.cache" : ".s3tc.cache");
+}
+
+/**
+ * \brief Turn the content of an image file into texture levels: decode it,
+ * build the mip chain and compress it if wanted. With a source path, a
+ * compressed chain cached next to the file is used instead if it is still
+ * up to date, and is written otherwise. Safe to call from any thread.
+ */
+inline bool prepareTextureData(const void *file_data, std::size_t size,
+    const std::string &source_path, const TextureLoadOptions &options,
+    TextureData &out, std::string &error)
+{
+    out.hash = hashBytes(file_data, size);
+
+    std::string cache_path;
+    if(options.compression != TextureCompression::NONE &&
+        options.diskCache && !source_path.empty())
+    {
+        cache_path = compressedCachePath(source_path, options.compression);
+        std::vector<CompressedImage> levels;
+        if(readCompressedMipChain(cache_path, out.hash, options.mipFilter,
+            levels) && (levels.front().format == BlockFormat::BC7) ==
+            (options.compression == TextureCompression::BC7))
+        {
+            out.width = levels.front().width;
+            out.height = levels.front().height;
+            out.compressed = std::move(levels);
+            out.fromDiskCache = true;
+            return true;
+        }
+    }
+
+    int num_channels;
+    out.pixels.reset(stbi_load_from_memory(
+        static_cast<const stbi_uc *>(file_data), static_cast<int>(size),
+        &out.width, &out.height, &num_channels, 4));
+    // The failure reason of stb_image is shared by all threads, but it
+    // always points to a string literal, so at worst the message is
+    // another decoder's.
+    if(!out.pixels)
+    {
+        error = stbi_failure_reason();
+        return false;
+    }
+    out.mips = buildMipLevels(out.pixels.get(), out.width, out.height,
+        options.mipFilter);
+    if(options.compression == TextureCompression::NONE) return true;
+
+    const auto format = options.compression == TextureCompression::BC7 ?
+        BlockFormat::BC7 :
+        hasTranslucency(out.pixels.get(), out.width, out.height) ?
+        BlockFormat::BC3 : BlockFormat::BC1;
+    out.compressed.reserve(out.mips.size() + 1);
+    out.compressed.push_back(compressImage(out.pixels.get(),
+        out.width, out.height, format));
+    for(auto &&mip : out.mips)
+    {
+        out.compressed.push_back(compressImage(mip.pixels.data(),
+            mip.width, mip.height, format));
+    }
+    out.pixels.reset();
+    out.mips.clear();
+
+    if(!cache_path.empty() && !writeCompressedMipChain(cache_path, out.hash,
+        options.mipFilter, out.compressed))
+    {
+        std::cerr << "Cannot write texture cache " << cache_path << std::endl;
+    }
+    return true;
+}
+
+/**
+ * \brief Get the texture levels of an image file or a texture container.
+ * Containers are mapped and not copied; with prefetch their pages are read
+ * from disk by the calling thread. Safe to call from any thread.
+ */
+inline bool loadTextureData(const std::string &path,
+    const TextureLoadOptions &options, TextureData &out, std::string &error,
+    bool prefetch = false)
+{
+    if(isTextureContainerPath(path))
+    {
+        auto container = std::make_shared<TextureContainer>();
+        if(!container->open(path, error)) return false;
+        const auto format = container->format();
+        if(isBlockCompressed(format) && !(options.blockFormats &
+            (1u << static_cast<int>(containerBlockFormat(format)))))
+        {
+            error = std::string(containerFormatName(format)) +
+                " is not supported by the driver";
+            return false;
+        }
+        if(prefetch) container->prefetch();
+        out.width = container->width();
+        out.height = container->height();
+        out.hash = container->sourceHash();
+        out.container = std::move(container);
+        return true;
+    }
+
+    std::ifstream file(path, std::ios::binary | std::ios::ate);
+    std::vector<char> content;
+    if(file)
+    {
+        content.resize(static_cast<std::size_t>(file.tellg()));
+        file.seekg(0);
+    }
+    if(!file || !file.read(content.data(), content.size()))
+    {
+        error = "cannot read file";
+        return false;
+    }
+    return prepareTextureData(content.data(), content.size(), path, options,
+        out, error);
+}
+
+/**
+ * \brief Get the base level of an image file or an uncompressed texture
+ * container as an Image, for the renderers which sample on the CPU. Safe to
+ * call from any thread.
+ */
+inline bool loadImageFile(const std::string &path, Image &out,
+    std::string &error)
+{
+    // Neither compressed nor cached, so that the texels can be read
+    TextureData data;
+    if(!loadTextureData(path, TextureLoadOptions(), data, error))
+        return false;
+    const auto level = data.level(0);
+    out = Image(level.width, level.height);
+    std::copy_n(level.data, out.pixels.size(), out.pixels.data());
+    return true;
+}
+
+inline void Texture::upload(const TextureData &data)
+{
+    if(mTextureId == 0) create();
+    glBindTexture(GL_TEXTURE_2D, mTextureId);
+    for(int i = 0; i < data.levelCount(); ++i)
+    {
+        const auto level = data.level(i);
+        if(data.isCompressed())
+        {
+            glCompressedTexImage2D(GL_TEXTURE_2D, i, data.internalFormat(),
+                level.width, level.height, 0,
+                static_cast<GLsizei>(level.bytes), level.data);
+        }
+        else
+        {
+            glTexImage2D(GL_TEXTURE_2D, i, GL_RGBA, level.width, level.height,
+                0, GL_RGBA, GL_UNSIGNED_BYTE, level.data);
+        }
+    }
+    glBindTexture(GL_TEXTURE_2D, 0);
+    mWidth = data.width;
+    mHeight = data.height;
+    mBytes = data.bytes();
+    setLevels(data.levelCount());
+    mLoaded = true;
+    mPending = false;
+    mError.clear();
+}
+
+inline bool Texture::loadFromMemory(const void *file_data, std::size_t size,
+    const std::string &source_path)
+{
+    TextureData data;
+    std::string error;
+    if(!prepareTextureData(file_data, size, source_path,
+        TextureLoadOptions::current(), data, error))
+    {
+        fail(std::move(error));
+        return false;
+    }
+    upload(data);
+    return true;
+}
+
+inline bool Texture::loadFromFile(const char *path)
+{
+    TextureData data;
+    std::string error;
+    if(loadTextureData(path, TextureLoadOptions::current(), data, error))
+    {
+        upload(data);
+        return true;
+    }
+    fail(std::move(error));
+    std::cerr << "Cannot load texture " << path << ": " << mError
+        << std::endl;
+    return false;
+}
+
+/*****************************************************************************/
+// TextureUploader
+/*****************************************************************************/
+
+/**
+ * \brief Loads textures without blocking the render thread. Files are read
+ * and decoded (or texture containers mapped) on the worker pool, the pixels
+ * are handed back through a lock-free queue and pump() uploads them from the
+ * render thread in strips of rows, spending at most a fixed amount of time
+ * per frame. Until the last strip is uploaded the texture binds the fallback
+ * checkerboard.
+ */
+class TextureUploader
+{
+public:
+    // Called on the render thread once the image is decoded, with the hash
+    // of the file content. Returning false skips the upload, e.g. because
+    // the texture was made an alias of one with the same content.
+    using DecodedHook = std::function<bool(std::uint64_t hash)>;
+
+private:
+    struct Job
+    {
+        Texture *target = nullptr;
+        std::weak_ptr<char> alive;
+        std::uint32_t serial = 0;
+        std::string path;
+        TextureLoadOptions options;
+        DecodedHook onDecoded;
+
+        TextureData data;
+        std::string error;
+
+        // Level being uploaded and its rows already uploaded
+        int level = 0;
+        int nextRow = 0;
+    };
+
+    MpscQueue<std::unique_ptr<Job>> mDecoded;
+    std::deque<std::unique_ptr<Job>> mUploading;
+    std::atomic<std::size_t> mDecoding { 0 };
+
+    double mBudgetMs = 2.0;
+    std::size_t mStripBytes = 256 << 10;
+
+    std::uint64_t mUploaded = 0;
+    std::uint64_t mFailed = 0;
+    std::uint64_t mDiscarded = 0;
+    std::uint64_t mDiskCacheHits = 0;
+    float mLastPumpMs = 0;
+
+    static void decode(Job &job)
+    {
+        // Containers are read from disk here so that the strips uploaded
+        // from the mapping later do not wait for it.
+        loadTextureData(job.path, job.options, job.data, job.error, true);
+    }
+
+    // Whether the texture still exists and still wants this job's image.
+    static bool current(const Job &job)
+    {
+        return !job.alive.expired() && job.target->mLoadSerial == job.serial;
+    }
+
+    void accept(std::unique_ptr<Job> job)
+    {
+        if(!current(*job))
+        {
+            ++mDiscarded;
+            return;
+        }
+        auto &&texture = *job->target;
+        if(!job->error.empty())
+        {
+            std::cerr << "Cannot load texture " << job->path << ": "
+                << job->error << std::endl;
+            texture.fail(std::move(job->error));
+            ++mFailed;
+            return;
+        }
+        if(job->data.fromDiskCache) ++mDiskCacheHits;
+        texture.mWidth = job->data.width;
+        texture.mHeight = job->data.height;
+        texture.mLevels = job->data.levelCount();
+        texture.mBytes = job->data.bytes();
+        if(job->onDecoded && !job->onDecoded(job->data.hash))
+        {
+            texture.mPending = false;
+            ++mUploaded;
+            return;
+        }
+        mUploading.push_back(std::move(job));
+    }
+
+    // Upload the next strip of rows of the front job. The base level goes
+    // first, then the smaller mip levels.
+    void uploadStrip()
+    {
+        auto &&job = *mUploading.front();
+        auto &&texture = *job.target;
+        const auto &data = job.data;
+        const auto level = data.level(job.level);
+
+        if(job.level == 0 && job.nextRow == 0)
+        {
+            if(texture.mTextureId == 0) texture.create();
+            // The storage is respecified; the old image must not be shown.
+            texture.mLoaded = false;
+        }
+        glBindTexture(GL_TEXTURE_2D, texture.mTextureId);
+        if(job.nextRow == 0)
+        {
+            // Allocate the level, the strips fill it in.
+            if(data.isCompressed())
+            {
+                glCompressedTexImage2D(GL_TEXTURE_2D, job.level,
+                    data.internalFormat(), level.width, level.height, 0,
+                    static_cast<GLsizei>(level.bytes), nullptr);
+            }
+            else
+            {
+                glTexImage2D(GL_TEXTURE_2D, job.level, GL_RGBA, level.width,
+                    level.height, 0, GL_RGBA, GL_UNSIGNED_BYTE, nullptr);
+            }
+        }
+        // Whole groups of rows, the last one possibly cut by the edge
+        const auto groups = std::max<std::size_t>(1,
+            mStripBytes / level.groupBytes);
+        const auto rows = std::min(level.height - job.nextRow,
+            static_cast<int>(groups) * level.groupRows);
+        const auto *pixels = level.data +
+            level.groupBytes * (job.nextRow / level.groupRows);
+        if(data.isCompressed())
+        {
+            const auto bytes = level.groupBytes *
+                ((rows + level.groupRows - 1) / level.groupRows);
+            glCompressedTexSubImage2D(GL_TEXTURE_2D, job.level, 0,
+                job.nextRow, level.width, rows, data.internalFormat(),
+                static_cast<GLsizei>(bytes), pixels);
+        }
+        else
+        {
+            glTexSubImage2D(GL_TEXTURE_2D, job.level, 0, job.nextRow,
+                level.width, rows, GL_RGBA, GL_UNSIGNED_BYTE, pixels);
+        }
+        glBindTexture(GL_TEXTURE_2D, 0);
+        job.nextRow += rows;
+
+        if(job.nextRow < level.height) return;
+        job.nextRow = 0;
+        if(++job.level < data.levelCount()) return;
+
+        texture.setLevels(job.level);
+        texture.mLoaded = true;
+        texture.mPending = false;
+        ++mUploaded;
+        mUploading.pop_front();
+    }
+
+public:
+    void setBudgetMs(double ms) { mBudgetMs = ms; }
+    double budgetMs() const { return mBudgetMs; }
+
+    // Loads which are decoding or waiting for upload
+    std::size_t inFlight() const
+    {
+        return mDecoding.load() + mUploading.size();
+    }
+
+    /**
+     * \brief Start loading an image file into a texture. A previous load
+     * still in flight for the same texture is superseded. Must be called on
+     * the render thread.
+     */
+    void load(Texture &texture, std::string path,
+        DecodedHook on_decoded = nullptr)
+    {
+        texture.mPending = true;
+        texture.mError.clear();
+        texture.mAlias.reset();
+
+        auto job = std::make_unique<Job>();
+        job->target = &texture;
+        job->alive = texture.mAlive;
+        job->serial = ++texture.mLoadSerial;
+        job->path = std::move(path);
+        job->options = TextureLoadOptions::current();
+        job->onDecoded = std::move(on_decoded);
+
+        ++mDecoding;
+        // std::function needs a copyable callable
+        auto shared = std::make_shared<std::unique_ptr<Job>>(std::move(job));
+        workerPool().post([this, shared]() {
+            ProfileScope scope("Decode Texture");
+            decode(**shared);
+            mDecoded.push(std::move(*shared));
+            --mDecoding;
+        });
+    }
+
+    /**
+     * \brief Collect decoded images and upload them until the time budget
+     * of this frame is used up. At least one strip is uploaded per call so
+     * that loading always makes progress.
+     */
+    void pump()
+    {
+        using Clock = std::chrono::steady_clock;
+        const auto start = Clock::now();
+        const auto deadline = start +
+            std::chrono::duration_cast<Clock::duration>(
+                std::chrono::duration<double, std::milli>(mBudgetMs));
+
+        std::unique_ptr<Job> job;
+        while(mDecoded.pop(job)) accept(std::move(job));
+
+        bool first = true;
+        while(!mUploading.empty() && (first || Clock::now() < deadline))
+        {
+            if(!current(*mUploading.front()))
+            {
+                mUploading.pop_front();
+                ++mDiscarded;
+                continue;
+            }
+            uploadStrip();
+            first = false;
+        }
+
+        mLastPumpMs = std::chrono::duration<float, std::milli>(
+            Clock::now() - start).count();
+    }
+
+    void emitControlWidgets()
+    {
+        auto budget = static_cast<float>(mBudgetMs);
+        if(ImGui::DragFloat("Upload Budget (ms)", &budget, 0.1f, 0.1f, 33.f))
+            mBudgetMs = budget;
+        ImGui::Text("%zu decoding, %zu uploading, last frame %.2f ms",
+            mDecoding.load(), mUploading.size(), mLastPumpMs);
+        ImGui::Text("%llu uploaded, %llu failed, %llu discarded",
+            static_cast<unsigned long long>(mUploaded),
+            static_cast<unsigned long long>(mFailed),
+            static_cast<unsigned long long>(mDiscarded));
+        ImGui::Text("%llu loaded from compressed disk cache",
+            static_cast<unsigned long long>(mDiskCacheHits));
+    }
+};
+
+inline TextureUploader gTextureUploader;
+
+inline void Texture::loadFromFileAsync(const char *path)
+{
+    gTextureUploader.load(*this, path);
+}
@@ -0,0 +1,244 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <future>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+/*****************************************************************************/
+// ThreadPool
+/*****************************************************************************/
+
+/**
+ * \brief A fixed set of worker threads consuming a shared task queue.
+ * Used for the CPU-side work of the framework (culling, importing, decoding)
+ * so that the render thread only has to issue OpenGL commands.
+ */
+class ThreadPool
+{
+    std::vector<std::thread> mWorkers;
+    std::deque<std::function<void()>> mTasks;
+    std::mutex mMutex;
+    std::condition_variable mCondition;
+    bool mStopping = false;
+
+    static int & currentWorkerIndex()
+    {
+        thread_local int index = -1;
+        return index;
+    }
+
+    void workerMain(int index)
+    {
+        currentWorkerIndex() = index;
+        while(true)
+        {
+            std::function<void()> task;
+            {
+                std::unique_lock<std::mutex> lock(mMutex);
+                mCondition.wait(lock, [this]() {
+                    return mStopping || !mTasks.empty();
+                });
+                if(mStopping && mTasks.empty()) return;
+                task = std::move(mTasks.front());
+                mTasks.pop_front();
+            }
+            task();
+        }
+    }
+
+public:
+    explicit ThreadPool(unsigned num_threads = defaultThreadCount())
+    {
+        if(num_threads == 0) num_threads = 1;
+        for(unsigned i = 0; i < num_threads; ++i)
+            mWorkers.emplace_back([this, i]() { workerMain(int(i)); });
+    }
+
+    // Workers drain the remaining tasks before the pool is destroyed.
+    ~ThreadPool()
+    {
+        {
+            std::lock_guard<std::mutex> lock(mMutex);
+            mStopping = true;
+        }
+        mCondition.notify_all();
+        for(auto &&w : mWorkers) w.join();
+    }
+
+    ThreadPool(const ThreadPool &) = delete;
+    ThreadPool & operator=(const ThreadPool &) = delete;
+
+    static unsigned defaultThreadCount()
+    {
+        const auto n = std::thread::hardware_concurrency();
+        return n ? n : 1;
+    }
+
+    std::size_t size() const { return mWorkers.size(); }
+
+    // The index of the calling thread in its pool, or -1 outside of pools,
+    // e.g. to tell the workers apart in the profiler.
+    static int workerIndex() { return currentWorkerIndex(); }
+
+    /**
+     * \brief Queue a task without waiting for its completion.
+     */
+    template <typename F>
+    void post(F &&task)
+    {
+        {
+            std::lock_guard<std::mutex> lock(mMutex);
+            mTasks.emplace_back(std::forward<F>(task));
+        }
+        mCondition.notify_one();
+    }
+
+    /**
+     * \brief Queue a task and get a future for its result.
+     */
+    template <typename F>
+    auto submit(F &&task) -> std::future<decltype(task())>
+    {
+        using Result = decltype(task());
+        auto packaged = std::make_shared<std::packaged_task<Result()>>(
+            std::forward<F>(task));
+        auto future = packaged->get_future();
+        post([packaged]() { (*packaged)(); });
+        return future;
+    }
+
+    /**
+     * \brief Run body(begin, end) over [0, count) split into ranges of at
+     * most grain elements and block until every range is done. The calling
+     * thread also processes ranges, so this is safe to call from a worker.
+     */
+    template <typename F>
+    void parallelFor(std::size_t count, std::size_t grain, F &&body)
+    {
+        if(count == 0) return;
+        if(grain == 0) grain = 1;
+        const auto num_ranges = (count + grain - 1) / grain;
+        if(num_ranges == 1)
+        {
+            body(std::size_t(0), count);
+            return;
+        }
+
+        // The state is shared with the helper tasks, which may still be
+        // sitting in the queue after all ranges were taken by others.
+        struct State
+        {
+            std::atomic<std::size_t> next { 0 };
+            std::atomic<std::size_t> done { 0 };
+            std::mutex mutex;
+            std::condition_variable finished;
+        };
+        auto state = std::make_shared<State>();
+        auto *fn = &body;
+
+        auto run = [state, fn, count, grain, num_ranges]() {
+            std::size_t r;
+            while((r = state->next.fetch_add(1)) < num_ranges)
+            {
+                const auto begin = r * grain;
+                const auto end = std::min(begin + grain, count);
+                (*fn)(begin, end);
+                if(state->done.fetch_add(1) + 1 == num_ranges)
+                {
+                    std::lock_guard<std::mutex> lock(state->mutex);
+                    state->finished.notify_all();
+                }
+            }
+        };
+
+        const auto helpers = std::min(mWorkers.size(), num_ranges - 1);
+        for(std::size_t i = 0; i < helpers; ++i) post(run);
+        run();
+
+        std::unique_lock<std::mutex> lock(state->mutex);
+        state->finished.wait(lock, [&]() {
+            return state->done.load() == num_ranges;
+        });
+    }
+};
+
+/**
+ * \brief The pool shared by all framework subsystems.
+ */
+inline ThreadPool & workerPool()
+{
+    static ThreadPool pool;
+    return pool;
+}
+
+/*****************************************************************************/
+// MpscQueue
+/*****************************************************************************/
+
+/**
+ * \brief Lock-free queue with any number of producers and a single consumer,
+ * used to hand results from the workers to the render thread. After Dmitry
+ * Vyukov's non-intrusive MPSC node-based queue. Producers never wait for
+ * each other or for the consumer. A pop may miss an element whose push is
+ * still in progress; it is then returned by a later pop.
+ */
+template <typename T>
+class MpscQueue
+{
+    struct Node
+    {
+        std::atomic<Node *> next { nullptr };
+        T value;
+    };
+
+    // Producers append here
+    std::atomic<Node *> mHead;
+    // The consumer owns this node; its value was already taken.
+    Node *mTail;
+
+public:
+    MpscQueue()
+    {
+        mTail = new Node();
+        mHead.store(mTail, std::memory_order_relaxed);
+    }
+
+    ~MpscQueue()
+    {
+        while(mTail)
+        {
+            auto *next = mTail->next.load(std::memory_order_relaxed);
+            delete mTail;
+            mTail = next;
+        }
+    }
+
+    MpscQueue(const MpscQueue &) = delete;
+    MpscQueue & operator=(const MpscQueue &) = delete;
+
+    void push(T value)
+    {
+        auto *node = new Node();
+        node->value = std::move(value);
+        auto *prev = mHead.exchange(node, std::memory_order_acq_rel);
+        prev->next.store(node, std::memory_order_release);
+    }
+
+    // Consumer only
+    bool pop(T &value)
+    {
+        auto *next = mTail->next.load(std::memory_order_acquire);
+        if(!next) return false;
+        value = std::move(next->value);
+        delete mTail;
+        mTail = next;
+        return true;
+    }
+};
@@ -0,0 +1,11 @@
+// Stores the distance divided by the range, so that the faces are cleared
+// to 1 where nothing is in the way.
+
+uniform float shadowRange;
+
+varying vec3 v;
+
+void main(void)
+{
+   gl_FragColor = vec4(length(v) / shadowRange);
+}
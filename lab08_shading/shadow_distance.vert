@@ -0,0 +1,10 @@
+// Distance from a point light to the surface, for the cube map of
+// ShadowMaps. The modelview looks from the light through one face.
+
+varying vec3 v;
+
+void main(void)
+{
+   v = vec3(gl_ModelViewMatrix * gl_Vertex);
+   gl_Position = gl_ModelViewProjectionMatrix * gl_Vertex;
+}
@@ -0,0 +1,107 @@
+// Compresses an image with the block encoders, decodes it again and reports
+// speed and quality, so that the encoders can be checked without a GPU.
+//
+// Usage: bc_check <image> [bc1|bc3|bc7] [decoded.ppm]
+//
+// Built by the CMake project at the root of the repository, or e.g.:
+//     g++ -std=c++17 -O2 -pthread -I.. bc_check.cpp
+// along with ../../third_party/stb_image.cpp, which decodes the images.
+
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <cstring>
+
+#include "../../third_party/stb_image.h"
+
+#include "lab08_block_compression.hpp"
+
+namespace
+{
+// Peak signal-to-noise ratio over the channels that the format stores.
+double psnr(const std::uint8_t *a, const std::uint8_t *b, std::size_t texels,
+    int channels)
+{
+    double sum = 0;
+    for(std::size_t t = 0; t < texels; ++t)
+    {
+        for(int c = 0; c < channels; ++c)
+        {
+            const double e = double(a[t * 4 + c]) - b[t * 4 + c];
+            sum += e * e;
+        }
+    }
+    const auto mse = sum / (double(texels) * channels);
+    return mse > 0 ? 10 * std::log10(255.0 * 255.0 / mse) : INFINITY;
+}
+
+bool writePpm(const char *path, const Image &image)
+{
+    auto *file = std::fopen(path, "wb");
+    if(!file) return false;
+    std::fprintf(file, "P6\n%d %d\n255\n", image.width, image.height);
+    for(std::size_t t = 0; t < image.pixels.size(); t += 4)
+        std::fwrite(&image.pixels[t], 1, 3, file);
+    return std::fclose(file) == 0;
+}
+}
+
+int main(int argc, char *argv[])
+{
+    if(argc < 2)
+    {
+        std::fprintf(stderr, "Usage: %s <image> [bc1|bc3|bc7] [decoded.ppm]\n",
+            argv[0]);
+        return 1;
+    }
+
+    int width, height, num_channels;
+    auto *pixels = stbi_load(argv[1], &width, &height, &num_channels, 4);
+    if(!pixels)
+    {
+        std::fprintf(stderr, "Cannot load %s: %s\n", argv[1],
+            stbi_failure_reason());
+        return 1;
+    }
+
+    auto format = hasTranslucency(pixels, width, height) ?
+        BlockFormat::BC3 : BlockFormat::BC1;
+    if(argc > 2)
+    {
+        if(std::strcmp(argv[2], "bc1") == 0) format = BlockFormat::BC1;
+        else if(std::strcmp(argv[2], "bc3") == 0) format = BlockFormat::BC3;
+        else if(std::strcmp(argv[2], "bc7") == 0) format = BlockFormat::BC7;
+        else
+        {
+            std::fprintf(stderr, "Unknown format %s\n", argv[2]);
+            return 1;
+        }
+    }
+
+    const auto start = std::chrono::steady_clock::now();
+    const auto compressed = compressImage(pixels, width, height, format);
+    const std::chrono::duration<double> seconds =
+        std::chrono::steady_clock::now() - start;
+    const auto decoded = decompressImage(compressed);
+
+    const auto texels = std::size_t(width) * height;
+    std::printf("%s: %dx%d %s, %zu -> %zu bytes, %.1f MPix/s\n", argv[1],
+        width, height, blockFormatName(format), texels * 4,
+        compressed.bytes(), texels / seconds.count() / 1e6);
+    std::printf("PSNR RGB %.2f dB", psnr(pixels, decoded.pixels.data(),
+        texels, 3));
+    if(format != BlockFormat::BC1)
+    {
+        std::printf(", RGBA %.2f dB", psnr(pixels, decoded.pixels.data(),
+            texels, 4));
+    }
+    std::printf("\n");
+
+    stbi_image_free(pixels);
+    if(argc > 3 && !writePpm(argv[3], decoded))
+    {
+        std::fprintf(stderr, "Cannot write %s\n", argv[3]);
+        return 1;
+    }
+    return 0;
+}
@@ -0,0 +1,85 @@
+// Measures how fast buildMipLevels() produces mip chains, in millions of
+// base level pixels per second.
+//
+// Usage: mip_benchmark [size] [repetitions]
+//
+// Built by the CMake project at the root of the repository, or e.g.:
+//     g++ -std=c++17 -O2 -pthread -I.. mip_benchmark.cpp
+
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+
+#include "lab08_image.hpp"
+
+namespace
+{
+// A pattern with edges and gradients, so that no filter can take shortcuts.
+Image makeTestImage(int size)
+{
+    Image image(size, size);
+    for(int y = 0; y < size; ++y)
+    {
+        for(int x = 0; x < size; ++x)
+        {
+            auto *p = &image.pixels[(std::size_t(y) * size + x) * 4];
+            p[0] = static_cast<std::uint8_t>(x * 255 / size);
+            p[1] = static_cast<std::uint8_t>(y * 255 / size);
+            p[2] = ((x >> 3) ^ (y >> 3)) & 1 ? 255 : 0;
+            p[3] = 255;
+        }
+    }
+    return image;
+}
+
+double run(const Image &image, MipFilter filter, ThreadPool &pool,
+    int repetitions)
+{
+    // Warm up the tables and the workers
+    buildMipLevels(image.pixels.data(), image.width, image.height, filter,
+        pool);
+
+    const auto start = std::chrono::steady_clock::now();
+    for(int i = 0; i < repetitions; ++i)
+    {
+        buildMipLevels(image.pixels.data(), image.width, image.height,
+            filter, pool);
+    }
+    const std::chrono::duration<double> seconds =
+        std::chrono::steady_clock::now() - start;
+    const double pixels = double(image.width) * image.height * repetitions;
+    return pixels / seconds.count() / 1e6;
+}
+}
+
+int main(int argc, char *argv[])
+{
+    const int size = argc > 1 ? std::atoi(argv[1]) : 2048;
+    const int repetitions = argc > 2 ? std::atoi(argv[2]) : 5;
+    if(size <= 0 || repetitions <= 0)
+    {
+        std::fprintf(stderr, "Usage: %s [size] [repetitions]\n", argv[0]);
+        return 1;
+    }
+
+    const auto image = makeTestImage(size);
+#ifdef LAB_IMAGE_SSE2
+    const char *simd = "SSE2";
+#else
+    const char *simd = "scalar";
+#endif
+    std::printf("%dx%d, %d repetitions, %s\n", size, size, repetitions, simd);
+
+    // parallelFor() runs on the calling thread as well as on the workers.
+    ThreadPool single(1);
+    auto &pool = workerPool();
+    for(auto filter : { MipFilter::BOX, MipFilter::KAISER })
+    {
+        const auto narrow = run(image, filter, single, repetitions);
+        const auto wide = run(image, filter, pool, repetitions);
+        std::printf("%-7s %2zu threads: %8.1f MPix/s   %2zu threads: %8.1f MPix/s\n",
+            mipFilterName(filter), single.size() + 1, narrow,
+            pool.size() + 1, wide);
+    }
+    return 0;
+}
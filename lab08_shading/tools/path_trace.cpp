@@ -0,0 +1,187 @@
+// Renders a fixed scene with the path tracer on the CPU and reports the rays
+// traced per second, without a window or a GPU.
+//
+// Usage: path_trace [--size <width> <height>] [--samples <count>]
+//                   [--bounces <count>] [--write <out.ppm>]
+//
+// Built by the CMake project at the root of the repository, or e.g.:
+//     g++ -std=c++17 -O2 -pthread -I.. path_trace.cpp
+
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+
+#include "lab08_path_tracer.hpp"
+#include "tool_scene.hpp"
+
+namespace
+{
+// A square on the ground plane, facing up
+std::vector<SoftwareVertex> floorSquare(float half_size)
+{
+    const auto h = half_size;
+    const SoftwareVertex corners[4] = {
+        { { -h, 0, -h }, { 0, 1, 0 }, { 0, 0 } },
+        { { -h, 0, h }, { 0, 1, 0 }, { 0, 1 } },
+        { { h, 0, h }, { 0, 1, 0 }, { 1, 1 } },
+        { { h, 0, -h }, { 0, 1, 0 }, { 1, 0 } } };
+    std::vector<SoftwareVertex> vertices;
+    for(int i : { 0, 1, 2, 0, 2, 3 }) vertices.push_back(corners[i]);
+    return vertices;
+}
+
+// Draw the scene of raster_check into the capture, in world space.
+void drawScene(PathTracerScene &scene, const Image &texture,
+    const std::vector<SoftwareVertex> &sphere,
+    const std::vector<std::uint32_t> &sphere_indices,
+    const std::vector<SoftwareVertex> &box,
+    const std::vector<SoftwareVertex> &ground)
+{
+    const Matrix identity;
+    scene.setModelView(identity.m);
+    SoftwareLight sun;
+    sun.position[0] = 0.4f;
+    sun.position[1] = 1;
+    sun.position[2] = 0.6f;
+    sun.position[3] = 0;
+    sun.diffuse[0] = sun.specular[0] = 0.9f;
+    sun.diffuse[1] = sun.specular[1] = 0.85f;
+    sun.diffuse[2] = sun.specular[2] = 0.8f;
+    scene.setLight(0, sun);
+    scene.enableLight(0, true);
+    SoftwareLight lamp;
+    lamp.position[0] = -2;
+    lamp.position[1] = 1.5f;
+    lamp.position[2] = 2;
+    lamp.position[3] = 1;
+    lamp.diffuse[0] = lamp.specular[0] = 0.3f;
+    lamp.diffuse[1] = lamp.specular[1] = 0.5f;
+    lamp.diffuse[2] = lamp.specular[2] = 1;
+    lamp.attenuation[1] = 0.2f;
+    scene.setLight(1, lamp);
+    scene.enableLight(1, true);
+
+    SoftwareMaterial shiny;
+    shiny.specular[0] = shiny.specular[1] = shiny.specular[2] = 0.5f;
+    shiny.shininess = 40;
+
+    for(int z = -2; z <= 2; ++z)
+    {
+        for(int x = -3; x <= 3; ++x)
+        {
+            scene.setModelView((translate(x * 1.2f, 0.5f, z * 1.2f) *
+                rotateX(-90)).m);
+            auto material = shiny;
+            material.diffuse[0] = 0.3f + 0.1f * (x + 3);
+            material.diffuse[2] = 0.3f + 0.15f * (z + 2);
+            scene.setMaterial(material);
+            scene.setTexture((x + z) % 2 ? &texture : nullptr);
+            scene.drawIndexed(sphere.data(), sphere.size(),
+                sphere_indices.data(), sphere_indices.size());
+        }
+    }
+
+    scene.setTexture(&texture);
+    scene.setMaterial(SoftwareMaterial());
+    scene.setModelView((translate(0, 0.75f, 3.2f) * rotateY(30) *
+        rotateX(20)).m);
+    scene.drawTriangles(box.data(), box.size());
+
+    scene.setTexture(nullptr);
+    scene.setModelView(identity.m);
+    scene.drawTriangles(ground.data(), ground.size());
+}
+
+// The inverse of a rotation followed by a translation
+Matrix inverseRigid(const Matrix &a)
+{
+    Matrix out;
+    for(int c = 0; c < 3; ++c)
+    {
+        for(int r = 0; r < 3; ++r) out.m[c * 4 + r] = a.m[r * 4 + c];
+    }
+    for(int r = 0; r < 3; ++r)
+    {
+        out.m[12 + r] = -(out.m[r] * a.m[12] + out.m[4 + r] * a.m[13] +
+            out.m[8 + r] * a.m[14]);
+    }
+    return out;
+}
+}
+
+int main(int argc, char *argv[])
+{
+    int width = 640, height = 360, samples = 16;
+    PathTracer::Settings settings;
+    const char *write_path = nullptr;
+    for(int i = 1; i < argc; ++i)
+    {
+        if(std::strcmp(argv[i], "--size") == 0 && i + 2 < argc)
+        {
+            width = std::atoi(argv[++i]);
+            height = std::atoi(argv[++i]);
+        }
+        else if(std::strcmp(argv[i], "--samples") == 0 && i + 1 < argc)
+            samples = std::atoi(argv[++i]);
+        else if(std::strcmp(argv[i], "--bounces") == 0 && i + 1 < argc)
+            settings.maxBounces = std::atoi(argv[++i]);
+        else if(std::strcmp(argv[i], "--write") == 0 && i + 1 < argc)
+            write_path = argv[++i];
+        else
+        {
+            std::fprintf(stderr, "Usage: %s [--size <width> <height>] "
+                "[--samples <count>] [--bounces <count>] "
+                "[--write <out.ppm>]\n", argv[0]);
+            return 1;
+        }
+    }
+    if(width <= 0 || height <= 0 || samples <= 0 || settings.maxBounces < 0)
+    {
+        std::fprintf(stderr, "Invalid size, sample or bounce count\n");
+        return 1;
+    }
+
+    const auto texture = checker(256, 8);
+    std::vector<SoftwareVertex> sphere;
+    std::vector<std::uint32_t> sphere_indices;
+    buildSoftwareSphere(0.5f, 64, 64, sphere, sphere_indices);
+
+    auto build_start = std::chrono::steady_clock::now();
+    auto scene = std::make_shared<PathTracerScene>();
+    drawScene(*scene, texture, sphere, sphere_indices, cube(),
+        floorSquare(10));
+    scene->build();
+    const std::chrono::duration<double, std::milli> build_ms =
+        std::chrono::steady_clock::now() - build_start;
+    std::printf("%zu triangles, %zu nodes, built in %.1f ms\n",
+        scene->triangleCount(), scene->nodeCount(), build_ms.count());
+
+    PathCamera camera;
+    const auto view = translate(0, -1, -9) * rotateX(25);
+    std::copy_n(inverseRigid(view).m, 16, camera.eyeToWorld);
+    std::copy_n(perspective(45, float(width) / height, 0.1f, 100).m, 16,
+        camera.projection);
+
+    PathTracer tracer;
+    tracer.restart(scene, camera, settings, width, height);
+    double rays = 0, seconds = 0;
+    for(int sample = 0; sample < samples; ++sample)
+    {
+        tracer.renderPass();
+        seconds += tracer.passMilliseconds() / 1000;
+        rays += tracer.rays();
+    }
+    std::printf("%dx%d, %d samples, %d bounces, %zu workers: %.2f ms per "
+        "sample, %.2f Mrays/s\n", width, height, samples,
+        settings.maxBounces, workerPool().size(), seconds * 1000 / samples,
+        rays / seconds / 1e6);
+
+    if(write_path && !writePpm(write_path, width, height, tracer.pixels()))
+    {
+        std::fprintf(stderr, "Cannot write %s\n", write_path);
+        return 1;
+    }
+    return 0;
+}
@@ -0,0 +1,248 @@
+// Renders a fixed scene with the software rasterizer, reports the frame
+// time and compares the image against a reference, so that changes to the
+// rasterizer can be checked without a GPU.
+//
+// Usage: raster_check [--size <width> <height>] [--frames <count>]
+//                     [--write <out.ppm>] [--compare <reference.ppm>]
+//                     [--tolerance <levels>]
+//
+// Exits with 1 when more than 0.1% of the pixels differ from the reference
+// by more than the tolerance in some channel (default 8 of 255).
+//
+// raster_check_320x180.ppm next to this file is the reference at that size,
+// which ctest compares against. Regenerate it with --write only for changes
+// to the rasterizer that are meant to change its output.
+//
+// Built by the CMake project at the root of the repository, or e.g.:
+//     g++ -std=c++17 -O2 -pthread -I.. raster_check.cpp
+
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+
+#include "lab08_software_rasterizer.hpp"
+#include "tool_scene.hpp"
+
+namespace
+{
+std::vector<SoftwareVertex> ground(int half_size)
+{
+    std::vector<SoftwareVertex> vertices;
+    for(int i = -half_size; i <= half_size; ++i)
+    {
+        const auto a = float(i);
+        const auto b = float(half_size);
+        vertices.push_back({ { a, 0, -b }, { 0, 1, 0 }, { 0, 0 } });
+        vertices.push_back({ { a, 0, b }, { 0, 1, 0 }, { 0, 0 } });
+        vertices.push_back({ { -b, 0, a }, { 0, 1, 0 }, { 0, 0 } });
+        vertices.push_back({ { b, 0, a }, { 0, 1, 0 }, { 0, 0 } });
+    }
+    return vertices;
+}
+
+bool readPpm(const char *path, int &width, int &height,
+    std::vector<std::uint8_t> &rgb)
+{
+    auto *file = std::fopen(path, "rb");
+    if(!file) return false;
+    int max_value = 0;
+    const auto ok = std::fscanf(file, "P6 %d %d %d", &width, &height,
+        &max_value) == 3 && max_value == 255 && std::fgetc(file) != EOF;
+    if(ok)
+    {
+        rgb.resize(std::size_t(width) * height * 3);
+        if(std::fread(rgb.data(), 1, rgb.size(), file) != rgb.size())
+            rgb.clear();
+    }
+    std::fclose(file);
+    return ok && !rgb.empty();
+}
+
+void drawScene(SoftwareRasterizer &raster, const Matrix &view,
+    const Image &texture, const std::vector<SoftwareVertex> &sphere,
+    const std::vector<std::uint32_t> &sphere_indices,
+    const std::vector<SoftwareVertex> &box,
+    const std::vector<SoftwareVertex> &grid)
+{
+    raster.clear(0.1f, 0.1f, 0.15f, 1);
+
+    raster.setModelView(view.m);
+    raster.setTexturing(true);
+    raster.setLighting(true);
+    SoftwareLight sun;
+    sun.position[0] = 0.4f;
+    sun.position[1] = 1;
+    sun.position[2] = 0.6f;
+    sun.position[3] = 0;
+    sun.diffuse[0] = sun.specular[0] = 0.9f;
+    sun.diffuse[1] = sun.specular[1] = 0.85f;
+    sun.diffuse[2] = sun.specular[2] = 0.8f;
+    raster.setLight(0, sun);
+    raster.enableLight(0, true);
+    SoftwareLight lamp;
+    lamp.position[0] = -2;
+    lamp.position[1] = 1.5f;
+    lamp.position[2] = 2;
+    lamp.position[3] = 1;
+    lamp.diffuse[0] = lamp.specular[0] = 0.3f;
+    lamp.diffuse[1] = lamp.specular[1] = 0.5f;
+    lamp.diffuse[2] = lamp.specular[2] = 1;
+    lamp.attenuation[1] = 0.2f;
+    raster.setLight(1, lamp);
+    raster.enableLight(1, true);
+
+    SoftwareMaterial shiny;
+    shiny.specular[0] = shiny.specular[1] = shiny.specular[2] = 1;
+    shiny.shininess = 40;
+
+    // A grid of spheres, every other one textured
+    for(int z = -2; z <= 2; ++z)
+    {
+        for(int x = -3; x <= 3; ++x)
+        {
+            raster.setModelView((view * translate(x * 1.2f, 0.5f,
+                z * 1.2f) * rotateX(-90)).m);
+            auto material = shiny;
+            material.diffuse[0] = 0.3f + 0.1f * (x + 3);
+            material.diffuse[2] = 0.3f + 0.15f * (z + 2);
+            raster.setMaterial(material);
+            raster.setTexture((x + z) % 2 ? &texture : nullptr);
+            raster.drawIndexed(sphere.data(), sphere.size(),
+                sphere_indices.data(), sphere_indices.size());
+        }
+    }
+
+    raster.setTexture(&texture);
+    raster.setMaterial(SoftwareMaterial());
+    raster.setModelView((view * translate(0, 0.75f, 3.2f) * rotateY(30) *
+        rotateX(20)).m);
+    raster.drawTriangles(box.data(), box.size());
+
+    raster.setTexture(nullptr);
+    raster.setLighting(false);
+    raster.setColor(0.5f, 0.5f, 0.5f);
+    raster.setModelView(view.m);
+    raster.drawLines(grid.data(), grid.size());
+
+    raster.finish();
+}
+}
+
+int main(int argc, char *argv[])
+{
+    int width = 1280, height = 720, frames = 30;
+    const char *write_path = nullptr;
+    const char *compare_path = nullptr;
+    int tolerance = 8;
+    for(int i = 1; i < argc; ++i)
+    {
+        if(std::strcmp(argv[i], "--size") == 0 && i + 2 < argc)
+        {
+            width = std::atoi(argv[++i]);
+            height = std::atoi(argv[++i]);
+        }
+        else if(std::strcmp(argv[i], "--frames") == 0 && i + 1 < argc)
+            frames = std::atoi(argv[++i]);
+        else if(std::strcmp(argv[i], "--write") == 0 && i + 1 < argc)
+            write_path = argv[++i];
+        else if(std::strcmp(argv[i], "--compare") == 0 && i + 1 < argc)
+            compare_path = argv[++i];
+        else if(std::strcmp(argv[i], "--tolerance") == 0 && i + 1 < argc)
+            tolerance = std::atoi(argv[++i]);
+        else
+        {
+            std::fprintf(stderr, "Usage: %s [--size <width> <height>] "
+                "[--frames <count>] [--write <out.ppm>] "
+                "[--compare <reference.ppm>] [--tolerance <levels>]\n",
+                argv[0]);
+            return 1;
+        }
+    }
+    if(width <= 0 || height <= 0 || frames <= 0)
+    {
+        std::fprintf(stderr, "Invalid size or frame count\n");
+        return 1;
+    }
+
+    const auto texture = checker(256, 8);
+    std::vector<SoftwareVertex> sphere;
+    std::vector<std::uint32_t> sphere_indices;
+    buildSoftwareSphere(0.5f, 64, 64, sphere, sphere_indices);
+    const auto box = cube();
+    const auto grid = ground(10);
+
+    SoftwareRasterizer raster;
+    raster.resize(width, height);
+    raster.setProjection(perspective(45, float(width) / height, 0.1f,
+        100).m);
+    const auto view = translate(0, -1, -9) * rotateX(25);
+
+    // The first frame warms up the caches and the worker pool.
+    drawScene(raster, view, texture, sphere, sphere_indices, box, grid);
+    const auto start = std::chrono::steady_clock::now();
+    for(int frame = 0; frame < frames; ++frame)
+        drawScene(raster, view, texture, sphere, sphere_indices, box, grid);
+    const std::chrono::duration<double, std::milli> ms =
+        std::chrono::steady_clock::now() - start;
+    const auto frame_ms = ms.count() / frames;
+    std::printf("%dx%d, %zu triangles, %zu lines, %zu binned, %zu workers: "
+        "%.2f ms per frame (%.1f fps), %.2f ms in tiles\n", width, height,
+        raster.triangles(), raster.lines(), raster.binned(),
+        workerPool().size(), frame_ms, 1000 / frame_ms,
+        raster.finishMilliseconds());
+
+    std::vector<std::uint8_t> rgba(std::size_t(width) * height * 4);
+    raster.readPixels(rgba.data());
+    if(write_path && !writePpm(write_path, width, height, rgba))
+    {
+        std::fprintf(stderr, "Cannot write %s\n", write_path);
+        return 1;
+    }
+
+    if(compare_path)
+    {
+        int reference_width, reference_height;
+        std::vector<std::uint8_t> reference;
+        if(!readPpm(compare_path, reference_width, reference_height,
+            reference))
+        {
+            std::fprintf(stderr, "Cannot read %s\n", compare_path);
+            return 1;
+        }
+        if(reference_width != width || reference_height != height)
+        {
+            std::fprintf(stderr, "%s is %dx%d\n", compare_path,
+                reference_width, reference_height);
+            return 1;
+        }
+        std::size_t differing = 0;
+        int max_difference = 0;
+        double sum = 0;
+        for(int y = 0; y < height; ++y)
+        {
+            for(int x = 0; x < width; ++x)
+            {
+                const auto *a = &rgba[(std::size_t(y) * width + x) * 4];
+                const auto *b = &reference[
+                    (std::size_t(height - 1 - y) * width + x) * 3];
+                int difference = 0;
+                for(int c = 0; c < 3; ++c)
+                {
+                    const auto d = std::abs(int(a[c]) - b[c]);
+                    difference = std::max(difference, d);
+                    sum += d;
+                }
+                max_difference = std::max(max_difference, difference);
+                if(difference > tolerance) ++differing;
+            }
+        }
+        const auto pixels = double(width) * height;
+        std::printf("Against %s: max %d, mean %.3f, %.3f%% above %d\n",
+            compare_path, max_difference, sum / (pixels * 3),
+            100 * differing / pixels, tolerance);
+        if(differing > pixels * 0.001) return 1;
+    }
+    return 0;
+}
@@ -0,0 +1,106 @@
+// Projects environments whose irradiance is known in closed form into
+// spherical harmonics and compares the irradiance they evaluate to, so that
+// projectIrradiance() can be checked without a GPU.
+//
+// Usage: sh_check [--size <width> <height>] [--tolerance <error>]
+//
+// A uniform sky of radiance L gives L in every direction. A sky of radiance
+// L above the horizon and black below gives L (1 + n.y) / 2, which bands 0
+// and 1 hold exactly. Exits with 1 when a direction is off by more than the
+// tolerance (default 0.01) relative to L.
+//
+// Built by the CMake project at the root of the repository, or e.g.:
+//     g++ -std=c++17 -O2 -pthread -I.. sh_check.cpp
+
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+
+#include "lab08_spherical_harmonics.hpp"
+
+namespace
+{
+const float kRadiance[3] = { 1.f, 0.5f, 0.25f };
+
+// Rows below the horizon are black when half_sky is set.
+LinearImage sky(int width, int height, bool half_sky)
+{
+    LinearImage image(width, height);
+    for(int y = 0; y < height; ++y)
+    {
+        const auto lit = !half_sky || y < height / 2;
+        auto *texel = image.row(y);
+        for(int x = 0; x < width; ++x, texel += 4)
+        {
+            for(int c = 0; c < 3; ++c) texel[c] = lit ? kRadiance[c] : 0.f;
+            texel[3] = 1;
+        }
+    }
+    return image;
+}
+
+// The largest error over a set of directions, relative to the radiance
+double check(const char *name, const ShIrradiance &irradiance,
+    bool half_sky)
+{
+    const float s = 1 / std::sqrt(3.f);
+    const float normals[][3] = {
+        { 1, 0, 0 }, { -1, 0, 0 }, { 0, 1, 0 }, { 0, -1, 0 }, { 0, 0, 1 },
+        { 0, 0, -1 }, { s, s, s }, { -s, s, -s }, { s, -s, -s },
+        { -s, -s, s },
+    };
+    double max_error = 0;
+    for(auto &&n : normals)
+    {
+        float rgb[3];
+        irradiance.evaluate(n, rgb);
+        const auto expected = half_sky ? (1 + n[1]) / 2 : 1.f;
+        for(int c = 0; c < 3; ++c)
+        {
+            const auto error = std::fabs(rgb[c] / kRadiance[c] - expected);
+            if(error > max_error) max_error = error;
+        }
+    }
+    std::printf("%s: largest error %.5f\n", name, max_error);
+    return max_error;
+}
+}
+
+int main(int argc, char *argv[])
+{
+    int width = 128, height = 64;
+    double tolerance = 0.01;
+    for(int i = 1; i < argc; ++i)
+    {
+        if(std::strcmp(argv[i], "--size") == 0 && i + 2 < argc)
+        {
+            width = std::atoi(argv[++i]);
+            height = std::atoi(argv[++i]);
+        }
+        else if(std::strcmp(argv[i], "--tolerance") == 0 && i + 1 < argc)
+            tolerance = std::atof(argv[++i]);
+        else
+        {
+            std::fprintf(stderr, "Usage: %s [--size <width> <height>] "
+                "[--tolerance <error>]\n", argv[0]);
+            return 1;
+        }
+    }
+    if(width < 1 || height < 2)
+    {
+        std::fprintf(stderr, "Invalid size %dx%d\n", width, height);
+        return 1;
+    }
+
+    const auto uniform = check("Uniform sky",
+        projectIrradiance(sky(width, height, false)), false);
+    const auto half = check("Half sky",
+        projectIrradiance(sky(width, height, true)), true);
+    if(uniform > tolerance || half > tolerance)
+    {
+        std::fprintf(stderr, "Error above the tolerance of %g\n", tolerance);
+        return 1;
+    }
+    return 0;
+}
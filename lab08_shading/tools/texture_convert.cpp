@@ -0,0 +1,227 @@
+// Converts images into texture containers (.cgtex) holding the whole mip
+// chain in the format it is uploaded in, so that the application maps them
+// instead of decoding and compressing at load time. Each image is written
+// next to itself with the extension replaced. With --verify the written
+// containers are read back and timed.
+//
+// Usage: texture_convert [--format rgba8|bc1|bc3|bc7|auto]
+//                        [--filter box|kaiser] [--verify] <image>...
+//
+// auto picks BC1, or BC3 for images with translucent texels.
+//
+// Built by the CMake project at the root of the repository, or e.g.:
+//     g++ -std=c++17 -O2 -pthread -I.. texture_convert.cpp
+// along with ../../third_party/stb_image.cpp, which decodes the images.
+
+#include <chrono>
+#include <cstdio>
+#include <cstring>
+#include <string>
+#include <vector>
+
+#include "../../third_party/stb_image.h"
+
+#include "lab08_texture_container.hpp"
+
+namespace
+{
+enum class Choice
+{
+    RGBA8,
+    BC1,
+    BC3,
+    BC7,
+    AUTO,
+};
+
+bool parseChoice(const char *name, Choice &choice)
+{
+    static const char *names[] = { "rgba8", "bc1", "bc3", "bc7", "auto" };
+    for(int i = 0; i < 5; ++i)
+    {
+        if(std::strcmp(name, names[i]) == 0)
+        {
+            choice = static_cast<Choice>(i);
+            return true;
+        }
+    }
+    return false;
+}
+
+std::string containerPath(const std::string &image_path)
+{
+    const auto slash = image_path.find_last_of("/\\");
+    const auto dot = image_path.find_last_of('.');
+    const auto stem = dot != std::string::npos &&
+        (slash == std::string::npos || dot > slash) ?
+        image_path.substr(0, dot) : image_path;
+    return stem + ".cgtex";
+}
+
+bool readFile(const char *path, std::vector<char> &content)
+{
+    std::ifstream file(path, std::ios::binary | std::ios::ate);
+    if(!file) return false;
+    content.resize(static_cast<std::size_t>(file.tellg()));
+    file.seekg(0);
+    return static_cast<bool>(file.read(content.data(), content.size()));
+}
+
+bool convert(const char *path, Choice choice, MipFilter filter, bool verify)
+{
+    std::vector<char> content;
+    if(!readFile(path, content))
+    {
+        std::fprintf(stderr, "Cannot read %s\n", path);
+        return false;
+    }
+    int width, height, num_channels;
+    auto *pixels = stbi_load_from_memory(
+        reinterpret_cast<const stbi_uc *>(content.data()),
+        static_cast<int>(content.size()), &width, &height, &num_channels, 4);
+    if(!pixels)
+    {
+        std::fprintf(stderr, "Cannot decode %s: %s\n", path,
+            stbi_failure_reason());
+        return false;
+    }
+
+    const auto start = std::chrono::steady_clock::now();
+    auto mips = buildMipLevels(pixels, width, height, filter);
+
+    auto format = ContainerFormat::RGBA8;
+    switch(choice)
+    {
+        case Choice::RGBA8: format = ContainerFormat::RGBA8; break;
+        case Choice::BC1: format = ContainerFormat::BC1; break;
+        case Choice::BC3: format = ContainerFormat::BC3; break;
+        case Choice::BC7: format = ContainerFormat::BC7; break;
+        case Choice::AUTO:
+            format = hasTranslucency(pixels, width, height) ?
+                ContainerFormat::BC3 : ContainerFormat::BC1;
+            break;
+    }
+
+    std::vector<ContainerLevel> levels;
+    std::vector<CompressedImage> compressed;
+    if(isBlockCompressed(format))
+    {
+        const auto block_format = containerBlockFormat(format);
+        compressed.push_back(compressImage(pixels, width, height,
+            block_format));
+        for(auto &&mip : mips)
+        {
+            compressed.push_back(compressImage(mip.pixels.data(), mip.width,
+                mip.height, block_format));
+        }
+        for(auto &&c : compressed)
+            levels.push_back({ c.width, c.height, c.blocks.data(), c.bytes() });
+    }
+    else
+    {
+        levels.push_back({ width, height, pixels,
+            std::size_t(4) * width * height });
+        for(auto &&mip : mips)
+        {
+            levels.push_back({ mip.width, mip.height, mip.pixels.data(),
+                mip.pixels.size() });
+        }
+    }
+    const std::chrono::duration<double> seconds =
+        std::chrono::steady_clock::now() - start;
+
+    const auto out_path = containerPath(path);
+    const auto ok = writeTextureContainer(out_path, format,
+        hashBytes(content.data(), content.size()), levels);
+    stbi_image_free(pixels);
+    if(!ok)
+    {
+        std::fprintf(stderr, "Cannot write %s\n", out_path.c_str());
+        return false;
+    }
+
+    std::size_t bytes = 0;
+    for(auto &&level : levels) bytes += level.bytes;
+    std::printf("%s -> %s: %dx%d %s, %zu levels, %zu bytes, %.2f s\n",
+        path, out_path.c_str(), width, height, containerFormatName(format),
+        levels.size(), bytes, seconds.count());
+
+    if(verify)
+    {
+        const auto read_start = std::chrono::steady_clock::now();
+        TextureContainer container;
+        std::string error;
+        if(!container.open(out_path, error))
+        {
+            std::fprintf(stderr, "Cannot read back %s: %s\n",
+                out_path.c_str(), error.c_str());
+            return false;
+        }
+        container.prefetch();
+        const std::chrono::duration<double, std::milli> read_ms =
+            std::chrono::steady_clock::now() - read_start;
+        for(int i = 0; i < container.levelCount(); ++i)
+        {
+            auto &&level = container.level(i);
+            if(level.bytes != levels[i].bytes ||
+                std::memcmp(level.data, levels[i].data, level.bytes) != 0)
+            {
+                std::fprintf(stderr, "Level %d of %s differs\n", i,
+                    out_path.c_str());
+                return false;
+            }
+        }
+        std::printf("  verified, mapped and read in %.2f ms\n",
+            read_ms.count());
+    }
+    return true;
+}
+}
+
+int main(int argc, char *argv[])
+{
+    auto choice = Choice::AUTO;
+    auto filter = MipFilter::BOX;
+    auto verify = false;
+    std::vector<const char *> inputs;
+    for(int i = 1; i < argc; ++i)
+    {
+        if(std::strcmp(argv[i], "--format") == 0 && i + 1 < argc)
+        {
+            if(!parseChoice(argv[++i], choice))
+            {
+                std::fprintf(stderr, "Unknown format %s\n", argv[i]);
+                return 1;
+            }
+        }
+        else if(std::strcmp(argv[i], "--filter") == 0 && i + 1 < argc)
+        {
+            ++i;
+            if(std::strcmp(argv[i], "box") == 0) filter = MipFilter::BOX;
+            else if(std::strcmp(argv[i], "kaiser") == 0)
+                filter = MipFilter::KAISER;
+            else
+            {
+                std::fprintf(stderr, "Unknown filter %s\n", argv[i]);
+                return 1;
+            }
+        }
+        else if(std::strcmp(argv[i], "--verify") == 0)
+            verify = true;
+        else
+            inputs.push_back(argv[i]);
+    }
+    if(inputs.empty())
+    {
+        std::fprintf(stderr, "Usage: %s [--format rgba8|bc1|bc3|bc7|auto] "
+            "[--filter box|kaiser] [--verify] <image>...\n", argv[0]);
+        return 1;
+    }
+
+    int failed = 0;
+    for(auto *input : inputs)
+    {
+        if(!convert(input, choice, filter, verify)) ++failed;
+    }
+    return failed ? 1 : 0;
+}
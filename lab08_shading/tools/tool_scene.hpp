@@ -0,0 +1,154 @@
+#pragma once
+
+// The scene helpers shared by the tools rendering without OpenGL or GLM:
+// matrices as OpenGL takes them, a test texture and cube, and PPM output.
+
+#include <cmath>
+#include <cstdio>
+#include <cstdint>
+#include <vector>
+
+#include "lab08_software_rasterizer.hpp"
+
+struct Matrix
+{
+    // Column-major
+    float m[16] { 1, 0, 0, 0, 0, 1, 0, 0, 0, 0, 1, 0, 0, 0, 0, 1 };
+};
+
+inline Matrix operator*(const Matrix &a, const Matrix &b)
+{
+    Matrix out;
+    for(int c = 0; c < 4; ++c)
+    {
+        for(int r = 0; r < 4; ++r)
+        {
+            out.m[c * 4 + r] = 0;
+            for(int k = 0; k < 4; ++k)
+                out.m[c * 4 + r] += a.m[k * 4 + r] * b.m[c * 4 + k];
+        }
+    }
+    return out;
+}
+
+inline Matrix perspective(float fovy_degrees, float aspect, float near, float far)
+{
+    const auto f = 1 / std::tan(fovy_degrees * 3.14159265f / 360);
+    Matrix out;
+    out.m[0] = f / aspect;
+    out.m[5] = f;
+    out.m[10] = (far + near) / (near - far);
+    out.m[11] = -1;
+    out.m[14] = 2 * far * near / (near - far);
+    out.m[15] = 0;
+    return out;
+}
+
+inline Matrix translate(float x, float y, float z)
+{
+    Matrix out;
+    out.m[12] = x;
+    out.m[13] = y;
+    out.m[14] = z;
+    return out;
+}
+
+inline Matrix rotateX(float degrees)
+{
+    const auto a = degrees * 3.14159265f / 180;
+    Matrix out;
+    out.m[5] = std::cos(a);
+    out.m[6] = std::sin(a);
+    out.m[9] = -std::sin(a);
+    out.m[10] = std::cos(a);
+    return out;
+}
+
+inline Matrix rotateY(float degrees)
+{
+    const auto a = degrees * 3.14159265f / 180;
+    Matrix out;
+    out.m[0] = std::cos(a);
+    out.m[2] = -std::sin(a);
+    out.m[8] = std::sin(a);
+    out.m[10] = std::cos(a);
+    return out;
+}
+
+// Two by two texels of alternating color, like a checker board
+inline Image checker(int size, int squares)
+{
+    Image image(size, size);
+    for(int y = 0; y < size; ++y)
+    {
+        for(int x = 0; x < size; ++x)
+        {
+            const auto odd = (x * squares / size + y * squares / size) % 2;
+            auto *texel = &image.pixels[(std::size_t(y) * size + x) * 4];
+            texel[0] = odd ? 230 : 40;
+            texel[1] = odd ? 200 : 60;
+            texel[2] = odd ? 60 : 160;
+            texel[3] = 255;
+        }
+    }
+    return image;
+}
+
+// The six faces of a cube with side 1, as Cube of the framework draws it
+inline std::vector<SoftwareVertex> cube()
+{
+    const float normals[6][3] = { { 1, 0, 0 }, { -1, 0, 0 }, { 0, 1, 0 },
+        { 0, -1, 0 }, { 0, 0, 1 }, { 0, 0, -1 } };
+    std::vector<SoftwareVertex> vertices;
+    for(auto &&n : normals)
+    {
+        // Two axes spanning the face
+        float s[3], t[3];
+        if(n[0] != 0)
+        {
+            s[0] = 0; s[1] = n[0]; s[2] = 0;
+            t[0] = 0; t[1] = 0; t[2] = 1;
+        }
+        else if(n[1] != 0)
+        {
+            s[0] = 0; s[1] = 0; s[2] = n[1];
+            t[0] = 1; t[1] = 0; t[2] = 0;
+        }
+        else
+        {
+            s[0] = n[2]; s[1] = 0; s[2] = 0;
+            t[0] = 0; t[1] = 1; t[2] = 0;
+        }
+        SoftwareVertex corners[4];
+        const float signs[4][2] = { { -1, -1 }, { 1, -1 }, { 1, 1 },
+            { -1, 1 } };
+        for(int i = 0; i < 4; ++i)
+        {
+            for(int c = 0; c < 3; ++c)
+            {
+                corners[i].position[c] = 0.5f * (n[c] + signs[i][0] * s[c] +
+                    signs[i][1] * t[c]);
+                corners[i].normal[c] = n[c];
+            }
+            corners[i].texcoord[0] = signs[i][0] * 0.5f + 0.5f;
+            corners[i].texcoord[1] = signs[i][1] * 0.5f + 0.5f;
+        }
+        for(int i : { 0, 1, 2, 0, 2, 3 }) vertices.push_back(corners[i]);
+    }
+    return vertices;
+}
+
+inline bool writePpm(const char *path, int width, int height,
+    const std::vector<std::uint8_t> &rgba)
+{
+    auto *file = std::fopen(path, "wb");
+    if(!file) return false;
+    std::fprintf(file, "P6\n%d %d\n255\n", width, height);
+    // From the top row down
+    for(int y = height - 1; y >= 0; --y)
+    {
+        for(int x = 0; x < width; ++x)
+            std::fwrite(&rgba[(std::size_t(y) * width + x) * 4], 1, 3, file);
+    }
+    return std::fclose(file) == 0;
+}
@@ -0,0 +1,5 @@
+// The implementation of stb_image, compiled once for every lab and tool that
+// includes stb_image.h.
+
+#define STB_IMAGE_IMPLEMENTATION
+#include "stb_image.h"
@@ -0,0 +1,6 @@
+// The implementation of stb_rect_pack, shared by ImGui and the texture atlas
+// of lab08. imconfig.h keeps imgui_draw.cpp from compiling its own, private
+// copy.
+
+#define STB_RECT_PACK_IMPLEMENTATION
+#include "imgui-1.73/imstb_rectpack.h"
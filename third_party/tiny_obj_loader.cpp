@@ -0,0 +1,5 @@
+// The implementation of tinyobjloader, compiled once for every lab that
+// includes tiny_obj_loader.h.
+
+#define TINYOBJLOADER_IMPLEMENTATION
+#include "tiny_obj_loader.h"